@@ -17,6 +17,14 @@
 **       metrics = "clicks,impressions,cost"
 **    );
 **
+**    CREATE VIRTUAL TABLE temp.my_druid_result USING druid_json(
+**       filename = "../raw_result.json",
+**       metrics = "clicks,impressions,cost",
+**       rollups = "P1D:app,country"
+**    );
+**    SELECT timestamp, app, sum(clicks) FROM my_druid_result
+**     WHERE _granularity = 'P1D' GROUP BY 1, 2;
+**
 ** Some extra debugging features (used for testing virtual tables) are available
 ** if this module is compiled with -DSQLITE_TEST.
 */
@@ -30,6 +38,33 @@ SQLITE_EXTENSION_INIT1
 #include <ctype.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+# include <poll.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <tmmintrin.h>
+# define DRUID_UTF8_SSSE3 1
+#endif
+#if defined(__SSE2__)
+# include <emmintrin.h>
+# define DRUID_SKIP_SSE2 1
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+# include <immintrin.h>
+# define DRUID_ACCUM_AVX2 1
+#endif
 
 #ifndef SQLITE_OMIT_VIRTUALTABLE
 
@@ -45,6 +80,61 @@ SQLITE_EXTENSION_INIT1
 #  define DRUIDJSON_NOINLINE
 #endif
 
+/*
+** Bit scans of the SWAR and SIMD loops: the number of trailing zero bits
+** of a non-zero value, and the number of bits set.
+*/
+#if defined(__GNUC__)
+#  define DRUID_CTZ32(x)       __builtin_ctz(x)
+#  define DRUID_CTZ64(x)       __builtin_ctzll(x)
+#  define DRUID_POPCOUNT64(x)  __builtin_popcountll(x)
+#elif defined(_MSC_VER) && defined(_M_X64)
+#  include <intrin.h>
+static __inline int druid_ctz32(unsigned int x){
+  unsigned long i;
+  _BitScanForward(&i, x);
+  return (int)i;
+}
+static __inline int druid_ctz64(sqlite3_uint64 x){
+  unsigned long i;
+  _BitScanForward64(&i, x);
+  return (int)i;
+}
+#  define DRUID_CTZ32(x)       druid_ctz32(x)
+#  define DRUID_CTZ64(x)       druid_ctz64(x)
+#  define DRUID_POPCOUNT64(x)  ((int)__popcnt64(x))
+#else
+static int druid_ctz64(sqlite3_uint64 x){
+  int n = 0;
+  while( (x&1)==0 ){
+    x >>= 1;
+    n++;
+  }
+  return n;
+}
+static int druid_popcount64(sqlite3_uint64 x){
+  x = x - ((x>>1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x>>2) & 0x3333333333333333ULL);
+  x = (x + (x>>4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (int)((x * 0x0101010101010101ULL)>>56);
+}
+#  define DRUID_CTZ32(x)       druid_ctz64(x)
+#  define DRUID_CTZ64(x)       druid_ctz64(x)
+#  define DRUID_POPCOUNT64(x)  druid_popcount64(x)
+#endif
+
+/*
+** Nanoseconds of the modification and status change times in a struct
+** stat, that tell apart two versions of a file written within a second.
+*/
+#if defined(__APPLE__)
+#  define DRUID_MTIME_NSEC(pSt)  ((pSt)->st_mtimespec.tv_nsec)
+#  define DRUID_CTIME_NSEC(pSt)  ((pSt)->st_ctimespec.tv_nsec)
+#else
+#  define DRUID_MTIME_NSEC(pSt)  ((pSt)->st_mtim.tv_nsec)
+#  define DRUID_CTIME_NSEC(pSt)  ((pSt)->st_ctim.tv_nsec)
+#endif
+
 
 /* Max size of the error message in a DruidReader */
 #define DRUIDJSON_MXERR 200
@@ -52,6 +142,22 @@ SQLITE_EXTENSION_INIT1
 /* Size of the DruidReader input buffer */
 #define DRUIDJSON_INBUFSZ 1024
 
+/* Interval between two size checks of a followed file, when inotify is
+** not available */
+#define DRUIDJSON_FOLLOW_POLL_MS 50
+
+/* Size of the blocks read ahead by the worker pool */
+#define DRUIDJSON_READAHEAD_SZ 65536
+
+/* Bytes looked at to find the first row after an offset in the middle of
+** a file */
+#define DRUIDJSON_RESYNC_SZ 65536
+
+/* Smallest part of a file whose rows are counted on a worker of the pool */
+#ifndef DRUIDJSON_COUNT_CHUNK_SZ
+# define DRUIDJSON_COUNT_CHUNK_SZ (4*1024*1024)
+#endif
+
 
 // copied from json1.c
 /*
@@ -131,6 +237,14 @@ static const char jsonIsNumber[] = {
 #define JSON_FALSE  (6)
 #define JSON_NULL   (7)
 
+#ifndef SQLITE_AMALGAMATION
+/* Unsigned integer types.  These are already defined in the sqliteInt.h,
+** but the definitions need to be repeated for separate compilation. */
+typedef unsigned int u32;
+typedef unsigned short int u16;
+typedef unsigned char u8;
+#endif
+
 /* A context object used when read a Druid result file. */
 typedef struct DruidReader DruidReader;
 struct DruidReader {
@@ -144,8 +258,17 @@ struct DruidReader {
   int value_n;           /* Number of bytes in value */
   int value_type;        /* value json type (string, number, null, bool) */
   int value_nAlloc;      /* Space allocated for value_n[] */
+  double rNumber;        /* Value of a JSON_NUMBER value */
+  sqlite3_int64 iNumber; /* Value of an integral JSON_NUMBER value */
+  bool bIntegral;        /* True if the JSON_NUMBER value is an integer */
   int nResult;             /* Current line number */
   int bNotFirst;         /* True if prior text has been seen */
+  bool bEof;             /* True if the end of the file was reached */
+  bool bClosed;          /* True if the closing ']' of the result was read */
+  bool bValidateUtf8;    /* Fail on strings that are not valid UTF-8 */
+  bool bIoErr;           /* True if a read of the file failed */
+  int fdNotify;          /* inotify descriptor used by druid_reader_wait() */
+  struct DruidReadAhead *pAhead;  /* Read of the next block, or NULL */
   size_t iIn;            /* Next unread character in the input buffer */
   size_t nIn;            /* Number of characters in the input buffer */
   char *zIn;             /* The input buffer */
@@ -175,16 +298,30 @@ static void druid_reader_init(DruidReader *p){
   p->value_nAlloc = 0;
   p->nResult = 0;
   p->bNotFirst = 0;
+  p->bEof = false;
+  p->bClosed = false;
+  p->bValidateUtf8 = false;
+  p->bIoErr = false;
+  p->fdNotify = -1;
+  p->pAhead = 0;
   p->nIn = 0;
   p->zIn = 0;
   p->zErr[0] = 0;
 }
 
+static void druid_readahead_cancel(DruidReader*);
+static void druid_readahead_free(DruidReader*);
+static void druid_readahead_refill(DruidReader*);
+
 /* Close and reset a DruidReader object */
 static void druid_reader_reset(DruidReader *p){
   if( p->in ){
+    druid_readahead_free(p);
     fclose(p->in);
     sqlite3_free(p->zIn);
+#ifdef __linux__
+    if( p->fdNotify>=0 ) close(p->fdNotify);
+#endif
   }
   sqlite3_free(p->label);
   sqlite3_free(p->value);
@@ -206,6 +343,7 @@ static int druid_reader_open(
   DruidReader *p,               /* The reader to open */
   const char *zFilename      /* Read from this filename */
 ){
+    p->fdNotify = -1;
     p->zIn = sqlite3_malloc( DRUIDJSON_INBUFSZ );
     if( p->zIn==0 ){
       druid_errmsg(p, "out of memory");
@@ -230,7 +368,12 @@ static DRUIDJSON_NOINLINE void druid_getc_refill(DruidReader *p){
   assert( p->iIn>=p->nIn );  /* Only called on an empty input buffer */
   assert( p->in!=0 );        /* Only called if reading froma file */
 
+  if( p->pAhead ){
+    druid_readahead_refill(p);
+    return;
+  }
   got = fread(p->zIn, 1, DRUIDJSON_INBUFSZ, p->in);
+  if( got==0 && ferror(p->in) ) p->bIoErr = true;
   p->nIn = got;
   p->iIn = 0;
 }
@@ -248,9 +391,11 @@ static int druid_getc(DruidReader *p, bool advance, bool skip_whitespace, bool s
       if (p->in != 0) {
         druid_getc_refill(p);
         if (p->nIn == 0) {
+          p->bEof = true;
           return EOF;
         }
       } else {
+        p->bEof = true;
         return EOF;
       }
     }
@@ -268,6 +413,79 @@ static int druid_getc(DruidReader *p, bool advance, bool skip_whitespace, bool s
   }
 }
 
+/* Return the offset in the file of the next unread character */
+static sqlite3_int64 druid_reader_tell(DruidReader *p){
+  return (sqlite3_int64)ftell(p->in) - (sqlite3_int64)(p->nIn - p->iIn);
+}
+
+/* Continue reading the file at offset iOff, which must be the start of
+** a result or the end of the last one */
+static void druid_reader_seek(DruidReader *p, sqlite3_int64 iOff){
+  clearerr(p->in);
+  fseek(p->in, (long)iOff, SEEK_SET);
+  p->iIn = 0;
+  p->nIn = 0;
+  p->file_off = (unsigned int)iOff;
+  p->inside_event = false;
+  p->bEof = false;
+  p->bIoErr = false;
+}
+
+/* Milliseconds of a monotonic clock */
+static sqlite3_int64 druid_now_ms(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (sqlite3_int64)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/*
+** Wait until file zFilename, which is being written by another process,
+** grows beyond the nRead bytes the reader already got.  Return true if it
+** did, or false if msTimeout milliseconds passed first.
+**
+** On Linux the reader sleeps on an inotify watch of the file, elsewhere
+** it checks the size of the file every DRUIDJSON_FOLLOW_POLL_MS.
+*/
+static bool druid_reader_wait(
+  DruidReader *p,
+  const char *zFilename,
+  sqlite3_int64 nRead,
+  int msTimeout
+){
+  struct stat st;
+  int msLeft = msTimeout;
+#ifdef __linux__
+  if( p->fdNotify<0 ){
+    p->fdNotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if( p->fdNotify>=0
+     && inotify_add_watch(p->fdNotify, zFilename, IN_MODIFY|IN_CLOSE_WRITE)<0 ){
+      close(p->fdNotify);
+      p->fdNotify = -1;
+    }
+  }
+#endif
+  while( true ){
+    if( stat(zFilename, &st)==0 && (sqlite3_int64)st.st_size>nRead ) return true;
+    if( msLeft<=0 ) return false;
+#ifdef __linux__
+    if( p->fdNotify>=0 ){
+      struct pollfd sPoll;
+      char aEvent[1024];
+      sqlite3_int64 iStart = druid_now_ms();
+      sPoll.fd = p->fdNotify;
+      sPoll.events = POLLIN;
+      if( poll(&sPoll, 1, msLeft)>0 ){
+        while( read(p->fdNotify, aEvent, sizeof(aEvent))>0 ){}
+      }
+      msLeft -= (int)(druid_now_ms() - iStart);
+      continue;
+    }
+#endif
+    sqlite3_sleep(DRUIDJSON_FOLLOW_POLL_MS);
+    msLeft -= DRUIDJSON_FOLLOW_POLL_MS;
+  }
+}
+
 /* Increase the size of p->z and append character c to the end. 
 ** Return 0 on success and non-zero if there is an OOM error */
 static DRUIDJSON_NOINLINE int druid_resize_and_append(DruidReader *p, char c, char **z, int* nAlloc, int* n){
@@ -306,6 +524,27 @@ static int druid_append(DruidReader *p, char c, bool is_value){
   return 0;
 }
 
+/* Append the n characters at z to the DruidReader.z[] array.
+** Return 0 on success and non-zero if there is an OOM error */
+static int druid_append_n(DruidReader *p, const char *z, size_t n, bool is_value){
+  int *pn = is_value ? &p->value_n : &p->label_n;
+  int *pnAlloc = is_value ? &p->value_nAlloc : &p->label_nAlloc;
+  char **pz = is_value ? &p->value : &p->label;
+  if( *pn + (sqlite3_int64)n >= *pnAlloc - 1 ){
+    sqlite3_int64 nNew = (*pnAlloc)*2 + (sqlite3_int64)n + 100;
+    char *zNew = nNew<0x7fffffff ? sqlite3_realloc64(*pz, nNew) : 0;
+    if( zNew==0 ){
+      druid_errmsg(p, "out of memory");
+      return 1;
+    }
+    *pz = zNew;
+    *pnAlloc = (int)nNew;
+  }
+  memcpy(*pz + *pn, z, n);
+  *pn += (int)n;
+  return 0;
+}
+
 static bool read_string(DruidReader *p, bool is_value); // forward definition
 static bool consume_literal(DruidReader *p, int cur_char, char* string){
   char* cur_pos = string;
@@ -325,14 +564,137 @@ static bool consume_literal(DruidReader *p, int cur_char, char* string){
     }
     return true;
 }
+
+/*
+** Numbers.  consume_number() finds the end of a number in the input
+** buffer 4 characters at a time, copies it with a single append and
+** parses it right away into p->rNumber, and p->iNumber if it is an
+** integer, so that metrics are not parsed again from their text.
+*/
+
+/* Flag the bytes b of x with m < b < n, for 0<=m<=127 and 0<=n<=128 */
+#define DRUID_SWAR_BETWEEN(x,m,n) \
+  (((0x01010101u*(127+(n))) - ((x)&0x7f7f7f7fu)) & ~(x) \
+   & (((x)&0x7f7f7f7fu) + 0x01010101u*(127-(m))) & 0x80808080u)
+
+/* Flag the bytes of x that are 0 */
+#define DRUID_SWAR_ZERO(x) \
+  (~((((x)&0x7f7f7f7fu) + 0x7f7f7f7fu) | (x)) & 0x80808080u)
+
+/* Return the number of characters at z, at most n, that are in a number
+** (the jsonIsNumber[] characters '-', '.', '0'..'9', 'e' and 'E') */
+static size_t druid_number_span(const u8 *z, size_t n){
+  size_t i = 0;
+  while( i+4<=n ){
+    u32 x = (u32)z[i] | ((u32)z[i+1]<<8) | ((u32)z[i+2]<<16) | ((u32)z[i+3]<<24);
+    u32 m = (DRUID_SWAR_BETWEEN(x, 0x2c, 0x3a) & ~DRUID_SWAR_ZERO(x ^ 0x2f2f2f2fu))
+          | DRUID_SWAR_ZERO((x | 0x20202020u) ^ 0x65656565u);
+    if( m!=0x80808080u ){
+      return i + DRUID_CTZ32(~m & 0x80808080u)/8;
+    }
+    i += 4;
+  }
+  while( i<n && safe_isnumber(z[i]) ) i++;
+  return i;
+}
+
+/* Exact powers of 10 of a double */
+static const double druid_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Parse the n characters of a number at z, which are followed by a
+** character that is not part of a number, into *pr.  Return true and
+** set *pi too if it is an integer.  Numbers of up to 19 significant
+** digits whose mantissa and power of 10 are exact doubles are computed
+** exactly with a single multiplication or division, the others by
+** strtod() */
+static bool druid_parse_number(const char *z, int n, double *pr, sqlite3_int64 *pi){
+  const char *zEnd = &z[n];
+  const char *zStart = z;
+  bool bNeg = false;
+  sqlite3_uint64 m = 0;
+  int nDigit = 0;              /* Significant digits in m */
+  bool bDigit = false;         /* True if the mantissa has digits */
+  int e = 0;
+  if( z<zEnd && *z=='-' ){ bNeg = true; z++; }
+  if( z==zEnd ) goto parse_slow;
+  bDigit = *z>='0' && *z<='9';
+  while( z<zEnd && *z>='0' && *z<='9' ){
+    if( nDigit<19 ){
+      m = m*10 + (u32)(*z - '0');
+      if( m ) nDigit++;
+    }else{
+      goto parse_slow;
+    }
+    z++;
+  }
+  if( z==zEnd ){
+    if( nDigit<=18 ){
+      *pi = bNeg ? -(sqlite3_int64)m : (sqlite3_int64)m;
+      *pr = bNeg ? -(double)m : (double)m;
+      return true;
+    }
+    goto parse_slow;
+  }
+  if( *z=='.' ){
+    z++;
+    if( z<zEnd && *z>='0' && *z<='9' ) bDigit = true;
+    while( z<zEnd && *z>='0' && *z<='9' ){
+      if( nDigit>=19 ) goto parse_slow;
+      m = m*10 + (u32)(*z - '0');
+      if( m ) nDigit++;
+      e--;
+      z++;
+    }
+  }
+  if( !bDigit ) goto parse_slow;
+  if( z<zEnd && (*z=='e' || *z=='E') ){
+    bool bNegExp = false;
+    int x = 0;
+    z++;
+    if( z<zEnd && *z=='-' ){ bNegExp = true; z++; }
+    if( z==zEnd ) goto parse_slow;
+    while( z<zEnd && *z>='0' && *z<='9' && x<1000 ){
+      x = x*10 + (*z - '0');
+      z++;
+    }
+    e += bNegExp ? -x : x;
+  }
+  if( z!=zEnd || m>((sqlite3_uint64)1<<53) || e<-22 || e>22 ) goto parse_slow;
+  *pr = e<0 ? (double)m / druid_pow10[-e] : (double)m * druid_pow10[e];
+  if( bNeg ) *pr = -*pr;
+  return false;
+
+parse_slow:
+  *pr = strtod(zStart, 0);
+  return false;
+}
+
 static bool consume_number(DruidReader *p, int cur_char){
+  int iStart = p->value_n;
+  size_t n;
   druid_append(p, cur_char, true);
-  cur_char = druid_getc(p, false, false, false);
-  while (safe_isnumber(cur_char)) {
+  do{
+    n = druid_number_span((const u8*)&p->zIn[p->iIn], p->nIn - p->iIn);
+    if( n ){
+      druid_append_n(p, &p->zIn[p->iIn], n, true);
+      p->iIn += n;
+      p->file_off += (unsigned int)n;
+    }
+    /* Past the end of the buffer, the number may go on in the next one */
+    cur_char = druid_getc(p, false, false, false);
+    if( !safe_isnumber(cur_char) ) break;
     druid_advance_c(p);
     druid_append(p, cur_char, true);
-    cur_char = druid_getc(p, false, false, false);
-  }
+  }while( true );
+  /* Terminated for strtod(), the terminator is appended again by the
+  ** caller */
+  if( druid_append(p, 0, true) ) return false;
+  p->value_n--;
+  p->bIntegral = druid_parse_number(&p->value[iStart], p->value_n - iStart,
+                                    &p->rNumber, &p->iNumber);
   return true;
 }
 
@@ -402,6 +764,11 @@ static int druid_read_one_field(DruidReader *p) {
     if( c==EOF ){
       return EOF;
     }
+    if( ']' == c ){
+      // end of the result array, written after the last result was read
+      p->bClosed = true;
+      return EOF;
+    }
     if( '"' != c){
       druid_errmsg(p, "result %d(offset %d): expected '\"' got '%c' character\n", p->nResult, p->file_off, c);
       return GOT_FAILURE;
@@ -439,17 +806,430 @@ static int druid_read_one_field(DruidReader *p) {
         if(']' == druid_getc(p, false, true, false)){
           // consume last char in file
           druid_getc(p, true, true, false);
+          p->bClosed = true;
         }
         return GOT_LAST_FIELD;
     }
     return GOT_FIELD;
 }
-#ifndef SQLITE_AMALGAMATION
-/* Unsigned integer types.  These are already defined in the sqliteInt.h,
-** but the definitions need to be repeated for separate compilation. */
-typedef unsigned int u32;
-typedef unsigned char u8;
+
+/*
+** Row skipping.  druid_skip_row() looks at the file 64 characters at a
+** time, as simdjson does: bitmasks of the quotes, backslashes and brackets
+** of a block tell which characters are escaped and which are inside of
+** strings, and only the brackets outside of strings are visited one by
+** one to track the depth.  DruidSkip carries the state from a block to
+** the next.
+*/
+typedef struct DruidSkip {
+  sqlite3_uint64 bEscaped;   /* 1 if the next character is escaped */
+  sqlite3_uint64 mInString;  /* All ones if the next character is in a string */
+  int depth;                 /* Nesting depth of the next character */
+} DruidSkip;
+
+#define DRUID_EVEN_BITS 0x5555555555555555ULL
+
+/* Set the bits of the quotes, backslashes, '{' or '[', and '}' or ']'
+** among the 64 characters at z */
+static void druid_skip_masks(
+  const u8 *z,
+  sqlite3_uint64 *pmQuote,
+  sqlite3_uint64 *pmBackslash,
+  sqlite3_uint64 *pmOpen,
+  sqlite3_uint64 *pmClose
+){
+  sqlite3_uint64 mQuote = 0, mBackslash = 0, mOpen = 0, mClose = 0;
+  int k;
+#if defined(DRUID_SKIP_SSE2)
+  const __m128i vQuote = _mm_set1_epi8('"');
+  const __m128i vBackslash = _mm_set1_epi8('\\');
+  const __m128i vCase = _mm_set1_epi8(0x20);
+  const __m128i vOpen = _mm_set1_epi8('{');       /* '[' | 0x20 */
+  const __m128i vClose = _mm_set1_epi8('}');      /* ']' | 0x20 */
+  for(k=0; k<4; k++){
+    __m128i v = _mm_loadu_si128((const __m128i*)&z[k*16]);
+    __m128i l = _mm_or_si128(v, vCase);
+    mQuote |= (sqlite3_uint64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vQuote)) << (k*16);
+    mBackslash |= (sqlite3_uint64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vBackslash)) << (k*16);
+    mOpen |= (sqlite3_uint64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(l, vOpen)) << (k*16);
+    mClose |= (sqlite3_uint64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(l, vClose)) << (k*16);
+  }
+#else
+  /* 8 characters at a time: flag the 0 bytes of x^c, then gather the
+  ** flags into 8 bits by multiplication */
+# define DRUID_SWAR_ZERO64(x) \
+    (~((((x)&0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | (x)) & 0x8080808080808080ULL)
+# define DRUID_SWAR_GATHER(m) ((((m)>>7) * 0x0102040810204080ULL) >> 56)
+  for(k=0; k<8; k++){
+    sqlite3_uint64 x, l;
+    memcpy(&x, &z[k*8], 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__==__ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    l = x | 0x2020202020202020ULL;
+    mQuote |= DRUID_SWAR_GATHER(DRUID_SWAR_ZERO64(x ^ 0x2222222222222222ULL)) << (k*8);
+    mBackslash |= DRUID_SWAR_GATHER(DRUID_SWAR_ZERO64(x ^ 0x5c5c5c5c5c5c5c5cULL)) << (k*8);
+    mOpen |= DRUID_SWAR_GATHER(DRUID_SWAR_ZERO64(l ^ 0x7b7b7b7b7b7b7b7bULL)) << (k*8);
+    mClose |= DRUID_SWAR_GATHER(DRUID_SWAR_ZERO64(l ^ 0x7d7d7d7d7d7d7d7dULL)) << (k*8);
+  }
 #endif
+  *pmQuote = mQuote;
+  *pmBackslash = mBackslash;
+  *pmOpen = mOpen;
+  *pmClose = mClose;
+}
+
+/* Return the bits of the escaped characters of a block, given the bits of
+** its backslashes.  The character after an odd run of backslashes is
+** escaped: the runs are told apart by the parity of the bit they start
+** on, and the carry of adding a run start to the run finds its end. */
+static sqlite3_uint64 druid_skip_escaped(DruidSkip *pSkip, sqlite3_uint64 mBackslash){
+  sqlite3_uint64 mFollows, mOddStarts, mEvenEnds;
+  if( mBackslash==0 ){
+    sqlite3_uint64 m = pSkip->bEscaped;
+    pSkip->bEscaped = 0;
+    return m;
+  }
+  mBackslash &= ~pSkip->bEscaped;
+  mFollows = (mBackslash<<1) | pSkip->bEscaped;
+  mOddStarts = mBackslash & ~DRUID_EVEN_BITS & ~mFollows;
+  mEvenEnds = mOddStarts + mBackslash;
+  pSkip->bEscaped = mEvenEnds<mOddStarts;
+  return (DRUID_EVEN_BITS ^ (mEvenEnds<<1)) & mFollows;
+}
+
+/* Skip the 64 characters at z.  Return the number of characters up to
+** and including the bracket that closes the row, or 0 if the row does
+** not end in the block */
+static int druid_skip_block(DruidSkip *pSkip, const u8 *z){
+  sqlite3_uint64 mQuote, mBackslash, mOpen, mClose, mInString, mBracket;
+  druid_skip_masks(z, &mQuote, &mBackslash, &mOpen, &mClose);
+  mQuote &= ~druid_skip_escaped(pSkip, mBackslash);
+  /* Prefix XOR of the quotes: the opening quote and the characters of
+  ** the strings are set */
+  mInString = mQuote;
+  mInString ^= mInString<<1;
+  mInString ^= mInString<<2;
+  mInString ^= mInString<<4;
+  mInString ^= mInString<<8;
+  mInString ^= mInString<<16;
+  mInString ^= mInString<<32;
+  mInString ^= pSkip->mInString;
+  pSkip->mInString = (sqlite3_uint64)((sqlite3_int64)mInString>>63);
+  mBracket = (mOpen | mClose) & ~mInString;
+  while( mBracket ){
+    int k = DRUID_CTZ64(mBracket);
+    if( (mOpen>>k)&1 ){
+      pSkip->depth++;
+    }else if( --pSkip->depth==0 ){
+      return k+1;
+    }
+    mBracket &= mBracket-1;
+  }
+  return 0;
+}
+
+/* Skip the whitespace and the ',' before the next result, and the '[' of
+** the first one.  Return the next character, which is not consumed */
+static int druid_skip_separators(DruidReader *p){
+  int c = druid_getc(p, false, true, false);
+  while( c==',' || c=='[' ){
+    druid_advance_c(p);
+    c = druid_getc(p, false, true, false);
+  }
+  return c;
+}
+
+/*
+** Skip the next result of the file without decoding its fields.  Only
+** strings and the nesting depth are tracked, which is much cheaper than
+** reading the row with druid_read_one_field().
+**
+** A row cut by the end of the file ends the same way as it does with
+** druid_read_one_field().
+**
+** return -2 on failure
+** return -1 on EOF
+** return 1 when a row was skipped
+*/
+static int druid_skip_row(DruidReader *p){
+    DruidSkip skip = {0, 0, 0};
+    char cLast = 0;               /* Last character read outside of blanks */
+    bool bEventKey = false;       /* cLast is the ':' after "event" */
+    size_t i;
+    int c = druid_skip_separators(p);
+    if( c==EOF ){
+      return EOF;
+    }
+    if( ']' == c ){
+      druid_advance_c(p);
+      p->bClosed = true;
+      return EOF;
+    }
+    if('{' != c){
+        druid_errmsg(p, "result %d(offset %d): expected '{' got '%c' character\n",
+                     p->nResult, p->file_off, c);
+        return GOT_FAILURE;
+    }
+    while(true){
+        bool bEnd = false;
+        if( p->iIn >= p->nIn ){
+          if( p->in==0 ) break;
+          druid_getc_refill(p);
+          if( p->nIn==0 ){
+            p->bEof = true;
+            break;
+          }
+        }
+        i = p->iIn;
+        while( i+64<=p->nIn ){
+            int n = druid_skip_block(&skip, (const u8*)&p->zIn[i]);
+            if( n ){
+                i += n;
+                bEnd = true;
+                break;
+            }
+            i += 64;
+        }
+        /* The last characters of the buffer, one at a time */
+        for(; !bEnd && i<p->nIn; i++){
+            char ch = p->zIn[i];
+            if( skip.bEscaped ){
+                skip.bEscaped = 0;
+            }else if( skip.mInString ){
+                if('\\' == ch) skip.bEscaped = 1;
+                else if('"' == ch) skip.mInString = 0;
+            }else if('"' == ch){
+                skip.mInString = ~(sqlite3_uint64)0;
+            }else if('{' == ch || '[' == ch){
+                skip.depth++;
+            }else if(('}' == ch || ']' == ch) && --skip.depth==0){
+                i++;
+                bEnd = true;
+                break;
+            }
+        }
+        if( !bEnd ){
+            size_t j = i;
+            while( j>p->iIn && safe_isspace(p->zIn[j-1]) ) j--;
+            if( j>p->iIn ){
+                cLast = p->zIn[j-1];
+                bEventKey = false;
+                if( cLast==':' ){
+                    j--;
+                    while( j>p->iIn && safe_isspace(p->zIn[j-1]) ) j--;
+                    bEventKey = j>=p->iIn+7
+                             && memcmp(&p->zIn[j-7], "\"event\"", 7)==0;
+                }
+            }
+        }
+        p->file_off += (unsigned int)(i - p->iIn);
+        p->iIn = i;
+        if( bEnd ){
+            p->inside_event = false;
+            p->nResult++;
+            if(']' == druid_getc(p, false, true, false)){
+              // consume last char in file
+              druid_getc(p, true, true, false);
+              p->bClosed = true;
+            }
+            return GOT_LAST_FIELD;
+        }
+    }
+    if( skip.mInString ){
+      druid_errmsg(p, "result %d(offset %d): unterminated string",
+                   p->nResult, p->file_off);
+      return GOT_FAILURE;
+    }
+    if( cLast==',' || cLast=='{' || (bEventKey && skip.depth==1) ) return EOF;
+    if( cLast=='}' && skip.depth==1 ){
+      /* Only the '}' of the row is missing */
+      p->inside_event = false;
+      p->nResult++;
+      return GOT_LAST_FIELD;
+    }
+    druid_errmsg(p, "result %d(offset %d): unexpected end of input\n",
+                 p->nResult, p->file_off);
+    return GOT_FAILURE;
+}
+
+/* Skip the rest of a string whose opening quote was read.  Return false
+** if the file ends first */
+static bool druid_skip_string(DruidReader *p){
+  bool escaped = false;
+  while( true ){
+    size_t i;
+    if( p->iIn>=p->nIn ){
+      if( p->in==0 ) return false;
+      druid_getc_refill(p);
+      if( p->nIn==0 ){
+        p->bEof = true;
+        return false;
+      }
+    }
+    for(i=p->iIn; i<p->nIn; i++){
+      char ch = p->zIn[i];
+      if( escaped ){
+        escaped = false;
+      }else if( '\\'==ch ){
+        escaped = true;
+      }else if( '"'==ch ){
+        i++;
+        p->file_off += (unsigned int)(i - p->iIn);
+        p->iIn = i;
+        return true;
+      }
+    }
+    p->file_off += (unsigned int)(i - p->iIn);
+    p->iIn = i;
+  }
+}
+
+/* Skip a number or a literal, up to the character that follows it */
+static void druid_skip_scalar(DruidReader *p){
+  int c = druid_getc(p, false, false, false);
+  while( c!=EOF && c!=',' && c!='}' && c!=']' && !safe_isspace(c) ){
+    druid_advance_c(p);
+    c = druid_getc(p, false, false, false);
+  }
+}
+
+/*
+** Resynchronization, to read a file from the first row that starts after
+** an offset in the middle of it.  A row starts at a '{' that follows '}'
+** and ',' outside of strings, but the bytes after the offset do not tell
+** whether they are inside of a string.  Both guesses are made, and a
+** guess is refuted when one of its strings opens after something else
+** than '{', '[', ',' or ':', or closes before something else than ':',
+** ',', '}' or ']': the other reading of a string of Druid output is not
+** valid JSON.  When both or none of the guesses hold over the bytes
+** looked at, the caller must read the file from a known row instead.
+** The caller also checks the guess once the previous row is known, e.g.
+** by the chunk of the file before, as the values of unknown queries
+** might mimic a row boundary.
+*/
+#define DRUID_RESYNC_ROW     0    /* A row starts at the offset found */
+#define DRUID_RESYNC_END     1    /* No row starts, the result ends there */
+#define DRUID_RESYNC_UNKNOWN 2    /* The guesses do not tell */
+
+/* Bytes read before the offset to resynchronize at, so that a row that
+** starts right at it is seen after the '}' and ',' before it */
+#define DRUID_RESYNC_BACK    64
+
+/* Find the first row start or result end in z[iMin..n), guessing that
+** z[1] is in a string if bInString.  z[0] is the byte before, which is not
+** a backslash.  Return false if the guess is refuted. */
+static bool druid_resync_guess(
+  const u8 *z, size_t n,
+  size_t iMin,
+  bool bInString,
+  int *peRes,                     /* OUT: One of DRUID_RESYNC_xxx */
+  size_t *piRow                   /* OUT: Offset in z[] of the row or end */
+){
+  bool bEscaped = false;
+  bool bClosed = false;           /* A string closed at the last character */
+  u8 cLast = 0, cPrev = 0;        /* Last two characters outside of strings */
+  size_t i;
+  *peRes = DRUID_RESYNC_UNKNOWN;
+  for(i=1; i<n; i++){
+    u8 c = z[i];
+    if( bInString ){
+      if( bEscaped ){
+        bEscaped = false;
+      }else if( c=='\\' ){
+        bEscaped = true;
+      }else if( c=='"' ){
+        bInString = false;
+        bClosed = true;
+        cPrev = cLast;
+        cLast = c;
+      }
+      continue;
+    }
+    if( safe_isspace(c) ) continue;
+    if( bClosed && c!=':' && c!=',' && c!='}' && c!=']' ) return false;
+    bClosed = false;
+    switch( c ){
+      case '"':
+        if( cLast && cLast!='{' && cLast!='[' && cLast!=',' && cLast!=':' ){
+          return false;
+        }
+        bInString = true;
+        break;
+      case '{':
+        if( cLast==',' && cPrev=='}' && i>=iMin && *peRes==DRUID_RESYNC_UNKNOWN ){
+          *peRes = DRUID_RESYNC_ROW;
+          *piRow = i;
+        }
+        break;
+      case ']':
+        if( cLast=='}' && i>=iMin && *peRes==DRUID_RESYNC_UNKNOWN ){
+          *peRes = DRUID_RESYNC_END;
+          *piRow = i;
+        }
+        break;
+      case '\\':
+        return false;
+    }
+    cPrev = cLast;
+    cLast = c;
+  }
+  return true;
+}
+
+/* Find the first row start or result end in z[iMin..n), where iMin is
+** the offset to resynchronize at.  Return DRUID_RESYNC_xxx and set *piRow
+** to its offset in z[] */
+static int druid_resync_chunk(
+  const u8 *z, size_t n,
+  size_t iMin,
+  size_t *piRow
+){
+  size_t j = 0;
+  int eOut, eIn;
+  size_t iOut = 0, iIn = 0;
+  bool bOut, bIn;
+  /* The byte after a backslash may be escaped or not, start after it */
+  while( j+1<n && z[j]=='\\' ) j++;
+  iMin = iMin>j ? iMin-j : 1;
+  bOut = druid_resync_guess(&z[j], n-j, iMin, false, &eOut, &iOut);
+  bIn = druid_resync_guess(&z[j], n-j, iMin, true, &eIn, &iIn);
+  if( bOut && bIn ){
+    if( eOut!=eIn || iOut!=iIn ) return DRUID_RESYNC_UNKNOWN;
+  }else if( bIn ){
+    eOut = eIn;
+    iOut = iIn;
+  }else if( !bOut ){
+    return DRUID_RESYNC_UNKNOWN;
+  }
+  if( eOut!=DRUID_RESYNC_UNKNOWN ) *piRow = j + iOut;
+  return eOut;
+}
+
+/* Continue reading the file at the first row that starts at or after
+** offset iOff, which is not 0, or at the end of the result.  zWindow has
+** room for DRUIDJSON_RESYNC_SZ bytes.  Return DRUID_RESYNC_xxx and set
+** *piRow to the offset of the row or end.  The reader is not moved if
+** DRUID_RESYNC_UNKNOWN is returned. */
+static int druid_reader_resync(
+  DruidReader *p,
+  sqlite3_int64 iOff,
+  u8 *zWindow,
+  sqlite3_int64 *piRow
+){
+  sqlite3_int64 iWindow = iOff>DRUID_RESYNC_BACK ? iOff-DRUID_RESYNC_BACK : 0;
+  size_t n, iRow = 0;
+  int eRes;
+  clearerr(p->in);
+  if( fseek(p->in, (long)iWindow, SEEK_SET) ) return DRUID_RESYNC_UNKNOWN;
+  n = fread(zWindow, 1, DRUIDJSON_RESYNC_SZ, p->in);
+  eRes = druid_resync_chunk(zWindow, n, (size_t)(iOff-iWindow), &iRow);
+  if( eRes!=DRUID_RESYNC_UNKNOWN ){
+    *piRow = iWindow + (sqlite3_int64)iRow;
+    druid_reader_seek(p, *piRow);
+  }
+  return eRes;
+}
 #  define safe_isxdigit(x) isxdigit((unsigned char)(x))
 
 /*
@@ -483,85 +1263,481 @@ static u32 jsonHexToInt4(const char *z){
   return v;
 }
 
-static bool read_string(DruidReader *p, bool is_value){
-  int c;
-  char u_value_low[4];
-  char u_value[4];
-  c = druid_getc(p, true, false, false);
-  while ('"' != c) {
-    if ('\\' == c) {
-      c = druid_getc(p, true, false, false);
-      switch (c) {
-        case '"':
-        case '\\':
-        case '/':
-          druid_append(p, c, is_value);
-          break;
-        case 'b':
-          c = '\b';
-          druid_append(p, c, is_value);
-          break;
-        case 'n':
-          c = '\n';
-          druid_append(p, c, is_value);
-          break;
-        case 'r':
-          c = '\r';
-          druid_append(p, c, is_value);
-          break;
-        case 't':
-          c = '\t';
-          druid_append(p, c, is_value);
-          break;
-        case 'u':
-          u_value[0] = druid_getc(p, true, false, false);
-          u_value[1] = druid_getc(p, true, false, false);
-          u_value[2] = druid_getc(p, true, false, false);
-          u_value[3] = druid_getc(p, true, false, false);
-          u32 v = jsonHexToInt4(u_value);
-          if(0==v)
-            break;
-          if(v<=0x7f){
-            druid_append(p, (char)v, is_value);
-          }else if( v<=0x7ff ){
-            druid_append(p, (char)(0xc0 | (v>>6)), is_value);
-            druid_append(p, (char)(0x80 | (v&0x3f)), is_value);
-          }else{
-            u32 vlo;
-            if( (v&0xfc00)==0xd800
-                && (druid_getc(p, false, false, false)=='\\')
-                && druid_advance_c(p)
-                && (druid_getc(p, false, false, false)=='u')
-                && druid_advance_c(p)
-                && (u_value_low[0] = druid_getc(p, true, false, false))
-                && (u_value_low[1] = druid_getc(p, true, false, false))
-                && (u_value_low[2] = druid_getc(p, true, false, false))
-                && (u_value_low[3] = druid_getc(p, true, false, false))
-                && ((vlo = jsonHexToInt4(u_value_low))&0xfc00)==0xdc00
-                ){
-              /* We have a surrogate pair */
-              v = ((v&0x3ff)<<10) + (vlo&0x3ff) + 0x10000;
-              druid_append(p, (char)(0xf0 | (v>>18)), is_value);
-              druid_append(p, (char)(0x80 | ((v>>12)&0x3f)), is_value);
-              druid_append(p, (char)(0x80 | ((v>>6)&0x3f)), is_value);
-              druid_append(p, (char)(0x80 | (v&0x3f)), is_value);
-            }else{
-              druid_append(p, (char)(0xe0 | (v>>12)), is_value);
-              druid_append(p, (char)(0x80 | ((v>>6)&0x3f)), is_value);
-              druid_append(p, (char)(0x80 | (v&0x3f)), is_value);
-            }
-          }
-          break;
-        default:
-          druid_errmsg(p, "result %d(offset %d): unexpected escape char", p->nResult, p->file_off, c);
-          return false;
+/*
+** Map a base64 character to its 6-bit value, or 0xff for characters that
+** are not part of the standard base64 alphabet.
+*/
+static const u8 druidBase64Value[256] = {
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,  62,0xff,0xff,0xff,  63,
+    52,  53,  54,  55,  56,  57,  58,  59,   60,  61,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,   0,   1,   2,   3,   4,   5,   6,    7,   8,   9,  10,  11,  12,  13,  14,
+    15,  16,  17,  18,  19,  20,  21,  22,   23,  24,  25,0xff,0xff,0xff,0xff,0xff,
+  0xff,  26,  27,  28,  29,  30,  31,  32,   33,  34,  35,  36,  37,  38,  39,  40,
+    41,  42,  43,  44,  45,  46,  47,  48,   49,  50,  51,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+  0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff, 0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,
+};
+
+/*
+** Decode n bytes of base64 text into zOut, which must have room for at
+** least (n/4)*3 bytes.  Four input characters are decoded per iteration,
+** the padding is only allowed at the end.  Return the number of decoded
+** bytes, or -1 if the input is not valid base64.
+*/
+static int druid_base64_decode(const char *zIn, int n, u8 *zOut){
+  const u8 *z = (const u8*)zIn;
+  u8 *zStart = zOut;
+  int nPad = 0;
+  int i;
+  if( n%4 ) return -1;
+  if( n>0 && z[n-1]=='=' ) nPad++;
+  if( n>1 && z[n-2]=='=' ) nPad++;
+  for(i=0; i+4<=n; i+=4){
+    u32 a = druidBase64Value[z[i]];
+    u32 b = druidBase64Value[z[i+1]];
+    u32 c = druidBase64Value[z[i+2]];
+    u32 d = druidBase64Value[z[i+3]];
+    u32 v;
+    if( (a|b|c|d) & 0xc0 ){
+      /* Only the last quantum may contain padding */
+      if( i+4!=n || nPad==0 || ((a|b) & 0xc0) ) return -1;
+      if( nPad==2 ){
+        *zOut++ = (u8)((a<<2) | (b>>4));
+      }else{
+        if( c & 0xc0 ) return -1;
+        *zOut++ = (u8)((a<<2) | (b>>4));
+        *zOut++ = (u8)((b<<4) | (c>>2));
       }
-    }else{
-      druid_append(p, c, is_value);
+      break;
     }
-    c = druid_getc(p, true, false, false);
+    v = (a<<18) | (b<<12) | (c<<6) | d;
+    zOut[0] = (u8)(v>>16);
+    zOut[1] = (u8)(v>>8);
+    zOut[2] = (u8)v;
+    zOut += 3;
   }
-  return true;
+  return (int)(zOut - zStart);
+}
+
+/* Return the serialized sketch held by an SQL value.  BLOBs are returned
+** as is, TEXT is decoded from base64 into a buffer that is returned in
+** *pzFree and must be freed by the caller.  Return NULL with *pn set to
+** -1 on OOM, or to -2 if the value is not valid base64.
+*/
+static const u8 *druid_sketch_bytes(sqlite3_value *pVal, int *pn, u8 **pzFree){
+  *pzFree = 0;
+  if( sqlite3_value_type(pVal)==SQLITE_TEXT ){
+    const char *z = (const char*)sqlite3_value_text(pVal);
+    int n = sqlite3_value_bytes(pVal);
+    u8 *zBuf = sqlite3_malloc(n/4*3 + 1);
+    if( zBuf==0 ){
+      *pn = -1;
+      return 0;
+    }
+    *pn = druid_base64_decode(z, n, zBuf);
+    if( *pn<0 ){
+      sqlite3_free(zBuf);
+      *pn = -2;
+      return 0;
+    }
+    *pzFree = zBuf;
+    return zBuf;
+  }
+  *pn = sqlite3_value_bytes(pVal);
+  return (const u8*)sqlite3_value_blob(pVal);
+}
+
+/*
+** Batch decoding of \uXXXX escapes.  Druid writes the characters of
+** localized values as runs of escapes, one per character.  When the
+** whole run is in the input buffer, druid_decode_u_run() validates and
+** decodes the 4 hex digits of each escape at once, 32 bits at a time,
+** combines surrogate pairs, and appends the UTF-8 of the run with a
+** single write.
+*/
+
+/* Decode the 4 hex digits at z into *pv.  Return false if one of them
+** is not a hex digit */
+static bool druid_hex4(const u8 *z, u32 *pv){
+  u32 x = (u32)z[0] | ((u32)z[1]<<8) | ((u32)z[2]<<16) | ((u32)z[3]<<24);
+  u32 y = x | 0x20202020u;
+  u32 val;
+  if( (DRUID_SWAR_BETWEEN(x, 0x2f, 0x3a) | DRUID_SWAR_BETWEEN(y, 0x60, 0x67))!=0x80808080u ){
+    return false;
+  }
+  /* '0'..'9' -> 0..9, 'a'..'f' and 'A'..'F' -> 10..15 */
+  val = (x & 0x0f0f0f0fu) + 9*((x>>6) & 0x01010101u);
+  *pv = ((val & 0xff)<<12) | (((val>>8) & 0xff)<<8)
+      | (((val>>16) & 0xff)<<4) | (val>>24);
+  return true;
+}
+
+/* Decode the run of \u escapes whose first 4 hex digits are the next
+** characters of p, if it is in the input buffer.  Return the number of
+** escapes decoded, 0 if the caller must decode the escape itself */
+static int druid_decode_u_run(DruidReader *p, bool is_value, u8 *pmHigh){
+  const u8 *z = (const u8*)p->zIn + p->iIn;
+  size_t nAvail = p->nIn - p->iIn;
+  u8 aOut[256];
+  int nOut = 0;
+  int nEsc = 0;
+  size_t i = 0;
+  size_t iEnd = 0;           /* End of the last escape decoded */
+  u32 v, vlo;
+  while( i+4<=nAvail && nOut<=(int)sizeof(aOut)-4 && druid_hex4(&z[i], &v) ){
+    if( (v&0xfc00)==0xd800 ){
+      /* A high surrogate, combined with the low surrogate that follows */
+      if( i+10>nAvail ) break;
+      if( z[i+4]=='\\' && z[i+5]=='u' && druid_hex4(&z[i+6], &vlo)
+       && (vlo&0xfc00)==0xdc00 ){
+        v = ((v&0x3ff)<<10) + (vlo&0x3ff) + 0x10000;
+        i += 6;
+      }
+    }
+    i += 4;
+    nEsc++;
+    if( v==0 ){
+      /* \u0000 is dropped */
+    }else if( v<=0x7f ){
+      aOut[nOut++] = (u8)v;
+    }else if( v<=0x7ff ){
+      aOut[nOut++] = (u8)(0xc0 | (v>>6));
+      aOut[nOut++] = (u8)(0x80 | (v&0x3f));
+    }else if( v<=0xffff ){
+      aOut[nOut++] = (u8)(0xe0 | (v>>12));
+      aOut[nOut++] = (u8)(0x80 | ((v>>6)&0x3f));
+      aOut[nOut++] = (u8)(0x80 | (v&0x3f));
+    }else{
+      aOut[nOut++] = (u8)(0xf0 | (v>>18));
+      aOut[nOut++] = (u8)(0x80 | ((v>>12)&0x3f));
+      aOut[nOut++] = (u8)(0x80 | ((v>>6)&0x3f));
+      aOut[nOut++] = (u8)(0x80 | (v&0x3f));
+    }
+    if( v>0x7f ) *pmHigh |= 0x80;
+    iEnd = i;
+    /* Continue with the next escape if it is one */
+    if( i+6>nAvail || z[i]!='\\' || z[i+1]!='u' ) break;
+    if( !druid_hex4(&z[i+2], &v) ) break;
+    i += 2;
+  }
+  if( nEsc==0 ) return 0;
+  druid_append_n(p, (const char*)aOut, nOut, is_value);
+  p->iIn += iEnd;
+  p->file_off += (unsigned int)iEnd;
+  return nEsc;
+}
+
+/*
+** UTF-8 validation of the strings of a table with validate_utf8=1.
+** read_string() ORs the bytes together as it copies them, and checks the
+** strings with non-ASCII characters right after they are decoded, while
+** they are still in the L1 cache.
+**
+** druid_utf8_valid_scalar() skips ASCII 8 bytes at a time and checks
+** the other characters one at a time against the well-formed byte
+** sequences of RFC 3629.  On x86 CPUs with SSSE3 the strings of 16 bytes
+** or more are checked 16 bytes at a time with the lookup algorithm of
+** Keiser and Lemire ("Validating UTF-8 In Less Than One Instruction Per
+** Byte"): three 16-entry tables indexed by the nibbles of each byte and of
+** the byte before it flag the errors of two byte sequences, and the
+** continuation bytes required by 3 and 4 byte characters are checked
+** against the lead bytes 2 and 3 positions before.
+*/
+static bool druid_utf8_valid_scalar(const u8 *z, int n){
+  int i = 0;
+  while( i<n ){
+    u8 c = z[i];
+    if( c<0x80 ){
+      sqlite3_uint64 w;
+      i++;
+      while( i+8<=n ){
+        memcpy(&w, &z[i], 8);
+        if( w & 0x8080808080808080ULL ) break;
+        i += 8;
+      }
+      continue;
+    }
+    if( c>=0xc2 && c<=0xdf ){
+      if( i+1>=n || (z[i+1]&0xc0)!=0x80 ) return false;
+      i += 2;
+    }else if( c>=0xe0 && c<=0xef ){
+      u8 lo = c==0xe0 ? 0xa0 : 0x80;
+      u8 hi = c==0xed ? 0x9f : 0xbf;
+      if( i+2>=n || z[i+1]<lo || z[i+1]>hi || (z[i+2]&0xc0)!=0x80 ) return false;
+      i += 3;
+    }else if( c>=0xf0 && c<=0xf4 ){
+      u8 lo = c==0xf0 ? 0x90 : 0x80;
+      u8 hi = c==0xf4 ? 0x8f : 0xbf;
+      if( i+3>=n || z[i+1]<lo || z[i+1]>hi
+       || (z[i+2]&0xc0)!=0x80 || (z[i+3]&0xc0)!=0x80 ){
+        return false;
+      }
+      i += 4;
+    }else{
+      return false;
+    }
+  }
+  return true;
+}
+
+#if defined(DRUID_UTF8_SSSE3)
+/* Error flags of the lookup tables */
+#define DRUID_U8_TOO_SHORT   (1<<0)  /* 11______ 0_______ or 11______ 11______ */
+#define DRUID_U8_TOO_LONG    (1<<1)  /* 0_______ 10______ */
+#define DRUID_U8_OVERLONG_3  (1<<2)  /* 11100000 100_____ */
+#define DRUID_U8_TOO_LARGE   (1<<3)  /* 11110100 1001____ and above */
+#define DRUID_U8_SURROGATE   (1<<4)  /* 11101101 101_____ */
+#define DRUID_U8_OVERLONG_2  (1<<5)  /* 1100000_ 10______ */
+#define DRUID_U8_TOO_LARGE_1000 (1<<6)  /* 11110101 1000____ and above */
+#define DRUID_U8_OVERLONG_4  (1<<6)  /* 11110000 1000____ */
+#define DRUID_U8_TWO_CONTS   (1<<7)  /* 10______ 10______ */
+#define DRUID_U8_CARRY (DRUID_U8_TOO_SHORT|DRUID_U8_TOO_LONG|DRUID_U8_TWO_CONTS)
+
+/* Errors of the 16 bytes of input given the 16 bytes that precede them */
+__attribute__((target("ssse3")))
+static __m128i druid_utf8_errors(__m128i input, __m128i prev){
+  const __m128i mLow = _mm_set1_epi8(0x0f);
+  const __m128i aByte1High = _mm_setr_epi8(
+    DRUID_U8_TOO_LONG, DRUID_U8_TOO_LONG, DRUID_U8_TOO_LONG, DRUID_U8_TOO_LONG,
+    DRUID_U8_TOO_LONG, DRUID_U8_TOO_LONG, DRUID_U8_TOO_LONG, DRUID_U8_TOO_LONG,
+    DRUID_U8_TWO_CONTS, DRUID_U8_TWO_CONTS, DRUID_U8_TWO_CONTS, DRUID_U8_TWO_CONTS,
+    DRUID_U8_TOO_SHORT|DRUID_U8_OVERLONG_2,
+    DRUID_U8_TOO_SHORT,
+    DRUID_U8_TOO_SHORT|DRUID_U8_OVERLONG_3|DRUID_U8_SURROGATE,
+    (char)(DRUID_U8_TOO_SHORT|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000|DRUID_U8_OVERLONG_4)
+  );
+  const __m128i aByte1Low = _mm_setr_epi8(
+    (char)(DRUID_U8_CARRY|DRUID_U8_OVERLONG_3|DRUID_U8_OVERLONG_2|DRUID_U8_OVERLONG_4),
+    (char)(DRUID_U8_CARRY|DRUID_U8_OVERLONG_2),
+    (char)DRUID_U8_CARRY,
+    (char)DRUID_U8_CARRY,
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000|DRUID_U8_SURROGATE),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000),
+    (char)(DRUID_U8_CARRY|DRUID_U8_TOO_LARGE|DRUID_U8_TOO_LARGE_1000)
+  );
+  const __m128i aByte2High = _mm_setr_epi8(
+    DRUID_U8_TOO_SHORT, DRUID_U8_TOO_SHORT, DRUID_U8_TOO_SHORT, DRUID_U8_TOO_SHORT,
+    DRUID_U8_TOO_SHORT, DRUID_U8_TOO_SHORT, DRUID_U8_TOO_SHORT, DRUID_U8_TOO_SHORT,
+    (char)(DRUID_U8_TOO_LONG|DRUID_U8_OVERLONG_2|DRUID_U8_TWO_CONTS
+           |DRUID_U8_OVERLONG_3|DRUID_U8_TOO_LARGE_1000|DRUID_U8_OVERLONG_4),
+    (char)(DRUID_U8_TOO_LONG|DRUID_U8_OVERLONG_2|DRUID_U8_TWO_CONTS
+           |DRUID_U8_OVERLONG_3|DRUID_U8_TOO_LARGE),
+    (char)(DRUID_U8_TOO_LONG|DRUID_U8_OVERLONG_2|DRUID_U8_TWO_CONTS
+           |DRUID_U8_SURROGATE|DRUID_U8_TOO_LARGE),
+    (char)(DRUID_U8_TOO_LONG|DRUID_U8_OVERLONG_2|DRUID_U8_TWO_CONTS
+           |DRUID_U8_SURROGATE|DRUID_U8_TOO_LARGE),
+    DRUID_U8_TOO_SHORT, DRUID_U8_TOO_SHORT, DRUID_U8_TOO_SHORT, DRUID_U8_TOO_SHORT
+  );
+  __m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+  __m128i prev2 = _mm_alignr_epi8(input, prev, 14);
+  __m128i prev3 = _mm_alignr_epi8(input, prev, 13);
+  __m128i special = _mm_and_si128(
+      _mm_and_si128(
+        _mm_shuffle_epi8(aByte1High, _mm_and_si128(_mm_srli_epi16(prev1, 4), mLow)),
+        _mm_shuffle_epi8(aByte1Low, _mm_and_si128(prev1, mLow))),
+      _mm_shuffle_epi8(aByte2High, _mm_and_si128(_mm_srli_epi16(input, 4), mLow)));
+  /* The bytes 2 after a 3 or 4 byte lead, or 3 after a 4 byte lead,
+  ** must be continuation bytes: only these get the 0x80 flag */
+  __m128i must23 = _mm_or_si128(
+      _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0-0x80))),
+      _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0-0x80))));
+  __m128i must23x80 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+  return _mm_xor_si128(must23x80, special);
+}
+
+/* Validate n>=16 bytes 16 at a time.  The last partial block is copied
+** into a block padded with ASCII NULs. */
+__attribute__((target("ssse3")))
+static bool druid_utf8_valid_ssse3(const u8 *z, int n){
+  /* Lead bytes that need more bytes than there are left in the block */
+  const __m128i mIncomplete = _mm_setr_epi8(
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    (char)(0xf0-1), (char)(0xe0-1), (char)(0xc0-1));
+  __m128i prev = _mm_setzero_si128();
+  __m128i error = _mm_setzero_si128();
+  __m128i incomplete = _mm_setzero_si128();
+  u8 aTail[16];
+  int i;
+  for(i=0; i<n; i+=16){
+    __m128i input;
+    if( i+16<=n ){
+      input = _mm_loadu_si128((const __m128i*)&z[i]);
+    }else{
+      memset(aTail, 0, sizeof(aTail));
+      memcpy(aTail, &z[i], n-i);
+      input = _mm_loadu_si128((const __m128i*)aTail);
+    }
+    if( _mm_movemask_epi8(input)==0 ){
+      /* ASCII only, an error if the last block ended inside a character */
+      error = _mm_or_si128(error, incomplete);
+    }else{
+      error = _mm_or_si128(error, druid_utf8_errors(input, prev));
+      incomplete = _mm_subs_epu8(input, mIncomplete);
+    }
+    prev = input;
+  }
+  error = _mm_or_si128(error, incomplete);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128()))==0xffff;
+}
+#endif /* DRUID_UTF8_SSSE3 */
+
+/* True if the n bytes at z are valid UTF-8 */
+static bool druid_utf8_valid(const u8 *z, int n){
+#if defined(DRUID_UTF8_SSSE3)
+  if( n>=16 && __builtin_cpu_supports("ssse3") ) return druid_utf8_valid_ssse3(z, n);
+#endif
+  return druid_utf8_valid_scalar(z, n);
+}
+
+/* Read the 4 hex digits of a \u escape into *pv.  Return false, with
+** the error of p set, if the file ends or one of them is not a hex digit */
+static bool druid_read_hex4(DruidReader *p, u32 *pv){
+  char z[4];
+  int i;
+  for(i=0; i<4; i++){
+    int c = druid_getc(p, true, false, false);
+    if( c==EOF ){
+      druid_errmsg(p, "result %d(offset %d): unterminated string", p->nResult, p->file_off);
+      return false;
+    }
+    if( !safe_isxdigit(c) ){
+      druid_errmsg(p, "result %d(offset %d): invalid \\u escape", p->nResult, p->file_off);
+      return false;
+    }
+    z[i] = (char)c;
+  }
+  *pv = jsonHexToInt4(z);
+  return true;
+}
+
+static bool read_string(DruidReader *p, bool is_value){
+  int c;
+  int iStart = is_value ? p->value_n : p->label_n;
+  u8 mHigh = 0;              /* OR of the bytes appended, see below */
+  c = druid_getc(p, true, false, false);
+  while ('"' != c) {
+    if (EOF == c) {
+      druid_errmsg(p, "result %d(offset %d): unterminated string", p->nResult, p->file_off);
+      return false;
+    }
+    if ('\\' == c) {
+      c = druid_getc(p, true, false, false);
+    escape:
+      switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+          druid_append(p, c, is_value);
+          break;
+        case 'b':
+          c = '\b';
+          druid_append(p, c, is_value);
+          break;
+        case 'n':
+          c = '\n';
+          druid_append(p, c, is_value);
+          break;
+        case 'r':
+          c = '\r';
+          druid_append(p, c, is_value);
+          break;
+        case 't':
+          c = '\t';
+          druid_append(p, c, is_value);
+          break;
+        case 'u': {
+          u32 v, vlo = 0;
+          if( druid_decode_u_run(p, is_value, &mHigh) ) break;
+          if( !druid_read_hex4(p, &v) ) return false;
+        decode_u:
+          if(0==v)
+            break;
+          if( v>0x7f ) mHigh |= 0x80;
+          if(v<=0x7f){
+            druid_append(p, (char)v, is_value);
+          }else if( v<=0x7ff ){
+            druid_append(p, (char)(0xc0 | (v>>6)), is_value);
+            druid_append(p, (char)(0x80 | (v&0x3f)), is_value);
+          }else if( (v&0xfc00)==0xd800 && druid_getc(p, false, false, false)=='\\' ){
+            druid_advance_c(p);
+            c = druid_getc(p, true, false, false);
+            if( c=='u' ){
+              if( !druid_read_hex4(p, &vlo) ) return false;
+              if( (vlo&0xfc00)==0xdc00 ){
+                /* We have a surrogate pair */
+                v = ((v&0x3ff)<<10) + (vlo&0x3ff) + 0x10000;
+                druid_append(p, (char)(0xf0 | (v>>18)), is_value);
+                druid_append(p, (char)(0x80 | ((v>>12)&0x3f)), is_value);
+                druid_append(p, (char)(0x80 | ((v>>6)&0x3f)), is_value);
+                druid_append(p, (char)(0x80 | (v&0x3f)), is_value);
+                break;
+              }
+            }
+            /* A lone high surrogate.  The escape after it is decoded on its
+            ** own, as druid_decode_u_run() does */
+            druid_append(p, (char)(0xe0 | (v>>12)), is_value);
+            druid_append(p, (char)(0x80 | ((v>>6)&0x3f)), is_value);
+            druid_append(p, (char)(0x80 | (v&0x3f)), is_value);
+            if( c!='u' ) goto escape;
+            v = vlo;
+            goto decode_u;
+          }else{
+            druid_append(p, (char)(0xe0 | (v>>12)), is_value);
+            druid_append(p, (char)(0x80 | ((v>>6)&0x3f)), is_value);
+            druid_append(p, (char)(0x80 | (v&0x3f)), is_value);
+          }
+          break;
+        }
+        case EOF:
+          druid_errmsg(p, "result %d(offset %d): unterminated string", p->nResult, p->file_off);
+          return false;
+        default:
+          druid_errmsg(p, "result %d(offset %d): unexpected escape char", p->nResult, p->file_off, c);
+          return false;
+      }
+    }else{
+      /* Copy c and the plain characters that follow it at once */
+      const char *z = p->zIn + p->iIn;
+      size_t n = 0;
+      size_t nAvail = p->nIn - p->iIn;
+      mHigh |= (u8)c;
+      while( n<nAvail && z[n]!='"' && z[n]!='\\' ) mHigh |= (u8)z[n++];
+      druid_append(p, c, is_value);
+      if( n>0 ){
+        druid_append_n(p, z, n, is_value);
+        p->iIn += n;
+        p->file_off += (unsigned int)n;
+      }
+    }
+    c = druid_getc(p, true, false, false);
+  }
+  if( p->bValidateUtf8 && (mHigh & 0x80)!=0 ){
+    /* Only the strings with non-ASCII characters need to be checked */
+    const char *z = is_value ? p->value : p->label;
+    int n = is_value ? p->value_n : p->label_n;
+    if( n>iStart && !druid_utf8_valid((const u8*)z + iStart, n - iStart) ){
+      druid_errmsg(p, "result %d(offset %d): invalid UTF-8 in string", p->nResult, p->file_off);
+      return false;
+    }
+  }
+  return true;
 }
 
 
@@ -581,560 +1757,7253 @@ static int druidtabNext(sqlite3_vtab_cursor*);
 static int druidtabEof(sqlite3_vtab_cursor*);
 static int druidtabColumn(sqlite3_vtab_cursor*,sqlite3_context*,int);
 static int druidtabRowid(sqlite3_vtab_cursor*,sqlite3_int64*);
+static int druidtabRename(sqlite3_vtab*, const char*);
 static void rewindCur(DruidReader *p);
 
 static void free_druid_metrics_names(int num_druid_metrics, char **druid_metric_names);
 
-/* An instance of the Druid virtual table */
-typedef struct DruidTable {
-  sqlite3_vtab base;              /* Base class.  Must be first */
-  char *zFilename;                /* Name of the CSV file */
-  long iStart;                    /* Offset to start of data in zFilename */
-  int nCol;                       /* Number of columns in the Druid response */
-  bool* metricsCols;              /* Columns that should return REAL instead of TEXT */
-  char **colNames;                /* Column names */
-  unsigned int tstFlags;          /* Bit values used for testing */
-} DruidTable;
+/* Granularity units understood by the rollups= parameter */
+#define DRUID_PERIOD_MINUTE (1)
+#define DRUID_PERIOD_HOUR   (2)
+#define DRUID_PERIOD_DAY    (3)
+#define DRUID_PERIOD_WEEK   (4)
+#define DRUID_PERIOD_MONTH  (5)
+#define DRUID_PERIOD_YEAR   (6)
 
-/* Allowed values for tstFlags */
-#define CSVTEST_FIDX  0x0001      /* Pretend that constrained searchs cost less*/
+/* Max number of rollups that can be declared on one table */
+#define DRUID_MAX_ROLLUPS 16
 
-/* A cursor for the CSV virtual table */
-typedef struct DruidCursor {
-  sqlite3_vtab_cursor base;       /* Base class.  Must be first */
-  DruidReader rdr;                  /* The DruidReader object */
-  char **azVal;                   /* Value of the current row */
-  int *aLen;                      /* Length of each entry */
-  int *jsonType;                  /* Parsed JSON types of current row */
-  sqlite3_int64 iRowid;           /* The current rowid.  Negative for EOF */
-} DruidCursor;
+/* Max number of key parts (time bucket + dimensions) of a rollup */
+#define DRUID_MAX_ROLLUP_KEY 64
 
-/* Transfer error message text from a reader into a DruidTable */
-static void druid_xfer_error(DruidTable *pTab, DruidReader *pRdr){
-  sqlite3_free(pTab->base.zErrMsg);
-  pTab->base.zErrMsg = sqlite3_mprintf("%s", pRdr->zErr);
-}
+/* Memory that is freed all at once, see druid_arena_alloc() */
+typedef struct DruidSlab DruidSlab;
+typedef struct DruidArena {
+  DruidSlab *pSlab;               /* Slab allocated from, the newest first */
+  size_t nNext;                   /* Size of the next slab, 0 for the first */
+} DruidArena;
+
+/* One aggregated row of a rollup: a (time bucket, dimensions) group */
+typedef struct DruidRollupGroup DruidRollupGroup;
+struct DruidRollupGroup {
+  DruidRollupGroup *pNext;        /* Next group in insertion order */
+  DruidRollupGroup *pHashNext;    /* Next group in the same hash bucket */
+  unsigned int h;                 /* Hash of azKey[] */
+  sqlite3_int64 nRow;             /* Number of source rows in this group */
+  char **azKey;                   /* Bucket timestamp followed by nDim dimensions */
+  double *aSum;                   /* Per column sum, only used for metrics */
+  bool *aHasSum;                  /* True if aSum[i] saw a non-NULL value */
+};
+
+/* A rollup declared with rollups="PERIOD:dim,dim;..." */
+typedef struct DruidRollup {
+  char *zPeriod;                  /* ISO-8601 period as declared, e.g. "P1D" */
+  int ePeriod;                    /* One of DRUID_PERIOD_xxx */
+  int nPeriod;                    /* Multiplier of ePeriod, e.g. 15 in PT15M */
+  int nDim;                       /* Number of dimensions */
+  int *aiDim;                     /* Column index of each dimension */
+  bool bBuilt;                    /* True once the groups were computed */
+  int nHash;                      /* Number of slots in apHash[] */
+  DruidRollupGroup **apHash;      /* Hash table of groups */
+  bool bHugeHash;                 /* apHash[] was mapped by druid_huge_alloc() */
+  DruidArena groups;              /* Memory of the groups */
+  DruidRollupGroup *pFirst;       /* First group in insertion order */
+  DruidRollupGroup *pLast;        /* Last group in insertion order */
+  sqlite3_int64 nGroup;           /* Number of groups */
+} DruidRollup;
+
+/* Sum, smallest and largest of the numbers of a column, see
+** druid_accum_batch() */
+#define DRUID_ACCUM_LANES 16
+
+typedef struct DruidAccum {
+  double aLane[DRUID_ACCUM_LANES];  /* Partial sums, see druid_accum_sum() */
+  double rMin;                    /* Smallest number, +Inf if none */
+  double rMax;                    /* Largest number, -Inf if none */
+  sqlite3_int64 n;                /* Number of numbers */
+} DruidAccum;
+
+/* Statistics of the columns of a result file, collected by a full scan */
+typedef struct DruidHll DruidHll;
+typedef struct DruidStats {
+  sqlite3_int64 nRow;             /* Number of rows */
+  sqlite3_int64 *anNull;          /* Number of NULLs of each column */
+  DruidHll *aHll;                 /* Distinct values sketch of each TEXT column */
+  DruidAccum *aAccum;             /* Numbers of each metric column */
+} DruidStats;
 
 /*
-** This method is the destructor fo a DruidTable object.
+** Result files in use by the druid_json tables of the process.
+**
+** Each file has a generation number that is incremented whenever the file
+** is replaced, e.g. overwritten by a newer Druid run.  When a scan starts,
+** a table compares it with the generation its caches (rollups, statistics,
+** shm cache, open cursors) were built from.  That is a single atomic load
+** on an entry the table holds a reference to, so scans of hot files never
+** take a lock.
+**
+** On Linux a watcher thread, shared by the process, waits on inotify
+** watches of the directories of the files and increments the generation
+** of a file on IN_CLOSE_WRITE and IN_MOVED_TO events for its name.
+** Elsewhere, or when a watch cannot be created, the generation is
+** incremented when the identity of the file (device, inode, size and
+** modification time) changes, which one of the scans checks with stat()
+** at most once every DRUID_FILE_CHECK_SECS seconds.
+**
+** Connections on different threads share the registry.  It is split in
+** DRUID_FILE_SHARDS lists, by the hash of the last component of the path
+** so that the watcher can find the shard of an event from its name, each
+** with its own mutex.  Registering and releasing files, which only
+** happens when tables are created and dropped, is further serialized by
+** druidRegistryMutex, which also guards the watcher thread.  The lock
+** order is druidRegistryMutex, then the mutex of a shard.
 */
-static int druidtabDisconnect(sqlite3_vtab *pVtab){
-  DruidTable *p = (DruidTable*)pVtab;
-  sqlite3_free(p->zFilename);
-  sqlite3_free(p->metricsCols);
-  if(p->colNames) {
-      for (int i = 0; i < p->nCol; i++) {
-          sqlite3_free(p->colNames[i]);
+#define DRUID_FILE_CHECK_SECS 1
+#define DRUID_FILE_SHARDS     16
+
+#if defined(__GNUC__)
+# define DRUID_ATOMIC_LOAD(p)   __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define DRUID_ATOMIC_STORE(p,v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define DRUID_ATOMIC_INC(p)    __atomic_add_fetch((p), 1, __ATOMIC_RELEASE)
+# define DRUID_ATOMIC_TRYLOCK(p) (__atomic_exchange_n((p), 1, __ATOMIC_ACQUIRE)==0)
+# define DRUID_ATOMIC_UNLOCK(p) __atomic_store_n((p), 0, __ATOMIC_RELEASE)
+# define DRUID_ATOMIC_DEC(p)    __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+# define DRUID_ATOMIC_CAS(p,o,n) \
+    __atomic_compare_exchange_n((p), &(o), (n), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+# define DRUID_ATOMIC_LOAD(p)   (*(p))
+# define DRUID_ATOMIC_STORE(p,v) (*(p) = (v))
+# define DRUID_ATOMIC_INC(p)    (++*(p))
+# define DRUID_ATOMIC_TRYLOCK(p) (*(p) ? 0 : (*(p) = 1))
+# define DRUID_ATOMIC_UNLOCK(p) (*(p) = 0)
+# define DRUID_ATOMIC_DEC(p)    (--*(p))
+# define DRUID_ATOMIC_CAS(p,o,n) (*(p)==(o) ? (*(p) = (n), 1) : 0)
+#endif
+
+typedef struct DruidFile DruidFile;
+struct DruidFile {
+  char *zPath;                    /* Canonical name of the file */
+  const char *zBase;              /* Last component of zPath */
+  int iShard;                     /* Index in druidFileShards[] */
+  int wd;                         /* inotify watch of the directory, or -1 */
+  unsigned int iGeneration;       /* Incremented when the file is replaced */
+  int bChecking;                  /* Set while a scan checks the identity */
+  time_t tChecked;                /* Time of the last identity check */
+  dev_t iDev;                     /* Identity of the file at tChecked */
+  ino_t iIno;
+  off_t iSize;
+  time_t iMtime;
+  int nRef;                       /* Number of tables using this file */
+  DruidFile *pNext;               /* Next file of the same shard */
+};
+
+/* One list of the registry */
+typedef struct DruidFileShard {
+  pthread_mutex_t mutex;          /* Guards pFirst and the nRef of its files */
+  DruidFile *pFirst;              /* Files whose zBase hashes to this shard */
+} DruidFileShard;
+
+#define DRUID_SHARD_INIT  { PTHREAD_MUTEX_INITIALIZER, 0 }
+static DruidFileShard druidFileShards[DRUID_FILE_SHARDS] = {
+  DRUID_SHARD_INIT, DRUID_SHARD_INIT, DRUID_SHARD_INIT, DRUID_SHARD_INIT,
+  DRUID_SHARD_INIT, DRUID_SHARD_INIT, DRUID_SHARD_INIT, DRUID_SHARD_INIT,
+  DRUID_SHARD_INIT, DRUID_SHARD_INIT, DRUID_SHARD_INIT, DRUID_SHARD_INIT,
+  DRUID_SHARD_INIT, DRUID_SHARD_INIT, DRUID_SHARD_INIT, DRUID_SHARD_INIT,
+};
+static pthread_mutex_t druidRegistryMutex = PTHREAD_MUTEX_INITIALIZER;
+static int druidFileCount = 0;    /* Registered files, guarded by druidRegistryMutex */
+
+/* Shard of the files named zBase */
+static int druid_file_shard(const char *zBase){
+  unsigned int h = 2166136261u;
+  while( *zBase ){
+    h = (h ^ (unsigned char)*zBase++) * 16777619u;
+  }
+  return (int)(h % DRUID_FILE_SHARDS);
+}
+
+#ifdef __linux__
+/* The watcher thread, running while files are registered.  Guarded by
+** druidRegistryMutex.  The thread itself does not use it. */
+static struct {
+  int fd;                         /* inotify descriptor, or -1 */
+  int aPipe[2];                   /* Written to stop the thread */
+  pthread_t thread;
+  int nWd;                        /* Number of entries in aWd[] */
+  struct DruidWatchDir {
+    int wd;                       /* inotify watch of a directory */
+    int nRef;                     /* Number of files in the directory */
+  } *aWd;
+} druidWatch = { -1, { -1, -1 }, 0, 0, 0 };
+
+/* Increment the generation of the files of a shard that an inotify event
+** is about.  All files if the event queue overflowed. */
+static void druid_watch_event(int iShard, const struct inotify_event *pEv){
+  DruidFileShard *pShard = &druidFileShards[iShard];
+  DruidFile *pFile;
+  pthread_mutex_lock(&pShard->mutex);
+  for(pFile=pShard->pFirst; pFile; pFile=pFile->pNext){
+    if( (pEv->mask & IN_Q_OVERFLOW)
+     || (pFile->wd==pEv->wd && strcmp(pFile->zBase, pEv->name)==0)
+    ){
+      DRUID_ATOMIC_INC(&pFile->iGeneration);
+    }
+  }
+  pthread_mutex_unlock(&pShard->mutex);
+}
+
+static void *druid_watch_main(void *pArg){
+  union {
+    struct inotify_event ev;
+    char a[4096];
+  } u;
+  struct pollfd aPoll[2];
+  /* The descriptors are passed by druid_watch_start(), as druidWatch may
+  ** already be reset by druid_file_release() when the thread starts */
+  aPoll[0].fd = ((int*)pArg)[0];
+  aPoll[0].events = POLLIN;
+  aPoll[1].fd = ((int*)pArg)[1];
+  aPoll[1].events = POLLIN;
+  free(pArg);
+  while( true ){
+    ssize_t n;
+    char *z;
+    if( poll(aPoll, 2, -1)<0 ){
+      if( errno==EINTR ) continue;
+      break;
+    }
+    if( aPoll[1].revents ) break;
+    n = read(aPoll[0].fd, u.a, sizeof(u.a));
+    for(z=u.a; n>0 && z<u.a+n; z+=sizeof(struct inotify_event)+((struct inotify_event*)z)->len){
+      const struct inotify_event *pEv = (const struct inotify_event*)z;
+      int i;
+      if( pEv->mask & IN_Q_OVERFLOW ){
+        for(i=0; i<DRUID_FILE_SHARDS; i++) druid_watch_event(i, pEv);
+      }else if( pEv->len>0 ){
+        druid_watch_event(druid_file_shard(pEv->name), pEv);
       }
-      sqlite3_free(p->colNames);
+    }
   }
-  sqlite3_free(p);
-  return SQLITE_OK;
+  return 0;
 }
 
-/* Skip leading whitespace.  Return a pointer to the first non-whitespace
-** character, or to the zero terminator if the string has only whitespace */
-static const char *druid_skip_whitespace(const char *z){
-  while( isspace((unsigned char)z[0]) ) z++;
-  return z;
+/* Start the watcher thread.  Called with druidRegistryMutex held */
+static void druid_watch_start(void){
+  int *aFd;
+  druidWatch.fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if( druidWatch.fd<0 ) return;
+  if( pipe(druidWatch.aPipe)==0 ){
+    aFd = malloc(sizeof(int)*2);
+    if( aFd ){
+      aFd[0] = druidWatch.fd;
+      aFd[1] = druidWatch.aPipe[0];
+      if( pthread_create(&druidWatch.thread, 0, druid_watch_main, aFd)==0 ) return;
+      free(aFd);
+    }
+    close(druidWatch.aPipe[0]);
+    close(druidWatch.aPipe[1]);
+  }
+  close(druidWatch.fd);
+  druidWatch.fd = -1;
 }
 
-/* Remove trailing whitespace from the end of string z[] */
-static void druid_trim_whitespace(char *z){
-  size_t n = strlen(z);
-  while( n>0 && isspace((unsigned char)z[n]) ) n--;
-  z[n] = 0;
+/* Stop the watcher thread.  Called without druidRegistryMutex */
+static void druid_watch_stop(int fd, int fdStop, int fdStopRead, pthread_t thread){
+  if( write(fdStop, "", 1)==1 ) pthread_join(thread, 0);
+  close(fdStop);
+  close(fdStopRead);
+  close(fd);
 }
 
-/* Dequote the string */
-static void druid_dequote(char *z){
-  int j;
-  char cQuote = z[0];
-  size_t i, n;
+/* Watch directory zDir.  Return the watch descriptor or -1.
+** Called with druidRegistryMutex held */
+static int druid_watch_add(const char *zDir){
+  struct DruidWatchDir *aNew;
+  int wd, i;
+  if( druidWatch.fd<0 ) return -1;
+  wd = inotify_add_watch(druidWatch.fd, zDir, IN_CLOSE_WRITE|IN_MOVED_TO);
+  if( wd<0 ) return -1;
+  for(i=0; i<druidWatch.nWd; i++){
+    if( druidWatch.aWd[i].wd==wd ){
+      druidWatch.aWd[i].nRef++;
+      return wd;
+    }
+  }
+  aNew = sqlite3_realloc64(druidWatch.aWd, sizeof(aNew[0])*(druidWatch.nWd+1));
+  if( aNew==0 ){
+    inotify_rm_watch(druidWatch.fd, wd);
+    return -1;
+  }
+  druidWatch.aWd = aNew;
+  aNew[druidWatch.nWd].wd = wd;
+  aNew[druidWatch.nWd].nRef = 1;
+  druidWatch.nWd++;
+  return wd;
+}
 
-  if( cQuote!='\'' && cQuote!='"' ) return;
-  n = strlen(z);
-  if( n<2 || z[n-1]!=z[0] ) return;
-  for(i=1, j=0; i<n-1; i++){
-    if( z[i]==cQuote && z[i+1]==cQuote ) i++;
-    z[j++] = z[i];
+/* Release a watch returned by druid_watch_add().
+** Called with druidRegistryMutex held */
+static void druid_watch_remove(int wd){
+  int i;
+  for(i=0; i<druidWatch.nWd; i++){
+    if( druidWatch.aWd[i].wd!=wd ) continue;
+    if( --druidWatch.aWd[i].nRef==0 ){
+      inotify_rm_watch(druidWatch.fd, wd);
+      druidWatch.aWd[i] = druidWatch.aWd[--druidWatch.nWd];
+    }
+    break;
+  }
+  if( druidWatch.nWd==0 ){
+    sqlite3_free(druidWatch.aWd);
+    druidWatch.aWd = 0;
   }
-  z[j] = 0;
 }
+#endif /* __linux__ */
 
-/* Check to see if the string is of the form:  "TAG = VALUE" with optional
-** whitespace before and around tokens.  If it is, return a pointer to the
-** first character of VALUE.  If it is not, return NULL.
-*/
-static const char *druid_parameter(const char *zTag, int nTag, const char *z){
-  z = druid_skip_whitespace(z);
-  if( strncmp(zTag, z, nTag)!=0 ) return 0;
-  z = druid_skip_whitespace(z+nTag);
-  if( z[0]!='=' ) return 0;
-  return druid_skip_whitespace(z+1);
+/* Record the identity of a file.  Return true if it changed */
+static bool druid_file_identify(DruidFile *pFile){
+  struct stat st;
+  bool bChanged;
+  if( stat(pFile->zPath, &st)!=0 ) return false;
+  bChanged = st.st_dev!=pFile->iDev || st.st_ino!=pFile->iIno
+          || st.st_size!=pFile->iSize || st.st_mtime!=pFile->iMtime;
+  pFile->iDev = st.st_dev;
+  pFile->iIno = st.st_ino;
+  pFile->iSize = st.st_size;
+  pFile->iMtime = st.st_mtime;
+  return bChanged;
 }
 
-/* Decode a parameter that requires a dequoted string.
-**
-** Return 1 if the parameter is seen, or 0 if not.  1 is returned
-** even if there is an error.  If an error occurs, then an error message
-** is left in p->zErr.  If there are no errors, p->zErr[0]==0.
-*/
-static int druid_string_parameter(
-  DruidReader *p,            /* Leave the error message here, if there is one */
-  const char *zParam,      /* Parameter we are checking for */
-  const char *zArg,        /* Raw text of the virtual table argment */
-  char **pzVal             /* Write the dequoted string value here */
-){
-  const char *zValue;
-  zValue = druid_parameter(zParam,(int)strlen(zParam),zArg);
-  if( zValue==0 ) return 0;
-  p->zErr[0] = 0;
-  if( *pzVal ){
-    druid_errmsg(p, "more than one '%s' parameter", zParam);
-    return 1;
+/* Return the registry entry of file zFilename, or NULL on OOM */
+static DruidFile *druid_file_acquire(const char *zFilename){
+  char *zReal = realpath(zFilename, 0);
+  const char *zPath = zReal ? zReal : zFilename;
+  const char *zSlash = strrchr(zPath, '/');
+  int iShard = druid_file_shard(zSlash ? zSlash+1 : zPath);
+  DruidFileShard *pShard = &druidFileShards[iShard];
+  DruidFile *pFile;
+
+  pthread_mutex_lock(&druidRegistryMutex);
+  pthread_mutex_lock(&pShard->mutex);
+  for(pFile=pShard->pFirst; pFile; pFile=pFile->pNext){
+    if( strcmp(pFile->zPath, zPath)==0 ) break;
   }
-  *pzVal = sqlite3_mprintf("%s", zValue);
-  if( *pzVal==0 ){
-    druid_errmsg(p, "out of memory");
-    return 1;
+  if( pFile ) pFile->nRef++;
+  pthread_mutex_unlock(&pShard->mutex);
+
+  if( pFile==0 ){
+    size_t nPath = strlen(zPath);
+    pFile = sqlite3_malloc64(sizeof(*pFile) + nPath + 1);
+    if( pFile ){
+      memset(pFile, 0, sizeof(*pFile));
+      pFile->zPath = (char*)&pFile[1];
+      memcpy(pFile->zPath, zPath, nPath+1);
+      zSlash = strrchr(pFile->zPath, '/');
+      pFile->zBase = zSlash ? zSlash+1 : pFile->zPath;
+      pFile->iShard = iShard;
+      pFile->wd = -1;
+      pFile->nRef = 1;
+      druid_file_identify(pFile);
+      pFile->tChecked = time(0);
+#ifdef __linux__
+      if( druidFileCount==0 ) druid_watch_start();
+      {
+        char *zDir = zSlash ? sqlite3_mprintf("%.*s", (int)(zSlash - pFile->zPath), pFile->zPath)
+                            : sqlite3_mprintf(".");
+        if( zDir ){
+          pFile->wd = druid_watch_add(zDir[0] ? zDir : "/");
+          sqlite3_free(zDir);
+        }
+      }
+#endif
+      druidFileCount++;
+      pthread_mutex_lock(&pShard->mutex);
+      pFile->pNext = pShard->pFirst;
+      pShard->pFirst = pFile;
+      pthread_mutex_unlock(&pShard->mutex);
+    }
   }
-  druid_trim_whitespace(*pzVal);
-  druid_dequote(*pzVal);
-  return 1;
+  pthread_mutex_unlock(&druidRegistryMutex);
+  free(zReal);
+  return pFile;
 }
 
-/*
-** Parameters:
-**    filename=FILENAME          Name of file containing CSV content
-**    metrics=METRICS            Comma seperated list of metric names (changes the datatype from TEXT -> REAL)
-**
-** Only available if compiled with SQLITE_TEST:
-**
-**    testflags=N                Bitmask of test flags.  Optional
+/* Release a file returned by druid_file_acquire() */
+static void druid_file_release(DruidFile *pFile){
+  DruidFileShard *pShard;
+  DruidFile **pp;
+  bool bFree = false;
+#ifdef __linux__
+  bool bStop = false;
+  int fd = -1, aPipe[2];
+  pthread_t thread;
+#endif
+  if( pFile==0 ) return;
+  pShard = &druidFileShards[pFile->iShard];
+  pthread_mutex_lock(&druidRegistryMutex);
+  pthread_mutex_lock(&pShard->mutex);
+  if( --pFile->nRef==0 ){
+    for(pp=&pShard->pFirst; *pp!=pFile; pp=&(*pp)->pNext){}
+    *pp = pFile->pNext;
+    bFree = true;
+  }
+  pthread_mutex_unlock(&pShard->mutex);
+  if( bFree ){
+    druidFileCount--;
+#ifdef __linux__
+    if( pFile->wd>=0 ) druid_watch_remove(pFile->wd);
+    if( druidFileCount==0 && druidWatch.fd>=0 ){
+      bStop = true;
+      fd = druidWatch.fd;
+      aPipe[0] = druidWatch.aPipe[0];
+      aPipe[1] = druidWatch.aPipe[1];
+      thread = druidWatch.thread;
+      druidWatch.fd = -1;
+    }
+#endif
+    sqlite3_free(pFile);
+  }
+  pthread_mutex_unlock(&druidRegistryMutex);
+#ifdef __linux__
+  if( bStop ) druid_watch_stop(fd, aPipe[1], aPipe[0], thread);
+#endif
+}
+
+/* Return the current generation of a file.  Without a watch, the first
+** scan after DRUID_FILE_CHECK_SECS checks the identity of the file while
+** the concurrent ones use the generation as it is. */
+static unsigned int druid_file_generation(DruidFile *pFile){
+  if( pFile->wd<0 ){
+    time_t now = time(0);
+    if( now - DRUID_ATOMIC_LOAD(&pFile->tChecked) >= DRUID_FILE_CHECK_SECS
+     && DRUID_ATOMIC_TRYLOCK(&pFile->bChecking)
+    ){
+      if( now - pFile->tChecked >= DRUID_FILE_CHECK_SECS ){
+        if( druid_file_identify(pFile) ) DRUID_ATOMIC_INC(&pFile->iGeneration);
+        DRUID_ATOMIC_STORE(&pFile->tChecked, now);
+      }
+      DRUID_ATOMIC_UNLOCK(&pFile->bChecking);
+    }
+  }
+  return DRUID_ATOMIC_LOAD(&pFile->iGeneration);
+}
+
+/*
+** Worker pool
+**
+** Background work (reading the next block of a file while the current one
+** is parsed) runs on a single process-wide pool of worker threads, started
+** on the first task and sized by druid_json_config('threads', N), which
+** defaults to the number of online CPUs.  0 runs everything on the thread
+** of the query.
+**
+** Each worker owns a Chase-Lev deque: it pushes and takes the tasks it
+** submits itself at the bottom, without a lock, while idle workers steal
+** from the top of the others.  These are the halves of a row count that a
+** worker splits further (see druid_count_chunk()), so the oldest tasks,
+** which steals take, are the largest.  Tasks submitted by the threads of
+** SQLite connections go to the injector, a FIFO list guarded by the pool
+** mutex, which is also where idle workers sleep.
+**
+** A task is referenced by its submitter and by the queue holding it, and
+** freed by whichever releases it last, possibly on a worker, so tasks are
+** allocated with malloc() rather than sqlite3_malloc().  A submitter that
+** needs the result of a task still queued runs it on its own thread, and
+** one that no longer needs it (e.g. a cursor closed before the end of the
+** scan) cancels it, so that it is dropped by the worker that pops it.
+*/
+#define DRUID_TASK_QUEUED    0
+#define DRUID_TASK_RUNNING   1
+#define DRUID_TASK_DONE      2
+#define DRUID_TASK_CANCELLED 3
+
+typedef struct DruidTask DruidTask;
+struct DruidTask {
+  void (*xRun)(void*);            /* The work */
+  void *pArg;                     /* Argument of xRun */
+  int eState;                     /* One of the DRUID_TASK_ values */
+  int nRef;                       /* The submitter and the queue */
+  DruidTask *pNext;               /* Next task in the injector */
+};
+
+/* Drop a reference to a task */
+static void druid_task_release(DruidTask *pTask){
+  if( pTask && DRUID_ATOMIC_DEC(&pTask->nRef)==0 ) free(pTask);
+}
+
+#if defined(__GNUC__)
+
+#define DRUID_POOL_MAX    64       /* Largest number of workers */
+#define DRUID_DEQUE_SIZE  256      /* Capacity of a deque, a power of two */
+
+/* The deque of a worker.  iTop and iBottom are on their own cache lines
+** as the first is written by thieves and the second by the owner. */
+typedef struct DruidDeque {
+  long iTop;
+  char aPad1[64 - sizeof(long)];
+  long iBottom;
+  char aPad2[64 - sizeof(long)];
+  DruidTask *aTask[DRUID_DEQUE_SIZE];
+} DruidDeque;
+
+static struct {
+  pthread_mutex_t mutex;          /* Guards all but the deques and nQueued */
+  pthread_cond_t condWork;        /* Signalled when a task is queued */
+  pthread_cond_t condDone;        /* Broadcast when a task completes */
+  int nConfig;                    /* Configured size, -1 until configured */
+  int nWorker;                    /* Running workers, 0 while stopped */
+  bool bStop;                     /* Set while the workers are stopped */
+  int nQueued;                    /* Tasks in the injector and the deques */
+  DruidTask *pFirst, *pLast;      /* The injector */
+  DruidDeque *aDeque;             /* One deque per worker */
+  pthread_t *aThread;
+  int nModule;                    /* Connections using the extension */
+} druidPool = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, -1, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* 1 + the index of the worker running on this thread, 0 on others */
+static __thread int druidPoolWorker = 0;
+
+/* Push a task at the bottom of the deque of the current worker.  Return
+** false if the deque is full. */
+static bool druid_deque_push(DruidDeque *pDeque, DruidTask *pTask){
+  long b = __atomic_load_n(&pDeque->iBottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&pDeque->iTop, __ATOMIC_ACQUIRE);
+  if( b - t >= DRUID_DEQUE_SIZE ) return false;
+  __atomic_store_n(&pDeque->aTask[b & (DRUID_DEQUE_SIZE-1)], pTask, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&pDeque->iBottom, b+1, __ATOMIC_RELAXED);
+  return true;
+}
+
+/* Take the last task pushed on the deque of the current worker */
+static DruidTask *druid_deque_take(DruidDeque *pDeque){
+  long b = __atomic_load_n(&pDeque->iBottom, __ATOMIC_RELAXED) - 1;
+  long t;
+  DruidTask *pTask = 0;
+  __atomic_store_n(&pDeque->iBottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  t = __atomic_load_n(&pDeque->iTop, __ATOMIC_RELAXED);
+  if( t<=b ){
+    pTask = __atomic_load_n(&pDeque->aTask[b & (DRUID_DEQUE_SIZE-1)], __ATOMIC_RELAXED);
+    if( t==b ){
+      /* Last task, race the thieves for it */
+      if( !__atomic_compare_exchange_n(&pDeque->iTop, &t, t+1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ){
+        pTask = 0;
+      }
+      __atomic_store_n(&pDeque->iBottom, b+1, __ATOMIC_RELAXED);
+    }
+  }else{
+    __atomic_store_n(&pDeque->iBottom, b+1, __ATOMIC_RELAXED);
+  }
+  return pTask;
+}
+
+/* Steal the oldest task of the deque of another worker */
+static DruidTask *druid_deque_steal(DruidDeque *pDeque){
+  long t = __atomic_load_n(&pDeque->iTop, __ATOMIC_ACQUIRE);
+  long b;
+  DruidTask *pTask;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  b = __atomic_load_n(&pDeque->iBottom, __ATOMIC_ACQUIRE);
+  if( t>=b ) return 0;
+  pTask = __atomic_load_n(&pDeque->aTask[t & (DRUID_DEQUE_SIZE-1)], __ATOMIC_RELAXED);
+  if( !__atomic_compare_exchange_n(&pDeque->iTop, &t, t+1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ){
+    return 0;
+  }
+  return pTask;
+}
+
+/* Run a task popped from a queue, unless it was cancelled or is already
+** being run by its submitter */
+static void druid_task_run(DruidTask *pTask){
+  int eState = DRUID_TASK_QUEUED;
+  if( DRUID_ATOMIC_CAS(&pTask->eState, eState, DRUID_TASK_RUNNING) ){
+    pTask->xRun(pTask->pArg);
+    pthread_mutex_lock(&druidPool.mutex);
+    DRUID_ATOMIC_STORE(&pTask->eState, DRUID_TASK_DONE);
+    pthread_cond_broadcast(&druidPool.condDone);
+    pthread_mutex_unlock(&druidPool.mutex);
+  }
+  druid_task_release(pTask);
+}
+
+/* Main loop of a worker */
+static void *druid_pool_main(void *pArg){
+  int iWorker = (int)(size_t)pArg;
+  int nWorker = druidPool.nWorker;
+  DruidDeque *aDeque = druidPool.aDeque;
+  int i;
+  druidPoolWorker = iWorker + 1;
+  for(;;){
+    DruidTask *pTask = druid_deque_take(&aDeque[iWorker]);
+    if( pTask==0 ){
+      pthread_mutex_lock(&druidPool.mutex);
+      pTask = druidPool.pFirst;
+      if( pTask ){
+        druidPool.pFirst = pTask->pNext;
+        if( druidPool.pFirst==0 ) druidPool.pLast = 0;
+      }
+      pthread_mutex_unlock(&druidPool.mutex);
+    }
+    for(i=1; pTask==0 && i<nWorker; i++){
+      pTask = druid_deque_steal(&aDeque[(iWorker + i) % nWorker]);
+    }
+    if( pTask ){
+      DRUID_ATOMIC_DEC(&druidPool.nQueued);
+      druid_task_run(pTask);
+      continue;
+    }
+    pthread_mutex_lock(&druidPool.mutex);
+    while( DRUID_ATOMIC_LOAD(&druidPool.nQueued)==0 && !druidPool.bStop ){
+      pthread_cond_wait(&druidPool.condWork, &druidPool.mutex);
+    }
+    if( DRUID_ATOMIC_LOAD(&druidPool.nQueued)==0 ){
+      /* Stopping, and every queued task was run */
+      pthread_mutex_unlock(&druidPool.mutex);
+      break;
+    }
+    pthread_mutex_unlock(&druidPool.mutex);
+  }
+  return 0;
+}
+
+/* The configured number of workers.  Called with the pool mutex held */
+static int druid_pool_size(void){
+  if( druidPool.nConfig<0 ){
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    druidPool.nConfig = n<1 ? 1 : n>DRUID_POOL_MAX ? DRUID_POOL_MAX : (int)n;
+  }
+  return druidPool.nConfig;
+}
+
+/* Start the workers.  Called with the pool mutex held */
+static void druid_pool_start(void){
+  int n = druid_pool_size();
+  int i;
+  if( n==0 ) return;
+  druidPool.aDeque = sqlite3_malloc64(sizeof(DruidDeque)*n);
+  druidPool.aThread = sqlite3_malloc64(sizeof(pthread_t)*n);
+  if( druidPool.aDeque==0 || druidPool.aThread==0 ) goto pool_start_failed;
+  memset(druidPool.aDeque, 0, sizeof(DruidDeque)*n);
+  druidPool.nWorker = n;
+  for(i=0; i<n; i++){
+    if( pthread_create(&druidPool.aThread[i], 0, druid_pool_main, (void*)(size_t)i) ){
+      break;
+    }
+  }
+  if( i<n ){
+    /* Stop the workers started so far, which cannot have any task yet */
+    druidPool.bStop = true;
+    pthread_cond_broadcast(&druidPool.condWork);
+    pthread_mutex_unlock(&druidPool.mutex);
+    while( i-- ) pthread_join(druidPool.aThread[i], 0);
+    pthread_mutex_lock(&druidPool.mutex);
+    druidPool.bStop = false;
+    druidPool.nWorker = 0;
+    goto pool_start_failed;
+  }
+  return;
+
+pool_start_failed:
+  sqlite3_free(druidPool.aDeque);
+  sqlite3_free(druidPool.aThread);
+  druidPool.aDeque = 0;
+  druidPool.aThread = 0;
+}
+
+/* Stop the workers, once they ran every queued task */
+static void druid_pool_stop(void){
+  pthread_t *aThread;
+  int i, n;
+  pthread_mutex_lock(&druidPool.mutex);
+  if( druidPool.nWorker==0 || druidPool.bStop ){
+    pthread_mutex_unlock(&druidPool.mutex);
+    return;
+  }
+  druidPool.bStop = true;
+  aThread = druidPool.aThread;
+  n = druidPool.nWorker;
+  pthread_cond_broadcast(&druidPool.condWork);
+  pthread_mutex_unlock(&druidPool.mutex);
+  for(i=0; i<n; i++) pthread_join(aThread[i], 0);
+  pthread_mutex_lock(&druidPool.mutex);
+  sqlite3_free(druidPool.aDeque);
+  sqlite3_free(druidPool.aThread);
+  druidPool.aDeque = 0;
+  druidPool.aThread = 0;
+  druidPool.nWorker = 0;
+  druidPool.bStop = false;
+  pthread_mutex_unlock(&druidPool.mutex);
+}
+
+/*
+** Queue xRun(pArg) on the pool, starting it if needed.  Return the task,
+** to be waited for or cancelled, then released, by the caller.  Return
+** NULL if the pool is disabled or the task cannot be queued, in which
+** case the caller does the work itself.
+*/
+static DruidTask *druid_pool_submit(void (*xRun)(void*), void *pArg){
+  DruidTask *pTask = malloc(sizeof(*pTask));
+  if( pTask==0 ) return 0;
+  pTask->xRun = xRun;
+  pTask->pArg = pArg;
+  pTask->eState = DRUID_TASK_QUEUED;
+  pTask->nRef = 2;
+  pTask->pNext = 0;
+  if( druidPoolWorker ){
+    /* Submitted by a worker, which owns its deque until the pool stops */
+    DruidDeque *pDeque = &druidPool.aDeque[druidPoolWorker-1];
+    DRUID_ATOMIC_INC(&druidPool.nQueued);
+    if( druid_deque_push(pDeque, pTask) ){
+      pthread_mutex_lock(&druidPool.mutex);
+      pthread_cond_signal(&druidPool.condWork);
+      pthread_mutex_unlock(&druidPool.mutex);
+      return pTask;
+    }
+    DRUID_ATOMIC_DEC(&druidPool.nQueued);
+  }
+  pthread_mutex_lock(&druidPool.mutex);
+  if( druidPool.nWorker==0 && !druidPool.bStop ) druid_pool_start();
+  if( druidPool.nWorker==0 || druidPool.bStop ){
+    pthread_mutex_unlock(&druidPool.mutex);
+    free(pTask);
+    return 0;
+  }
+  if( druidPool.pLast ){
+    druidPool.pLast->pNext = pTask;
+  }else{
+    druidPool.pFirst = pTask;
+  }
+  druidPool.pLast = pTask;
+  DRUID_ATOMIC_INC(&druidPool.nQueued);
+  pthread_cond_signal(&druidPool.condWork);
+  pthread_mutex_unlock(&druidPool.mutex);
+  return pTask;
+}
+
+/* Wait for a task to complete, running it here if no worker started it */
+static void druid_task_wait(DruidTask *pTask){
+  int eState = DRUID_TASK_QUEUED;
+  if( DRUID_ATOMIC_CAS(&pTask->eState, eState, DRUID_TASK_RUNNING) ){
+    pTask->xRun(pTask->pArg);
+    DRUID_ATOMIC_STORE(&pTask->eState, DRUID_TASK_DONE);
+    return;
+  }
+  pthread_mutex_lock(&druidPool.mutex);
+  while( DRUID_ATOMIC_LOAD(&pTask->eState)==DRUID_TASK_RUNNING ){
+    pthread_cond_wait(&druidPool.condDone, &druidPool.mutex);
+  }
+  pthread_mutex_unlock(&druidPool.mutex);
+}
+
+/* Cancel a task if no worker started it, or wait for it to complete.
+** Either way, its argument can be freed when this returns. */
+static void druid_task_cancel(DruidTask *pTask){
+  int eState = DRUID_TASK_QUEUED;
+  if( DRUID_ATOMIC_CAS(&pTask->eState, eState, DRUID_TASK_CANCELLED) ) return;
+  druid_task_wait(pTask);
+}
+
+/* The number of workers of the pool, running or not */
+static int druid_pool_threads(void){
+  int n;
+  pthread_mutex_lock(&druidPool.mutex);
+  n = druid_pool_size();
+  pthread_mutex_unlock(&druidPool.mutex);
+  return n;
+}
+
+/* Resize the pool.  The workers are restarted on the next task, with
+** the new size as it is set before they are stopped */
+static void druid_pool_configure(int nThread){
+  pthread_mutex_lock(&druidPool.mutex);
+  druidPool.nConfig = nThread;
+  pthread_mutex_unlock(&druidPool.mutex);
+  druid_pool_stop();
+}
+
+/* True on the threads of the pool */
+static bool druid_pool_is_worker(void){
+  return druidPoolWorker!=0;
+}
+
+/* Register a connection loading the extension */
+static void druid_pool_attach(void){
+  pthread_mutex_lock(&druidPool.mutex);
+  druidPool.nModule++;
+  pthread_mutex_unlock(&druidPool.mutex);
+}
+
+/* Unregister a connection.  The pool is stopped with the last one, as
+** the library may be unloaded next. */
+static void druid_pool_detach(void){
+  int nModule;
+  pthread_mutex_lock(&druidPool.mutex);
+  nModule = --druidPool.nModule;
+  pthread_mutex_unlock(&druidPool.mutex);
+  if( nModule==0 ) druid_pool_stop();
+}
+
+#else /* !defined(__GNUC__) */
+
+#define DRUID_POOL_MAX 0
+
+static DruidTask *druid_pool_submit(void (*xRun)(void*), void *pArg){ return 0; }
+static void druid_task_wait(DruidTask *pTask){}
+static void druid_task_cancel(DruidTask *pTask){}
+static int druid_pool_threads(void){ return 0; }
+static void druid_pool_configure(int nThread){}
+static bool druid_pool_is_worker(void){ return false; }
+static void druid_pool_attach(void){}
+static void druid_pool_detach(void){}
+
+#endif /* defined(__GNUC__) */
+
+/* The block of a file read ahead on the worker pool */
+typedef struct DruidReadAhead {
+  int fd;                         /* Descriptor of the FILE of the reader */
+  char *zNext;                    /* The block */
+  sqlite3_int64 iNext;            /* Offset of the block in the file */
+  ssize_t nNext;                  /* Bytes read, or -1 on error */
+  DruidTask *pTask;               /* The read, or NULL */
+} DruidReadAhead;
+
+static void druid_readahead_task(void *pArg){
+  DruidReadAhead *pAhead = (DruidReadAhead*)pArg;
+  ssize_t n;
+  do{
+    n = pread(pAhead->fd, pAhead->zNext, DRUIDJSON_READAHEAD_SZ, (off_t)pAhead->iNext);
+  }while( n<0 && errno==EINTR );
+  pAhead->nNext = n;
+}
+
+/*
+** Make a reader read the file by blocks of DRUIDJSON_READAHEAD_SZ bytes,
+** reading the next block on the worker pool while the current one is
+** parsed.  Does nothing if the pool is disabled.  The blocks are read
+** with pread() and the position of the FILE is moved past each block, so
+** that ftell() and fseek() work as with fread().
+*/
+static void druid_reader_readahead(DruidReader *p){
+  DruidReadAhead *pAhead;
+  char *zIn, *zNext;
+  if( p->pAhead || druid_pool_threads()==0 ) return;
+  pAhead = sqlite3_malloc64(sizeof(*pAhead));
+  zNext = sqlite3_malloc64(DRUIDJSON_READAHEAD_SZ);
+  zIn = sqlite3_realloc64(p->zIn, DRUIDJSON_READAHEAD_SZ);
+  if( zIn ) p->zIn = zIn;
+  if( pAhead==0 || zNext==0 || zIn==0 ){
+    /* Keep reading with fread() */
+    sqlite3_free(pAhead);
+    sqlite3_free(zNext);
+    return;
+  }
+  pAhead->fd = fileno(p->in);
+  pAhead->zNext = zNext;
+  pAhead->iNext = -1;
+  pAhead->nNext = -1;
+  pAhead->pTask = 0;
+  p->pAhead = pAhead;
+}
+
+/* Cancel the pending read of a reader, if any */
+static void druid_readahead_cancel(DruidReader *p){
+  DruidReadAhead *pAhead = p->pAhead;
+  if( pAhead==0 || pAhead->pTask==0 ) return;
+  druid_task_cancel(pAhead->pTask);
+  druid_task_release(pAhead->pTask);
+  pAhead->pTask = 0;
+}
+
+/* Cancel the read ahead of a reader and free it */
+static void druid_readahead_free(DruidReader *p){
+  DruidReadAhead *pAhead = p->pAhead;
+  if( pAhead==0 ) return;
+  druid_readahead_cancel(p);
+  sqlite3_free(pAhead->zNext);
+  sqlite3_free(pAhead);
+  p->pAhead = 0;
+}
+
+/* druid_getc_refill() of a reader that reads ahead */
+static void druid_readahead_refill(DruidReader *p){
+  DruidReadAhead *pAhead = p->pAhead;
+  sqlite3_int64 iOff = (sqlite3_int64)ftell(p->in);
+  ssize_t n = -1;
+  if( pAhead->pTask ){
+    if( pAhead->iNext==iOff ){
+      druid_task_wait(pAhead->pTask);
+    }else{
+      /* The reader moved since, e.g. rewound for a new scan */
+      druid_task_cancel(pAhead->pTask);
+    }
+    druid_task_release(pAhead->pTask);
+    pAhead->pTask = 0;
+    if( pAhead->iNext==iOff && pAhead->nNext>=0 ){
+      char *z = p->zIn;
+      p->zIn = pAhead->zNext;
+      pAhead->zNext = z;
+      n = pAhead->nNext;
+    }
+  }
+  if( n<0 ){
+    do{
+      n = pread(pAhead->fd, p->zIn, DRUIDJSON_READAHEAD_SZ, (off_t)iOff);
+    }while( n<0 && errno==EINTR );
+    if( n<0 ){
+      /* Seen as the end of the file, the cursor reports it */
+      p->bIoErr = true;
+      n = 0;
+    }
+  }
+  if( n>0 ) fseek(p->in, (long)(iOff + n), SEEK_SET);
+  p->nIn = (size_t)n;
+  p->iIn = 0;
+  if( n==DRUIDJSON_READAHEAD_SZ ){
+    pAhead->iNext = iOff + n;
+    pAhead->nNext = -1;
+    pAhead->pTask = druid_pool_submit(druid_readahead_task, pAhead);
+  }
+}
+
+/* Shared memory cache of the decoded rows of a file */
+typedef struct DruidShm DruidShm;
+
+/* Rows decoded once for the concurrent scans of a table */
+typedef struct DruidStream DruidStream;
+
+/* State shared by the druid_json tables and functions of a connection */
+typedef struct DruidModule DruidModule;
+struct DruidModule {
+  struct DruidTable *pTables;     /* All druid_json tables of the connection */
+};
+
+/* An index of a materialized table, declared by the index= parameter */
+typedef struct DruidIndex {
+  int nCol;                       /* Number of columns */
+  int *aiCol;                     /* Indexed columns, in order */
+} DruidIndex;
+
+/* Max number of closed cursors a table keeps for reuse */
+#define DRUID_CURSOR_CACHE 4
+
+/* An instance of the Druid virtual table */
+typedef struct DruidTable {
+  sqlite3_vtab base;              /* Base class.  Must be first */
+  char *zFilename;                /* Name of the CSV file */
+  long iStart;                    /* Offset to start of data in zFilename */
+  int nCol;                       /* Number of columns in the Druid response */
+  bool* metricsCols;              /* Columns that should return REAL instead of TEXT */
+  bool* sketchCols;               /* Base64 sketch columns that return a BLOB */
+  char **colNames;                /* Column names */
+  int iTimestampCol;              /* Index of the "timestamp" column, or -1 */
+  int nRollup;                    /* Number of declared rollups */
+  DruidRollup *aRollup;           /* Declared rollups */
+  DruidStats *pStats;             /* Column statistics, once a full scan completed */
+  sqlite3_uint64 iSampleSeed;     /* Seed of the _sample row selection */
+  bool bFollow;                   /* Wait for rows appended to zFilename */
+  int msFollowTimeout;            /* How long to wait for more rows */
+  DruidFile *pFile;               /* Registry entry of zFilename */
+  unsigned int iGeneration;       /* Generation of pFile the caches are from */
+  int nRollupScan;                /* Number of cursors iterating a rollup */
+  bool bShm;                      /* Scan the shm cache of zFilename */
+  bool bValidateUtf8;             /* Fail on strings that are not valid UTF-8 */
+  bool bTrusted;                  /* Read the file with druid_cursor_read_trusted_row() */
+  DruidShm *pShm;                 /* Mapped shm cache, if any */
+  DruidStream *pStream;           /* Rows shared by concurrent scans, if any */
+  bool bMaterialize;              /* Scan the <name>_data shadow table */
+  bool bMaterializing;            /* Filling <name>_data, scan the file */
+  int nIndex;                     /* Number of indexes on <name>_data */
+  DruidIndex *aIndex;             /* Indexes on <name>_data */
+  char *zIdentity;                /* Identity of the file, see druid_file_identity() */
+  unsigned int iIdentityGeneration;  /* Generation of pFile zIdentity is for */
+  sqlite3_stmt *pIdentity;        /* Reads the identity of the materialized file */
+  char *zSchema;                  /* Schema of the virtual table */
+  sqlite3 *db;                    /* Connection of the table */
+  sqlite3_stmt *pProbe;           /* See druid_interrupted() */
+  sqlite3_int64 msProbe;          /* When pProbe last ran, see druid_now_ms() */
+  sqlite3_stmt *apJson[2];        /* See druid_json_builtin() */
+  struct DruidCursor *pCursors;   /* Open cursors, listed by druid_json_scans */
+  int nFreeCursor;                /* Number of entries in apFreeCursor[] */
+  struct DruidCursor *apFreeCursor[DRUID_CURSOR_CACHE];  /* Closed cursors */
+  char *zName;                    /* Name of the virtual table */
+  DruidModule *pModule;           /* Module state of the database connection */
+  struct DruidTable *pNextTable;  /* Next table of pModule */
+  unsigned int tstFlags;          /* Bit values used for testing */
+} DruidTable;
+
+/* Hidden columns, declared after the nCol columns of the Druid response */
+#define DRUID_HIDDEN_GRANULARITY  (0)   /* _granularity: rollup period */
+#define DRUID_HIDDEN_COUNT        (1)   /* _count: number of rows rolled up */
+#define DRUID_HIDDEN_SAMPLE       (2)   /* _sample: fraction of rows visited */
+#define DRUID_N_HIDDEN            (3)
+
+/* Scan modes of a DruidCursor, selected by idxNum */
+#define DRUID_SCAN_ROWS    (0)    /* Parse the rows of the result file */
+#define DRUID_SCAN_ROLLUP  (1)    /* Iterate over the groups of a rollup */
+#define DRUID_SCAN_MATERIALIZED (2)  /* Query the <name>_data shadow table */
+
+/* idxNum layout: the low nibble is the scan mode, and the bits above the
+** low byte are the set of rollups that cover the columns used by the
+** query.  The rest of the plan is in idxStr, see druid_plan_item() */
+#define DRUID_IDX_MODE(idxNum)     ((idxNum)&0x0f)
+#define DRUID_IDX_ROLLUPS(idxNum)  (((unsigned)(idxNum))>>8)
+
+/* Bit of column i in a mask of columns, such as colUsed.  The last bit
+** stands for all the columns from the 64th on */
+#define DRUID_COLUMN_BIT(i)  (((sqlite3_uint64)1)<<((i)<63 ? (i) : 63))
+
+/* Allowed values for tstFlags */
+#define CSVTEST_FIDX  0x0001      /* Pretend that constrained searchs cost less*/
+
+/* The parsed value of a JSON_NUMBER value of a row batch */
+typedef struct DruidNumber {
+  double r;                       /* The value */
+  sqlite3_int64 i;                /* The value if eNum is DRUID_NUM_INT */
+  u8 eNum;                        /* One of DRUID_NUM_xxx */
+} DruidNumber;
+
+#define DRUID_NUM_TEXT 0          /* Not parsed yet, parse the text */
+#define DRUID_NUM_REAL 1
+#define DRUID_NUM_INT  2
+
+/* Integers up to this magnitude are exact doubles */
+#define DRUID_MAX_EXACT (((sqlite3_int64)1)<<53)
+
+/* A comparison of a metric with a number, pushed down into a scan */
+typedef struct DruidRange {
+  int iCol;                       /* The metric column */
+  int eOp;                        /* SQLITE_INDEX_CONSTRAINT_EQ, _GT, _LE, _LT or _GE */
+  double r;                       /* The number */
+} DruidRange;
+
+/*
+** Row batches.  The readers decode the rows of a scan straight into a
+** batch of up to DRUID_BATCH_ROWS rows, held as column vectors: the text
+** of each value, its length, JSON type and parsed number, and a mask of
+** the missing and null values.  xNext and xColumn serve the rows of the
+** current batch of the cursor, and the scans the extension runs for
+** itself (the rollup and statistics builds, the shm cache build, the
+** decoder of the shared stream) go over their batches a column at a time.
+** Only the columns in mCol are copied, or decoded at all by trusted scans.
+*/
+#define DRUID_BATCH_ROWS 256
+
+typedef struct DruidBatchCol {
+  const char **azVal;             /* Text of each value, NULL if missing */
+  DruidNumber *aNum;              /* JSON_NUMBER values, see druid_batch_real() */
+  int *anVal;                     /* Length of each text */
+  int *aiOff;                     /* Offset of each text in zText, or -1 */
+  u8 *aType;                      /* JSON type of each value */
+  sqlite3_uint64 aNull[DRUID_BATCH_ROWS/64];  /* Missing and null values */
+} DruidBatchCol;
+
+typedef struct DruidBatch {
+  int nCol;                       /* Number of columns of the table */
+  sqlite3_uint64 mCol;            /* Columns copied, see DRUID_COLUMN_BIT */
+  int nRow;                       /* Number of rows */
+  sqlite3_int64 aiRowid[DRUID_BATCH_ROWS];  /* Rowid of each row */
+  DruidBatchCol *aCol;            /* The nCol columns */
+  char *zText;                    /* Text of the values, NUL-terminated */
+  sqlite3_int64 nText;            /* Bytes used in zText */
+  sqlite3_int64 nTextAlloc;       /* Bytes allocated for zText */
+} DruidBatch;
+
+/* True if the value of row iRow of a batch column is missing or null */
+#define DRUID_BATCH_IS_NULL(pCol, iRow) \
+  ((((pCol)->aNull[(iRow)>>6])>>((iRow)&63))&1)
+
+/* A member of the top level object or array of a JSON document */
+typedef struct DruidJsonMember {
+  int iKey;                       /* Offset of the label, -1 for an element */
+  int nKey;                       /* Length of the label */
+  bool bEscape;                   /* The label has escapes */
+  int iVal;                       /* Offset of the value */
+  int nVal;                       /* Length of the value */
+} DruidJsonMember;
+
+/* The JSON document held by a column of the current row of a cursor,
+** with the members found by the first json_extract() or ->> on it, see
+** druid_json_doc() */
+typedef struct DruidJsonDoc {
+  int iCol;                       /* Column of the document, or -1 */
+  char cTop;                      /* '{' or '[' of the top level, or 0 */
+  int nMember;                    /* Members, -1 until scanned, -2 if unusable */
+  int nAlloc;                     /* Entries allocated in aMember */
+  DruidJsonMember *aMember;       /* The members, in order */
+} DruidJsonDoc;
+
+/* A cursor for the CSV virtual table */
+typedef struct DruidCursor {
+  sqlite3_vtab_cursor base;       /* Base class.  Must be first */
+  DruidReader rdr;                  /* The DruidReader object */
+  DruidBatch *pBatch;             /* Rows read by a scan of the rows */
+  int iBatchRow;                  /* Row of pBatch of the scan, -1 at EOF */
+  int nBatchMax;                  /* Rows of the next batch */
+  int rcBatch;                    /* Error that ended pBatch, after its rows */
+  sqlite3_uint64 aSel[DRUID_BATCH_ROWS/64];  /* Rows of pBatch that match */
+  DruidJsonDoc json;              /* Document of row iBatchRow, if any */
+  sqlite3_int64 iRowid;           /* The current rowid, the last row read by
+                                  ** a scan of the rows.  Negative for EOF */
+  int eScan;                      /* One of DRUID_SCAN_xxx */
+  DruidRollup *pRollup;           /* Rollup iterated by DRUID_SCAN_ROLLUP */
+  DruidRollupGroup *pGroup;       /* Current group of pRollup */
+  int nEq;                        /* Number of pushed down equality constraints */
+  int *aiEqCol;                   /* Column of each equality constraint */
+  char **azEq;                    /* Value each column must be equal to */
+  int nRange;                     /* Number of pushed down metric comparisons */
+  DruidRange *aRange;             /* The metric comparisons */
+  DruidStats *pStats;             /* Statistics collected by this full scan */
+  bool bSample;                   /* Visit only a sample of the rows */
+  double rSample;                 /* Value of the _sample constraint */
+  sqlite3_uint64 iSampleRng;      /* Random state of the sample */
+  bool bFollow;                   /* Wait for rows appended to the file */
+  unsigned int iGeneration;       /* Generation of the file rdr reads */
+  DruidShm *pShm;                 /* Cache read instead of rdr, if any */
+  const u8 *pShmNext;             /* Next row of pShm */
+  sqlite3_int64 iShmRow;          /* Index of the row at pShmNext */
+  DruidStream *pStream;           /* Stream read instead of rdr, if any */
+  int iBlock;                     /* Block of pStream the cursor is in, or -1 */
+  int iBlockRow;                  /* Index in the block of the row at pShmNext */
+  sqlite3_uint64 mProject;        /* Columns decoded by a trusted scan, see DRUID_COLUMN_BIT */
+  bool bSkipRows;                 /* Skip the rows instead of decoding them */
+  bool bCountRows;                /* Count the rest of the rows in parallel */
+  sqlite3_int64 nRowCount;        /* Rowid of the last row once counted, or -1 */
+  sqlite3_stmt *pSelect;          /* Query of DRUID_SCAN_MATERIALIZED */
+  char *zSelect;                  /* The idxStr pSelect was prepared for */
+  int nTick;                      /* Rows until the next interrupt check */
+  const char *zKind;              /* What the scan is for, NULL until started */
+  struct DruidCursor *pNextCursor;  /* Next cursor of the same table */
+} DruidCursor;
+
+static void druid_cursor_free(DruidCursor*);
+static int druid_cursor_read_row(DruidCursor*, DruidBatch*);
+static int druid_cursor_fill(DruidCursor*, DruidBatch*, int);
+
+/* Transfer error message text from a reader into a DruidTable */
+static void druid_xfer_error(DruidTable *pTab, DruidReader *pRdr){
+  sqlite3_free(pTab->base.zErrMsg);
+  pTab->base.zErrMsg = sqlite3_mprintf("%s", pRdr->zErr);
+}
+
+/* Fail the scan of pCur after a read of its file failed, which its
+** reader took for the end of the file */
+static int druid_cursor_ioerr(DruidCursor *pCur){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  pCur->iRowid = -1;
+  sqlite3_free(pTab->base.zErrMsg);
+  pTab->base.zErrMsg = sqlite3_mprintf("error reading %s", pTab->zFilename);
+  return SQLITE_IOERR;
+}
+
+/* Free a batch */
+static void druid_batch_free(DruidBatch *p){
+  if( p ){
+    sqlite3_free(p->zText);
+    sqlite3_free(p);
+  }
+}
+
+/* Allocate a batch for the columns in mCol of a table of nCol columns.
+** Return NULL on OOM */
+static DruidBatch *druid_batch_new(int nCol, sqlite3_uint64 mCol){
+  const size_t nPer = (sizeof(char*) + sizeof(DruidNumber)
+                       + sizeof(int)*2 + sizeof(u8))*DRUID_BATCH_ROWS;
+  DruidBatch *p;
+  u8 *a;
+  int i;
+  p = sqlite3_malloc64(sizeof(*p) + (sizeof(DruidBatchCol) + nPer)*nCol);
+  if( p==0 ) return 0;
+  memset(p, 0, sizeof(*p));
+  p->nCol = nCol;
+  p->mCol = mCol;
+  p->aCol = (DruidBatchCol*)&p[1];
+  a = (u8*)&p->aCol[nCol];
+  for(i=0; i<nCol; i++){
+    DruidBatchCol *pCol = &p->aCol[i];
+    memset(pCol->aNull, 0, sizeof(pCol->aNull));
+    pCol->azVal = (const char**)a;
+    a += sizeof(char*)*DRUID_BATCH_ROWS;
+    pCol->aNum = (DruidNumber*)a;
+    a += sizeof(DruidNumber)*DRUID_BATCH_ROWS;
+    pCol->anVal = (int*)a;
+    a += sizeof(int)*DRUID_BATCH_ROWS;
+    pCol->aiOff = (int*)a;
+    a += sizeof(int)*DRUID_BATCH_ROWS;
+    pCol->aType = a;
+    a += DRUID_BATCH_ROWS;
+  }
+  return p;
+}
+
+/* Empty a batch, to be filled with the next rows of a scan */
+static void druid_batch_reset(DruidBatch *pBatch){
+  int i;
+  pBatch->nRow = 0;
+  pBatch->nText = 0;
+  for(i=0; i<pBatch->nCol; i++){
+    memset(pBatch->aCol[i].aNull, 0, sizeof(pBatch->aCol[i].aNull));
+  }
+}
+
+/* Set column iCol of row iRow of a batch to the n bytes of text at z, a
+** value of JSON type eType, or to a missing value if z is NULL.  The text
+** is copied into zText.  Return SQLITE_OK or SQLITE_NOMEM */
+static int druid_batch_set(
+  DruidBatch *pBatch,
+  int iRow,
+  int iCol,
+  const char *z,
+  int n,
+  int eType
+){
+  DruidBatchCol *pCol;
+  if( (pBatch->mCol & DRUID_COLUMN_BIT(iCol))==0 ) return SQLITE_OK;
+  pCol = &pBatch->aCol[iCol];
+  pCol->aType[iRow] = (u8)eType;
+  pCol->aNum[iRow].eNum = DRUID_NUM_TEXT;
+  if( z==0 || eType==JSON_NULL ){
+    pCol->aNull[iRow>>6] |= ((sqlite3_uint64)1)<<(iRow&63);
+  }else{
+    pCol->aNull[iRow>>6] &= ~(((sqlite3_uint64)1)<<(iRow&63));
+  }
+  if( z==0 ){
+    pCol->azVal[iRow] = 0;
+    pCol->aiOff[iRow] = -1;
+    pCol->anVal[iRow] = 0;
+    return SQLITE_OK;
+  }
+  if( pBatch->nText + n + 1 > pBatch->nTextAlloc ){
+    sqlite3_int64 nNew = pBatch->nTextAlloc*2 + n + 1;
+    char *zNew = sqlite3_realloc64(pBatch->zText, nNew);
+    if( zNew==0 ) return SQLITE_NOMEM;
+    pBatch->zText = zNew;
+    pBatch->nTextAlloc = nNew;
+  }
+  memcpy(&pBatch->zText[pBatch->nText], z, n);
+  pBatch->zText[pBatch->nText + n] = 0;
+  pCol->aiOff[iRow] = (int)pBatch->nText;
+  pCol->anVal[iRow] = n;
+  pBatch->nText += n + 1;
+  return SQLITE_OK;
+}
+
+/* Keep the number reader p parsed for the value just set by
+** druid_batch_set(), if any */
+static void druid_batch_set_number(DruidBatch *pBatch, int iRow, int iCol, DruidReader *p){
+  DruidNumber *pNum;
+  if( (pBatch->mCol & DRUID_COLUMN_BIT(iCol))==0 || p->value_type!=JSON_NUMBER ) return;
+  pNum = &pBatch->aCol[iCol].aNum[iRow];
+  pNum->r = p->rNumber;
+  pNum->i = p->iNumber;
+  pNum->eNum = p->bIntegral ? DRUID_NUM_INT : DRUID_NUM_REAL;
+}
+
+/* Point the values copied into zText at it, once it no longer moves */
+static void druid_batch_finish(DruidBatch *pBatch){
+  int i, iRow;
+  for(i=0; i<pBatch->nCol; i++){
+    DruidBatchCol *pCol = &pBatch->aCol[i];
+    if( (pBatch->mCol & DRUID_COLUMN_BIT(i))==0 ) continue;
+    for(iRow=0; iRow<pBatch->nRow; iRow++){
+      if( pCol->aiOff[iRow]>=0 ) pCol->azVal[iRow] = &pBatch->zText[pCol->aiOff[iRow]];
+    }
+  }
+}
+
+/* Return the value of row iRow of a batch column, a JSON_NUMBER */
+static double druid_batch_real(DruidBatchCol *pCol, int iRow){
+  DruidNumber *pNum = &pCol->aNum[iRow];
+  if( pNum->eNum==DRUID_NUM_TEXT ){
+    pNum->eNum = druid_parse_number(pCol->azVal[iRow], pCol->anVal[iRow],
+                                    &pNum->r, &pNum->i) ? DRUID_NUM_INT : DRUID_NUM_REAL;
+  }
+  return pNum->r;
+}
+
+/*
+** Numeric kernels.  The numbers of a batch column are resolved into an
+** array of doubles, 0.0 where the value is not a number, and a mask with
+** a bit per row that is set for the numbers.  druid_accum_batch() then
+** adds up the array and keeps its smallest and largest number 16 rows at
+** a time with AVX2, where the CPU has it.  The sum is kept in 16 lanes,
+** lane k adding up the rows whose index is k modulo 16, so that the adds
+** of 4 registers do not wait for each other.  The scalar code adds the
+** rows in the same order, and both give the same sum to the bit.
+*/
+static void druid_accum_init(DruidAccum *p){
+  memset(p->aLane, 0, sizeof(p->aLane));
+  p->rMin = INFINITY;
+  p->rMax = -INFINITY;
+  p->n = 0;
+}
+
+static double druid_accum_sum(const DruidAccum *p){
+  double r = 0.0;
+  int k;
+  for(k=0; k<DRUID_ACCUM_LANES; k++) r += p->aLane[k];
+  return r;
+}
+
+/* Resolve the numbers of the first nRow rows of a batch column into a[]
+** and the mask aSel[] */
+static void druid_batch_numbers(
+  DruidBatchCol *pCol,
+  int nRow,
+  double *a,
+  sqlite3_uint64 *aSel
+){
+  int iRow;
+  memset(aSel, 0, sizeof(sqlite3_uint64)*DRUID_BATCH_ROWS/64);
+  for(iRow=0; iRow<nRow; iRow++){
+    if( pCol->aType[iRow]==JSON_NUMBER ){
+      a[iRow] = druid_batch_real(pCol, iRow);
+      aSel[iRow>>6] |= ((sqlite3_uint64)1)<<(iRow&63);
+    }else{
+      a[iRow] = 0.0;
+    }
+  }
+}
+
+static void druid_accum_scalar(DruidAccum *p, const double *a, const sqlite3_uint64 *aSel, int i, int n){
+  double aLane[DRUID_ACCUM_LANES];
+  double rMin = p->rMin, rMax = p->rMax;
+  memcpy(aLane, p->aLane, sizeof(aLane));
+  for(; i<n; i++){
+    aLane[i&(DRUID_ACCUM_LANES-1)] += a[i];
+    if( (aSel[i>>6]>>(i&63)) & 1 ){
+      if( a[i]<rMin ) rMin = a[i];
+      if( a[i]>rMax ) rMax = a[i];
+    }
+  }
+  memcpy(p->aLane, aLane, sizeof(aLane));
+  p->rMin = rMin;
+  p->rMax = rMax;
+}
+
+#if defined(DRUID_ACCUM_AVX2)
+__attribute__((target("avx2")))
+static int druid_accum_avx2(DruidAccum *p, const double *a, const sqlite3_uint64 *aSel, int n){
+  const __m256i vBit = _mm256_set_epi64x(8, 4, 2, 1);
+  const __m256d vInf = _mm256_set1_pd(INFINITY);
+  const __m256d vNegInf = _mm256_set1_pd(-INFINITY);
+  __m256d vSum[4], vMin[4], vMax[4];
+  double aMin[4], aMax[4];
+  int i, j, k;
+  for(j=0; j<4; j++){
+    vSum[j] = _mm256_loadu_pd(&p->aLane[j*4]);
+    vMin[j] = _mm256_set1_pd(p->rMin);
+    vMax[j] = _mm256_set1_pd(p->rMax);
+  }
+  for(i=0; i+DRUID_ACCUM_LANES<=n; i+=DRUID_ACCUM_LANES){
+    sqlite3_int64 m = (sqlite3_int64)((aSel[i>>6]>>(i&63)) & 0xffff);
+    for(j=0; j<4; j++){
+      __m256d vMask = _mm256_castsi256_pd(_mm256_cmpeq_epi64(
+          _mm256_and_si256(_mm256_set1_epi64x(m>>(j*4)), vBit), vBit));
+      __m256d v = _mm256_loadu_pd(&a[i+j*4]);
+      vSum[j] = _mm256_add_pd(vSum[j], v);
+      vMin[j] = _mm256_min_pd(vMin[j], _mm256_blendv_pd(vInf, v, vMask));
+      vMax[j] = _mm256_max_pd(vMax[j], _mm256_blendv_pd(vNegInf, v, vMask));
+    }
+  }
+  for(j=0; j<4; j++){
+    _mm256_storeu_pd(&p->aLane[j*4], vSum[j]);
+    _mm256_storeu_pd(aMin, vMin[j]);
+    _mm256_storeu_pd(aMax, vMax[j]);
+    for(k=0; k<4; k++){
+      if( aMin[k]<p->rMin ) p->rMin = aMin[k];
+      if( aMax[k]>p->rMax ) p->rMax = aMax[k];
+    }
+  }
+  return i;
+}
+#endif /* DRUID_ACCUM_AVX2 */
+
+/* Add the n numbers of a[] selected by aSel[] to an accumulator whose
+** number of rows so far is a multiple of DRUID_ACCUM_LANES */
+static void druid_accum_batch(DruidAccum *p, const double *a, const sqlite3_uint64 *aSel, int n){
+  int i = 0, k;
+  for(k=0; k<(n+63)/64; k++) p->n += DRUID_POPCOUNT64(aSel[k]);
+#if defined(DRUID_ACCUM_AVX2)
+  if( __builtin_cpu_supports("avx2") ) i = druid_accum_avx2(p, a, aSel, n);
+#endif
+  druid_accum_scalar(p, a, aSel, i, n);
+}
+
+/*
+** Interrupts.  SQLite only checks sqlite3_interrupt() between the rows
+** a cursor returns, while a single xFilter or xNext call can go through
+** the whole file (rows not matching the pushed down constraints, sample
+** gaps, rollup and statistics builds).  Cursors check it themselves every
+** DRUID_INTERRUPT_ROWS rows and every DRUID_INTERRUPT_MS milliseconds of
+** waiting for a followed file to grow.
+*/
+#define DRUID_INTERRUPT_ROWS 256
+#define DRUID_INTERRUPT_MS   50
+
+/* True if sqlite3_interrupt() was called on the connection of pTab.  The
+** flag cannot be read before SQLite 3.41, but a statement fails with
+** SQLITE_INTERRUPT when it is set, so a trivial one is stepped instead,
+** at most once every DRUID_INTERRUPT_MS milliseconds. */
+static bool druid_interrupted(DruidTable *pTab){
+  sqlite3_int64 msNow;
+  int rc;
+#if SQLITE_VERSION_NUMBER>=3041000
+  if( sqlite3_libversion_number()>=3041000 ) return sqlite3_is_interrupted(pTab->db)!=0;
+#endif
+  msNow = druid_now_ms();
+  if( msNow - pTab->msProbe < DRUID_INTERRUPT_MS ) return false;
+  pTab->msProbe = msNow;
+  if( pTab->pProbe==0
+   && sqlite3_prepare_v2(pTab->db, "SELECT 1", -1, &pTab->pProbe, 0)!=SQLITE_OK ){
+    return false;
+  }
+  rc = sqlite3_step(pTab->pProbe);
+  sqlite3_reset(pTab->pProbe);
+  return rc==SQLITE_INTERRUPT;
+}
+
+/* Return SQLITE_INTERRUPT, ending the scan and cancelling its pending
+** work, if the statement was interrupted */
+static int druid_cursor_interrupt(DruidCursor *pCur){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  if( !druid_interrupted(pTab) ) return SQLITE_OK;
+  pCur->iRowid = -1;
+  druid_readahead_cancel(&pCur->rdr);
+  sqlite3_free(pTab->base.zErrMsg);
+  pTab->base.zErrMsg = sqlite3_mprintf("interrupted");
+  return SQLITE_INTERRUPT;
+}
+
+/* Count a row read or skipped, checking for interrupts every
+** DRUID_INTERRUPT_ROWS rows */
+static int druid_cursor_tick(DruidCursor *pCur){
+  if( --pCur->nTick>0 ) return SQLITE_OK;
+  pCur->nTick = DRUID_INTERRUPT_ROWS;
+  return druid_cursor_interrupt(pCur);
+}
+
+/*
+** Druid HyperLogLog sketches.
+**
+** Druid serializes hyperUnique / cardinality aggregators as a
+** HyperLogLogCollector: 2048 registers of 4 bits, stored relative to a
+** register offset, plus a single overflow register for the largest value
+** that does not fit in 4 bits.  Version 1 (current) layout:
+**
+**    byte 0      version (1)
+**    byte 1      register offset
+**    bytes 2-3   number of non-zero registers
+**    byte 4      max overflow value
+**    bytes 5-6   max overflow register
+**    payload     either 1024 bytes (dense, two registers per byte with the
+**                even register in the upper nibble) or a list of 3-byte
+**                (short position, byte value) entries (sparse)
+**
+** Version 0 has a 3-byte header (offset, non-zero count) and no overflow.
+** All multi-byte values are big-endian.
+**
+**    druid_hll_union(X)      aggregate, union of the sketches in X
+**    druid_hll_estimate(X)   aggregate, cardinality estimate of the union
+**
+** X may be a BLOB (see the sketches= parameter) or base64 TEXT.
+*/
+#define DRUID_HLL_BUCKETS        2048
+#define DRUID_HLL_DENSE_BYTES    (DRUID_HLL_BUCKETS/2)
+#define DRUID_HLL_V0_HEADER      3
+#define DRUID_HLL_V1_HEADER      7
+#define DRUID_HLL_DENSE_THRESHOLD 128
+
+/* Registers of a HyperLogLog sketch, as absolute values */
+struct DruidHll {
+  bool bInit;                     /* True once any sketch was merged */
+  u8 aReg[DRUID_HLL_BUCKETS];     /* Register values */
+};
+
+/* Merge a serialized Druid HyperLogLogCollector into p.
+** Return 0 on success or non-zero if the sketch is malformed.
+*/
+static int druid_hll_merge_bytes(DruidHll *p, const u8 *a, int n){
+  int nHeader, iOffset, iOverflow = -1, overflowValue = 0;
+  int i;
+  p->bInit = true;
+  if( n==0 ) return 0;                      /* an empty collector */
+  if( n%3==0 || n==DRUID_HLL_V0_HEADER+DRUID_HLL_DENSE_BYTES ){
+    nHeader = DRUID_HLL_V0_HEADER;
+    iOffset = a[0];
+  }else{
+    if( n<DRUID_HLL_V1_HEADER || a[0]!=1 ) return 1;
+    nHeader = DRUID_HLL_V1_HEADER;
+    iOffset = a[1];
+    overflowValue = a[4];
+    iOverflow = (a[5]<<8) | a[6];
+    if( iOverflow>=DRUID_HLL_BUCKETS ) return 1;
+  }
+  a += nHeader;
+  n -= nHeader;
+  if( n==DRUID_HLL_DENSE_BYTES ){
+    for(i=0; i<DRUID_HLL_DENSE_BYTES; i++){
+      int hi = iOffset + (a[i]>>4);
+      int lo = iOffset + (a[i]&0x0f);
+      if( hi>p->aReg[2*i] ) p->aReg[2*i] = (u8)hi;
+      if( lo>p->aReg[2*i+1] ) p->aReg[2*i+1] = (u8)lo;
+    }
+  }else{
+    if( n%3 ) return 1;
+    if( iOffset>0 ){
+      /* Registers missing from a sparse payload hold the offset */
+      for(i=0; i<DRUID_HLL_BUCKETS; i++){
+        if( iOffset>p->aReg[i] ) p->aReg[i] = (u8)iOffset;
+      }
+    }
+    for(i=0; i<n; i+=3){
+      int iPos = (a[i]<<8) | a[i+1];
+      int hi, lo;
+      if( iPos>=DRUID_HLL_DENSE_BYTES ) return 1;
+      hi = iOffset + (a[i+2]>>4);
+      lo = iOffset + (a[i+2]&0x0f);
+      if( hi>p->aReg[2*iPos] ) p->aReg[2*iPos] = (u8)hi;
+      if( lo>p->aReg[2*iPos+1] ) p->aReg[2*iPos+1] = (u8)lo;
+    }
+  }
+  if( iOverflow>=0 && overflowValue>p->aReg[iOverflow] ){
+    p->aReg[iOverflow] = (u8)overflowValue;
+  }
+  return 0;
+}
+
+/* Estimate the number of distinct values counted by p, using the same
+** bias corrections as Druid's HyperLogLogCollector.
+*/
+static double druid_hll_estimate(const DruidHll *p){
+  const double nBuckets = DRUID_HLL_BUCKETS;
+  const double alpha = 0.7213/(1.0 + 1.079/nBuckets);
+  const double two64 = 18446744073709551616.0;
+  double e = 0.0;
+  int nZero = 0;
+  int i;
+  for(i=0; i<DRUID_HLL_BUCKETS; i++){
+    e += ldexp(1.0, -p->aReg[i]);
+    nZero += p->aReg[i]==0;
+  }
+  e = alpha*nBuckets*nBuckets/e;
+  if( e<=5.0*nBuckets/2.0 ){
+    return nZero==0 ? e : nBuckets*log(nBuckets/nZero);
+  }
+  if( e>two64/30.0 ){
+    double ratio = e/two64;
+    return ratio>=1.0 ? 1.7976931348623157e308 : -two64*log(1.0 - ratio);
+  }
+  return e;
+}
+
+/* Serialize p as a version 1 Druid HyperLogLogCollector.  The output is
+** sparse if few registers are set, like Druid does.  zOut must have room
+** for DRUID_HLL_V1_HEADER + DRUID_HLL_DENSE_BYTES bytes.  Return the
+** number of bytes written.
+*/
+static int druid_hll_serialize(const DruidHll *p, u8 *zOut){
+  u8 aDense[DRUID_HLL_DENSE_BYTES];
+  int iOffset = 255, iOverflow = 0, overflowValue = 0, nNonZero = 0;
+  int i, n;
+  for(i=0; i<DRUID_HLL_BUCKETS; i++){
+    if( p->aReg[i]<iOffset ) iOffset = p->aReg[i];
+  }
+  for(i=0; i<DRUID_HLL_BUCKETS; i++){
+    int v = p->aReg[i] - iOffset;
+    if( v>15 ){
+      if( p->aReg[i]>overflowValue ){
+        overflowValue = p->aReg[i];
+        iOverflow = i;
+      }
+      v = 15;
+    }
+    nNonZero += v!=0;
+    if( i&1 ){
+      aDense[i/2] |= (u8)v;
+    }else{
+      aDense[i/2] = (u8)(v<<4);
+    }
+  }
+  zOut[0] = 1;
+  zOut[1] = (u8)iOffset;
+  zOut[2] = (u8)(nNonZero>>8);
+  zOut[3] = (u8)nNonZero;
+  zOut[4] = (u8)overflowValue;
+  zOut[5] = (u8)(iOverflow>>8);
+  zOut[6] = (u8)iOverflow;
+  n = DRUID_HLL_V1_HEADER;
+  if( nNonZero<DRUID_HLL_DENSE_THRESHOLD ){
+    for(i=0; i<DRUID_HLL_DENSE_BYTES; i++){
+      if( aDense[i]==0 ) continue;
+      zOut[n++] = (u8)(i>>8);
+      zOut[n++] = (u8)i;
+      zOut[n++] = aDense[i];
+    }
+  }else{
+    memcpy(&zOut[n], aDense, DRUID_HLL_DENSE_BYTES);
+    n += DRUID_HLL_DENSE_BYTES;
+  }
+  return n;
+}
+
+/* xStep of druid_hll_union() and druid_hll_estimate().  BLOBs hold the
+** serialized collector, TEXT is decoded from base64 first, and both are
+** checked by druid_hll_merge_bytes() */
+static void druid_hll_step(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  DruidHll *p;
+  const u8 *a;
+  u8 *zFree;
+  int n, bErr;
+  (void)argc;
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL ) return;
+  p = sqlite3_aggregate_context(ctx, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  a = druid_sketch_bytes(argv[0], &n, &zFree);
+  if( a==0 && n==-1 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  bErr = (a==0 && n!=0) || druid_hll_merge_bytes(p, a, n);
+  sqlite3_free(zFree);
+  if( bErr ) sqlite3_result_error(ctx, "malformed Druid HyperLogLog sketch", -1);
+}
+
+/* xFinal of druid_hll_union() */
+static void druid_hll_union_final(sqlite3_context *ctx){
+  DruidHll *p = sqlite3_aggregate_context(ctx, 0);
+  u8 *zOut;
+  int n;
+  if( p==0 || !p->bInit ) return;
+  zOut = sqlite3_malloc(DRUID_HLL_V1_HEADER + DRUID_HLL_DENSE_BYTES);
+  if( zOut==0 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  n = druid_hll_serialize(p, zOut);
+  sqlite3_result_blob(ctx, zOut, n, sqlite3_free);
+}
+
+/* xFinal of druid_hll_estimate() */
+static void druid_hll_estimate_final(sqlite3_context *ctx){
+  DruidHll *p = sqlite3_aggregate_context(ctx, 0);
+  if( p==0 || !p->bInit ) return;
+  sqlite3_result_double(ctx, druid_hll_estimate(p));
+}
+
+/*
+** Column statistics.
+**
+** The first full scan of a table counts the rows, the NULLs of every
+** column and keeps a HyperLogLog sketch of the values of every TEXT
+** column.  The statistics are used by xBestIndex to estimate the number
+** of rows matching equality constraints (rows / distinct values), and are
+** exposed by the druid_json_column_stats table-valued function.
+*/
+
+/* MurmurHash64A of n bytes */
+static sqlite3_uint64 druid_hash64(const void *pKey, int n){
+  const sqlite3_uint64 m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  const u8 *z = (const u8*)pKey;
+  sqlite3_uint64 h = 0x8445d61a4e774912ULL ^ (n*m);
+  int i;
+  for(i=0; i+8<=n; i+=8){
+    sqlite3_uint64 k;
+    memcpy(&k, &z[i], 8);
+    k *= m;
+    k ^= k>>r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  switch( n&7 ){
+    case 7: h ^= (sqlite3_uint64)z[i+6]<<48; /* fall through */
+    case 6: h ^= (sqlite3_uint64)z[i+5]<<40; /* fall through */
+    case 5: h ^= (sqlite3_uint64)z[i+4]<<32; /* fall through */
+    case 4: h ^= (sqlite3_uint64)z[i+3]<<24; /* fall through */
+    case 3: h ^= (sqlite3_uint64)z[i+2]<<16; /* fall through */
+    case 2: h ^= (sqlite3_uint64)z[i+1]<<8;  /* fall through */
+    case 1: h ^= (sqlite3_uint64)z[i];
+            h *= m;
+  }
+  h ^= h>>r;
+  h *= m;
+  h ^= h>>r;
+  return h;
+}
+
+/* Add a value, given by its 64-bit hash, to a HyperLogLog sketch */
+static void druid_hll_add_hash(DruidHll *p, sqlite3_uint64 h){
+  int iBucket = (int)(h & (DRUID_HLL_BUCKETS-1));
+  sqlite3_uint64 w = h>>11;
+  int v = 1;
+  while( (w & 1)==0 && v<54 ){
+    w >>= 1;
+    v++;
+  }
+  if( v>p->aReg[iBucket] ) p->aReg[iBucket] = (u8)v;
+  p->bInit = true;
+}
+
+static void druid_stats_free(DruidStats *p){
+  if( p ){
+    sqlite3_free(p->anNull);
+    sqlite3_free(p->aHll);
+    sqlite3_free(p->aAccum);
+    sqlite3_free(p);
+  }
+}
+
+/* Allocate empty statistics for nCol columns, or return NULL on OOM */
+static DruidStats *druid_stats_new(int nCol){
+  DruidStats *p = sqlite3_malloc(sizeof(*p));
+  int i;
+  if( p==0 ) return 0;
+  p->aAccum = 0;
+  p->nRow = 0;
+  p->anNull = sqlite3_malloc64(sizeof(sqlite3_int64)*nCol);
+  p->aHll = sqlite3_malloc64(sizeof(DruidHll)*nCol);
+  p->aAccum = sqlite3_malloc64(sizeof(DruidAccum)*nCol);
+  if( p->anNull==0 || p->aHll==0 || p->aAccum==0 ){
+    druid_stats_free(p);
+    return 0;
+  }
+  memset(p->anNull, 0, sizeof(sqlite3_int64)*nCol);
+  memset(p->aHll, 0, sizeof(DruidHll)*nCol);
+  for(i=0; i<nCol; i++) druid_accum_init(&p->aAccum[i]);
+  return p;
+}
+
+/* Return true if column i of pTab is a TEXT column */
+static bool druid_is_text_col(DruidTable *pTab, int i){
+  return !pTab->metricsCols[i] && !pTab->sketchCols[i];
+}
+
+/* Account for the rows of a batch of all the columns in statistics.  Only
+** the last batch of a scan has a number of rows that is not a multiple of
+** DRUID_ACCUM_LANES */
+static void druid_stats_add_batch(DruidTable *pTab, DruidStats *p, DruidBatch *pBatch){
+  double a[DRUID_BATCH_ROWS];
+  sqlite3_uint64 aSel[DRUID_BATCH_ROWS/64];
+  int i, iRow;
+  p->nRow += pBatch->nRow;
+  for(i=0; i<pTab->nCol; i++){
+    DruidBatchCol *pCol = &pBatch->aCol[i];
+    bool bText = druid_is_text_col(pTab, i);
+    if( pTab->metricsCols[i] ){
+      druid_batch_numbers(pCol, pBatch->nRow, a, aSel);
+      druid_accum_batch(&p->aAccum[i], a, aSel, pBatch->nRow);
+    }
+    for(iRow=0; iRow<pBatch->nRow; iRow++){
+      if( DRUID_BATCH_IS_NULL(pCol, iRow) ){
+        p->anNull[i]++;
+      }else if( bText ){
+        druid_hll_add_hash(&p->aHll[i], druid_hash64(pCol->azVal[iRow], pCol->anVal[iRow]));
+      }
+    }
+  }
+}
+
+/* Estimated number of distinct non-NULL values of column i */
+static double druid_stats_ndv(DruidTable *pTab, int i){
+  DruidStats *p = pTab->pStats;
+  double ndv;
+  if( p==0 || !druid_is_text_col(pTab, i) ) return -1.0;
+  ndv = p->aHll[i].bInit ? druid_hll_estimate(&p->aHll[i]) : 0.0;
+  if( ndv>(double)(p->nRow - p->anNull[i]) ) ndv = (double)(p->nRow - p->anNull[i]);
+  if( ndv<1.0 && p->nRow>p->anNull[i] ) ndv = 1.0;
+  return ndv;
+}
+
+/* xStep of approx_count_distinct() */
+static void druid_approx_count_distinct_step(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  DruidHll *p;
+  const unsigned char *z;
+  (void)argc;
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL ) return;
+  p = sqlite3_aggregate_context(ctx, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  if( sqlite3_value_type(argv[0])==SQLITE_BLOB ){
+    z = sqlite3_value_blob(argv[0]);
+  }else{
+    z = sqlite3_value_text(argv[0]);
+  }
+  druid_hll_add_hash(p, druid_hash64(z, sqlite3_value_bytes(argv[0])));
+}
+
+/* xFinal of approx_count_distinct() */
+static void druid_approx_count_distinct_final(sqlite3_context *ctx){
+  DruidHll *p = sqlite3_aggregate_context(ctx, 0);
+  sqlite3_result_int64(ctx, p && p->bInit ? (sqlite3_int64)(druid_hll_estimate(p) + 0.5) : 0);
+}
+
+/*
+** Huge pages.
+**
+** The groups of a rollup with many distinct keys, and its hash table, can
+** take gigabytes that are probed at random while the rollup is built,
+** where the TLB misses of 4KB pages show.  Allocations of DRUID_HUGE_SZ
+** bytes and more are mapped on huge pages instead: with MAP_HUGETLB from
+** the pages reserved by the administrator, else with madvise() for
+** transparent huge pages, else on normal pages.  The shm cache mappings
+** are advised too.  druid_json_config('hugepages', 0) turns this off.
+*/
+#define DRUID_HUGE_SZ   (2*1024*1024)
+
+/* Size of the first slab of an arena */
+#define DRUID_SLAB_MIN  65536
+
+static int druidHugePages = 1;    /* druid_json_config('hugepages') */
+
+/* Ask for transparent huge pages for the n bytes mapped at p */
+static void druid_huge_advise(void *p, size_t n){
+#ifdef MADV_HUGEPAGE
+  if( DRUID_ATOMIC_LOAD(&druidHugePages) && n>=DRUID_HUGE_SZ ){
+    madvise(p, n, MADV_HUGEPAGE);
+  }
+#endif
+}
+
+/* Size of the mapping of n bytes */
+static size_t druid_huge_round(size_t n){
+  return (n + DRUID_HUGE_SZ - 1) & ~(size_t)(DRUID_HUGE_SZ - 1);
+}
+
+/* Allocate n bytes, on huge pages if it is large enough.  *pbMapped is
+** set if it was mapped, and must be passed to druid_huge_free() */
+static void *druid_huge_alloc(size_t n, bool *pbMapped){
+  *pbMapped = false;
+  if( n>=DRUID_HUGE_SZ && DRUID_ATOMIC_LOAD(&druidHugePages) ){
+    size_t nMap = druid_huge_round(n);
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = mmap(0, nMap, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+    if( p==MAP_FAILED ){
+      p = mmap(0, nMap, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if( p!=MAP_FAILED ) druid_huge_advise(p, nMap);
+    }
+    if( p!=MAP_FAILED ){
+      *pbMapped = true;
+      return p;
+    }
+  }
+  return sqlite3_malloc64(n);
+}
+
+/* Free n bytes allocated by druid_huge_alloc() */
+static void druid_huge_free(void *p, size_t n, bool bMapped){
+  if( bMapped ){
+    munmap(p, druid_huge_round(n));
+  }else{
+    sqlite3_free(p);
+  }
+}
+
+/* A slab of an arena, followed by the memory allocated from it */
+struct DruidSlab {
+  DruidSlab *pNext;               /* Previous slab of the arena */
+  size_t nByte;                   /* Size of the slab, with this header */
+  size_t nUsed;                   /* Bytes used, with this header */
+  bool bMapped;                   /* Allocated with druid_huge_alloc() mapped */
+};
+
+/* Allocate n bytes from an arena, 8-byte aligned.  Return NULL on OOM.
+** The slabs double in size up to DRUID_HUGE_SZ, so that small arenas
+** stay small and large ones are on huge pages */
+static void *druid_arena_alloc(DruidArena *pArena, size_t n){
+  DruidSlab *pSlab = pArena->pSlab;
+  const size_t nHdr = (sizeof(DruidSlab) + 7) & ~(size_t)7;
+  void *p;
+  n = (n + 7) & ~(size_t)7;
+  if( pSlab==0 || pSlab->nUsed + n > pSlab->nByte ){
+    size_t nSlab = pArena->nNext ? pArena->nNext : DRUID_SLAB_MIN;
+    size_t nByte = nSlab<nHdr+n ? nHdr+n : nSlab;
+    bool bMapped;
+    pSlab = druid_huge_alloc(nByte, &bMapped);
+    if( pSlab==0 ) return 0;
+    pSlab->pNext = pArena->pSlab;
+    pSlab->nByte = bMapped ? druid_huge_round(nByte) : nByte;
+    pSlab->nUsed = nHdr;
+    pSlab->bMapped = bMapped;
+    pArena->pSlab = pSlab;
+    pArena->nNext = nSlab<DRUID_HUGE_SZ ? nSlab*2 : DRUID_HUGE_SZ;
+  }
+  p = (u8*)pSlab + pSlab->nUsed;
+  pSlab->nUsed += n;
+  return p;
+}
+
+/* Free all the memory of an arena */
+static void druid_arena_free(DruidArena *pArena){
+  while( pArena->pSlab ){
+    DruidSlab *pSlab = pArena->pSlab;
+    pArena->pSlab = pSlab->pNext;
+    druid_huge_free(pSlab, pSlab->nByte, pSlab->bMapped);
+  }
+  pArena->nNext = 0;
+}
+
+/*
+** Rollups.
+**
+** A rollup pre-aggregates the rows of the result file at a coarser time
+** granularity, grouped by a subset of the dimensions.  Metrics are summed
+** and the number of source rows is kept in the hidden _count column.
+** Rollups are declared with
+**
+**    rollups = "P1D:app,country;PT1H:app"
+**
+** and are computed lazily by the first query that needs them.  A query
+** selects a rollup by constraining the hidden _granularity column, and
+** xBestIndex only offers the rollups whose dimensions cover every column
+** used by the query.
+*/
+
+/* Free the groups of a rollup and mark it as not built */
+static void druid_rollup_clear(DruidRollup *pRollup){
+  druid_arena_free(&pRollup->groups);
+  druid_huge_free(pRollup->apHash, sizeof(DruidRollupGroup*)*pRollup->nHash,
+                  pRollup->bHugeHash);
+  pRollup->apHash = 0;
+  pRollup->bHugeHash = false;
+  pRollup->nHash = 0;
+  pRollup->pFirst = 0;
+  pRollup->pLast = 0;
+  pRollup->nGroup = 0;
+  pRollup->bBuilt = false;
+}
+
+/* Free all rollups of a table */
+static void druid_rollups_free(int nRollup, DruidRollup *aRollup){
+  int i;
+  for(i=0; i<nRollup; i++){
+    druid_rollup_clear(&aRollup[i]);
+    sqlite3_free(aRollup[i].zPeriod);
+    sqlite3_free(aRollup[i].aiDim);
+  }
+  sqlite3_free(aRollup);
+}
+
+/* Parse an ISO-8601 period such as "PT15M", "PT1H", "P1D", "P1W", "P1M"
+** or "P1Y".  Return 0 on success and non-zero if the period is not
+** supported.
+*/
+static int druid_parse_period(const char *z, int n, int *pePeriod, int *pnPeriod){
+  int i = 1;
+  int bTime = 0;
+  int nPeriod = 0;
+  if( n<3 || (z[0]!='P' && z[0]!='p') ) return 1;
+  if( z[1]=='T' || z[1]=='t' ){
+    bTime = 1;
+    i++;
+  }
+  while( i<n && z[i]>='0' && z[i]<='9' ){
+    nPeriod = nPeriod*10 + (z[i]-'0');
+    if( nPeriod>100000 ) return 1;
+    i++;
+  }
+  if( nPeriod<=0 || i!=n-1 ) return 1;
+  switch( toupper((unsigned char)z[i]) ){
+    case 'M': *pePeriod = bTime ? DRUID_PERIOD_MINUTE : DRUID_PERIOD_MONTH; break;
+    case 'H': if( !bTime ) return 1; *pePeriod = DRUID_PERIOD_HOUR; break;
+    case 'D': if( bTime ) return 1; *pePeriod = DRUID_PERIOD_DAY; break;
+    case 'W': if( bTime ) return 1; *pePeriod = DRUID_PERIOD_WEEK; break;
+    case 'Y': if( bTime ) return 1; *pePeriod = DRUID_PERIOD_YEAR; break;
+    default: return 1;
+  }
+  *pnPeriod = nPeriod;
+  return 0;
+}
+
+/* Number of days since 1970-01-01 of a proleptic Gregorian date */
+static sqlite3_int64 druid_days_from_civil(int y, int m, int d){
+  sqlite3_int64 era, yoe, doy, doe;
+  y -= m<=2;
+  era = (y>=0 ? y : y-399)/400;
+  yoe = y - era*400;
+  doy = (153*(m>2 ? m-3 : m+9) + 2)/5 + d-1;
+  doe = yoe*365 + yoe/4 - yoe/100 + doy;
+  return era*146097 + doe - 719468;
+}
+
+/* Inverse of druid_days_from_civil() */
+static void druid_civil_from_days(sqlite3_int64 z, int *pY, int *pM, int *pD){
+  sqlite3_int64 era, doe, yoe, doy, mp;
+  int y, m;
+  z += 719468;
+  era = (z>=0 ? z : z-146096)/146097;
+  doe = z - era*146097;
+  yoe = (doe - doe/1460 + doe/36524 - doe/146096)/365;
+  y = (int)(yoe + era*400);
+  doy = doe - (365*yoe + yoe/4 - yoe/100);
+  mp = (5*doy + 2)/153;
+  *pD = (int)(doy - (153*mp + 2)/5 + 1);
+  m = (int)(mp<10 ? mp+3 : mp-9);
+  *pM = m;
+  *pY = y + (m<=2);
+}
+
+/* Floor division that rounds toward negative infinity */
+static sqlite3_int64 druid_floor_div(sqlite3_int64 a, sqlite3_int64 b){
+  sqlite3_int64 q = a/b;
+  if( (a%b)!=0 && ((a<0)!=(b<0)) ) q--;
+  return q;
+}
+
+/* Truncate a Druid timestamp ("2020-01-31T13:00:00.000Z") to the start
+** of its rollup bucket.  The result is written into zOut, which must be
+** at least 32 bytes.  Return 0 on success or non-zero if zTs is not a
+** timestamp, in which case the caller keeps the original value.
+*/
+static int druid_timestamp_bucket(
+  const DruidRollup *pRollup,
+  const char *zTs,
+  char *zOut
+){
+  int y, mo, d, h = 0, mi = 0, sec = 0;
+  sqlite3_int64 days, secs, unit;
+  if( sscanf(zTs, "%4d-%2d-%2d", &y, &mo, &d)!=3 ) return 1;
+  /* A short date such as 2024-1-1 ends before zTs[10] */
+  if( strlen(zTs)>10 && (zTs[10]=='T' || zTs[10]==' ') ){
+    if( sscanf(zTs+11, "%2d:%2d:%2d", &h, &mi, &sec)<2 ) return 1;
+  }
+  if( mo<1 || mo>12 || d<1 || d>31 ) return 1;
+  days = druid_days_from_civil(y, mo, d);
+  secs = days*86400 + h*3600 + mi*60 + sec;
+  switch( pRollup->ePeriod ){
+    case DRUID_PERIOD_MINUTE:
+    case DRUID_PERIOD_HOUR:
+    case DRUID_PERIOD_DAY:
+      unit = pRollup->ePeriod==DRUID_PERIOD_MINUTE ? 60 :
+             pRollup->ePeriod==DRUID_PERIOD_HOUR ? 3600 : 86400;
+      unit *= pRollup->nPeriod;
+      secs = druid_floor_div(secs, unit)*unit;
+      break;
+    case DRUID_PERIOD_WEEK: {
+      /* 1970-01-01 was a Thursday, weeks start on Monday */
+      sqlite3_int64 weeks = druid_floor_div(days+3, 7);
+      weeks = druid_floor_div(weeks, pRollup->nPeriod)*pRollup->nPeriod;
+      secs = (weeks*7 - 3)*86400;
+      break;
+    }
+    case DRUID_PERIOD_MONTH: {
+      sqlite3_int64 months = (sqlite3_int64)y*12 + (mo-1);
+      months = druid_floor_div(months, pRollup->nPeriod)*pRollup->nPeriod;
+      secs = druid_days_from_civil((int)druid_floor_div(months, 12),
+                                   (int)(months - druid_floor_div(months, 12)*12) + 1,
+                                   1)*86400;
+      break;
+    }
+    case DRUID_PERIOD_YEAR:
+      y = (int)(druid_floor_div(y, pRollup->nPeriod)*pRollup->nPeriod);
+      secs = druid_days_from_civil(y, 1, 1)*86400;
+      break;
+  }
+  days = druid_floor_div(secs, 86400);
+  secs -= days*86400;
+  druid_civil_from_days(days, &y, &mo, &d);
+  sqlite3_snprintf(32, zOut, "%04d-%02d-%02dT%02d:%02d:%02d.000Z",
+                   y, mo, d, (int)(secs/3600), (int)(secs/60%60), (int)(secs%60));
+  return 0;
+}
+
+/* Parse the rollups= parameter.  Return 0 on success.  On failure an
+** error message is left in pRdr.
+*/
+static int druid_parse_rollups(
+  DruidReader *pRdr,         /* Leave the error message here */
+  DruidTable *pTab,          /* Table whose columns are referenced */
+  const char *zSpec          /* Value of the rollups= parameter */
+){
+  const char *z = zSpec;
+  while( *z ){
+    const char *zEnd;
+    const char *zColon;
+    char *zDims, *zName, *zNext;
+    DruidRollup *pRollup;
+    int n, nPeriod;
+    while( isspace((unsigned char)z[0]) ) z++;
+    zEnd = strchr(z, ';');
+    n = zEnd ? (int)(zEnd - z) : (int)strlen(z);
+    if( n==0 ){
+      if( zEnd ) z++;
+      continue;
+    }
+    if( pTab->nRollup>=DRUID_MAX_ROLLUPS ){
+      druid_errmsg(pRdr, "too many rollups, at most %d are supported", DRUID_MAX_ROLLUPS);
+      return 1;
+    }
+    if( pTab->iTimestampCol<0 ){
+      druid_errmsg(pRdr, "rollups require a \"timestamp\" column");
+      return 1;
+    }
+    zColon = memchr(z, ':', n);
+    if( zColon==0 ){
+      druid_errmsg(pRdr, "bad rollup '%.*s', expected PERIOD:dim,dim,...", n, z);
+      return 1;
+    }
+    pRollup = sqlite3_realloc64(pTab->aRollup, sizeof(DruidRollup)*(pTab->nRollup+1));
+    if( pRollup==0 ){
+      druid_errmsg(pRdr, "out of memory");
+      return 1;
+    }
+    pTab->aRollup = pRollup;
+    pRollup = &pTab->aRollup[pTab->nRollup++];
+    memset(pRollup, 0, sizeof(*pRollup));
+    nPeriod = (int)(zColon - z);
+    while( nPeriod>0 && isspace((unsigned char)z[nPeriod-1]) ) nPeriod--;
+    pRollup->zPeriod = sqlite3_mprintf("%.*s", nPeriod, z);
+    if( pRollup->zPeriod==0 ){
+      druid_errmsg(pRdr, "out of memory");
+      return 1;
+    }
+    if( druid_parse_period(z, nPeriod, &pRollup->ePeriod, &pRollup->nPeriod) ){
+      druid_errmsg(pRdr, "unsupported rollup period '%s'", pRollup->zPeriod);
+      return 1;
+    }
+    pRollup->aiDim = sqlite3_malloc64(sizeof(int)*pTab->nCol);
+    zDims = sqlite3_mprintf("%.*s", n - (int)(zColon - z) - 1, zColon + 1);
+    if( pRollup->aiDim==0 || zDims==0 ){
+      sqlite3_free(zDims);
+      druid_errmsg(pRdr, "out of memory");
+      return 1;
+    }
+    for(zName=zDims; zName; zName=zNext){
+      int iCol;
+      int nName;
+      zNext = strchr(zName, ',');
+      if( zNext ) *(zNext++) = 0;
+      while( isspace((unsigned char)zName[0]) ) zName++;
+      nName = (int)strlen(zName);
+      while( nName>0 && isspace((unsigned char)zName[nName-1]) ) zName[--nName] = 0;
+      if( nName==0 ) continue;
+      for(iCol=0; iCol<pTab->nCol; iCol++){
+        if( strcmp(pTab->colNames[iCol], zName)==0 ) break;
+      }
+      if( iCol>=pTab->nCol || pTab->metricsCols[iCol] || pTab->sketchCols[iCol]
+       || iCol==pTab->iTimestampCol ){
+        druid_errmsg(pRdr, "rollup %s: '%s' is not a dimension", pRollup->zPeriod, zName);
+        sqlite3_free(zDims);
+        return 1;
+      }
+      if( pRollup->nDim>=DRUID_MAX_ROLLUP_KEY-1 ){
+        druid_errmsg(pRdr, "rollup %s: too many dimensions", pRollup->zPeriod);
+        sqlite3_free(zDims);
+        return 1;
+      }
+      pRollup->aiDim[pRollup->nDim++] = iCol;
+    }
+    sqlite3_free(zDims);
+    z = zEnd ? zEnd + 1 : z + strlen(z);
+  }
+  return 0;
+}
+
+/* Hash the key of a rollup group */
+static unsigned int druid_rollup_hash(int nKey, const char *const*azKey){
+  unsigned int h = 2166136261u;
+  int i;
+  for(i=0; i<nKey; i++){
+    const unsigned char *z = (const unsigned char*)azKey[i];
+    if( z==0 ){
+      h = (h ^ 0xff)*16777619u;
+    }else{
+      while( *z ) h = (h ^ *z++)*16777619u;
+    }
+    h = (h ^ 0)*16777619u;
+  }
+  return h;
+}
+
+/* Return true if both group keys are the same */
+static bool druid_rollup_key_eq(int nKey, const char *const*azA, const char *const*azB){
+  int i;
+  for(i=0; i<nKey; i++){
+    if( azA[i]==0 || azB[i]==0 ){
+      if( azA[i]!=azB[i] ) return false;
+    }else if( strcmp(azA[i], azB[i])!=0 ){
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Double the size of the hash table of a rollup.
+** Return 0 on success and non-zero if there is an OOM error */
+static int druid_rollup_rehash(DruidRollup *pRollup){
+  int nNew = pRollup->nHash ? pRollup->nHash*2 : 1024;
+  bool bHuge;
+  DruidRollupGroup **apNew = druid_huge_alloc(sizeof(DruidRollupGroup*)*nNew, &bHuge);
+  DruidRollupGroup *pGroup;
+  if( apNew==0 ) return 1;
+  memset(apNew, 0, sizeof(DruidRollupGroup*)*nNew);
+  for(pGroup=pRollup->pFirst; pGroup; pGroup=pGroup->pNext){
+    int iSlot = pGroup->h & (nNew-1);
+    pGroup->pHashNext = apNew[iSlot];
+    apNew[iSlot] = pGroup;
+  }
+  druid_huge_free(pRollup->apHash, sizeof(DruidRollupGroup*)*pRollup->nHash,
+                  pRollup->bHugeHash);
+  pRollup->apHash = apNew;
+  pRollup->bHugeHash = bHuge;
+  pRollup->nHash = nNew;
+  return 0;
+}
+
+/* Return the group of a rollup with the key azKey[], adding it if there
+** is none.  Return NULL if there is an OOM error */
+static DruidRollupGroup *druid_rollup_group(
+  DruidTable *pTab,
+  DruidRollup *pRollup,
+  const char *const*azKey
+){
+  int nKey = pRollup->nDim + 1;
+  int i;
+  unsigned int h;
+  DruidRollupGroup *pGroup;
+
+  h = druid_rollup_hash(nKey, azKey);
+  pGroup = 0;
+  if( pRollup->nHash ){
+    for(pGroup=pRollup->apHash[h & (pRollup->nHash-1)]; pGroup; pGroup=pGroup->pHashNext){
+      if( pGroup->h==h && druid_rollup_key_eq(nKey, (const char *const*)pGroup->azKey, azKey) ) break;
+    }
+  }
+  if( pGroup==0 ){
+    /* The group, its key and its sums live in a single allocation */
+    size_t nByte = sizeof(*pGroup) + sizeof(char*)*nKey
+                 + (sizeof(double)+sizeof(bool))*pTab->nCol;
+    char *zText;
+    for(i=0; i<nKey; i++){
+      if( azKey[i] ) nByte += strlen(azKey[i]) + 1;
+    }
+    if( pRollup->nGroup>=pRollup->nHash && druid_rollup_rehash(pRollup) ) return 0;
+    pGroup = druid_arena_alloc(&pRollup->groups, nByte);
+    if( pGroup==0 ) return 0;
+    memset(pGroup, 0, sizeof(*pGroup));
+    pGroup->h = h;
+    pGroup->aSum = (double*)&pGroup[1];
+    pGroup->azKey = (char**)&pGroup->aSum[pTab->nCol];
+    pGroup->aHasSum = (bool*)&pGroup->azKey[nKey];
+    memset(pGroup->aSum, 0, sizeof(double)*pTab->nCol);
+    memset(pGroup->aHasSum, 0, sizeof(bool)*pTab->nCol);
+    zText = (char*)&pGroup->aHasSum[pTab->nCol];
+    for(i=0; i<nKey; i++){
+      if( azKey[i] ){
+        size_t n = strlen(azKey[i]) + 1;
+        memcpy(zText, azKey[i], n);
+        pGroup->azKey[i] = zText;
+        zText += n;
+      }else{
+        pGroup->azKey[i] = 0;
+      }
+    }
+    pGroup->pHashNext = pRollup->apHash[h & (pRollup->nHash-1)];
+    pRollup->apHash[h & (pRollup->nHash-1)] = pGroup;
+    if( pRollup->pLast ){
+      pRollup->pLast->pNext = pGroup;
+    }else{
+      pRollup->pFirst = pGroup;
+    }
+    pRollup->pLast = pGroup;
+    pRollup->nGroup++;
+  }
+  return pGroup;
+}
+
+/* Add the rows of a batch to a rollup: find the group of each row, then
+** add up the metrics a column at a time.  The batch must have the
+** timestamp, the dimensions and the metrics.  Return 0 on success and
+** non-zero if there is an OOM error */
+static int druid_rollup_add_batch(DruidTable *pTab, DruidRollup *pRollup, DruidBatch *pBatch){
+  DruidRollupGroup *apGroup[DRUID_BATCH_ROWS];
+  const char *azKey[DRUID_MAX_ROLLUP_KEY];
+  char zBucket[32];
+  DruidBatchCol *pTime = &pBatch->aCol[pTab->iTimestampCol];
+  int i, iRow;
+
+  for(iRow=0; iRow<pBatch->nRow; iRow++){
+    azKey[0] = DRUID_BATCH_IS_NULL(pTime, iRow) ? 0 : pTime->azVal[iRow];
+    if( azKey[0] && druid_timestamp_bucket(pRollup, azKey[0], zBucket)==0 ){
+      azKey[0] = zBucket;
+    }
+    for(i=0; i<pRollup->nDim; i++){
+      DruidBatchCol *pDim = &pBatch->aCol[pRollup->aiDim[i]];
+      azKey[i+1] = DRUID_BATCH_IS_NULL(pDim, iRow) ? 0 : pDim->azVal[iRow];
+    }
+    apGroup[iRow] = druid_rollup_group(pTab, pRollup, azKey);
+    if( apGroup[iRow]==0 ) return 1;
+    apGroup[iRow]->nRow++;
+  }
+  for(i=0; i<pTab->nCol; i++){
+    DruidBatchCol *pCol = &pBatch->aCol[i];
+    if( !pTab->metricsCols[i] ) continue;
+    for(iRow=0; iRow<pBatch->nRow; iRow++){
+      if( pCol->aType[iRow]==JSON_NUMBER ){
+        apGroup[iRow]->aSum[i] += druid_batch_real(pCol, iRow);
+        apGroup[iRow]->aHasSum[i] = true;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+** Shared memory cache of the decoded rows of a result file (shm=1).
+**
+** Every process that queries a file would otherwise parse it again.  With
+** shm=1 the first scan writes the decoded rows to a file in /dev/shm,
+** named after the path and the identity of the result file, and the scans
+** of every process read them through a read-only shared mapping.  The
+** process that builds the cache holds an exclusive flock() on it, so the
+** others wait for it and then map the completed file instead of parsing
+** the result themselves.  The header is written last, a cache without
+** one is incomplete and rebuilt.
+**
+** Layout, in native byte order:
+**
+**    header     DruidShmHeader
+**    rows       u32 size of the rest of the row, then for each column a
+**               u8 JSON type, a u32 length (DRUID_SHM_NO_VALUE for missing
+**               values) and the NUL-terminated text of the value
+*/
+#define DRUID_SHM_MAGIC     "DRUIDSH2"
+#define DRUID_SHM_NO_VALUE  0xffffffff
+
+typedef struct DruidShmHeader {
+  char zMagic[8];                 /* DRUID_SHM_MAGIC once complete */
+  u32 nCol;                       /* Number of columns of each row */
+  u32 iUnused;
+  sqlite3_int64 nRow;             /* Number of rows */
+  sqlite3_int64 nByte;            /* Size of the cache file */
+  sqlite3_int64 iDev;             /* Identity of the result file */
+  sqlite3_int64 iIno;
+  sqlite3_int64 iSize;
+  sqlite3_int64 iMtime;
+  sqlite3_int64 iMtimeNsec;
+  sqlite3_int64 iCtime;
+  sqlite3_int64 iCtimeNsec;
+} DruidShmHeader;
+
+struct DruidShm {
+  int nRef;                       /* Number of users of the mapping */
+  const u8 *aMap;                 /* Read-only mapping of the cache file */
+  sqlite3_int64 nMap;             /* Size of aMap */
+  sqlite3_int64 nRow;             /* Number of rows */
+};
+
+/* Release a reference to a mapped cache */
+static void druid_shm_unref(DruidShm *pShm){
+  if( pShm && --pShm->nRef==0 ){
+    munmap((void*)pShm->aMap, (size_t)pShm->nMap);
+    sqlite3_free(pShm);
+  }
+}
+
+/* Directory of the cache files */
+static const char *druid_shm_dir(void){
+  struct stat st;
+  const char *z;
+  if( stat("/dev/shm", &st)==0 && S_ISDIR(st.st_mode) ) return "/dev/shm";
+  z = getenv("TMPDIR");
+  return z && z[0] ? z : "/tmp";
+}
+
+/* Fill the identity fields of a cache header */
+static void druid_shm_identity(DruidShmHeader *pHdr, const struct stat *pSt, int nCol){
+  memset(pHdr, 0, sizeof(*pHdr));
+  pHdr->nCol = (u32)nCol;
+  pHdr->iDev = (sqlite3_int64)pSt->st_dev;
+  pHdr->iIno = (sqlite3_int64)pSt->st_ino;
+  pHdr->iSize = (sqlite3_int64)pSt->st_size;
+  pHdr->iMtime = (sqlite3_int64)pSt->st_mtime;
+  pHdr->iMtimeNsec = (sqlite3_int64)DRUID_MTIME_NSEC(pSt);
+  pHdr->iCtime = (sqlite3_int64)pSt->st_ctime;
+  pHdr->iCtimeNsec = (sqlite3_int64)DRUID_CTIME_NSEC(pSt);
+}
+
+/* Return true if fd holds a complete cache of the file described by pExpected.
+** The header of the cache is written to *pHdr. */
+static bool druid_shm_valid(int fd, const DruidShmHeader *pExpected, DruidShmHeader *pHdr){
+  struct stat st;
+  if( pread(fd, pHdr, sizeof(*pHdr), 0)!=(ssize_t)sizeof(*pHdr) ) return false;
+  if( memcmp(pHdr->zMagic, DRUID_SHM_MAGIC, 8)!=0 ) return false;
+  if( pHdr->nCol!=pExpected->nCol
+   || pHdr->iDev!=pExpected->iDev || pHdr->iIno!=pExpected->iIno
+   || pHdr->iSize!=pExpected->iSize || pHdr->iMtime!=pExpected->iMtime
+   || pHdr->iMtimeNsec!=pExpected->iMtimeNsec
+   || pHdr->iCtime!=pExpected->iCtime || pHdr->iCtimeNsec!=pExpected->iCtimeNsec
+  ){
+    return false;
+  }
+  return fstat(fd, &st)==0 && (sqlite3_int64)st.st_size==pHdr->nByte;
+}
+
+/* Append row iRow of a batch of all the columns to a cache file.
+** Return the number of bytes written, or 0 on error. */
+static sqlite3_int64 druid_shm_write_row(FILE *out, DruidBatch *pBatch, int iRow){
+  u32 nRow = 0, n;
+  int i;
+  for(i=0; i<pBatch->nCol; i++){
+    nRow += 1 + sizeof(u32);
+    if( pBatch->aCol[i].azVal[iRow] ) nRow += (u32)pBatch->aCol[i].anVal[iRow] + 1;
+  }
+  if( fwrite(&nRow, sizeof(nRow), 1, out)!=1 ) return 0;
+  for(i=0; i<pBatch->nCol; i++){
+    DruidBatchCol *pCol = &pBatch->aCol[i];
+    u8 eType = pCol->aType[iRow];
+    n = pCol->azVal[iRow] ? (u32)pCol->anVal[iRow] : DRUID_SHM_NO_VALUE;
+    if( fwrite(&eType, 1, 1, out)!=1 || fwrite(&n, sizeof(n), 1, out)!=1 ) return 0;
+    if( pCol->azVal[iRow] && fwrite(pCol->azVal[iRow], n+1, 1, out)!=1 ) return 0;
+  }
+  return sizeof(nRow) + nRow;
+}
+
+/* Parse the result file of pTab into the cache file fd, which is locked */
+static int druid_shm_build(DruidTable *pTab, int fd, DruidShmHeader *pHdr){
+  sqlite3_vtab_cursor *pCursor = 0;
+  DruidCursor *pCur;
+  DruidBatch *pBatch;
+  FILE *out = 0;
+  int fdOut;
+  int rc;
+  int iRow;
+
+  if( ftruncate(fd, 0)!=0 || (fdOut = dup(fd))<0 ) goto shm_build_ioerr;
+  out = fdopen(fdOut, "wb");
+  if( out==0 ){
+    close(fdOut);
+    goto shm_build_ioerr;
+  }
+  pHdr->nRow = 0;
+  pHdr->nByte = sizeof(*pHdr);
+  if( fwrite(pHdr, sizeof(*pHdr), 1, out)!=1 ) goto shm_build_ioerr;
+
+  pBatch = druid_batch_new(pTab->nCol, ~(sqlite3_uint64)0);
+  if( pBatch==0 ){
+    fclose(out);
+    return SQLITE_NOMEM;
+  }
+  rc = druidtabOpen(&pTab->base, &pCursor);
+  if( rc!=SQLITE_OK ){
+    druid_batch_free(pBatch);
+    fclose(out);
+    return rc;
+  }
+  pCur = (DruidCursor*)pCursor;
+  pCur->zKind = "shm build";
+  rewindCur(&pCur->rdr);
+  while( (rc = druid_cursor_fill(pCur, pBatch, DRUID_BATCH_ROWS))==SQLITE_OK && pBatch->nRow>0 ){
+    for(iRow=0; iRow<pBatch->nRow; iRow++){
+      sqlite3_int64 n = druid_shm_write_row(out, pBatch, iRow);
+      if( n==0 ) break;
+      pHdr->nRow++;
+      pHdr->nByte += n;
+    }
+    if( iRow<pBatch->nRow ) break;
+  }
+  druidtabClose(pCursor);
+  druid_batch_free(pBatch);
+  if( rc!=SQLITE_OK ){
+    fclose(out);
+    if( ftruncate(fd, 0)!=0 ){ /* Left incomplete, rebuilt on next use */ }
+    return rc;
+  }
+  if( fflush(out)!=0 || ferror(out) ) goto shm_build_ioerr;
+  fclose(out);
+  out = 0;
+  /* The cache is complete once its header is written */
+  memcpy(pHdr->zMagic, DRUID_SHM_MAGIC, 8);
+  if( pwrite(fd, pHdr, sizeof(*pHdr), 0)!=(ssize_t)sizeof(*pHdr) ) goto shm_build_ioerr;
+  return SQLITE_OK;
+
+shm_build_ioerr:
+  if( out ) fclose(out);
+  if( ftruncate(fd, 0)!=0 ){ /* Left incomplete, rebuilt on next use */ }
+  sqlite3_free(pTab->base.zErrMsg);
+  pTab->base.zErrMsg = sqlite3_mprintf("cannot write the shm cache of %s: %s",
+                                       pTab->zFilename, strerror(errno));
+  return SQLITE_IOERR;
+}
+
+/* Caches not opened for this many seconds are removed, 0 never removes
+** them, see druid_shm_remove_stale() */
+static int druidShmMaxAge = 86400;  /* druid_json_config('shm_max_age') */
+
+/* Remove the caches of older versions of a file, named zPrefix*, and the
+** caches of every file that no process opened for druidShmMaxAge seconds.
+** Only the caches of the current user are removed.  The processes that
+** map a removed cache keep reading it, the next ones build it again. */
+static void druid_shm_remove_stale(const char *zDir, const char *zPrefix, const char *zKeep){
+  DIR *pDir = opendir(zDir);
+  struct dirent *pEntry;
+  size_t nPrefix = strlen(zPrefix);
+  int nMaxAge = DRUID_ATOMIC_LOAD(&druidShmMaxAge);
+  time_t now = time(0);
+  if( pDir==0 ) return;
+  while( (pEntry = readdir(pDir))!=0 ){
+    const char *zEntry = pEntry->d_name;
+    size_t n = strlen(zEntry);
+    struct stat st;
+    char *zPath;
+    if( strncmp(zEntry, "druid_json-", 11)!=0 || n<5 || strcmp(&zEntry[n-5], ".rows")!=0 ){
+      continue;
+    }
+    if( strcmp(zEntry, zKeep)==0 ) continue;
+    zPath = sqlite3_mprintf("%s/%s", zDir, zEntry);
+    if( zPath && lstat(zPath, &st)==0 && S_ISREG(st.st_mode) && st.st_uid==geteuid()
+     && (strncmp(zEntry, zPrefix, nPrefix)==0
+         || (nMaxAge>0 && now - st.st_mtime > nMaxAge)) ){
+      unlink(zPath);
+    }
+    sqlite3_free(zPath);
+  }
+  closedir(pDir);
+}
+
+/* Map the shm cache of the result file of pTab, building it first if
+** no process did yet */
+static int druid_shm_open(DruidTable *pTab, DruidShm **ppShm){
+  const char *zDir = druid_shm_dir();
+  DruidShmHeader sExpected, sHdr;
+  struct stat st;
+  sqlite3_uint64 hPath, hIdentity;
+  char *zPrefix = 0, *zName = 0, *zPath = 0;
+  bool bBuilt = false;
+  void *aMap;
+  int fd = -1;
+  int rc = SQLITE_OK;
+
+  *ppShm = 0;
+  if( stat(pTab->pFile->zPath, &st)!=0 ){
+    sqlite3_free(pTab->base.zErrMsg);
+    pTab->base.zErrMsg = sqlite3_mprintf("cannot stat %s", pTab->zFilename);
+    return SQLITE_ERROR;
+  }
+  druid_shm_identity(&sExpected, &st, pTab->nCol);
+  hPath = druid_hash64(pTab->pFile->zPath, (int)strlen(pTab->pFile->zPath));
+  hIdentity = druid_hash64((const char*)&sExpected, (int)sizeof(sExpected));
+  zPrefix = sqlite3_mprintf("druid_json-%016llx-", hPath);
+  zName = sqlite3_mprintf("%s%016llx.rows", zPrefix, hIdentity);
+  zPath = sqlite3_mprintf("%s/%s", zDir, zName);
+  if( zPrefix==0 || zName==0 || zPath==0 ){
+    rc = SQLITE_NOMEM;
+    goto shm_open_done;
+  }
+  /* The directory is writable by all: do not follow a link planted
+  ** there, nor use a file that another user created */
+  fd = open(zPath, O_RDWR|O_CREAT|O_CLOEXEC|O_NOFOLLOW, 0600);
+  if( fd<0 ){
+    sqlite3_free(pTab->base.zErrMsg);
+    pTab->base.zErrMsg = sqlite3_mprintf("cannot open %s: %s", zPath, strerror(errno));
+    rc = SQLITE_CANTOPEN;
+    goto shm_open_done;
+  }
+  if( fstat(fd, &st)!=0 || !S_ISREG(st.st_mode) || st.st_uid!=geteuid() ){
+    close(fd);
+    sqlite3_free(pTab->base.zErrMsg);
+    pTab->base.zErrMsg = sqlite3_mprintf(
+        "cannot use %s: not a regular file owned by the current user", zPath);
+    rc = SQLITE_CANTOPEN;
+    goto shm_open_done;
+  }
+  flock(fd, LOCK_SH);
+  if( !druid_shm_valid(fd, &sExpected, &sHdr) ){
+    /* Build the cache, unless another process did while we waited */
+    flock(fd, LOCK_EX);
+    if( !druid_shm_valid(fd, &sExpected, &sHdr) ){
+      sHdr = sExpected;
+      rc = druid_shm_build(pTab, fd, &sHdr);
+      bBuilt = rc==SQLITE_OK;
+    }
+  }
+  if( rc==SQLITE_OK && !bBuilt ){
+    /* The age of a cache is the time since it was last opened */
+    if( futimens(fd, 0)!=0 ){ /* Only removed sooner */ }
+  }
+  if( rc==SQLITE_OK ){
+    aMap = mmap(0, (size_t)sHdr.nByte, PROT_READ, MAP_SHARED, fd, 0);
+    if( aMap==MAP_FAILED ){
+      sqlite3_free(pTab->base.zErrMsg);
+      pTab->base.zErrMsg = sqlite3_mprintf("cannot map %s: %s", zPath, strerror(errno));
+      rc = SQLITE_IOERR;
+    }else{
+      DruidShm *pShm = sqlite3_malloc(sizeof(*pShm));
+      if( pShm==0 ){
+        munmap(aMap, (size_t)sHdr.nByte);
+        rc = SQLITE_NOMEM;
+      }else{
+        druid_huge_advise(aMap, (size_t)sHdr.nByte);
+        pShm->nRef = 1;
+        pShm->aMap = (const u8*)aMap;
+        pShm->nMap = sHdr.nByte;
+        pShm->nRow = sHdr.nRow;
+        *ppShm = pShm;
+      }
+    }
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+  if( bBuilt ) druid_shm_remove_stale(zDir, zPrefix, zName);
+
+shm_open_done:
+  sqlite3_free(zPrefix);
+  sqlite3_free(zName);
+  sqlite3_free(zPath);
+  return rc;
+}
+
+/* Return true if the encoded row at p, in a mapping that ends at pEnd,
+** holds nCol NUL-terminated values that end where the row does */
+static bool druid_shm_row_valid(const u8 *p, const u8 *pEnd, int nCol){
+  const u8 *pNext;
+  u32 nRow, n;
+  int i;
+  if( pEnd-p<(ptrdiff_t)sizeof(nRow) ) return false;
+  memcpy(&nRow, p, sizeof(nRow));
+  p += sizeof(nRow);
+  if( (sqlite3_uint64)nRow>(sqlite3_uint64)(pEnd-p) ) return false;
+  pNext = p + nRow;
+  for(i=0; i<nCol; i++){
+    if( pNext-p<(ptrdiff_t)(1+sizeof(n)) ) return false;
+    memcpy(&n, p+1, sizeof(n));
+    p += 1 + sizeof(n);
+    if( n==DRUID_SHM_NO_VALUE ) continue;
+    if( (sqlite3_uint64)n>=(sqlite3_uint64)(pNext-p) || p[n]!=0 ) return false;
+    p += n + 1;
+  }
+  return p==pNext;
+}
+
+/* Fail the scan of pCur on a row of its shm cache that is not valid */
+static int druid_shm_corrupt(DruidCursor *pCur){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  pCur->iRowid = -1;
+  sqlite3_free(pTab->base.zErrMsg);
+  pTab->base.zErrMsg = sqlite3_mprintf("corrupt shm cache of %s at row %lld",
+                                       pTab->zFilename, (long long)pCur->iShmRow);
+  return SQLITE_CORRUPT;
+}
+
+/* Point row iRow of a batch at the row encoded at p, in a shm cache or a
+** block of a stream, which must outlive the batch.  Return the next row */
+static const u8 *druid_batch_decode_row(DruidBatch *pBatch, int iRow, const u8 *p){
+  const u8 *pNext;
+  u32 nRow, n;
+  int i;
+  memcpy(&nRow, p, sizeof(nRow));
+  p += sizeof(nRow);
+  pNext = p + nRow;
+  for(i=0; i<pBatch->nCol; i++){
+    DruidBatchCol *pCol = &pBatch->aCol[i];
+    u8 eType = *p++;
+    memcpy(&n, p, sizeof(n));
+    p += sizeof(n);
+    if( (pBatch->mCol & DRUID_COLUMN_BIT(i))!=0 ){
+      pCol->aType[iRow] = eType;
+      pCol->aNum[iRow].eNum = DRUID_NUM_TEXT;
+      pCol->aiOff[iRow] = -1;
+      if( n==DRUID_SHM_NO_VALUE || eType==JSON_NULL ){
+        pCol->aNull[iRow>>6] |= ((sqlite3_uint64)1)<<(iRow&63);
+      }else{
+        pCol->aNull[iRow>>6] &= ~(((sqlite3_uint64)1)<<(iRow&63));
+      }
+      pCol->azVal[iRow] = n==DRUID_SHM_NO_VALUE ? 0 : (const char*)p;
+      pCol->anVal[iRow] = n==DRUID_SHM_NO_VALUE ? 0 : (int)n;
+    }
+    if( n!=DRUID_SHM_NO_VALUE ) p += n + 1;
+  }
+  return pNext;
+}
+
+/* Read the next row of a cursor from the shm cache into row pBatch->nRow
+** of a batch.  Its lengths are checked first, the file may have been
+** changed by another process */
+static int druid_cursor_read_shm_row(DruidCursor *pCur, DruidBatch *pBatch){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  const u8 *pEnd = pCur->pShm->aMap + pCur->pShm->nMap;
+  if( pCur->iShmRow>=pCur->pShm->nRow ){
+    pCur->iRowid = -1;
+    return SQLITE_OK;
+  }
+  if( !druid_shm_row_valid(pCur->pShmNext, pEnd, pTab->nCol) ){
+    return druid_shm_corrupt(pCur);
+  }
+  pCur->pShmNext = druid_batch_decode_row(pBatch, pBatch->nRow, pCur->pShmNext);
+  pCur->iShmRow++;
+  pCur->iRowid++;
+  return SQLITE_OK;
+}
+
+/* Skip nSkip rows of the shm cache, counting them in iRowid */
+static int druid_cursor_skip_shm_rows(DruidCursor *pCur, sqlite3_int64 nSkip){
+  const u8 *pEnd = pCur->pShm->aMap + pCur->pShm->nMap;
+  for(; nSkip>0; nSkip--){
+    u32 nRow;
+    if( pCur->iShmRow>=pCur->pShm->nRow ){
+      pCur->iRowid = -1;
+      return SQLITE_OK;
+    }
+    if( pEnd-pCur->pShmNext<(ptrdiff_t)sizeof(nRow) ) return druid_shm_corrupt(pCur);
+    memcpy(&nRow, pCur->pShmNext, sizeof(nRow));
+    if( (sqlite3_uint64)nRow>(sqlite3_uint64)(pEnd-pCur->pShmNext-sizeof(nRow)) ){
+      return druid_shm_corrupt(pCur);
+    }
+    pCur->pShmNext += sizeof(nRow) + nRow;
+    pCur->iShmRow++;
+    pCur->iRowid++;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Shared decoded blocks.  Cursors of one table open at the same time
+** (self-joins, correlated subqueries) share the rows decoded by a single
+** parser instead of each parsing the file.  The rows are decoded by
+** blocks of DRUID_BLOCK_ROWS, in the format of the shm cache, by a
+** private cursor of the DruidStream of the table.  A block is referenced
+** by the cursors positioned in it.  Once the stream holds more than
+** DRUID_STREAM_BLOCKS blocks, unreferenced blocks are freed, those all
+** cursors passed first, keeping the start of the file for the scans that
+** start over.  A block that was freed is decoded again when a cursor
+** needs it, from its offset in the file.
+**
+** A lone scan parses the file directly, as copying the rows in and out
+** of the blocks would only slow it down.  So does a scan past the start
+** of the file that no other scan follows closely enough to read the
+** blocks it would decode.
+*/
+#define DRUID_BLOCK_ROWS    256
+#define DRUID_STREAM_BLOCKS 64
+
+typedef struct DruidBlock {
+  int nRef;                       /* Number of cursors positioned in the block */
+  int nRow;                       /* Number of rows in aData */
+  bool bLast;                     /* No rows follow this block */
+  u8 *aData;                      /* The rows */
+} DruidBlock;
+
+struct DruidStream {
+  int nRef;                       /* The table and the cursors using it */
+  DruidTable *pTab;               /* Table of the stream */
+  DruidCursor *pDecoder;          /* Private cursor parsing the file */
+  int iDecoderBlock;              /* Block pDecoder is positioned at, or -1 */
+  int nBlock;                     /* Number of blocks whose offset is known */
+  int nAlloc;                     /* Allocated entries of aiOff[] and apBlock[] */
+  sqlite3_int64 *aiOff;           /* File offset of each block */
+  DruidBlock **apBlock;           /* Decoded blocks, or NULL */
+  int nCached;                    /* Number of blocks in apBlock[] */
+};
+
+/* Free a block */
+static void druid_block_free(DruidStream *pStream, int iBlock){
+  DruidBlock *pBlock = pStream->apBlock[iBlock];
+  assert( pBlock && pBlock->nRef==0 );
+  sqlite3_free(pBlock->aData);
+  sqlite3_free(pBlock);
+  pStream->apBlock[iBlock] = 0;
+  pStream->nCached--;
+}
+
+/* Release a reference to a DruidStream */
+static void druid_stream_unref(DruidStream *pStream){
+  int i;
+  if( pStream==0 || --pStream->nRef>0 ) return;
+  for(i=0; i<pStream->nBlock; i++){
+    if( pStream->apBlock[i] ) druid_block_free(pStream, i);
+  }
+  if( pStream->pDecoder ) druidtabClose(&pStream->pDecoder->base);
+  sqlite3_free(pStream->aiOff);
+  sqlite3_free(pStream->apBlock);
+  sqlite3_free(pStream);
+}
+
+/* Create the stream of a table, the file being parsed by a new cursor */
+static int druid_stream_new(DruidTable *pTab, DruidStream **ppStream){
+  DruidStream *pStream;
+  sqlite3_vtab_cursor *pCursor;
+  int rc;
+  *ppStream = 0;
+  pStream = sqlite3_malloc64(sizeof(*pStream));
+  if( pStream==0 ) return SQLITE_NOMEM;
+  memset(pStream, 0, sizeof(*pStream));
+  pStream->nRef = 1;
+  pStream->pTab = pTab;
+  pStream->iDecoderBlock = -1;
+  pStream->nAlloc = 16;
+  pStream->aiOff = sqlite3_malloc64(sizeof(sqlite3_int64)*pStream->nAlloc);
+  pStream->apBlock = sqlite3_malloc64(sizeof(DruidBlock*)*pStream->nAlloc);
+  if( pStream->aiOff==0 || pStream->apBlock==0 ){
+    druid_stream_unref(pStream);
+    return SQLITE_NOMEM;
+  }
+  memset(pStream->apBlock, 0, sizeof(DruidBlock*)*pStream->nAlloc);
+  pStream->aiOff[0] = 0;
+  pStream->nBlock = 1;
+  rc = druidtabOpen(&pTab->base, &pCursor);
+  if( rc!=SQLITE_OK ){
+    druid_stream_unref(pStream);
+    return rc;
+  }
+  pStream->pDecoder = (DruidCursor*)pCursor;
+  *ppStream = pStream;
+  return SQLITE_OK;
+}
+
+/* Append row iRow of a batch of all the columns to a block of nAlloc
+** bytes, of which nData are used.  Return SQLITE_NOMEM if it cannot grow. */
+static int druid_block_append(
+  DruidTable *pTab,
+  DruidBatch *pBatch,
+  int iRow,
+  DruidBlock *pBlock,
+  sqlite3_int64 *pnData,
+  sqlite3_int64 *pnAlloc
+){
+  u32 nRow = 0, n;
+  u8 *p;
+  int i;
+  for(i=0; i<pTab->nCol; i++){
+    nRow += 1 + sizeof(u32);
+    if( pBatch->aCol[i].azVal[iRow] ) nRow += (u32)pBatch->aCol[i].anVal[iRow] + 1;
+  }
+  if( *pnData + (sqlite3_int64)(sizeof(nRow) + nRow) > *pnAlloc ){
+    sqlite3_int64 nNew = (*pnAlloc)*2 + sizeof(nRow) + nRow;
+    u8 *aNew = sqlite3_realloc64(pBlock->aData, nNew);
+    if( aNew==0 ) return SQLITE_NOMEM;
+    pBlock->aData = aNew;
+    *pnAlloc = nNew;
+  }
+  p = &pBlock->aData[*pnData];
+  memcpy(p, &nRow, sizeof(nRow));
+  p += sizeof(nRow);
+  for(i=0; i<pTab->nCol; i++){
+    DruidBatchCol *pCol = &pBatch->aCol[i];
+    *p++ = pCol->aType[iRow];
+    n = pCol->azVal[iRow] ? (u32)pCol->anVal[iRow] : DRUID_SHM_NO_VALUE;
+    memcpy(p, &n, sizeof(n));
+    p += sizeof(n);
+    if( pCol->azVal[iRow] ){
+      memcpy(p, pCol->azVal[iRow], n+1);
+      p += n + 1;
+    }
+  }
+  *pnData += sizeof(nRow) + nRow;
+  return SQLITE_OK;
+}
+
+/* Decode block iBlock of a stream, whose offset is known */
+static int druid_stream_decode(DruidStream *pStream, int iBlock){
+  DruidTable *pTab = pStream->pTab;
+  DruidCursor *pDec = pStream->pDecoder;
+  DruidBlock *pBlock;
+  sqlite3_int64 nData = 0, nAlloc = 0;
+  int rc = SQLITE_OK;
+  int iRow;
+
+  assert( iBlock<pStream->nBlock && pStream->apBlock[iBlock]==0 );
+  if( pDec->pBatch==0 ){
+    pDec->pBatch = druid_batch_new(pTab->nCol, ~(sqlite3_uint64)0);
+    if( pDec->pBatch==0 ) return SQLITE_NOMEM;
+  }
+  pBlock = sqlite3_malloc64(sizeof(*pBlock));
+  if( pBlock==0 ) return SQLITE_NOMEM;
+  memset(pBlock, 0, sizeof(*pBlock));
+  if( pStream->iDecoderBlock!=iBlock ){
+    if( iBlock==0 ){
+      rewindCur(&pDec->rdr);
+    }else{
+      druid_reader_seek(&pDec->rdr, pStream->aiOff[iBlock]);
+    }
+  }
+  pDec->iRowid = 0;
+  rc = druid_cursor_fill(pDec, pDec->pBatch, DRUID_BLOCK_ROWS);
+  pBlock->bLast = pDec->iRowid<0;
+  for(iRow=0; rc==SQLITE_OK && iRow<pDec->pBatch->nRow; iRow++){
+    rc = druid_block_append(pTab, pDec->pBatch, iRow, pBlock, &nData, &nAlloc);
+    if( rc==SQLITE_OK ) pBlock->nRow++;
+  }
+  if( rc!=SQLITE_OK ){
+    pStream->iDecoderBlock = -1;
+    sqlite3_free(pBlock->aData);
+    sqlite3_free(pBlock);
+    return rc;
+  }
+  pStream->iDecoderBlock = pBlock->bLast ? -1 : iBlock+1;
+  if( !pBlock->bLast && iBlock+1==pStream->nBlock ){
+    if( pStream->nBlock>=pStream->nAlloc ){
+      int nNew = pStream->nAlloc*2;
+      sqlite3_int64 *aiOff = sqlite3_realloc64(pStream->aiOff, sizeof(sqlite3_int64)*nNew);
+      DruidBlock **apBlock;
+      if( aiOff ) pStream->aiOff = aiOff;
+      apBlock = aiOff ? sqlite3_realloc64(pStream->apBlock, sizeof(DruidBlock*)*nNew) : 0;
+      if( apBlock==0 ){
+        sqlite3_free(pBlock->aData);
+        sqlite3_free(pBlock);
+        return SQLITE_NOMEM;
+      }
+      memset(&apBlock[pStream->nAlloc], 0, sizeof(DruidBlock*)*(nNew - pStream->nAlloc));
+      pStream->apBlock = apBlock;
+      pStream->nAlloc = nNew;
+    }
+    pStream->aiOff[pStream->nBlock++] = druid_reader_tell(&pDec->rdr);
+  }
+  pStream->apBlock[iBlock] = pBlock;
+  pStream->nCached++;
+  return SQLITE_OK;
+}
+
+/* Free unreferenced blocks while the stream holds too many.  The blocks
+** before every cursor go first, the last of them first. */
+static void druid_stream_evict(DruidStream *pStream){
+  DruidCursor *pCur;
+  int iMin = pStream->nBlock;
+  int i;
+  if( pStream->nCached<=DRUID_STREAM_BLOCKS ) return;
+  for(pCur=pStream->pTab->pCursors; pCur; pCur=pCur->pNextCursor){
+    if( pCur->pStream==pStream && pCur->iBlock<iMin ) iMin = pCur->iBlock;
+  }
+  for(i=iMin-1; i>=0 && pStream->nCached>DRUID_STREAM_BLOCKS; i--){
+    if( pStream->apBlock[i] && pStream->apBlock[i]->nRef==0 ) druid_block_free(pStream, i);
+  }
+  for(i=pStream->nBlock-1; i>=iMin && pStream->nCached>DRUID_STREAM_BLOCKS; i--){
+    if( pStream->apBlock[i] && pStream->apBlock[i]->nRef==0 ) druid_block_free(pStream, i);
+  }
+}
+
+/* Start a scan of the stream of the table */
+static int druid_cursor_stream_start(DruidCursor *pCur){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  if( pTab->pStream==0 ){
+    int rc = druid_stream_new(pTab, &pTab->pStream);
+    if( rc!=SQLITE_OK ) return rc;
+  }
+  pCur->pStream = pTab->pStream;
+  pCur->pStream->nRef++;
+  pCur->iBlock = -1;
+  pCur->iBlockRow = 0;
+  return SQLITE_OK;
+}
+
+/* Leave the block of a cursor reading the stream, and the stream itself */
+static void druid_cursor_stream_end(DruidCursor *pCur){
+  DruidStream *pStream = pCur->pStream;
+  if( pStream==0 ) return;
+  if( pCur->iBlock>=0 ){
+    pStream->apBlock[pCur->iBlock]->nRef--;
+    pCur->iBlock = -1;
+    druid_stream_evict(pStream);
+  }
+  pCur->pStream = 0;
+  druid_stream_unref(pStream);
+}
+
+/* True if block iBlock, which pCur is about to decode, is worth keeping:
+** it is at the start of the file, or another cursor close enough behind
+** pCur will read it before it is freed */
+static bool druid_stream_wanted(DruidStream *pStream, DruidCursor *pCur, int iBlock){
+  DruidCursor *p;
+  if( iBlock<DRUID_STREAM_BLOCKS ) return true;
+  for(p=pStream->pTab->pCursors; p; p=p->pNextCursor){
+    if( p!=pCur && p->pStream==pStream
+     && p->iBlock<iBlock && p->iBlock>=iBlock-DRUID_STREAM_BLOCKS ){
+      return true;
+    }
+  }
+  return false;
+}
+
+/* True if the next row of the stream scan of pCur is in another block
+** than its last row */
+static bool druid_stream_block_end(DruidCursor *pCur){
+  return pCur->iBlock>=0
+      && pCur->iBlockRow>=pCur->pStream->apBlock[pCur->iBlock]->nRow;
+}
+
+/* Read the next row of the stream into row pBatch->nRow of a batch.  The
+** row points into the block of the cursor, the batch must not hold rows
+** of another block */
+static int druid_cursor_read_stream_row(DruidCursor *pCur, DruidBatch *pBatch){
+  DruidStream *pStream = pCur->pStream;
+  DruidBlock *pBlock = pCur->iBlock>=0 ? pStream->apBlock[pCur->iBlock] : 0;
+  while( pBlock==0 || pCur->iBlockRow>=pBlock->nRow ){
+    int iNext = pCur->iBlock + 1;
+    if( pBlock && pBlock->bLast ){
+      pCur->iRowid = -1;
+      return SQLITE_OK;
+    }
+    if( pStream->apBlock[iNext]==0 && !druid_stream_wanted(pStream, pCur, iNext) ){
+      /* No other scan would read the block, parse the file directly */
+      sqlite3_int64 iOff = pStream->aiOff[iNext];
+      druid_cursor_stream_end(pCur);
+      druid_reader_seek(&pCur->rdr, iOff);
+      return druid_cursor_read_row(pCur, pBatch);
+    }
+    if( pStream->apBlock[iNext]==0 ){
+      int rc = druid_stream_decode(pStream, iNext);
+      if( rc!=SQLITE_OK ){
+        pCur->iRowid = -1;
+        return rc;
+      }
+    }
+    pStream->apBlock[iNext]->nRef++;
+    pCur->iBlock = iNext;
+    pCur->iBlockRow = 0;
+    if( pBlock ){
+      pBlock->nRef--;
+      druid_stream_evict(pStream);
+    }
+    pBlock = pStream->apBlock[iNext];
+    pCur->pShmNext = pBlock->aData;
+  }
+  pCur->pShmNext = druid_batch_decode_row(pBatch, pBatch->nRow, pCur->pShmNext);
+  pCur->iBlockRow++;
+  pCur->iRowid++;
+  return SQLITE_OK;
+}
+
+/* True if a full scan of pCur should read the stream of the table: if
+** another cursor of the table is open, or the start of the file is
+** still decoded */
+static bool druid_table_shared(DruidTable *pTab, DruidCursor *pCur){
+  DruidStream *pStream = pTab->pStream;
+  DruidCursor *p;
+  if( pStream && pStream->apBlock[0] ) return true;
+  for(p=pTab->pCursors; p; p=p->pNextCursor){
+    if( p!=pCur && p->eScan!=DRUID_SCAN_MATERIALIZED
+     && (pStream==0 || p!=pStream->pDecoder) ){
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Compute every rollup in the mask that has not been built yet and, if
+** bStats is true and they are missing, the column statistics, with a
+** single scan of the result file.
+*/
+static int druid_table_build(DruidTable *pTab, unsigned int mRollup, bool bStats){
+  sqlite3_vtab_cursor *pCursor = 0;
+  DruidCursor *pCur;
+  DruidBatch *pBatch = 0;
+  DruidStats *pStats = 0;
+  sqlite3_uint64 mCol;
+  int rc;
+  int i, j;
+
+  for(i=0; i<pTab->nRollup; i++){
+    if( pTab->aRollup[i].bBuilt ) mRollup &= ~(1u<<i);
+  }
+  if( pTab->pStats ) bStats = false;
+  if( mRollup==0 && !bStats ) return SQLITE_OK;
+  /* Only the columns of the rollups are copied, or decoded by a trusted scan */
+  if( bStats ){
+    mCol = ~(sqlite3_uint64)0;
+  }else{
+    mCol = DRUID_COLUMN_BIT(pTab->iTimestampCol);
+    for(i=0; i<pTab->nCol; i++){
+      if( pTab->metricsCols[i] ) mCol |= DRUID_COLUMN_BIT(i);
+    }
+    for(i=0; i<pTab->nRollup; i++){
+      if( (mRollup & (1u<<i))==0 ) continue;
+      for(j=0; j<pTab->aRollup[i].nDim; j++){
+        mCol |= DRUID_COLUMN_BIT(pTab->aRollup[i].aiDim[j]);
+      }
+    }
+  }
+  pBatch = druid_batch_new(pTab->nCol, mCol);
+  if( pBatch==0 ) return SQLITE_NOMEM;
+  if( bStats ){
+    pStats = druid_stats_new(pTab->nCol);
+    if( pStats==0 ){
+      druid_batch_free(pBatch);
+      return SQLITE_NOMEM;
+    }
+  }
+  rc = druidtabOpen(&pTab->base, &pCursor);
+  if( rc!=SQLITE_OK ){
+    druid_stats_free(pStats);
+    druid_batch_free(pBatch);
+    return rc;
+  }
+  pCur = (DruidCursor*)pCursor;
+  pCur->zKind = bStats && mRollup==0 ? "stats build" : "rollup build";
+  pCur->mProject = mCol;
+  rewindCur(&pCur->rdr);
+  if( pTab->pShm ){
+    pCur->pShm = pTab->pShm;
+    pCur->pShm->nRef++;
+    pCur->pShmNext = pCur->pShm->aMap + sizeof(DruidShmHeader);
+    pCur->iShmRow = 0;
+  }
+  while( (rc = druid_cursor_fill(pCur, pBatch, DRUID_BATCH_ROWS))==SQLITE_OK && pBatch->nRow>0 ){
+    if( pStats ) druid_stats_add_batch(pTab, pStats, pBatch);
+    for(i=0; i<pTab->nRollup; i++){
+      if( (mRollup & (1u<<i))==0 ) continue;
+      if( druid_rollup_add_batch(pTab, &pTab->aRollup[i], pBatch) ){
+        rc = SQLITE_NOMEM;
+        break;
+      }
+    }
+    if( rc!=SQLITE_OK ) break;
+  }
+  if( pStats ){
+    /* The full scan completed, publish its statistics */
+    if( rc==SQLITE_OK && pTab->pStats==0 && pCur->iGeneration==pTab->iGeneration ){
+      pTab->pStats = pStats;
+    }else{
+      druid_stats_free(pStats);
+    }
+  }
+  druidtabClose(pCursor);
+  druid_batch_free(pBatch);
+  for(i=0; i<pTab->nRollup; i++){
+    if( (mRollup & (1u<<i))==0 ) continue;
+    if( rc==SQLITE_OK ){
+      pTab->aRollup[i].bBuilt = true;
+    }else{
+      druid_rollup_clear(&pTab->aRollup[i]);
+    }
+  }
+  return rc;
+}
+
+/*
+** Drop the rollups and statistics of a table if its file was replaced
+** since they were computed.  Rollups that cursors are iterating over are
+** kept until the last of these scans completes.
+*/
+static void druid_table_refresh(DruidTable *pTab){
+  unsigned int iGeneration = druid_file_generation(pTab->pFile);
+  int i;
+  if( iGeneration==pTab->iGeneration || pTab->nRollupScan>0 ) return;
+  for(i=0; i<pTab->nRollup; i++){
+    druid_rollup_clear(&pTab->aRollup[i]);
+  }
+  druid_stats_free(pTab->pStats);
+  pTab->pStats = 0;
+  druid_shm_unref(pTab->pShm);
+  pTab->pShm = 0;
+  druid_stream_unref(pTab->pStream);
+  pTab->pStream = 0;
+  pTab->iGeneration = iGeneration;
+}
+
+/*
+** Materialized tables.  With materialize=1 the rows of the file are copied
+** into the shadow table <name>_data, with the indexes declared by index=,
+** and row scans become queries on <name>_data that SQLite answers with
+** these B-trees.  <name>_config holds the identity of the file the rows
+** were copied from: the first scan after the file changed copies it again.
+** Rollups and samples still read the file.
+*/
+
+/* Parse the index= parameter, a semicolon separated list of comma
+** separated column lists.  Return 0 on success.  On failure an error
+** message is left in pRdr.
+*/
+static int druid_parse_indexes(
+  DruidReader *pRdr,         /* Leave the error message here */
+  DruidTable *pTab,          /* Table whose columns are referenced */
+  const char *zSpec          /* Value of the index= parameter */
+){
+  const char *z = zSpec;
+  while( *z ){
+    const char *zEnd;
+    char *zCols, *zName, *zNext;
+    DruidIndex *pIndex;
+    int n;
+    while( isspace((unsigned char)z[0]) ) z++;
+    zEnd = strchr(z, ';');
+    n = zEnd ? (int)(zEnd - z) : (int)strlen(z);
+    if( n==0 ){
+      if( zEnd ) z++;
+      continue;
+    }
+    pIndex = sqlite3_realloc64(pTab->aIndex, sizeof(DruidIndex)*(pTab->nIndex+1));
+    if( pIndex==0 ){
+      druid_errmsg(pRdr, "out of memory");
+      return 1;
+    }
+    pTab->aIndex = pIndex;
+    pIndex = &pTab->aIndex[pTab->nIndex++];
+    memset(pIndex, 0, sizeof(*pIndex));
+    pIndex->aiCol = sqlite3_malloc64(sizeof(int)*pTab->nCol);
+    zCols = sqlite3_mprintf("%.*s", n, z);
+    if( pIndex->aiCol==0 || zCols==0 ){
+      sqlite3_free(zCols);
+      druid_errmsg(pRdr, "out of memory");
+      return 1;
+    }
+    for(zName=zCols; zName; zName=zNext){
+      int iCol;
+      int nName;
+      zNext = strchr(zName, ',');
+      if( zNext ) *(zNext++) = 0;
+      while( isspace((unsigned char)zName[0]) ) zName++;
+      nName = (int)strlen(zName);
+      while( nName>0 && isspace((unsigned char)zName[nName-1]) ) zName[--nName] = 0;
+      if( nName==0 ) continue;
+      for(iCol=0; iCol<pTab->nCol; iCol++){
+        if( strcmp(pTab->colNames[iCol], zName)==0 ) break;
+      }
+      if( iCol>=pTab->nCol ){
+        druid_errmsg(pRdr, "index: no such column '%s'", zName);
+        sqlite3_free(zCols);
+        return 1;
+      }
+      if( pIndex->nCol<pTab->nCol ) pIndex->aiCol[pIndex->nCol++] = iCol;
+    }
+    sqlite3_free(zCols);
+    if( pIndex->nCol==0 ) pTab->nIndex--;
+    z += n;
+    if( *z ) z++;
+  }
+  return 0;
+}
+
+/* Create the shadow tables and the indexes of a materialized table */
+static int druid_materialize_create(DruidTable *pTab, char **pzErr){
+  sqlite3_str *pSql = sqlite3_str_new(pTab->db);
+  char *zSql;
+  int rc, i, j;
+  sqlite3_str_appendf(pSql,
+      "CREATE TABLE IF NOT EXISTS \"%w\".\"%w_config\"(k TEXT PRIMARY KEY, v) WITHOUT ROWID;"
+      "CREATE TABLE IF NOT EXISTS \"%w\".\"%w_data\"(",
+      pTab->zSchema, pTab->zName, pTab->zSchema, pTab->zName);
+  for(i=0; i<pTab->nCol; i++){
+    sqlite3_str_appendf(pSql, "%s\"%w\" %s", i ? "," : "", pTab->colNames[i],
+        pTab->metricsCols[i] ? "REAL" : pTab->sketchCols[i] ? "BLOB" : "TEXT");
+  }
+  sqlite3_str_appendf(pSql, ");");
+  for(i=0; i<pTab->nIndex; i++){
+    DruidIndex *pIndex = &pTab->aIndex[i];
+    sqlite3_str_appendf(pSql, "CREATE INDEX IF NOT EXISTS \"%w\".\"%w_data_i%d\" ON \"%w_data\"(",
+                        pTab->zSchema, pTab->zName, i, pTab->zName);
+    for(j=0; j<pIndex->nCol; j++){
+      sqlite3_str_appendf(pSql, "%s\"%w\"", j ? "," : "", pTab->colNames[pIndex->aiCol[j]]);
+    }
+    sqlite3_str_appendf(pSql, ");");
+  }
+  zSql = sqlite3_str_finish(pSql);
+  if( zSql==0 ) return SQLITE_NOMEM;
+  rc = sqlite3_exec(pTab->db, zSql, 0, 0, pzErr);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/* The identity of a file: it changes when the file is replaced or
+** modified.  Return NULL if the file cannot be stat()ed. */
+static char *druid_file_identity(const char *zFilename){
+  struct stat st;
+  if( stat(zFilename, &st) ) return 0;
+  return sqlite3_mprintf("%lld:%lld:%lld:%lld.%09ld:%lld.%09ld", (long long)st.st_dev,
+                         (long long)st.st_ino, (long long)st.st_size,
+                         (long long)st.st_mtime, (long)DRUID_MTIME_NSEC(&st),
+                         (long long)st.st_ctime, (long)DRUID_CTIME_NSEC(&st));
+}
+
+/* Copy the rows of the file into <name>_data, unless they are the rows of
+** the current file already.  The identity of the file is removed first and
+** stored last, so that a copy that fails half-way is done again. */
+static int druid_table_materialize(DruidTable *pTab){
+  unsigned int iGeneration = druid_file_generation(pTab->pFile);
+  sqlite3_str *pSql;
+  char *zSql;
+  char *zErr = 0;
+  bool bSame;
+  int rc, i;
+  if( pTab->zIdentity==0 || pTab->iIdentityGeneration!=iGeneration ){
+    sqlite3_free(pTab->zIdentity);
+    pTab->zIdentity = druid_file_identity(pTab->zFilename);
+    if( pTab->zIdentity==0 ){
+      sqlite3_free(pTab->base.zErrMsg);
+      pTab->base.zErrMsg = sqlite3_mprintf("cannot open '%s' for reading", pTab->zFilename);
+      return SQLITE_ERROR;
+    }
+    pTab->iIdentityGeneration = iGeneration;
+  }
+  if( pTab->pIdentity==0 ){
+    zSql = sqlite3_mprintf("SELECT v FROM \"%w\".\"%w_config\" WHERE k='identity'",
+                           pTab->zSchema, pTab->zName);
+    if( zSql==0 ) return SQLITE_NOMEM;
+    rc = sqlite3_prepare_v2(pTab->db, zSql, -1, &pTab->pIdentity, 0);
+    sqlite3_free(zSql);
+    if( rc!=SQLITE_OK ) goto materialize_error;
+  }
+  bSame = false;
+  if( sqlite3_step(pTab->pIdentity)==SQLITE_ROW ){
+    const char *zStored = (const char*)sqlite3_column_text(pTab->pIdentity, 0);
+    bSame = zStored && strcmp(zStored, pTab->zIdentity)==0;
+  }
+  rc = sqlite3_reset(pTab->pIdentity);
+  if( rc!=SQLITE_OK ) goto materialize_error;
+  if( bSame ) return SQLITE_OK;
+
+  pSql = sqlite3_str_new(pTab->db);
+  sqlite3_str_appendf(pSql,
+      "DELETE FROM \"%w\".\"%w_config\" WHERE k='identity';"
+      "DELETE FROM \"%w\".\"%w_data\";"
+      "INSERT INTO \"%w\".\"%w_data\"(rowid",
+      pTab->zSchema, pTab->zName, pTab->zSchema, pTab->zName,
+      pTab->zSchema, pTab->zName);
+  for(i=0; i<pTab->nCol; i++){
+    sqlite3_str_appendf(pSql, ",\"%w\"", pTab->colNames[i]);
+  }
+  sqlite3_str_appendf(pSql,
+      ") SELECT rowid,* FROM \"%w\".\"%w\";"
+      "INSERT INTO \"%w\".\"%w_config\"(k,v) VALUES('identity',%Q);",
+      pTab->zSchema, pTab->zName, pTab->zSchema, pTab->zName, pTab->zIdentity);
+  zSql = sqlite3_str_finish(pSql);
+  if( zSql==0 ) return SQLITE_NOMEM;
+  /* The nested scan of this table must read the file */
+  pTab->bMaterializing = true;
+  rc = sqlite3_exec(pTab->db, zSql, 0, 0, &zErr);
+  pTab->bMaterializing = false;
+  sqlite3_free(zSql);
+  if( rc!=SQLITE_OK ){
+    sqlite3_free(pTab->base.zErrMsg);
+    pTab->base.zErrMsg = zErr;
+  }
+  return rc;
+
+materialize_error:
+  sqlite3_free(pTab->base.zErrMsg);
+  pTab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(pTab->db));
+  return rc;
+}
+
+/* Start the query on <name>_data whose WHERE and ORDER BY clauses are
+** idxStr, and whose parameters are argv[] */
+static int druid_cursor_select(
+  DruidCursor *pCur,
+  const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  int rc = SQLITE_OK;
+  int i;
+  if( idxStr==0 ) idxStr = "";
+  if( pCur->pSelect && strcmp(pCur->zSelect, idxStr)==0 ){
+    sqlite3_reset(pCur->pSelect);
+  }else{
+    char *zSql;
+    sqlite3_finalize(pCur->pSelect);
+    pCur->pSelect = 0;
+    sqlite3_free(pCur->zSelect);
+    pCur->zSelect = sqlite3_mprintf("%s", idxStr);
+    zSql = sqlite3_mprintf("SELECT rowid,* FROM \"%w\".\"%w_data\" %s",
+                           pTab->zSchema, pTab->zName, idxStr);
+    if( zSql==0 || pCur->zSelect==0 ){
+      sqlite3_free(zSql);
+      return SQLITE_NOMEM;
+    }
+    rc = sqlite3_prepare_v2(pTab->db, zSql, -1, &pCur->pSelect, 0);
+    sqlite3_free(zSql);
+  }
+  for(i=0; rc==SQLITE_OK && i<argc; i++){
+    rc = sqlite3_bind_value(pCur->pSelect, i+1, argv[i]);
+  }
+  if( rc!=SQLITE_OK ){
+    sqlite3_free(pTab->base.zErrMsg);
+    pTab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(pTab->db));
+  }
+  return rc;
+}
+
+/* Move a DRUID_SCAN_MATERIALIZED cursor to the next row of its query */
+static int druid_cursor_step(DruidCursor *pCur){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  int rc = sqlite3_step(pCur->pSelect);
+  if( rc==SQLITE_ROW ){
+    pCur->iRowid = sqlite3_column_int64(pCur->pSelect, 0);
+    return SQLITE_OK;
+  }
+  pCur->iRowid = -1;
+  rc = sqlite3_reset(pCur->pSelect);
+  if( rc!=SQLITE_OK ){
+    sqlite3_free(pTab->base.zErrMsg);
+    pTab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(pTab->db));
+  }
+  return rc;
+}
+
+/* Index of the usable constraint of pIdxInfo on column iCol with operator op
+** and a BINARY collation, or -1 */
+static int druid_find_constraint(sqlite3_index_info *pIdxInfo, int iCol, int op, int iFrom){
+  int i;
+  for(i=iFrom; i<pIdxInfo->nConstraint; i++){
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    const char *zColl;
+    if( !pCons->usable || pCons->iColumn!=iCol || pCons->op!=op ) continue;
+    zColl = sqlite3_vtab_collation(pIdxInfo, i);
+    if( zColl && sqlite3_stricmp(zColl, "BINARY")!=0 ) continue;
+    return i;
+  }
+  return -1;
+}
+
+/*
+** xBestIndex of a materialized table.  The candidate plans are the rowid
+** and each index of <name>_data: equality constraints on a prefix of its
+** columns, then range constraints on the next column.  The plan that
+** visits the fewest rows is encoded as the WHERE clause of the query on
+** <name>_data, and the ORDER BY is consumed when the rows come in that
+** order.  SQLite checks the constraints again.
+*/
+static int druid_materialized_best_index(DruidTable *pTab, sqlite3_index_info *pIdxInfo){
+  static const int aRangeOp[] = {
+    SQLITE_INDEX_CONSTRAINT_GT, SQLITE_INDEX_CONSTRAINT_GE,
+    SQLITE_INDEX_CONSTRAINT_LT, SQLITE_INDEX_CONSTRAINT_LE,
+  };
+  static const char *azRangeOp[] = { ">", ">=", "<", "<=" };
+  static const int iRowidCol = -1;
+  double nRow = pTab->pStats ? (double)pTab->pStats->nRow : 1000000.0;
+  double rBest = nRow;            /* Rows visited by the best plan */
+  const int *aiCol = &iRowidCol;  /* Columns of the best plan */
+  int nCol = 1;                   /* Number of entries in aiCol[] */
+  int nEq = 0;                    /* Equality constraints of the best plan */
+  bool bRange = false;            /* Range constraints follow them */
+  sqlite3_str *pWhere;
+  int nArg = 0;
+  int iIndex, i, k;
+
+  for(iIndex=-1; iIndex<pTab->nIndex; iIndex++){
+    const int *ai = iIndex<0 ? &iRowidCol : pTab->aIndex[iIndex].aiCol;
+    int n = iIndex<0 ? 1 : pTab->aIndex[iIndex].nCol;
+    double nVisit = nRow;
+    bool bCandRange = false;
+    for(k=0; k<n; k++){
+      double ndv;
+      if( druid_find_constraint(pIdxInfo, ai[k], SQLITE_INDEX_CONSTRAINT_EQ, 0)<0 ) break;
+      ndv = ai[k]<0 ? nRow : druid_stats_ndv(pTab, ai[k]);
+      nVisit /= ndv>=1.0 ? ndv : 10.0;
+    }
+    if( k<n ){
+      for(i=0; i<4; i++){
+        if( druid_find_constraint(pIdxInfo, ai[k], aRangeOp[i], 0)>=0 ){
+          nVisit /= 4.0;
+          bCandRange = true;
+        }
+      }
+    }
+    if( (k>0 || bCandRange) && nVisit<rBest ){
+      rBest = nVisit;
+      aiCol = ai;
+      nCol = n;
+      nEq = k;
+      bRange = bCandRange;
+    }
+  }
+  if( nEq==0 && !bRange && pIdxInfo->nOrderBy>0 ){
+    /* No constraint is usable, scan the index that sorts the rows */
+    for(iIndex=0; iIndex<pTab->nIndex; iIndex++){
+      if( pTab->aIndex[iIndex].aiCol[0]==pIdxInfo->aOrderBy[0].iColumn ){
+        aiCol = pTab->aIndex[iIndex].aiCol;
+        nCol = pTab->aIndex[iIndex].nCol;
+        break;
+      }
+    }
+  }
+
+  pWhere = sqlite3_str_new(0);
+  for(k=0; k<nEq+bRange; k++){
+    const char *zCol = aiCol[k]<0 ? "rowid" : pTab->colNames[aiCol[k]];
+    for(i=0; i<(k<nEq ? 1 : 4); i++){
+      int op = k<nEq ? SQLITE_INDEX_CONSTRAINT_EQ : aRangeOp[i];
+      int iCons = -1;
+      while( (iCons = druid_find_constraint(pIdxInfo, aiCol[k], op, iCons+1))>=0 ){
+        pIdxInfo->aConstraintUsage[iCons].argvIndex = ++nArg;
+        sqlite3_str_appendf(pWhere, "%s\"%w\"%s?", nArg>1 ? " AND " : "WHERE ",
+                            zCol, k<nEq ? "=" : azRangeOp[i]);
+        if( k<nEq ) break;
+      }
+    }
+  }
+
+  /* The rows come in the order of the index columns that follow the
+  ** equality constraints, then of the rowid */
+  if( pIdxInfo->nOrderBy>0 ){
+    bool bDesc = pIdxInfo->aOrderBy[0].desc;
+    for(i=0; i<pIdxInfo->nOrderBy; i++){
+      int iCol = nEq+i<nCol ? aiCol[nEq+i] : -1;
+      if( nEq+i>nCol || pIdxInfo->aOrderBy[i].iColumn!=iCol
+       || pIdxInfo->aOrderBy[i].desc!=bDesc ){
+        break;
+      }
+    }
+    if( i>=pIdxInfo->nOrderBy ){
+      for(i=0; i<pIdxInfo->nOrderBy; i++){
+        int iCol = pIdxInfo->aOrderBy[i].iColumn;
+        sqlite3_str_appendf(pWhere, "%s\"%w\"%s", i ? "," : nArg ? " ORDER BY " : "ORDER BY ",
+                            iCol<0 ? "rowid" : pTab->colNames[iCol], bDesc ? " DESC" : "");
+      }
+      pIdxInfo->orderByConsumed = 1;
+    }
+  }
+
+  pIdxInfo->idxNum = DRUID_SCAN_MATERIALIZED;
+  pIdxInfo->estimatedRows = rBest<1.0 ? 1 : (sqlite3_int64)rBest;
+  pIdxInfo->estimatedCost = rBest + (nArg>0 ? log(nRow+1.0)/log(2.0) : 0.0);
+  if( aiCol[0]<0 && nEq==1 ){
+    pIdxInfo->idxFlags |= SQLITE_INDEX_SCAN_UNIQUE;
+  }
+  if( sqlite3_str_length(pWhere) ){
+    pIdxInfo->idxStr = sqlite3_str_finish(pWhere);
+    if( pIdxInfo->idxStr==0 ) return SQLITE_NOMEM;
+    pIdxInfo->needToFreeIdxStr = 1;
+  }else{
+    sqlite3_free(sqlite3_str_finish(pWhere));
+  }
+  return SQLITE_OK;
+}
+
+/*
+** This method is the destructor fo a DruidTable object.
+*/
+static int druidtabDisconnect(sqlite3_vtab *pVtab){
+  DruidTable *p = (DruidTable*)pVtab;
+  int i;
+  druid_stream_unref(p->pStream);
+  while( p->nFreeCursor>0 ){
+    druid_cursor_free(p->apFreeCursor[--p->nFreeCursor]);
+  }
+  sqlite3_free(p->zFilename);
+  sqlite3_free(p->metricsCols);
+  sqlite3_free(p->sketchCols);
+  druid_rollups_free(p->nRollup, p->aRollup);
+  druid_stats_free(p->pStats);
+  druid_shm_unref(p->pShm);
+  druid_file_release(p->pFile);
+  sqlite3_finalize(p->pProbe);
+  sqlite3_finalize(p->apJson[0]);
+  sqlite3_finalize(p->apJson[1]);
+  sqlite3_finalize(p->pIdentity);
+  sqlite3_free(p->zIdentity);
+  for(i=0; i<p->nIndex; i++) sqlite3_free(p->aIndex[i].aiCol);
+  sqlite3_free(p->aIndex);
+  sqlite3_free(p->zSchema);
+  if( p->pModule ){
+    DruidTable **pp;
+    for(pp=&p->pModule->pTables; *pp; pp=&(*pp)->pNextTable){
+      if( *pp==p ){
+        *pp = p->pNextTable;
+        break;
+      }
+    }
+  }
+  sqlite3_free(p->zName);
+  if(p->colNames) {
+      for (int i = 0; i < p->nCol; i++) {
+          sqlite3_free(p->colNames[i]);
+      }
+      sqlite3_free(p->colNames);
+  }
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+/* Skip leading whitespace.  Return a pointer to the first non-whitespace
+** character, or to the zero terminator if the string has only whitespace */
+static const char *druid_skip_whitespace(const char *z){
+  while( isspace((unsigned char)z[0]) ) z++;
+  return z;
+}
+
+/* Remove trailing whitespace from the end of string z[] */
+static void druid_trim_whitespace(char *z){
+  size_t n = strlen(z);
+  while( n>0 && isspace((unsigned char)z[n]) ) n--;
+  z[n] = 0;
+}
+
+/* Dequote the string */
+static void druid_dequote(char *z){
+  int j;
+  char cQuote = z[0];
+  size_t i, n;
+
+  if( cQuote!='\'' && cQuote!='"' ) return;
+  n = strlen(z);
+  if( n<2 || z[n-1]!=z[0] ) return;
+  for(i=1, j=0; i<n-1; i++){
+    if( z[i]==cQuote && z[i+1]==cQuote ) i++;
+    z[j++] = z[i];
+  }
+  z[j] = 0;
+}
+
+/* Check to see if the string is of the form:  "TAG = VALUE" with optional
+** whitespace before and around tokens.  If it is, return a pointer to the
+** first character of VALUE.  If it is not, return NULL.
+*/
+static const char *druid_parameter(const char *zTag, int nTag, const char *z){
+  z = druid_skip_whitespace(z);
+  if( strncmp(zTag, z, nTag)!=0 ) return 0;
+  z = druid_skip_whitespace(z+nTag);
+  if( z[0]!='=' ) return 0;
+  return druid_skip_whitespace(z+1);
+}
+
+/* Decode a parameter that requires a dequoted string.
+**
+** Return 1 if the parameter is seen, or 0 if not.  1 is returned
+** even if there is an error.  If an error occurs, then an error message
+** is left in p->zErr.  If there are no errors, p->zErr[0]==0.
+*/
+static int druid_string_parameter(
+  DruidReader *p,            /* Leave the error message here, if there is one */
+  const char *zParam,      /* Parameter we are checking for */
+  const char *zArg,        /* Raw text of the virtual table argment */
+  char **pzVal             /* Write the dequoted string value here */
+){
+  const char *zValue;
+  zValue = druid_parameter(zParam,(int)strlen(zParam),zArg);
+  if( zValue==0 ) return 0;
+  p->zErr[0] = 0;
+  if( *pzVal ){
+    druid_errmsg(p, "more than one '%s' parameter", zParam);
+    return 1;
+  }
+  *pzVal = sqlite3_mprintf("%s", zValue);
+  if( *pzVal==0 ){
+    druid_errmsg(p, "out of memory");
+    return 1;
+  }
+  druid_trim_whitespace(*pzVal);
+  druid_dequote(*pzVal);
+  return 1;
+}
+
+/* Return 0 or 1 if z is a recognized boolean value, or -1 otherwise */
+static int druid_boolean(const char *z){
+  if( sqlite3_stricmp("yes",z)==0
+   || sqlite3_stricmp("on",z)==0
+   || sqlite3_stricmp("true",z)==0
+   || (z[0]=='1' && z[1]==0)
+  ){
+    return 1;
+  }
+  if( sqlite3_stricmp("no",z)==0
+   || sqlite3_stricmp("off",z)==0
+   || sqlite3_stricmp("false",z)==0
+   || (z[0]=='0' && z[1]==0)
+  ){
+    return 0;
+  }
+  return -1;
+}
+
+/* Split a comma seperated list of column names.  The number of names is
+** written to *pnName.  Free the result with free_druid_metrics_names().
+*/
+static char **druid_split_names(const char *zList, int *pnName){
+  int i = 0;
+  int prev_start = 0;
+  int pos = 0;
+  int cur_len = 0;
+  int nName = count_string_reps((char*)zList, ',') + 1;
+  char **azName = sqlite3_malloc(sizeof (char*) * nName);
+  memset(azName, 0, sizeof (char*) * nName);
+  for(pos=0;zList[pos];pos++){
+    if(zList[pos]==','){
+      cur_len = pos - prev_start;
+      azName[i] = sqlite3_malloc(sizeof(char) * cur_len + 1);
+      memcpy(azName[i], &zList[prev_start], cur_len);
+      azName[i][cur_len] = 0;
+      prev_start = pos + 1;
+      i++;
+    }
+  }
+  cur_len = pos - prev_start;
+  azName[i] = sqlite3_malloc(sizeof(char) * cur_len + 1);
+  memcpy(azName[i], &zList[prev_start], cur_len);
+  azName[i][cur_len] = 0;
+  assert(i+1==nName);
+  *pnName = nName;
+  return azName;
+}
+
+/*
+** Parameters:
+**    filename=FILENAME          Name of file containing CSV content
+**    metrics=METRICS            Comma seperated list of metric names (changes the datatype from TEXT -> REAL)
+**    rollups=ROLLUPS            Semicolon seperated list of PERIOD:dim,dim rollups (e.g. "P1D:app,country")
+**    sketches=SKETCHES          Comma seperated list of base64 encoded sketch columns (changes the datatype from TEXT -> BLOB)
+**    sample_seed=N              Seed of the rows selected by _sample constraints.  Optional
+**    follow=BOOLEAN             Wait for results appended to a file that is still being written
+**    follow_timeout=MS          Give up waiting after MS milliseconds without new data (default 1000)
+**    shm=BOOLEAN                Share the decoded rows with other processes through /dev/shm
+**    materialize=BOOLEAN        Copy the rows into the <name>_data shadow table and query it
+**    index=INDEXES              Semicolon seperated list of col,col indexes on <name>_data
+**    validate_utf8=BOOLEAN      Fail on strings that are not valid UTF-8
+**    trusted=BOOLEAN            The file is well-formed Druid output, parse it with fewer checks
+**
+** Only available if compiled with SQLITE_TEST:
+**
+**    testflags=N                Bitmask of test flags.  Optional
+**
+*/
+static int druidtabConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  DruidTable *pNew = 0;        /* The DruidTable object to construct */
+  int rc = SQLITE_OK;        /* Result code from this routine */
+  int i, j;                  /* Loop counters */
+#ifdef SQLITE_TEST
+  int tstFlags = 0;          /* Value for testflags=N parameter */
+#endif
+  int b;                     /* Value of a boolean parameter */
+  int bShm = 0;              /* Value of the shm=BOOLEAN parameter */
+  int bMaterialize = 0;      /* Value of the materialize=BOOLEAN parameter */
+  int bValidateUtf8 = 0;     /* Value of the validate_utf8=BOOLEAN parameter */
+  int bTrusted = 0;          /* Value of the trusted=BOOLEAN parameter */
+  int nCol = -99;            /* Value of the columns= parameter */
+  int read_field_ret;
+  DruidReader sRdr;            /* A CSV file reader used to store an error
+                             ** message and/or to count the number of columns */
+  static const char *azParam[] = {
+     "filename", "metrics", "rollups", "sketches", "sample_seed",
+     "follow", "follow_timeout", "shm", "materialize", "index", "validate_utf8",
+     "trusted",
+  };
+  char *azPValue[12];        /* Parameter values */
+  char *schema;
+  int num_druid_metrics=0;
+  char **druid_metric_names = 0;
+  int num_druid_sketches=0;
+  char **druid_sketch_names = 0;
+# define DRUID_FILENAME (azPValue[0])
+# define DRUID_METRICS   (azPValue[1])
+# define DRUID_ROLLUPS   (azPValue[2])
+# define DRUID_SKETCHES  (azPValue[3])
+# define DRUID_SAMPLE_SEED (azPValue[4])
+# define DRUID_FOLLOW    (azPValue[5])
+# define DRUID_FOLLOW_TIMEOUT (azPValue[6])
+# define DRUID_SHM       (azPValue[7])
+# define DRUID_MATERIALIZE (azPValue[8])
+# define DRUID_INDEX     (azPValue[9])
+# define DRUID_VALIDATE_UTF8 (azPValue[10])
+# define DRUID_TRUSTED   (azPValue[11])
+
+
+  assert( sizeof(azPValue)==sizeof(azParam) );
+  memset(&sRdr, 0, sizeof(sRdr));
+  memset(azPValue, 0, sizeof(azPValue));
+  for(i=3; i<argc; i++){
+    const char *z = argv[i];
+    const char *zValue;
+    for(j=0; j<sizeof(azParam)/sizeof(azParam[0]); j++){
+      if( druid_string_parameter(&sRdr, azParam[j], z, &azPValue[j]) ) break;
+    }
+    if( j<sizeof(azParam)/sizeof(azParam[0]) ){
+      if( sRdr.zErr[0] ) goto csvtab_connect_error;
+    }else
+    {
+      druid_errmsg(&sRdr, "bad parameter: '%s'", z);
+      goto csvtab_connect_error;
+    }
+  }
+  if( DRUID_FILENAME==0 ){
+    druid_errmsg(&sRdr, "must specify either filename= ");
+    goto csvtab_connect_error;
+  }
+  if( DRUID_SAMPLE_SEED ){
+    char *zEnd = 0;
+    strtoll(DRUID_SAMPLE_SEED, &zEnd, 0);
+    if( DRUID_SAMPLE_SEED[0]==0 || *zEnd!=0 ){
+      druid_errmsg(&sRdr, "sample_seed must be an integer: '%s'", DRUID_SAMPLE_SEED);
+      goto csvtab_connect_error;
+    }
+  }
+  b = 0;
+  if( DRUID_FOLLOW && (b = druid_boolean(DRUID_FOLLOW))<0 ){
+    druid_errmsg(&sRdr, "unrecognized follow value: '%s'", DRUID_FOLLOW);
+    goto csvtab_connect_error;
+  }
+  if( DRUID_SHM && (bShm = druid_boolean(DRUID_SHM))<0 ){
+    druid_errmsg(&sRdr, "unrecognized shm value: '%s'", DRUID_SHM);
+    goto csvtab_connect_error;
+  }
+  if( b && bShm ){
+    druid_errmsg(&sRdr, "follow and shm cannot be combined");
+    goto csvtab_connect_error;
+  }
+  if( DRUID_MATERIALIZE && (bMaterialize = druid_boolean(DRUID_MATERIALIZE))<0 ){
+    druid_errmsg(&sRdr, "unrecognized materialize value: '%s'", DRUID_MATERIALIZE);
+    goto csvtab_connect_error;
+  }
+  if( b && bMaterialize ){
+    druid_errmsg(&sRdr, "follow and materialize cannot be combined");
+    goto csvtab_connect_error;
+  }
+  if( DRUID_VALIDATE_UTF8 && (bValidateUtf8 = druid_boolean(DRUID_VALIDATE_UTF8))<0 ){
+    druid_errmsg(&sRdr, "unrecognized validate_utf8 value: '%s'", DRUID_VALIDATE_UTF8);
+    goto csvtab_connect_error;
+  }
+  if( DRUID_TRUSTED && (bTrusted = druid_boolean(DRUID_TRUSTED))<0 ){
+    druid_errmsg(&sRdr, "unrecognized trusted value: '%s'", DRUID_TRUSTED);
+    goto csvtab_connect_error;
+  }
+  if( b && bTrusted ){
+    druid_errmsg(&sRdr, "follow and trusted cannot be combined");
+    goto csvtab_connect_error;
+  }
+  if( DRUID_INDEX && !bMaterialize ){
+    druid_errmsg(&sRdr, "index requires materialize=1");
+    goto csvtab_connect_error;
+  }
+  if( DRUID_FOLLOW_TIMEOUT && atoi(DRUID_FOLLOW_TIMEOUT)<0 ){
+    druid_errmsg(&sRdr, "follow_timeout must not be negative");
+    goto csvtab_connect_error;
+  }
+  if(DRUID_METRICS != 0){
+    druid_metric_names = druid_split_names(DRUID_METRICS, &num_druid_metrics);
+  }
+  if(DRUID_SKETCHES != 0){
+    druid_sketch_names = druid_split_names(DRUID_SKETCHES, &num_druid_sketches);
+  }
+
+  if(druid_reader_open(&sRdr, DRUID_FILENAME)){
+    goto csvtab_connect_error;
+  }
+  pNew = sqlite3_malloc( sizeof(*pNew) );
+  *ppVtab = (sqlite3_vtab*)pNew;
+  if( pNew==0 ) goto csvtab_connect_oom;
+  memset(pNew, 0, sizeof(*pNew));
+  pNew->db = db;
+  pNew->pFile = druid_file_acquire(DRUID_FILENAME);
+  if( pNew->pFile==0 ) goto csvtab_connect_oom;
+  pNew->iGeneration = druid_file_generation(pNew->pFile);
+
+  sqlite3_str *pStr = sqlite3_str_new(0);
+  char *zSep = "";
+  int iCol = 0;
+  sqlite3_str_appendf(pStr, "CREATE TABLE x(");
+  // count columns
+  nCol = 0;
+  do{
+    read_field_ret = druid_read_one_field(&sRdr);
+    nCol++;
+  }while( GOT_FIELD == read_field_ret);
+  if( sRdr.bIoErr ){
+    sqlite3_free(sqlite3_str_finish(pStr));
+    druid_errmsg(&sRdr, "error reading %s", DRUID_FILENAME);
+    goto csvtab_connect_error;
+  }
+  rewindCur(&sRdr);
+
+  pNew->colNames = sqlite3_malloc(sizeof(char*) * nCol);
+  memset(pNew->colNames, 0, sizeof(char*) * nCol);
+  pNew->metricsCols = sqlite3_malloc(sizeof(bool) * nCol);
+  memset(pNew->metricsCols, 0, sizeof(bool) * nCol);
+  pNew->sketchCols = sqlite3_malloc(sizeof(bool) * nCol);
+  memset(pNew->sketchCols, 0, sizeof(bool) * nCol);
+  pNew->iTimestampCol = -1;
+
+  // read header
+  do{
+    read_field_ret = druid_read_one_field(&sRdr);
+    if( nCol>0 && iCol<nCol ){
+      bool is_metric = 0;
+      for(i=0;i<num_druid_metrics;i++){
+        if(0 == strcmp(druid_metric_names[i], sRdr.label)){
+          is_metric = 1;
+          break;
+        }
+      }
+      bool is_sketch = 0;
+      for(i=0;i<num_druid_sketches;i++){
+        if(0 == strcmp(druid_sketch_names[i], sRdr.label)){
+          is_sketch = 1;
+          break;
+        }
+      }
+      if(is_metric){
+          sqlite3_str_appendf(pStr,"%s\"%w\" REAL", zSep, sRdr.label);
+          pNew->metricsCols[iCol] = 1;
+      }else if(is_sketch){
+          sqlite3_str_appendf(pStr,"%s\"%w\" BLOB", zSep, sRdr.label);
+          pNew->sketchCols[iCol] = 1;
+      }else{
+          sqlite3_str_appendf(pStr,"%s\"%w\" TEXT", zSep, sRdr.label);
+      }
+      zSep = ",";
+      pNew->colNames[iCol] = sqlite3_malloc(sizeof(char) * (strlen(sRdr.label) + 1));
+      strcpy(pNew->colNames[iCol], sRdr.label);
+      if( 0==strcmp(sRdr.label, "timestamp") ) pNew->iTimestampCol = iCol;
+      iCol++;
+    }
+  }while( GOT_FIELD == read_field_ret );
+    rewindCur(&sRdr);
+  pNew->nCol = nCol;
+  sqlite3_str_appendf(pStr, "%s_granularity HIDDEN,_count HIDDEN,_sample HIDDEN)", zSep);
+  if( DRUID_ROLLUPS && druid_parse_rollups(&sRdr, pNew, DRUID_ROLLUPS) ){
+    sqlite3_free(sqlite3_str_finish(pStr));
+    goto csvtab_connect_error;
+  }
+  if( DRUID_INDEX && druid_parse_indexes(&sRdr, pNew, DRUID_INDEX) ){
+    sqlite3_free(sqlite3_str_finish(pStr));
+    goto csvtab_connect_error;
+  }
+  schema = sqlite3_str_finish(pStr);
+
+  if( schema==0 ) goto csvtab_connect_oom;
+
+  pNew->zFilename = DRUID_FILENAME;  DRUID_FILENAME = 0;
+  if( DRUID_SAMPLE_SEED ){
+    pNew->iSampleSeed = (sqlite3_uint64)strtoll(DRUID_SAMPLE_SEED, 0, 0);
+  }
+  pNew->bFollow = b!=0;
+  pNew->bShm = bShm!=0;
+  pNew->bMaterialize = bMaterialize!=0;
+  pNew->bValidateUtf8 = bValidateUtf8!=0;
+  pNew->bTrusted = bTrusted!=0;
+  pNew->msFollowTimeout = DRUID_FOLLOW_TIMEOUT ? atoi(DRUID_FOLLOW_TIMEOUT) : 1000;
+  pNew->zName = sqlite3_mprintf("%s", argv[2]);
+  pNew->zSchema = sqlite3_mprintf("%s", argv[1]);
+  if( pNew->zName==0 || pNew->zSchema==0 ) goto csvtab_connect_oom;
+#ifdef SQLITE_TEST
+  pNew->tstFlags = tstFlags;
+#endif
+  // set iStart after header
+  pNew->iStart = (int)(ftell(sRdr.in) - sRdr.nIn + sRdr.iIn);
+  druid_reader_reset(&sRdr);
+  rc = sqlite3_declare_vtab(db, schema);
+  if( rc ){
+    druid_errmsg(&sRdr, "bad schema: '%s' - %s", schema, sqlite3_errmsg(db));
+    goto csvtab_connect_error;
+  }
+  for(i=0; i<sizeof(azPValue)/sizeof(azPValue[0]); i++){
+    sqlite3_free(azPValue[i]);
+  }
+  /* Rationale for DIRECTONLY:
+  ** An attacker who controls a database schema could use this vtab
+  ** to exfiltrate sensitive data from other files in the filesystem.
+  ** And, recommended practice is to put all CSV virtual tables in the
+  ** TEMP namespace, so they should still be usable from within TEMP
+  ** views, so there shouldn't be a serious loss of functionality by
+  ** prohibiting the use of this vtab from persistent triggers and views.
+  */
+  sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+  pNew->pModule = (DruidModule*)pAux;
+  if( pNew->pModule ){
+    pNew->pNextTable = pNew->pModule->pTables;
+    pNew->pModule->pTables = pNew;
+  }
+  free_druid_metrics_names(num_druid_metrics, druid_metric_names);
+  free_druid_metrics_names(num_druid_sketches, druid_sketch_names);
+  return SQLITE_OK;
+
+csvtab_connect_oom:
+  rc = SQLITE_NOMEM;
+  druid_errmsg(&sRdr, "out of memory");
+
+csvtab_connect_error:
+
+  free_druid_metrics_names(num_druid_metrics, druid_metric_names);
+  free_druid_metrics_names(num_druid_sketches, druid_sketch_names);
+
+  if( pNew ) druidtabDisconnect(&pNew->base);
+  for(i=0; i<sizeof(azPValue)/sizeof(azPValue[0]); i++){
+    sqlite3_free(azPValue[i]);
+  }
+  if( sRdr.zErr[0] ){
+    sqlite3_free(*pzErr);
+    *pzErr = sqlite3_mprintf("%s", sRdr.zErr);
+  }
+  druid_reader_reset(&sRdr);
+  if( rc==SQLITE_OK ) rc = SQLITE_ERROR;
+  return rc;
+}
+
+static void free_druid_metrics_names(int num_druid_metrics, char **druid_metric_names) {
+  if(num_druid_metrics){
+    for(int i=0;i<num_druid_metrics;i++){
+      sqlite3_free(druid_metric_names[i]);
+    }
+    sqlite3_free(druid_metric_names);
+  }
+}
+
+/*
+** The xConnect and xCreate methods do the same thing, but they must be
+** different so that the virtual table is not an eponymous virtual table.
+** xCreate also creates the shadow tables of a materialized table.
+*/
+static int druidtabCreate(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  int rc = druidtabConnect(db, pAux, argc, argv, ppVtab, pzErr);
+  if( rc==SQLITE_OK && ((DruidTable*)*ppVtab)->bMaterialize ){
+    rc = druid_materialize_create((DruidTable*)*ppVtab, pzErr);
+    if( rc!=SQLITE_OK ){
+      druidtabDisconnect(*ppVtab);
+      *ppVtab = 0;
+    }
+  }
+  return rc;
+}
+
+/*
+** Destructor of a table dropped by DROP TABLE, which drops its shadow
+** tables too.
+*/
+static int druidtabDestroy(sqlite3_vtab *pVtab){
+  DruidTable *pTab = (DruidTable*)pVtab;
+  int rc = SQLITE_OK;
+  if( pTab->bMaterialize ){
+    char *zSql;
+    sqlite3_finalize(pTab->pIdentity);
+    pTab->pIdentity = 0;
+    while( pTab->nFreeCursor>0 ){
+      druid_cursor_free(pTab->apFreeCursor[--pTab->nFreeCursor]);
+    }
+    zSql = sqlite3_mprintf(
+        "DROP TABLE IF EXISTS \"%w\".\"%w_config\";"
+        "DROP TABLE IF EXISTS \"%w\".\"%w_data\";",
+        pTab->zSchema, pTab->zName, pTab->zSchema, pTab->zName);
+    if( zSql==0 ) return SQLITE_NOMEM;
+    rc = sqlite3_exec(pTab->db, zSql, 0, 0, 0);
+    sqlite3_free(zSql);
+    if( rc!=SQLITE_OK ) return rc;
+  }
+  return druidtabDisconnect(pVtab);
+}
+
+/* The shadow tables of a materialized table are named after it */
+static int druidtabRename(sqlite3_vtab *pVtab, const char *zNew){
+  DruidTable *pTab = (DruidTable*)pVtab;
+  (void)zNew;
+  if( !pTab->bMaterialize ) return SQLITE_OK;
+  sqlite3_free(pTab->base.zErrMsg);
+  pTab->base.zErrMsg = sqlite3_mprintf("cannot rename the materialized table %s", pTab->zName);
+  return SQLITE_ERROR;
+}
+
+#if SQLITE_VERSION_NUMBER>=3026000
+/* The shadow tables of a materialized table */
+static int druidtabShadowName(const char *zSuffix){
+  return sqlite3_stricmp(zSuffix, "data")==0 || sqlite3_stricmp(zSuffix, "config")==0;
+}
+#endif
+
+/* Free the pushed down equality constraints of a cursor */
+static void druid_cursor_clear_eq(DruidCursor *pCur){
+  int i;
+  for(i=0; i<pCur->nEq; i++) sqlite3_free(pCur->azEq[i]);
+  sqlite3_free(pCur->aiEqCol);
+  sqlite3_free(pCur->azEq);
+  pCur->nEq = 0;
+  pCur->aiEqCol = 0;
+  pCur->azEq = 0;
+  sqlite3_free(pCur->aRange);
+  pCur->nRange = 0;
+  pCur->aRange = 0;
+}
+
+/* Free a DruidCursor that is not open */
+static void druid_cursor_free(DruidCursor *pCur){
+  sqlite3_finalize(pCur->pSelect);
+  sqlite3_free(pCur->zSelect);
+  druid_batch_free(pCur->pBatch);
+  sqlite3_free(pCur->json.aMember);
+  druid_reader_reset(&pCur->rdr);
+  sqlite3_free(pCur);
+}
+
+/*
+** Destructor for a DruidCursor.  Up to DRUID_CURSOR_CACHE closed cursors
+** are kept by the table, with their file, input buffers and row batch,
+** for the next xOpen: correlated subqueries and prepared statements run
+** again and again open and close cursors thousands of times.
+*/
+static int druidtabClose(sqlite3_vtab_cursor *cur){
+  DruidCursor *pCur = (DruidCursor*)cur;
+  DruidTable *pTab = (DruidTable*)cur->pVtab;
+  DruidCursor **pp;
+  for(pp=&pTab->pCursors; *pp; pp=&(*pp)->pNextCursor){
+    if( *pp==pCur ){
+      *pp = pCur->pNextCursor;
+      break;
+    }
+  }
+  if( pCur->pRollup ) pTab->nRollupScan--;
+  pCur->pRollup = 0;
+  pCur->pGroup = 0;
+  druid_shm_unref(pCur->pShm);
+  pCur->pShm = 0;
+  druid_cursor_stream_end(pCur);
+  druid_cursor_clear_eq(pCur);
+  druid_stats_free(pCur->pStats);
+  pCur->pStats = 0;
+  druid_readahead_cancel(&pCur->rdr);
+  if( pCur->pSelect ) sqlite3_reset(pCur->pSelect);
+  if( pTab->nFreeCursor<DRUID_CURSOR_CACHE && pCur->rdr.in ){
+    pTab->apFreeCursor[pTab->nFreeCursor++] = pCur;
+  }else{
+    druid_cursor_free(pCur);
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Constructor for a new DruidTable cursor object.
+*/
+static int druidtabOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor){
+  DruidTable *pTab = (DruidTable*)p;
+  DruidCursor *pCur;
+  while( pTab->nFreeCursor>0 ){
+    pCur = pTab->apFreeCursor[--pTab->nFreeCursor];
+    if( pCur->iGeneration!=druid_file_generation(pTab->pFile) ){
+      /* Its file was replaced */
+      druid_cursor_free(pCur);
+      continue;
+    }
+    /* The builds scan without xFilter, start them as a new cursor would */
+    pCur->iRowid = 0;
+    pCur->eScan = 0;
+    pCur->zKind = 0;
+    pCur->mProject = ~(sqlite3_uint64)0;
+    pCur->nTick = DRUID_INTERRUPT_ROWS;
+    pCur->bSample = false;
+    pCur->rSample = 1.0;
+    pCur->bFollow = false;
+    pCur->bSkipRows = false;
+    pCur->bCountRows = false;
+    pCur->nRowCount = -1;
+    pCur->iBatchRow = -1;
+    pCur->pNextCursor = pTab->pCursors;
+    pTab->pCursors = pCur;
+    *ppCursor = &pCur->base;
+    return SQLITE_OK;
+  }
+  pCur = sqlite3_malloc64(sizeof(*pCur));
+  if( pCur==0 ) return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  pCur->iBatchRow = -1;
+  pCur->rSample = 1.0;
+  pCur->nRowCount = -1;
+  pCur->iGeneration = pTab->iGeneration;
+  pCur->nTick = DRUID_INTERRUPT_ROWS;
+  pCur->mProject = ~(sqlite3_uint64)0;
+  if(druid_reader_open(&pCur->rdr, pTab->zFilename) ){
+    druid_xfer_error(pTab, &pCur->rdr);
+    sqlite3_free(pCur);
+    return SQLITE_ERROR;
+  }
+  druid_reader_readahead(&pCur->rdr);
+  pCur->rdr.bValidateUtf8 = pTab->bValidateUtf8;
+  pCur->base.pVtab = p;
+  pCur->pNextCursor = pTab->pCursors;
+  pTab->pCursors = pCur;
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+
+/*
+** Return true if every column in colUsed can be answered by a rollup:
+** the timestamp, the dimensions of the rollup, metrics and the hidden
+** columns.
+*/
+static bool druid_rollup_covers(
+  DruidTable *pTab,
+  DruidRollup *pRollup,
+  sqlite3_uint64 colUsed
+){
+  int i, j;
+  for(i=0; i<pTab->nCol; i++){
+    if( i>=63 ) return (colUsed & ((sqlite3_uint64)1)<<63)==0;
+    if( (colUsed & (((sqlite3_uint64)1)<<i))==0 ) continue;
+    if( i==pTab->iTimestampCol || pTab->metricsCols[i] ) continue;
+    for(j=0; j<pRollup->nDim && pRollup->aiDim[j]!=i; j++){}
+    if( j>=pRollup->nDim ) return false;
+  }
+  return true;
+}
+
+/* Return a column of the current group of a rollup scan */
+static int druid_rollup_column(
+  DruidTable *pTab,
+  DruidCursor *pCur,
+  sqlite3_context *ctx,
+  int i
+){
+  DruidRollup *pRollup = pCur->pRollup;
+  DruidRollupGroup *pGroup = pCur->pGroup;
+  int j;
+  if( i==pTab->nCol + DRUID_HIDDEN_GRANULARITY ){
+    sqlite3_result_text(ctx, pRollup->zPeriod, -1, SQLITE_STATIC);
+  }else if( i==pTab->nCol + DRUID_HIDDEN_COUNT ){
+    sqlite3_result_int64(ctx, pGroup->nRow);
+  }else if( i==pTab->iTimestampCol ){
+    if( pGroup->azKey[0] ) sqlite3_result_text(ctx, pGroup->azKey[0], -1, SQLITE_TRANSIENT);
+  }else if( i>=0 && i<pTab->nCol && pTab->metricsCols[i] ){
+    if( pGroup->aHasSum[i] ) sqlite3_result_double(ctx, pGroup->aSum[i]);
+  }else{
+    for(j=0; j<pRollup->nDim; j++){
+      if( pRollup->aiDim[j]==i ){
+        if( pGroup->azKey[j+1] ){
+          sqlite3_result_text(ctx, pGroup->azKey[j+1], -1, SQLITE_TRANSIENT);
+        }
+        break;
+      }
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** A following cursor that reached the end of the file before the closing
+** ']' of the result waits for the writer to append more data, then reads
+** the truncated result again from iRowStart.  Return false if the file did
+** not grow before the timeout, in which case the scan ends with the rows
+** available so far.
+*/
+static bool druid_cursor_follow(DruidCursor *pCur, sqlite3_int64 iRowStart){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  sqlite3_int64 nRead = (sqlite3_int64)ftell(pCur->rdr.in);
+  int msLeft = pTab->msFollowTimeout;
+  while( true ){
+    int ms = msLeft<DRUID_INTERRUPT_MS ? msLeft : DRUID_INTERRUPT_MS;
+    if( druid_reader_wait(&pCur->rdr, pTab->zFilename, nRead, ms) ) break;
+    msLeft -= ms;
+    if( msLeft<=0 || druid_interrupted(pTab) ) return false;
+  }
+  druid_reader_seek(&pCur->rdr, iRowStart);
+  return true;
+}
+
+/* True if a result could not be read because the file ends before it does */
+static bool druid_cursor_truncated(DruidCursor *pCur, int druid_field_ret, int nField){
+  if( !pCur->bFollow ) return false;
+  if( druid_field_ret==GOT_FAILURE ) return pCur->rdr.bEof;
+  return druid_field_ret==EOF && (nField>0 || !pCur->rdr.bClosed);
+}
+
+/*
+** Read the next row of a file of a trusted=1 table into row pBatch->nRow
+** of a batch.
+** The file is assumed to be well-formed Druid output whose fields come in
+** the order of the columns: the labels are skipped without being decoded
+** or compared, and only the separators that tell where the values and the
+** row end are looked at.  The values of the columns that are not in
+** pCur->mProject are skipped.  The only check is that the file does not
+** end before the closing ']' of the result.
+*/
+static int druid_cursor_read_trusted_row(DruidCursor *pCur, DruidBatch *pBatch){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  DruidReader *p = &pCur->rdr;
+  int iRow = pBatch->nRow;
+  int i = 0;
+  int c = druid_getc(p, true, false, true);
+  if( c==EOF || c==']' ){
+    if( c==']' ) p->bClosed = true;
+    pCur->iRowid = -1;
+    if( p->bClosed ) return SQLITE_OK;
+    druid_errmsg(p, "result %d(offset %d): unexpected end of input", p->nResult, p->file_off);
+    druid_xfer_error(pTab, p);
+    return SQLITE_ERROR;
+  }
+  while( true ){
+    /* c is the opening quote of a label */
+    if( !druid_skip_string(p) ) break;
+    druid_getc(p, true, true, false);         /* The ':' */
+    c = druid_getc(p, false, true, false);
+    if( c=='{' ){
+      /* The fields of "event" follow */
+      druid_advance_c(p);
+      p->inside_event = true;
+    }else{
+      if( i<pTab->nCol && (pCur->mProject & DRUID_COLUMN_BIT(i))!=0 ){
+        p->value_n = 0;
+        druid_advance_c(p);
+        if( c=='"' ){
+          if( !read_string(p, true) ) break;
+          p->value_type = JSON_STRING;
+        }else if( c=='n' || c=='t' || c=='f' ){
+          p->value_type = c=='n' ? JSON_NULL : c=='t' ? JSON_TRUE : JSON_FALSE;
+          druid_append_n(p, c=='n' ? "null" : c=='t' ? "true" : "false", c=='f' ? 5 : 4, true);
+          druid_skip_scalar(p);
+        }else{
+          consume_number(p, c);
+          p->value_type = JSON_NUMBER;
+        }
+        if( druid_batch_set(pBatch, iRow, i, p->value, p->value_n, p->value_type) ){
+          pCur->iRowid = -1;
+          return SQLITE_NOMEM;
+        }
+        druid_batch_set_number(pBatch, iRow, i, p);
+      }else if( i<pTab->nCol ){
+        if( c=='"' ){
+          druid_advance_c(p);
+          if( !druid_skip_string(p) ) break;
+        }else{
+          druid_skip_scalar(p);
+        }
+      }
+      i++;
+      c = druid_getc(p, true, true, false);   /* The ',' or '}' */
+      if( c=='}' && p->inside_event ){
+        p->inside_event = false;
+        c = druid_getc(p, true, true, false);
+      }
+      if( c!=',' ) break;
+    }
+    c = druid_getc(p, true, true, false);
+  }
+  if( c!='}' ){
+    pCur->iRowid = -1;
+    druid_errmsg(p, "result %d(offset %d): unexpected end of input", p->nResult, p->file_off);
+    druid_xfer_error(pTab, p);
+    return SQLITE_ERROR;
+  }
+  for(; i<pTab->nCol; i++){
+    druid_batch_set(pBatch, iRow, i, 0, 0, JSON_NULL);
+  }
+  p->nResult++;
+  if( ']'==druid_getc(p, false, true, false) ){
+    druid_advance_c(p);
+    p->bClosed = true;
+  }
+  pCur->iRowid++;
+  return SQLITE_OK;
+}
+
+/*
+** Read the next row of the result file into row pBatch->nRow of a batch.
+** Set the EOF marker if we reach the end of input.
+*/
+static int druid_cursor_read_row(DruidCursor *pCur, DruidBatch *pBatch){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  int iRow = pBatch->nRow;
+  int i;
+  int druid_field_ret;
+  sqlite3_int64 iRowStart;
+  if( pTab->bTrusted ) return druid_cursor_read_trusted_row(pCur, pBatch);
+  iRowStart = pCur->bFollow ? druid_reader_tell(&pCur->rdr) : 0;
+read_row:
+  i = 0;
+  do{
+    druid_field_ret = druid_read_one_field(&pCur->rdr);
+    if( druid_field_ret < 0){
+      break;
+    }
+    if( i<pTab->nCol ){
+      if(0 != strcmp(pCur->rdr.label, pTab->colNames[i])){
+        druid_errmsg(&pCur->rdr, "result %d(offset %d): druid json order change is not supported",
+                     pCur->rdr.nResult, pCur->rdr.file_off);
+        sqlite3_free(pTab->base.zErrMsg);
+        pTab->base.zErrMsg = sqlite3_mprintf("%s", pCur->rdr.zErr);
+        return SQLITE_ERROR;
+      }
+      /* value_n counts the terminator appended by read_value() */
+      if( druid_batch_set(pBatch, iRow, i, pCur->rdr.value, pCur->rdr.value_n - 1,
+                          pCur->rdr.value_type) ){
+        pCur->iRowid = -1;
+        return SQLITE_NOMEM;
+      }
+      druid_batch_set_number(pBatch, iRow, i, &pCur->rdr);
+      i++;
+    }
+  }while( GOT_FIELD == druid_field_ret);
+  if( druid_cursor_truncated(pCur, druid_field_ret, i) ){
+    if( druid_cursor_follow(pCur, iRowStart) ) goto read_row;
+    pCur->iRowid = -1;
+    return druid_cursor_interrupt(pCur);
+  }
+  if( GOT_FAILURE == druid_field_ret || (druid_field_ret == EOF && i<pTab->nCol) ){
+    pCur->iRowid = -1;
+  }else{
+    pCur->iRowid++;
+    while( i<pTab->nCol ){
+      druid_batch_set(pBatch, iRow, i, 0, 0, JSON_NULL);
+      i++;
+    }
+  }
+  if (GOT_FAILURE == druid_field_ret) {
+    sqlite3_free(pTab->base.zErrMsg);
+    pTab->base.zErrMsg = sqlite3_mprintf("%s", pCur->rdr.zErr);
+    return SQLITE_ERROR;
+  }
+  else
+    return SQLITE_OK;
+}
+
+/* Return the text of column i of the current group of a rollup scan, or
+** NULL */
+static const char *druid_group_text(DruidTable *pTab, DruidCursor *pCur, int i){
+  int j;
+  if( i==pTab->iTimestampCol ) return pCur->pGroup->azKey[0];
+  for(j=0; j<pCur->pRollup->nDim; j++){
+    if( pCur->pRollup->aiDim[j]==i ) return pCur->pGroup->azKey[j+1];
+  }
+  return 0;
+}
+
+/* Name of a comparison of a metric in idxStr, or NULL if it is not pushed down */
+static const char *druid_range_op_name(int op){
+  switch( op ){
+    case SQLITE_INDEX_CONSTRAINT_EQ: return "=";
+    case SQLITE_INDEX_CONSTRAINT_GT: return ">";
+    case SQLITE_INDEX_CONSTRAINT_GE: return ">=";
+    case SQLITE_INDEX_CONSTRAINT_LT: return "<";
+    case SQLITE_INDEX_CONSTRAINT_LE: return "<=";
+  }
+  return 0;
+}
+
+/* The comparison named z by druid_range_op_name(), or 0 */
+static int druid_range_op(const char *z){
+  switch( z[0] ){
+    case '=': return SQLITE_INDEX_CONSTRAINT_EQ;
+    case '>': return z[1]=='=' ? SQLITE_INDEX_CONSTRAINT_GE : SQLITE_INDEX_CONSTRAINT_GT;
+    case '<': return z[1]=='=' ? SQLITE_INDEX_CONSTRAINT_LE : SQLITE_INDEX_CONSTRAINT_LT;
+  }
+  return 0;
+}
+
+/* Return true if r satisfies the comparison eOp with rRhs */
+static bool druid_range_matches(int eOp, double r, double rRhs){
+  switch( eOp ){
+    case SQLITE_INDEX_CONSTRAINT_EQ: return r==rRhs;
+    case SQLITE_INDEX_CONSTRAINT_GT: return r>rRhs;
+    case SQLITE_INDEX_CONSTRAINT_GE: return r>=rRhs;
+    case SQLITE_INDEX_CONSTRAINT_LT: return r<rRhs;
+  }
+  return r<=rRhs;
+}
+
+/* Return true if the current group of a rollup scan satisfies the pushed
+** down constraints, all of them on its keys */
+static bool druid_group_matches(DruidTable *pTab, DruidCursor *pCur){
+  int i;
+  for(i=0; i<pCur->nEq; i++){
+    const char *z = druid_group_text(pTab, pCur, pCur->aiEqCol[i]);
+    if( z==0 || strcmp(z, pCur->azEq[i])!=0 ) return false;
+  }
+  return true;
+}
+
+/*
+** Filter kernels.  The pushed down constraints of a scan of the rows are
+** checked a batch column at a time: each kernel clears the bits of the
+** rows that fail its constraint in a selection vector, a bit per row of
+** the batch.  A comparison of a metric resolves the numbers of the column
+** with druid_batch_numbers() and compares them in a loop per operator,
+** without branches.  A metric that is not a number satisfies the
+** comparisons, so that xColumn reports it.
+*/
+
+/* Clear the bits of aSel of the first nRow rows whose value of pCol is
+** not the n bytes at z */
+static void druid_kernel_eq(
+  const DruidBatchCol *pCol,
+  int nRow,
+  const char *z,
+  int n,
+  sqlite3_uint64 *aSel
+){
+  int iRow;
+  for(iRow=0; iRow<nRow; iRow++){
+    sqlite3_uint64 m = ((sqlite3_uint64)1)<<(iRow&63);
+    if( (aSel[iRow>>6] & m)==0 ) continue;
+    if( (pCol->aNull[iRow>>6] & m)!=0 || pCol->anVal[iRow]!=n
+     || memcmp(pCol->azVal[iRow], z, n)!=0 ){
+      aSel[iRow>>6] &= ~m;
+    }
+  }
+}
+
+/* Clear the bits of aSel of the first nRow rows whose value of metric
+** pCol fails the comparison eOp with rRhs */
+static void druid_kernel_range(
+  DruidBatchCol *pCol,
+  int nRow,
+  int eOp,
+  double rRhs,
+  sqlite3_uint64 *aSel
+){
+  double a[DRUID_BATCH_ROWS];
+  sqlite3_uint64 aNum[DRUID_BATCH_ROWS/64];   /* Rows that are numbers */
+  sqlite3_uint64 aPass[DRUID_BATCH_ROWS/64];  /* Rows that pass */
+  int iRow, k;
+  druid_batch_numbers(pCol, nRow, a, aNum);
+  memset(aPass, 0, sizeof(aPass));
+  switch( eOp ){
+    case SQLITE_INDEX_CONSTRAINT_EQ:
+      for(iRow=0; iRow<nRow; iRow++){
+        aPass[iRow>>6] |= (sqlite3_uint64)(a[iRow]==rRhs)<<(iRow&63);
+      }
+      break;
+    case SQLITE_INDEX_CONSTRAINT_GT:
+      for(iRow=0; iRow<nRow; iRow++){
+        aPass[iRow>>6] |= (sqlite3_uint64)(a[iRow]>rRhs)<<(iRow&63);
+      }
+      break;
+    case SQLITE_INDEX_CONSTRAINT_GE:
+      for(iRow=0; iRow<nRow; iRow++){
+        aPass[iRow>>6] |= (sqlite3_uint64)(a[iRow]>=rRhs)<<(iRow&63);
+      }
+      break;
+    case SQLITE_INDEX_CONSTRAINT_LT:
+      for(iRow=0; iRow<nRow; iRow++){
+        aPass[iRow>>6] |= (sqlite3_uint64)(a[iRow]<rRhs)<<(iRow&63);
+      }
+      break;
+    default:
+      for(iRow=0; iRow<nRow; iRow++){
+        aPass[iRow>>6] |= (sqlite3_uint64)(a[iRow]<=rRhs)<<(iRow&63);
+      }
+      break;
+  }
+  for(k=0; k<(nRow+63)/64; k++){
+    /* Null and missing values fail, other values that are not numbers pass */
+    aSel[k] &= (aNum[k] & aPass[k]) | (~aNum[k] & ~pCol->aNull[k]);
+  }
+}
+
+/* Set pCur->aSel to the rows of its batch that satisfy the pushed down
+** constraints */
+static void druid_batch_select(DruidCursor *pCur){
+  DruidBatch *pBatch = pCur->pBatch;
+  int nRow = pBatch->nRow;
+  int i;
+  memset(pCur->aSel, 0, sizeof(pCur->aSel));
+  for(i=0; i<nRow/64; i++) pCur->aSel[i] = ~(sqlite3_uint64)0;
+  if( nRow%64 ) pCur->aSel[nRow/64] = (((sqlite3_uint64)1)<<(nRow%64)) - 1;
+  for(i=0; i<pCur->nEq; i++){
+    druid_kernel_eq(&pBatch->aCol[pCur->aiEqCol[i]], nRow,
+                    pCur->azEq[i], (int)strlen(pCur->azEq[i]), pCur->aSel);
+  }
+  for(i=0; i<pCur->nRange; i++){
+    const DruidRange *pRange = &pCur->aRange[i];
+    druid_kernel_range(&pBatch->aCol[pRange->iCol], nRow, pRange->eOp, pRange->r, pCur->aSel);
+  }
+}
+
+/*
+** Sampling.  A _sample = R constraint keeps each row with probability R,
+** independently of the others.  Rather than drawing a random number for
+** every row, the cursor draws the length of the gap to the next kept row
+** from the matching geometric distribution and skips that many rows
+** without decoding them.  The random sequence only depends on the
+** sample_seed= parameter and R, so a query returns the same sample every
+** time it runs.
+*/
+static sqlite3_uint64 druid_splitmix64(sqlite3_uint64 *pState){
+  sqlite3_uint64 z = (*pState += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z>>30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z>>27)) * 0x94d049bb133111ebULL;
+  return z ^ (z>>31);
+}
+
+/* Return the number of rows to skip before the next sampled row */
+#define DRUID_SAMPLE_MAX_GAP (((sqlite3_int64)1)<<52)
+static sqlite3_int64 druid_sample_gap(DruidCursor *pCur){
+  double u, r;
+  if( pCur->rSample>=1.0 ) return 0;
+  /* Uniform in (0,1] */
+  u = ((double)(druid_splitmix64(&pCur->iSampleRng)>>11) + 1.0) / 9007199254740992.0;
+  r = floor(log(u) / log1p(-pCur->rSample));
+  return r<(double)DRUID_SAMPLE_MAX_GAP ? (sqlite3_int64)r : DRUID_SAMPLE_MAX_GAP;
+}
+
+/*
+** Parallel row count.  A skip scan that skipped the first
+** DRUIDJSON_COUNT_CHUNK_SZ bytes of a file, and so is no EXISTS or
+** LIMIT that stops early, counts the rows of the rest of the file on the
+** worker pool, and then needs not read it.  The rest is a chunk, which
+** druid_count_chunk() splits in halves: it submits the second half to the
+** pool, and splits the first again, until it is smaller than two
+** DRUIDJSON_COUNT_CHUNK_SZ.  Idle workers take the halves and split them
+** in turn, or steal them from the deque of the worker that split them.
+** Each chunk but the first resynchronizes on the first row that starts in
+** it, and counts the rows that start in it.  The first row a chunk sees
+** past its end must be the one the next chunk resynchronized on, or the
+** rows are skipped one after the other instead.
+*/
+typedef struct DruidCountChunk DruidCountChunk;
+struct DruidCountChunk {
+  const char *zFilename;          /* File counted */
+  sqlite3_int64 iStart;           /* First byte of the chunk */
+  sqlite3_int64 iEnd;             /* First byte after the chunk */
+  sqlite3_int64 iFirst;           /* Offset of the first row, or -1 */
+  sqlite3_int64 iNext;            /* Offset of the first row after iEnd, or -1 */
+  sqlite3_int64 nRow;             /* Rows that start in the chunk */
+  bool bResync;                   /* iStart is not known to start a row */
+  bool bOk;                       /* Counted to iEnd or to the end of the file */
+  bool bClosed;                   /* Saw the ']' that ends the results */
+  DruidTable *pTab;               /* Check interrupts of this table, or NULL */
+  int *pbStop;                    /* Set to stop counting */
+  DruidTask *pTask;               /* Task counting the chunk, or NULL */
+  DruidCountChunk *pNext;         /* Next half split off the same chunk */
+};
+
+/* Count the rows of a chunk that is not split any further */
+static void druid_count_range(DruidCountChunk *pChunk){
+  DruidReader rdr;
+  DruidReader *p = &rdr;
+  u8 *zWindow = 0;
+  int rc;
+  /* Interrupts are checked on the thread of the query only */
+  DruidTable *pTab = druid_pool_is_worker() ? 0 : pChunk->pTab;
+  druid_reader_init(p);
+  if( druid_reader_open(p, pChunk->zFilename) ) return;
+  if( pChunk->bResync ){
+    sqlite3_int64 iRow;
+    int eRes;
+    zWindow = sqlite3_malloc(DRUIDJSON_RESYNC_SZ);
+    if( zWindow==0 ) goto count_range_done;
+    eRes = druid_reader_resync(p, pChunk->iStart, zWindow, &iRow);
+    if( eRes==DRUID_RESYNC_UNKNOWN ) goto count_range_done;
+    if( eRes==DRUID_RESYNC_ROW ) pChunk->iFirst = iRow;
+  }else{
+    druid_reader_seek(p, pChunk->iStart);
+  }
+  while( true ){
+    sqlite3_int64 iRow;
+    int c = druid_skip_separators(p);
+    if( c==EOF || c==']' ){
+      if( c==']' ) pChunk->bClosed = true;
+      pChunk->bOk = true;
+      break;
+    }
+    iRow = druid_reader_tell(p);
+    if( iRow>=pChunk->iEnd ){
+      pChunk->iNext = iRow;
+      pChunk->bOk = true;
+      break;
+    }
+    rc = druid_skip_row(p);
+    if( rc!=GOT_LAST_FIELD ){
+      pChunk->bOk = rc==EOF;
+      break;
+    }
+    pChunk->nRow++;
+    if( (pChunk->nRow % DRUID_INTERRUPT_ROWS)==0 ){
+      if( pTab && druid_interrupted(pTab) ){
+        DRUID_ATOMIC_STORE(pChunk->pbStop, 1);
+      }
+      if( DRUID_ATOMIC_LOAD(pChunk->pbStop) ) break;
+    }
+  }
+  /* The rows are skipped one after the other, which reports the error */
+  if( p->bIoErr ) pChunk->bOk = false;
+
+count_range_done:
+  sqlite3_free(zWindow);
+  druid_reader_reset(p);
+}
+
+/* Count the rows of a chunk, splitting it for the pool.  On return the
+** fields of the chunk describe all of it.  Run on the worker pool */
+static void druid_count_chunk(void *pArg){
+  DruidCountChunk *pChunk = (DruidCountChunk*)pArg;
+  DruidCountChunk *pSplit = 0;    /* Halves split off, first in the file first */
+  pChunk->iFirst = -1;
+  pChunk->iNext = -1;
+  pChunk->nRow = 0;
+  pChunk->bOk = false;
+  pChunk->bClosed = false;
+  while( pChunk->iEnd - pChunk->iStart >= 2*(sqlite3_int64)DRUIDJSON_COUNT_CHUNK_SZ
+      && !DRUID_ATOMIC_LOAD(pChunk->pbStop)
+  ){
+    DruidCountChunk *pNew = sqlite3_malloc(sizeof(*pNew));
+    if( pNew==0 ) break;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->zFilename = pChunk->zFilename;
+    pNew->iStart = pChunk->iStart + (pChunk->iEnd - pChunk->iStart)/2;
+    pNew->iEnd = pChunk->iEnd;
+    pNew->bResync = true;
+    pNew->pTab = pChunk->pTab;
+    pNew->pbStop = pChunk->pbStop;
+    pNew->pTask = druid_pool_submit(druid_count_chunk, pNew);
+    if( pNew->pTask==0 ){
+      sqlite3_free(pNew);
+      break;
+    }
+    pChunk->iEnd = pNew->iStart;
+    pNew->pNext = pSplit;
+    pSplit = pNew;
+  }
+  druid_count_range(pChunk);
+  /* Wait for the halves, running those no worker took, and append them */
+  while( pSplit ){
+    DruidCountChunk *pNext = pSplit->pNext;
+    druid_task_wait(pSplit->pTask);
+    druid_task_release(pSplit->pTask);
+    if( pChunk->bOk && pSplit->bOk && pChunk->iNext==pSplit->iFirst ){
+      pChunk->iEnd = pSplit->iEnd;
+      pChunk->iNext = pSplit->iNext;
+      pChunk->nRow += pSplit->nRow;
+      pChunk->bClosed = pSplit->bClosed;
+    }else{
+      pChunk->bOk = false;
+    }
+    sqlite3_free(pSplit);
+    pSplit = pNext;
+  }
+}
+
+/* Count the rows of the file after the current one of a skip
+** scan on the worker pool, and set pCur->nRowCount to the rowid of the
+** last one.  Leave it at -1 if the rest of the file is too small to be
+** split, or if the chunks do not agree. */
+static int druid_cursor_count_rows(DruidCursor *pCur){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  DruidCountChunk chunk;
+  struct stat st;
+  sqlite3_int64 iStart = druid_reader_tell(&pCur->rdr);
+  int bStop = 0;
+  if( druid_pool_threads()==0 ) return SQLITE_OK;
+  if( stat(pTab->zFilename, &st) ) return SQLITE_OK;
+  if( st.st_size - iStart < 2*(sqlite3_int64)DRUIDJSON_COUNT_CHUNK_SZ ) return SQLITE_OK;
+  memset(&chunk, 0, sizeof(chunk));
+  chunk.zFilename = pTab->zFilename;
+  chunk.iStart = iStart;
+  chunk.iEnd = st.st_size;
+  chunk.pTab = pTab;
+  chunk.pbStop = &bStop;
+  druid_count_chunk(&chunk);
+  if( bStop ) return druid_cursor_interrupt(pCur);
+  if( chunk.bOk && (!pTab->bTrusted || chunk.bClosed) ){
+    pCur->nRowCount = pCur->iRowid + chunk.nRow;
+  }
+  return SQLITE_OK;
+}
+
+/* Skip nSkip rows of the result file, counting them in iRowid */
+static int druid_cursor_skip_rows(DruidCursor *pCur, sqlite3_int64 nSkip){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  if( pCur->nRowCount>=0 ){
+    /* Counted by druid_cursor_count_rows(), there is nothing to read */
+    pCur->iRowid += nSkip;
+    if( pCur->iRowid>pCur->nRowCount ) pCur->iRowid = -1;
+    return SQLITE_OK;
+  }
+  if( pCur->pShm ){
+    return druid_cursor_skip_shm_rows(pCur, nSkip);
+  }
+  for(; nSkip>0; nSkip--){
+    sqlite3_int64 iRowStart = pCur->bFollow ? druid_reader_tell(&pCur->rdr) : 0;
+    int rc = druid_cursor_tick(pCur);
+    if( rc!=SQLITE_OK ) return rc;
+    if( pCur->bCountRows && druid_reader_tell(&pCur->rdr)>=DRUIDJSON_COUNT_CHUNK_SZ ){
+      pCur->bCountRows = false;
+      rc = druid_cursor_count_rows(pCur);
+      if( rc!=SQLITE_OK ) return rc;
+      if( pCur->nRowCount>=0 ) return druid_cursor_skip_rows(pCur, nSkip);
+    }
+    rc = druid_skip_row(&pCur->rdr);
+    if( pCur->rdr.bIoErr ) return druid_cursor_ioerr(pCur);
+    if( druid_cursor_truncated(pCur, rc, 0) ){
+      if( druid_cursor_follow(pCur, iRowStart) ){
+        nSkip++;
+        continue;
+      }
+      pCur->iRowid = -1;
+      return druid_cursor_interrupt(pCur);
+    }
+    if( rc==EOF && pTab->bTrusted && !pCur->rdr.bClosed ){
+      /* The one check of trusted files, as in druid_cursor_read_trusted_row() */
+      druid_errmsg(&pCur->rdr, "result %d(offset %d): unexpected end of input",
+                   pCur->rdr.nResult, pCur->rdr.file_off);
+      rc = GOT_FAILURE;
+    }
+    if( rc==EOF ){
+      pCur->iRowid = -1;
+      break;
+    }
+    if( rc==GOT_FAILURE ){
+      pCur->iRowid = -1;
+      druid_xfer_error(pTab, &pCur->rdr);
+      return SQLITE_ERROR;
+    }
+    pCur->iRowid++;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Read the next rows of the scan of pCur into pBatch, at most nMax of
+** them.  The scan is over once pCur->iRowid is negative.  The rows read
+** before an error are left in the batch.  A scan of the stream stops at
+** the end of a block, as the rows of the batch point into it.
+*/
+static int druid_cursor_fill(DruidCursor *pCur, DruidBatch *pBatch, int nMax){
+  int rc = SQLITE_OK;
+  druid_batch_reset(pBatch);
+  while( pBatch->nRow<nMax && pCur->iRowid>=0 ){
+    rc = druid_cursor_tick(pCur);
+    if( rc!=SQLITE_OK ) break;
+    if( pCur->bSample ){
+      rc = druid_cursor_skip_rows(pCur, druid_sample_gap(pCur));
+      if( rc!=SQLITE_OK || pCur->iRowid<0 ) break;
+    }
+    if( pCur->bSkipRows ){
+      rc = druid_cursor_skip_rows(pCur, 1);
+    }else if( pCur->pShm ){
+      rc = druid_cursor_read_shm_row(pCur, pBatch);
+    }else if( pCur->pStream ){
+      if( pBatch->nRow>0 && druid_stream_block_end(pCur) ) break;
+      rc = druid_cursor_read_stream_row(pCur, pBatch);
+    }else{
+      rc = druid_cursor_read_row(pCur, pBatch);
+    }
+    if( pCur->rdr.bIoErr ) rc = druid_cursor_ioerr(pCur);
+    if( rc!=SQLITE_OK || pCur->iRowid<0 ) break;
+    pBatch->aiRowid[pBatch->nRow++] = pCur->iRowid;
+  }
+  druid_batch_finish(pBatch);
+  return rc;
+}
+
+/* Move the scan of the rows of pCur to the next row of its batch that
+** satisfies the pushed down constraints, reading the next batch once it
+** is done.  An error is returned after the rows read before it */
+static int druid_cursor_next_row(DruidCursor *pCur){
+  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
+  DruidBatch *pBatch = pCur->pBatch;
+  int iRow = pCur->iBatchRow;
+  int rc;
+  pCur->json.iCol = -1;
+  while( true ){
+    /* The next bit set in the selection vector */
+    for(iRow++; iRow<pBatch->nRow; iRow = (iRow|63) + 1){
+      sqlite3_uint64 m = pCur->aSel[iRow>>6] >> (iRow&63);
+      if( m ){
+        pCur->iBatchRow = iRow + DRUID_CTZ64(m);
+        return SQLITE_OK;
+      }
+    }
+    pCur->iBatchRow = -1;
+    if( pCur->rcBatch!=SQLITE_OK || pCur->iRowid<0 ){
+      rc = pCur->rcBatch;
+      pCur->rcBatch = SQLITE_OK;
+      return rc;
+    }
+    rc = druid_cursor_fill(pCur, pBatch, pCur->nBatchMax);
+    if( pCur->nBatchMax<DRUID_BATCH_ROWS && !pCur->bFollow ) pCur->nBatchMax *= 2;
+    if( pCur->pStats ){
+      druid_stats_add_batch(pTab, pCur->pStats, pBatch);
+      if( rc!=SQLITE_OK || pCur->iRowid<0 ){
+        /* The full scan completed, publish its statistics */
+        if( rc==SQLITE_OK && pTab->pStats==0 && pCur->iGeneration==pTab->iGeneration ){
+          pTab->pStats = pCur->pStats;
+        }else{
+          druid_stats_free(pCur->pStats);
+        }
+        pCur->pStats = 0;
+      }
+    }
+    pCur->rcBatch = rc;
+    druid_batch_select(pCur);
+    iRow = -1;
+  }
+}
+
+/*
+** Advance a DruidCursor to its next row of input that satisfies the
+** pushed down constraints.  Set the EOF marker if we reach the end of
+** input.
+*/
+static int druidtabNext(sqlite3_vtab_cursor *cur){
+  DruidCursor *pCur = (DruidCursor*)cur;
+  DruidTable *pTab = (DruidTable*)cur->pVtab;
+  int rc = SQLITE_OK;
+  if( pCur->eScan==DRUID_SCAN_ROWS ) return druid_cursor_next_row(pCur);
+  do{
+    rc = druid_cursor_tick(pCur);
+    if( rc!=SQLITE_OK ) break;
+    if( pCur->eScan==DRUID_SCAN_MATERIALIZED ){
+      rc = druid_cursor_step(pCur);
+      continue;
+    }
+    if( pCur->eScan==DRUID_SCAN_ROLLUP ){
+      sqlite3_int64 nSkip = pCur->bSample ? druid_sample_gap(pCur) : 0;
+      do{
+        pCur->pGroup = pCur->pGroup ? pCur->pGroup->pNext : pCur->pRollup->pFirst;
+        pCur->iRowid = pCur->pGroup ? pCur->iRowid+1 : -1;
+      }while( pCur->pGroup && nSkip-- > 0 );
+    }
+  }while( rc==SQLITE_OK && pCur->iRowid>=0
+       && pCur->eScan==DRUID_SCAN_ROLLUP && !druid_group_matches(pTab, pCur) );
+  return rc;
+}
+
+/*
+** Return values of columns for the row at which the DruidCursor
+** is currently pointing.
+*/
+static int druidtabColumn(
+    sqlite3_vtab_cursor *cur,   /* The cursor */
+    sqlite3_context *ctx,       /* First argument to sqlite3_result_...() */
+    int i                       /* Which column to return */
+) {
+  DruidCursor *pCur = (DruidCursor *) cur;
+  DruidTable *pTab = (DruidTable *) cur->pVtab;
+  if (i == pTab->nCol + DRUID_HIDDEN_SAMPLE) {
+    sqlite3_result_double(ctx, pCur->rSample);
+    return SQLITE_OK;
+  }
+  if (pCur->eScan == DRUID_SCAN_ROLLUP) {
+    return druid_rollup_column(pTab, pCur, ctx, i);
+  }
+  if (i == pTab->nCol + DRUID_HIDDEN_COUNT) {
+    sqlite3_result_int(ctx, 1);
+    return SQLITE_OK;
+  }
+  if (pCur->eScan == DRUID_SCAN_MATERIALIZED) {
+    if (i >= 0 && i < pTab->nCol) {
+      sqlite3_result_value(ctx, sqlite3_column_value(pCur->pSelect, i + 1));
+    }
+    return SQLITE_OK;
+  }
+  if (i >= 0 && i < pTab->nCol) {
+    DruidBatch *pBatch = pCur->pBatch;
+    DruidBatchCol *pCol = &pBatch->aCol[i];
+    int iRow = pCur->iBatchRow;
+    if ((pBatch->mCol & DRUID_COLUMN_BIT(i)) == 0 || pCol->azVal[iRow] == 0) {
+      return SQLITE_OK;
+    }
+    if (pTab->metricsCols[i]) {
+      switch (pCol->aType[iRow]) {
+        case JSON_NUMBER:
+          sqlite3_result_double(ctx, druid_batch_real(pCol, iRow));
+          break;
+        case JSON_NULL:
+          sqlite3_result_null(ctx);
+          break;
+        default:
+          druid_errmsg(&pCur->rdr,
+                       "unexpected JSON value inside a metric, got %s='%s', expected JSON_NUMBER / JSON_NULL",
+                       pTab->colNames[i],
+                       pCol->azVal[iRow]
+          );
+          sqlite3_free(pTab->base.zErrMsg);
+          pTab->base.zErrMsg = sqlite3_mprintf("%s", pCur->rdr.zErr);
+          return SQLITE_ERROR;
+      }
+    } else if (pTab->sketchCols[i] && pCol->aType[iRow] == JSON_STRING) {
+      int n = pCol->anVal[iRow];
+      u8 *zBlob = sqlite3_malloc(n/4*3 + 1);
+      if (zBlob == 0) return SQLITE_NOMEM;
+      n = druid_base64_decode(pCol->azVal[iRow], n, zBlob);
+      if (n < 0) {
+        sqlite3_free(zBlob);
+        druid_errmsg(&pCur->rdr, "result %d: %s is not a base64 encoded sketch",
+                     (int)pBatch->aiRowid[iRow], pTab->colNames[i]);
+        sqlite3_free(pTab->base.zErrMsg);
+        pTab->base.zErrMsg = sqlite3_mprintf("%s", pCur->rdr.zErr);
+        return SQLITE_ERROR;
+      }
+      sqlite3_result_blob(ctx, zBlob, n, sqlite3_free);
+    } else {
+      switch (pCol->aType[iRow]) {
+        case JSON_NULL:
+          sqlite3_result_null(ctx);
+          break;
+        default:
+          if (pCur->json.iCol != i
+           && (pCol->azVal[iRow][0] == '{' || pCol->azVal[iRow][0] == '[')) {
+            /* A JSON document, see druid_json_doc() */
+            pCur->json.iCol = i;
+            pCur->json.nMember = -1;
+          }
+          sqlite3_result_text(ctx, pCol->azVal[iRow], pCol->anVal[iRow], SQLITE_TRANSIENT);
+      }
+    }
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Return the rowid for the current row.
+*/
+static int druidtabRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid){
+  DruidCursor *pCur = (DruidCursor*)cur;
+  if( pCur->eScan==DRUID_SCAN_ROWS ){
+    *pRowid = pCur->pBatch->aiRowid[pCur->iBatchRow];
+  }else{
+    *pRowid = pCur->iRowid;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** Return TRUE if the cursor has been moved off of the last
+** row of output.
+*/
+static int druidtabEof(sqlite3_vtab_cursor *cur){
+  DruidCursor *pCur = (DruidCursor*)cur;
+  if( pCur->eScan==DRUID_SCAN_ROWS ) return pCur->iBatchRow<0;
+  return pCur->iRowid<0;
+}
+
+static void rewindCur(DruidReader *p){
+    clearerr(p->in);
+    fseek(p->in, 0, SEEK_SET);
+    p->iIn = 0;
+    p->nIn = 0;
+    p->file_off = 0;
+    p->nResult = 0;
+    p->inside_event = false;
+    p->bEof = false;
+    p->bClosed = false;
+    p->bIoErr = false;
+}
+
+/*
+** The plan of a scan of the rows or of a rollup is in idxStr, so that it
+** shows in EXPLAIN QUERY PLAN.  It is a list of items separated by ';':
+**
+**   rollups=P1D,P1W   the periods of the rollups that cover the query
+**   _granularity=?    the period of the rollup scanned
+**   _sample=?         the fraction of the rows visited
+**   eq(app)           a TEXT column or a metric equal to a value
+**   cost>=?           a metric compared with a number (>, >=, < or <=)
+**   offset=?          the OFFSET of the query, rows skipped first
+**   limit             the query has a LIMIT, the scan may end early
+**   skip              the query uses no column, rows are not decoded
+**   proj=0,3          the columns decoded by a trusted scan, or none
+**   cache=shm         the rows are read from the shm cache
 **
+** Each '?' is an argument of xFilter, in the order of the items.  A column
+** name that is not an identifier is quoted with "" as in SQL.  A scan of
+** a materialized table has the WHERE and ORDER BY clauses of its query on
+** <name>_data instead.
+*/
+
+/* Append the separator of the next item of plan p */
+static void druid_plan_item(sqlite3_str *p){
+  if( sqlite3_str_length(p) ) sqlite3_str_appendchar(p, 1, ';');
+}
+
+/* Append the name of column iCol to plan p */
+static void druid_plan_column(DruidTable *pTab, sqlite3_str *p, int iCol){
+  const char *zName = pTab->colNames[iCol];
+  int i;
+  for(i=0; zName[i]; i++){
+    char c = zName[i];
+    if( !(c=='_' || (c>='a' && c<='z') || (c>='A' && c<='Z')
+          || (i>0 && c>='0' && c<='9')) ){
+      break;
+    }
+  }
+  if( i>0 && zName[i]==0 ){
+    sqlite3_str_appendall(p, zName);
+  }else{
+    sqlite3_str_appendf(p, "\"%w\"", zName);
+  }
+}
+
+/* Decode the column name at *pz written by druid_plan_column(), move *pz
+** past it and return its column, or -1 */
+static int druid_plan_parse_column(DruidTable *pTab, const char **pz){
+  const char *z = *pz;
+  char *zName;
+  int n = 0;
+  int iCol;
+  if( *z=='"' ){
+    const char *zEnd;
+    for(zEnd=z+1; *zEnd && (zEnd[0]!='"' || zEnd[1]=='"'); zEnd += zEnd[0]=='"' ? 2 : 1){}
+    if( *zEnd!='"' ) return -1;
+    zName = sqlite3_malloc64(zEnd - z);
+    if( zName==0 ) return -1;
+    for(z++; z<zEnd; z++){
+      zName[n++] = *z;
+      if( *z=='"' ) z++;
+    }
+    z++;
+  }else{
+    while( z[n]=='_' || (z[n]>='a' && z[n]<='z') || (z[n]>='A' && z[n]<='Z')
+        || (z[n]>='0' && z[n]<='9') ){
+      n++;
+    }
+    zName = sqlite3_malloc64(n+1);
+    if( zName==0 ) return -1;
+    memcpy(zName, z, n);
+    z += n;
+  }
+  zName[n] = 0;
+  for(iCol=0; iCol<pTab->nCol; iCol++){
+    if( strcmp(pTab->colNames[iCol], zName)==0 ) break;
+  }
+  sqlite3_free(zName);
+  *pz = z;
+  return iCol<pTab->nCol ? iCol : -1;
+}
+
+/* If the plan item at z is zItem, return the text that follows it in the
+** item, else NULL */
+static const char *druid_plan_match(const char *z, const char *zItem){
+  int n = (int)strlen(zItem);
+  if( strncmp(z, zItem, n)!=0 ) return 0;
+  if( zItem[n-1]!='=' && z[n]!=';' && z[n]!=0 ) return 0;
+  return z+n;
+}
+
+/* True if scan pCur decodes every column of the table */
+static bool druid_cursor_decodes_all(DruidTable *pTab, DruidCursor *pCur){
+  sqlite3_uint64 mAll;
+  if( pTab->nCol>=63 ){
+    mAll = ~(sqlite3_uint64)0;
+  }else{
+    mAll = DRUID_COLUMN_BIT(pTab->nCol)-1;
+  }
+  return (pCur->mProject & mAll)==mAll;
+}
+
+/*
+** A full table scan rewinds to the beginning of the file, or queries the
+** shadow table of a materialized table with the WHERE clause in idxStr.
+** The other scans decode the plan of druid_plan_item() in idxStr.  A
+** rollup scan picks the rollup whose period matches the value of the
+** _granularity constraint among the rollups that xBestIndex found to be
+** covering, building it first if needed.  The rows that do not satisfy
+** the pushed down constraints are skipped, and so are the rows before the
+** OFFSET, and all the rows of a skip scan.
+*/
+static int druidtabFilter(
+  sqlite3_vtab_cursor *pVtabCursor,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  DruidCursor *pCur = (DruidCursor*)pVtabCursor;
+  DruidTable *pTab = (DruidTable*)pVtabCursor->pVtab;
+  int iArg = 0;
+  sqlite3_int64 nOffset = 0;
+  bool bOffset = false;
+  bool bLimit = false;
+  const char *z;
+  if( pCur->pRollup ) pTab->nRollupScan--;
+  druid_shm_unref(pCur->pShm);
+  pCur->pShm = 0;
+  druid_cursor_stream_end(pCur);
+  druid_table_refresh(pTab);
+  if( pCur->iGeneration!=pTab->iGeneration ){
+    /* The file was replaced, read the new one */
+    druid_reader_reset(&pCur->rdr);
+    if( druid_reader_open(&pCur->rdr, pTab->zFilename) ){
+      druid_xfer_error(pTab, &pCur->rdr);
+      return SQLITE_ERROR;
+    }
+    druid_reader_readahead(&pCur->rdr);
+    pCur->rdr.bValidateUtf8 = pTab->bValidateUtf8;
+    pCur->iGeneration = pTab->iGeneration;
+  }
+  pCur->eScan = DRUID_IDX_MODE(idxNum);
+  pCur->zKind = pCur->eScan==DRUID_SCAN_ROLLUP ? "rollup"
+              : pCur->eScan==DRUID_SCAN_MATERIALIZED ? "materialized" : "scan";
+  pCur->nTick = DRUID_INTERRUPT_ROWS;
+  pCur->pRollup = 0;
+  pCur->pGroup = 0;
+  pCur->iRowid = 0;
+  pCur->iBatchRow = -1;
+  pCur->rcBatch = SQLITE_OK;
+  druid_cursor_clear_eq(pCur);
+  druid_stats_free(pCur->pStats);
+  pCur->pStats = 0;
+  pCur->bSample = false;
+  pCur->rSample = 1.0;
+  pCur->iSampleRng = pTab->iSampleSeed;
+  pCur->bFollow = pTab->bFollow;
+  pCur->mProject = ~(sqlite3_uint64)0;
+  pCur->bSkipRows = false;
+  pCur->nRowCount = -1;
+  if( pCur->eScan==DRUID_SCAN_MATERIALIZED ){
+    int rc = druid_table_materialize(pTab);
+    if( rc==SQLITE_OK ) rc = druid_cursor_select(pCur, idxStr, argc, argv);
+    if( rc!=SQLITE_OK ) return rc;
+    return druidtabNext(pVtabCursor);
+  }
+  if( argc>0 ){
+    pCur->aiEqCol = sqlite3_malloc64(sizeof(int)*argc);
+    pCur->azEq = sqlite3_malloc64(sizeof(char*)*argc);
+    pCur->aRange = sqlite3_malloc64(sizeof(DruidRange)*argc);
+    if( pCur->aiEqCol==0 || pCur->azEq==0 || pCur->aRange==0 ) return SQLITE_NOMEM;
+  }
+  for(z=idxStr ? idxStr : ""; *z; z++){
+    const char *zArg;
+    if( druid_plan_match(z, "rollups=") || druid_plan_match(z, "cache=") ){
+      /* Only shown, the rollups are in idxNum */
+    }else if( druid_plan_match(z, "_granularity=?") ){
+      const char *zPeriod = (const char*)sqlite3_value_text(argv[iArg++]);
+      unsigned int mRollup = DRUID_IDX_ROLLUPS(idxNum);
+      int i, rc;
+      if( zPeriod==0 ){
+        /* _granularity = NULL matches nothing */
+        pCur->iRowid = -1;
+        return SQLITE_OK;
+      }
+      for(i=0; i<pTab->nRollup; i++){
+        if( (mRollup & (1u<<i))==0 ) continue;
+        if( sqlite3_stricmp(pTab->aRollup[i].zPeriod, zPeriod)==0 ) break;
+      }
+      if( i>=pTab->nRollup ){
+        sqlite3_free(pTab->base.zErrMsg);
+        pTab->base.zErrMsg = sqlite3_mprintf(
+            "no rollup with granularity '%s' covers the columns used by the query",
+            zPeriod);
+        return SQLITE_ERROR;
+      }
+      rc = druid_table_build(pTab, 1u<<i, false);
+      if( rc!=SQLITE_OK ) return rc;
+      pCur->pRollup = &pTab->aRollup[i];
+      pTab->nRollupScan++;
+    }else if( druid_plan_match(z, "_sample=?") ){
+      sqlite3_value *pRate = argv[iArg++];
+      if( sqlite3_value_numeric_type(pRate)==SQLITE_NULL ){
+        /* _sample = NULL matches nothing */
+        pCur->iRowid = -1;
+        return SQLITE_OK;
+      }
+      pCur->rSample = sqlite3_value_double(pRate);
+      if( !(pCur->rSample>0.0) ){
+        pCur->iRowid = -1;
+        return SQLITE_OK;
+      }
+      pCur->bSample = pCur->rSample<1.0;
+    }else if( druid_plan_match(z, "offset=?") ){
+      nOffset = sqlite3_value_int64(argv[iArg++]);
+      bOffset = true;
+    }else if( druid_plan_match(z, "limit") ){
+      bLimit = true;
+    }else if( druid_plan_match(z, "skip") ){
+      pCur->bSkipRows = true;
+    }else if( (zArg = druid_plan_match(z, "proj="))!=0 ){
+      pCur->mProject = 0;
+      for(z=zArg; *z>='0' && *z<='9'; z++){
+        pCur->mProject |= DRUID_COLUMN_BIT(atoi(z));
+        while( z[1]>='0' && z[1]<='9' ) z++;
+        if( z[1]==',' ) z++;
+      }
+    }else{
+      /* A pushed down constraint on a column */
+      bool bEq = strncmp(z, "eq(", 3)==0;
+      int iCol, eOp;
+      if( bEq ) z += 3;
+      iCol = druid_plan_parse_column(pTab, &z);
+      if( iCol<0 || iArg>=argc ){
+        sqlite3_free(pTab->base.zErrMsg);
+        pTab->base.zErrMsg = sqlite3_mprintf("malformed plan: %s", idxStr);
+        return SQLITE_ERROR;
+      }
+      eOp = bEq ? SQLITE_INDEX_CONSTRAINT_EQ : druid_range_op(z);
+      if( pTab->metricsCols[iCol] && eOp ){
+        /* A metric compared with a number.  Larger integers are left to
+        ** SQLite, as they are not doubles */
+        sqlite3_value *pVal = argv[iArg++];
+        int eType = sqlite3_value_type(pVal);
+        sqlite3_int64 iVal = sqlite3_value_int64(pVal);
+        if( eType==SQLITE_NULL ){
+          /* col < NULL matches nothing */
+          pCur->iRowid = -1;
+          return SQLITE_OK;
+        }
+        if( eType==SQLITE_FLOAT
+         || (eType==SQLITE_INTEGER && iVal>=-DRUID_MAX_EXACT && iVal<=DRUID_MAX_EXACT) ){
+          DruidRange *pRange = &pCur->aRange[pCur->nRange++];
+          pCur->mProject |= DRUID_COLUMN_BIT(iCol);
+          pRange->iCol = iCol;
+          pRange->eOp = eOp;
+          pRange->r = sqlite3_value_double(pVal);
+        }
+      }else{
+        const char *zVal = (const char*)sqlite3_value_text(argv[iArg++]);
+        if( zVal==0 ){
+          /* col = NULL matches nothing */
+          pCur->iRowid = -1;
+          return SQLITE_OK;
+        }
+        pCur->mProject |= DRUID_COLUMN_BIT(iCol);
+        pCur->aiEqCol[pCur->nEq] = iCol;
+        pCur->azEq[pCur->nEq] = sqlite3_mprintf("%s", zVal);
+        if( pCur->azEq[pCur->nEq]==0 ) return SQLITE_NOMEM;
+        pCur->nEq++;
+      }
+    }
+    z = strchr(z, ';');
+    if( z==0 ) break;
+  }
+  if( pCur->eScan==DRUID_SCAN_ROLLUP ){
+    pCur->iRowid = -1;
+    return druidtabNext(pVtabCursor);
+  }
+  if( pTab->bShm ){
+    if( pTab->pShm==0 ){
+      int rc = druid_shm_open(pTab, &pTab->pShm);
+      if( rc!=SQLITE_OK ) return rc;
+    }
+    pCur->pShm = pTab->pShm;
+    pCur->pShm->nRef++;
+    pCur->pShmNext = pCur->pShm->aMap + sizeof(DruidShmHeader);
+    pCur->iShmRow = 0;
+  }
+  if( pCur->pShm==0 && !pCur->bSample && !pCur->bFollow && !pCur->bSkipRows
+   && nOffset<=0 && druid_table_shared(pTab, pCur) ){
+    int rc = druid_cursor_stream_start(pCur);
+    if( rc!=SQLITE_OK ) return rc;
+  }
+  if( pTab->pStats==0 && !pCur->bSample && !pCur->bFollow && !pCur->bSkipRows
+   && !bOffset && !bLimit && druid_cursor_decodes_all(pTab, pCur) ){
+    /* Piggyback the column statistics on this full scan, which decodes
+    ** every column anyway.  Other scans leave them to the first query of
+    ** druid_json_column_stats */
+    pCur->pStats = druid_stats_new(pTab->nCol);
+  }
+  if( pCur->pBatch==0 ){
+    pCur->pBatch = druid_batch_new(pTab->nCol, pCur->mProject);
+    if( pCur->pBatch==0 ) return SQLITE_NOMEM;
+  }
+  pCur->pBatch->mCol = pCur->mProject;
+  pCur->pBatch->nRow = 0;
+  /* The batches start small and double, so that queries that stop after
+  ** a few rows (LIMIT, EXISTS) do not read many more.  The statistics are
+  ** added up DRUID_ACCUM_LANES rows at a time */
+  pCur->nBatchMax = pCur->pStats ? DRUID_ACCUM_LANES : 1;
+  rewindCur(&(pCur->rdr));
+  /* An OFFSET comes with a LIMIT, which the count would read past */
+  pCur->bCountRows = pCur->bSkipRows && pCur->pShm==0 && !pCur->bSample
+                  && !pCur->bFollow && !bOffset;
+  if( nOffset>0 ){
+    int rc = druid_cursor_skip_rows(pCur, nOffset);
+    if( rc!=SQLITE_OK || pCur->iRowid<0 ) return rc;
+  }
+  return druidtabNext(pVtabCursor);
+}
+
+/* Estimated fraction of the rows that satisfy constraint i, a comparison
+** of a metric, from the smallest and largest number of the column */
+static double druid_stats_range(DruidTable *pTab, sqlite3_index_info *pIdxInfo, int i){
+  const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+  double rDefault = pCons->op==SQLITE_INDEX_CONSTRAINT_EQ ? 0.1 : 0.25;
+#if SQLITE_VERSION_NUMBER>=3038000
+  DruidStats *pStats = pTab->pStats;
+  DruidAccum *pAccum;
+  sqlite3_value *pVal = 0;
+  double r, rFrac;
+  int eType;
+  if( pStats==0 || pStats->nRow==0 ) return rDefault;
+  pAccum = &pStats->aAccum[pCons->iColumn];
+  if( pAccum->n==0 ) return 0.0;
+  if( sqlite3_vtab_rhs_value(pIdxInfo, i, &pVal)!=SQLITE_OK || pVal==0 ) return rDefault;
+  eType = sqlite3_value_type(pVal);
+  if( eType!=SQLITE_INTEGER && eType!=SQLITE_FLOAT ) return rDefault;
+  r = sqlite3_value_double(pVal);
+  if( pCons->op==SQLITE_INDEX_CONSTRAINT_EQ ){
+    rFrac = r<pAccum->rMin || r>pAccum->rMax ? 0.0 : rDefault;
+  }else if( pAccum->rMax<=pAccum->rMin ){
+    rFrac = druid_range_matches(pCons->op, pAccum->rMin, r) ? 1.0 : 0.0;
+  }else{
+    /* The numbers are assumed to be spread evenly */
+    rFrac = (r - pAccum->rMin)/(pAccum->rMax - pAccum->rMin);
+    if( pCons->op==SQLITE_INDEX_CONSTRAINT_GT || pCons->op==SQLITE_INDEX_CONSTRAINT_GE ){
+      rFrac = 1.0 - rFrac;
+    }
+    if( rFrac<0.0 ) rFrac = 0.0;
+    if( rFrac>1.0 ) rFrac = 1.0;
+  }
+  return rFrac*(double)pAccum->n/(double)pStats->nRow;
+#else
+  return rDefault;
+#endif
+}
+
+/*
+** Only a forward full table scan is supported, unless the query constrains
+** _granularity, in which case it is answered from a rollup.  Equality
+** constraints on TEXT columns are pushed down so that non matching rows
+** are skipped by the cursor, and the column statistics estimate how many
+** rows they select.  So are the comparisons of metrics with numbers,
+** estimated from the smallest and largest number of the metric.  An
+** equality constraint on _sample makes the cursor visit only that
+** fraction of the rows.  A scan that uses no column, such as count(*),
+** skips the rows without decoding them, and so does the OFFSET of a query
+** without other constraints.  The other scans of a materialized table are
+** planned by druid_materialized_best_index().
 */
-static int druidtabConnect(
-  sqlite3 *db,
-  void *pAux,
-  int argc, const char *const*argv,
-  sqlite3_vtab **ppVtab,
-  char **pzErr
+static int druidtabBestIndex(
+  sqlite3_vtab *tab,
+  sqlite3_index_info *pIdxInfo
 ){
-  DruidTable *pNew = 0;        /* The DruidTable object to construct */
-  int rc = SQLITE_OK;        /* Result code from this routine */
-  int i, j;                  /* Loop counters */
-#ifdef SQLITE_TEST
-  int tstFlags = 0;          /* Value for testflags=N parameter */
+  DruidTable *pTab = (DruidTable*)tab;
+  int iGranularity = pTab->nCol + DRUID_HIDDEN_GRANULARITY;
+  int iSample = pTab->nCol + DRUID_HIDDEN_SAMPLE;
+  sqlite3_str *pPlan;
+  double nRow;
+  bool bSample = false;
+  bool bSkip = false;
+  int nArg = 0;
+  int i;
+  nRow = pTab->pStats ? (double)pTab->pStats->nRow : 1000000.0;
+  pIdxInfo->idxNum = DRUID_SCAN_ROWS;
+  for(i=0; i<pIdxInfo->nConstraint; i++){
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if( pCons->usable && (pCons->iColumn==iGranularity || pCons->iColumn==iSample)
+     && pCons->op==SQLITE_INDEX_CONSTRAINT_EQ ){
+      break;
+    }
+  }
+  if( i>=pIdxInfo->nConstraint && pTab->bMaterialize && !pTab->bMaterializing ){
+    return druid_materialized_best_index(pTab, pIdxInfo);
+  }
+  for(i=0; i<pIdxInfo->nConstraint; i++){
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if( pCons->usable && pCons->iColumn==iGranularity
+     && pCons->op==SQLITE_INDEX_CONSTRAINT_EQ ){
+      break;
+    }
+  }
+  pPlan = sqlite3_str_new(0);
+  if( pTab->bTrusted && pIdxInfo->colUsed!=0 ){
+    /* Checked again below, as rollup scans read no column of the file */
+    bool bFirst = true;
+    int iCol;
+    sqlite3_str_appendall(pPlan, "proj=");
+    for(iCol=0; iCol<pTab->nCol; iCol++){
+      if( (pIdxInfo->colUsed & DRUID_COLUMN_BIT(iCol))==0 ) continue;
+      sqlite3_str_appendf(pPlan, "%s%d", bFirst ? "" : ",", iCol);
+      bFirst = false;
+    }
+    if( bFirst ) sqlite3_str_appendall(pPlan, "none");
+  }
+  if( i<pIdxInfo->nConstraint ){
+    unsigned int mRollup = 0;
+    sqlite3_int64 nGroup = -1;
+    int j;
+    for(j=0; j<pTab->nRollup; j++){
+      if( druid_rollup_covers(pTab, &pTab->aRollup[j], pIdxInfo->colUsed) ){
+        mRollup |= 1u<<j;
+        if( pTab->aRollup[j].bBuilt
+         && (nGroup<0 || pTab->aRollup[j].nGroup>nGroup) ){
+          nGroup = pTab->aRollup[j].nGroup;
+        }
+      }
+    }
+    if( mRollup==0 ){
+      /* No rollup has the columns of the query, and a scan of the rows
+      ** would have no _granularity to match */
+      sqlite3_free(sqlite3_str_finish(pPlan));
+      return SQLITE_CONSTRAINT;
+    }
+    /* A rollup scan reads no column of the file */
+    sqlite3_str_reset(pPlan);
+    sqlite3_str_appendall(pPlan, "rollups=");
+    for(j=0; j<pTab->nRollup; j++){
+      if( mRollup & (1u<<j) ){
+        sqlite3_str_appendf(pPlan, "%s%s", mRollup & ((1u<<j)-1) ? "," : "",
+                            pTab->aRollup[j].zPeriod);
+      }
+    }
+    sqlite3_str_appendall(pPlan, ";_granularity=?");
+    pIdxInfo->aConstraintUsage[i].argvIndex = ++nArg;
+    pIdxInfo->aConstraintUsage[i].omit = 1;
+    pIdxInfo->idxNum = DRUID_SCAN_ROLLUP | (int)(mRollup<<8);
+    nRow = nGroup>=0 ? (double)nGroup : 10000.0;
+  }
+  pIdxInfo->estimatedCost = nRow;
+  if( pIdxInfo->idxNum==DRUID_SCAN_ROWS ) pIdxInfo->estimatedCost = 1000000;
+  for(i=0; i<pIdxInfo->nConstraint; i++){
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if( pCons->usable && pCons->iColumn==iSample
+     && pCons->op==SQLITE_INDEX_CONSTRAINT_EQ ){
+      double rSample = 0.01;
+#if SQLITE_VERSION_NUMBER>=3038000
+      sqlite3_value *pRate = 0;
+      if( sqlite3_vtab_rhs_value(pIdxInfo, i, &pRate)==SQLITE_OK && pRate ){
+        rSample = sqlite3_value_double(pRate);
+        if( rSample>1.0 ) rSample = 1.0;
+        if( rSample<0.0 ) rSample = 0.0;
+      }
 #endif
-  int b;                     /* Value of a boolean parameter */
-  int nCol = -99;            /* Value of the columns= parameter */
-  int read_field_ret;
-  DruidReader sRdr;            /* A CSV file reader used to store an error
-                             ** message and/or to count the number of columns */
-  static const char *azParam[] = {
-     "filename", "metrics",
+      druid_plan_item(pPlan);
+      sqlite3_str_appendall(pPlan, "_sample=?");
+      pIdxInfo->aConstraintUsage[i].argvIndex = ++nArg;
+      pIdxInfo->aConstraintUsage[i].omit = 1;
+      bSample = true;
+      nRow *= rSample;
+      /* Skipped rows are scanned but not decoded */
+      pIdxInfo->estimatedCost *= 0.25 + 0.75*rSample;
+      break;
+    }
+  }
+  for(i=0; i<pIdxInfo->nConstraint; i++){
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    const char *zColl;
+    double ndv;
+    if( !pCons->usable ) continue;
+    if( pCons->iColumn<0 || pCons->iColumn>=pTab->nCol ) continue;
+    if( pTab->metricsCols[pCons->iColumn]
+     && DRUID_IDX_MODE(pIdxInfo->idxNum)==DRUID_SCAN_ROWS
+     && druid_range_op_name(pCons->op) ){
+      /* Checked again by SQLite, which also compares with TEXT values */
+      pIdxInfo->aConstraintUsage[i].argvIndex = ++nArg;
+      druid_plan_item(pPlan);
+      if( pCons->op==SQLITE_INDEX_CONSTRAINT_EQ ){
+        sqlite3_str_appendall(pPlan, "eq(");
+        druid_plan_column(pTab, pPlan, pCons->iColumn);
+        sqlite3_str_appendchar(pPlan, 1, ')');
+      }else{
+        druid_plan_column(pTab, pPlan, pCons->iColumn);
+        sqlite3_str_appendf(pPlan, "%s?", druid_range_op_name(pCons->op));
+      }
+      nRow *= druid_stats_range(pTab, pIdxInfo, i);
+      pIdxInfo->estimatedCost *= 0.9;
+      continue;
+    }
+    if( pCons->op!=SQLITE_INDEX_CONSTRAINT_EQ ) continue;
+    if( !druid_is_text_col(pTab, pCons->iColumn) ) continue;
+    zColl = sqlite3_vtab_collation(pIdxInfo, i);
+    if( zColl && sqlite3_stricmp(zColl, "BINARY")!=0 ) continue;
+    pIdxInfo->aConstraintUsage[i].argvIndex = ++nArg;
+    druid_plan_item(pPlan);
+    sqlite3_str_appendall(pPlan, "eq(");
+    druid_plan_column(pTab, pPlan, pCons->iColumn);
+    sqlite3_str_appendchar(pPlan, 1, ')');
+    ndv = DRUID_IDX_MODE(pIdxInfo->idxNum)==DRUID_SCAN_ROWS ? druid_stats_ndv(pTab, pCons->iColumn) : -1.0;
+    nRow /= ndv>=1.0 ? ndv : 10.0;
+    pIdxInfo->estimatedCost *= 0.9;
+  }
+  if( DRUID_IDX_MODE(pIdxInfo->idxNum)==DRUID_SCAN_ROWS && pIdxInfo->colUsed==0 ){
+    bSkip = true;
+  }
+#if SQLITE_VERSION_NUMBER>=3038000
+  /* The rows before the OFFSET are skipped without being decoded.  The
+  ** cursor must return every row that SQLite counts for the OFFSET, so
+  ** there can be no other constraint, nor sampling */
+  if( pIdxInfo->idxNum==DRUID_SCAN_ROWS && !bSample ){
+    int iOffset = -1;
+    for(i=0; i<pIdxInfo->nConstraint; i++){
+      const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+      if( pCons->op==SQLITE_INDEX_CONSTRAINT_OFFSET && pCons->usable ){
+        iOffset = i;
+      }else if( pCons->op!=SQLITE_INDEX_CONSTRAINT_LIMIT ){
+        break;
+      }
+    }
+    if( i>=pIdxInfo->nConstraint && iOffset>=0 && pIdxInfo->nOrderBy==0 ){
+      druid_plan_item(pPlan);
+      sqlite3_str_appendall(pPlan, "offset=?");
+      pIdxInfo->aConstraintUsage[iOffset].argvIndex = ++nArg;
+      pIdxInfo->aConstraintUsage[iOffset].omit = 1;
+    }
+  }
+  /* A scan cut short by a LIMIT does not collect the column statistics */
+  if( DRUID_IDX_MODE(pIdxInfo->idxNum)==DRUID_SCAN_ROWS ){
+    for(i=0; i<pIdxInfo->nConstraint; i++){
+      if( pIdxInfo->aConstraint[i].op==SQLITE_INDEX_CONSTRAINT_LIMIT ) break;
+    }
+    if( i<pIdxInfo->nConstraint ){
+      druid_plan_item(pPlan);
+      sqlite3_str_appendall(pPlan, "limit");
+    }
+  }
+#endif
+  if( bSkip ){
+    druid_plan_item(pPlan);
+    sqlite3_str_appendall(pPlan, "skip");
+  }
+  if( pTab->bShm && DRUID_IDX_MODE(pIdxInfo->idxNum)==DRUID_SCAN_ROWS ){
+    druid_plan_item(pPlan);
+    sqlite3_str_appendall(pPlan, "cache=shm");
+  }
+  if( sqlite3_str_errcode(pPlan) ){
+    sqlite3_free(sqlite3_str_finish(pPlan));
+    return SQLITE_NOMEM;
+  }
+  if( sqlite3_str_length(pPlan) ){
+    pIdxInfo->idxStr = sqlite3_str_finish(pPlan);
+    pIdxInfo->needToFreeIdxStr = 1;
+  }else{
+    sqlite3_free(sqlite3_str_finish(pPlan));
+  }
+  if( pTab->pStats || nArg>0 ){
+    pIdxInfo->estimatedRows = nRow<1.0 ? 1 : (sqlite3_int64)nRow;
+  }
+  return SQLITE_OK;
+}
+
+/*
+** json_extract(X, P) and X ->> P, where X is a column of a druid_json
+** table, are overloaded by xFindMethod.  The Druid values are strings,
+** which often hold JSON documents of their own.  The built-in functions
+** parse the whole document of every row before looking the path up, the
+** overloads go over its text once, without building a parse of it, and
+** keep the span of the value at the path on the way.  Only the paths made
+** of .label and [index] steps, and the strings, numbers, true, false and
+** null found there are answered that way: the other paths, objects and
+** arrays, numbers and escapes that the built-in could convert differently,
+** JSON5 and malformed documents are passed to the built-in function,
+** through a statement prepared once per table.
+**
+** A row often has several paths of the same document extracted.  The
+** first overload on the document of a column of the current row of a
+** cursor keeps the spans of the members of its top level object or
+** array, and the next ones go straight to the member of their first
+** step, see druid_json_doc().
+*/
+#define DRUID_JSON_EXTRACT   0    /* json_extract(X, P) */
+#define DRUID_JSON_ARROW     1    /* X ->> P */
+#define DRUID_JSON_MAX_STEP  16   /* Steps of the paths answered by the overloads */
+#define DRUID_JSON_MAX_DEPTH 64   /* Nesting of the documents they go through */
+
+typedef struct DruidJsonStep {
+  const char *zKey;               /* Label of a .label step, NULL for [index] */
+  int nKey;                       /* Length of zKey */
+  sqlite3_int64 iIdx;             /* Index of an [index] step */
+} DruidJsonStep;
+
+typedef struct DruidJsonScan {
+  const char *z;                  /* The JSON document */
+  int n;                          /* Length of z */
+  int i;                          /* Next character of z */
+  int depth;                      /* Objects and arrays i is in */
+  int nStep;                      /* Number of steps of the path */
+  DruidJsonStep aStep[DRUID_JSON_MAX_STEP];  /* The steps of the path */
+  int iVal;                       /* Offset of the value at the path, or -1 */
+  int nVal;                       /* Length of that value */
+  DruidJsonDoc *pDoc;             /* Keeps the top level members, or NULL */
+} DruidJsonScan;
+
+/* Parse the steps of the n bytes of a path that follow its '$'.  Return
+** false if the built-in must parse it */
+static bool druid_json_path(DruidJsonScan *p, const char *z, int n){
+  int i = 0;
+  p->nStep = 0;
+  while( i<n ){
+    DruidJsonStep *pStep;
+    int j;
+    if( p->nStep>=DRUID_JSON_MAX_STEP ) return false;
+    pStep = &p->aStep[p->nStep++];
+    j = ++i;
+    if( z[j-1]=='.' ){
+      if( i<n && z[i]=='"' ) return false;
+      while( i<n && z[i]!='.' && z[i]!='[' ) i++;
+      if( i==j ) return false;
+      pStep->zKey = &z[j];
+      pStep->nKey = i - j;
+    }else if( z[j-1]=='[' ){
+      pStep->zKey = 0;
+      pStep->iIdx = 0;
+      while( i<n && z[i]>='0' && z[i]<='9' && i-j<18 ){
+        pStep->iIdx = pStep->iIdx*10 + (z[i] - '0');
+        i++;
+      }
+      if( i==j || i>=n || z[i]!=']' ) return false;
+      i++;
+    }else{
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Parse the path of X ->> P.  A label is only taken as such if it could
+** not be read as anything else by any version of SQLite */
+static bool druid_json_arrow_path(DruidJsonScan *p, sqlite3_value *pPath){
+  const char *z;
+  int n, i;
+  if( sqlite3_value_type(pPath)==SQLITE_INTEGER ){
+    sqlite3_int64 iIdx = sqlite3_value_int64(pPath);
+    if( iIdx<0 ) return false;
+    p->nStep = 1;
+    p->aStep[0].zKey = 0;
+    p->aStep[0].iIdx = iIdx;
+    return true;
+  }
+  if( sqlite3_value_type(pPath)!=SQLITE_TEXT ) return false;
+  z = (const char*)sqlite3_value_text(pPath);
+  n = sqlite3_value_bytes(pPath);
+  if( z==0 || n==0 ) return false;
+  if( z[0]=='$' ) return druid_json_path(p, z+1, n-1);
+  if( !((z[0]>='a' && z[0]<='z') || (z[0]>='A' && z[0]<='Z') || z[0]=='_') ) return false;
+  for(i=1; i<n; i++){
+    if( !((z[i]>='a' && z[i]<='z') || (z[i]>='A' && z[i]<='Z')
+       || (z[i]>='0' && z[i]<='9') || z[i]=='_') ){
+      return false;
+    }
+  }
+  p->nStep = 1;
+  p->aStep[0].zKey = z;
+  p->aStep[0].nKey = n;
+  return true;
+}
+
+static void druid_json_ws(DruidJsonScan *p){
+  while( p->i<p->n && (p->z[p->i]==' ' || p->z[p->i]=='\t'
+                       || p->z[p->i]=='\n' || p->z[p->i]=='\r') ){
+    p->i++;
+  }
+}
+
+/* Value of hexadecimal digit c, or -1 */
+static int druid_json_hex(char c){
+  if( c>='0' && c<='9' ) return c - '0';
+  if( c>='a' && c<='f' ) return c - 'a' + 10;
+  if( c>='A' && c<='F' ) return c - 'A' + 10;
+  return -1;
+}
+
+/* Scan the string whose opening quote is at p->i.  *pbEscape is set if it
+** has escapes */
+static bool druid_json_string(DruidJsonScan *p, bool *pbEscape){
+  int i = p->i + 1;
+  *pbEscape = false;
+  while( i<p->n ){
+    u8 c = (u8)p->z[i];
+    if( c=='"' ){
+      p->i = i + 1;
+      return true;
+    }
+    if( c<0x20 ) return false;
+    i++;
+    if( c!='\\' ) continue;
+    *pbEscape = true;
+    if( i>=p->n ) return false;
+    if( p->z[i]=='u' ){
+      int k;
+      if( i+4>=p->n ) return false;
+      for(k=1; k<=4; k++){
+        if( druid_json_hex(p->z[i+k])<0 ) return false;
+      }
+      i += 5;
+    }else if( p->z[i]!=0 && strchr("\"\\/bfnrt", p->z[i])!=0 ){
+      i++;
+    }else{
+      return false;
+    }
+  }
+  return false;
+}
+
+/* Scan a number of the JSON grammar, without the JSON5 extensions */
+static bool druid_json_number(DruidJsonScan *p){
+  const char *z = p->z;
+  int i = p->i, j;
+  if( i<p->n && z[i]=='-' ) i++;
+  if( i<p->n && z[i]=='0' ){
+    i++;
+  }else{
+    for(j=i; i<p->n && z[i]>='0' && z[i]<='9'; i++){}
+    if( i==j ) return false;
+  }
+  if( i<p->n && z[i]=='.' ){
+    for(j=++i; i<p->n && z[i]>='0' && z[i]<='9'; i++){}
+    if( i==j ) return false;
+  }
+  if( i<p->n && (z[i]=='e' || z[i]=='E') ){
+    i++;
+    if( i<p->n && (z[i]=='+' || z[i]=='-') ) i++;
+    for(j=i; i<p->n && z[i]>='0' && z[i]<='9'; i++){}
+    if( i==j ) return false;
+  }
+  p->i = i;
+  return true;
+}
+
+static bool druid_json_value(DruidJsonScan *p, int iStep);
+
+/* Add to p->pDoc the member of the top level container whose value is
+** next, with the nKey bytes of label at iKey, or iKey -1 for an element.
+** Return false on OOM */
+static bool druid_json_member(DruidJsonScan *p, int iKey, int nKey, bool bEscape){
+  DruidJsonDoc *pDoc = p->pDoc;
+  DruidJsonMember *pMember;
+  if( pDoc->nMember>=pDoc->nAlloc ){
+    int nNew = pDoc->nAlloc ? pDoc->nAlloc*2 : 16;
+    DruidJsonMember *aNew = sqlite3_realloc64(pDoc->aMember, sizeof(aNew[0])*nNew);
+    if( aNew==0 ) return false;
+    pDoc->aMember = aNew;
+    pDoc->nAlloc = nNew;
+  }
+  druid_json_ws(p);
+  pMember = &pDoc->aMember[pDoc->nMember++];
+  pMember->iKey = iKey;
+  pMember->nKey = nKey;
+  pMember->bEscape = bEscape;
+  pMember->iVal = p->i;
+  pMember->nVal = 0;
+  return true;
+}
+
+/* Scan the object or array whose '{' or '[' is at p->i.  iStep is the
+** number of steps of the path that lead to it, or -1 if it is not on the
+** path.  Only the first member with the label of the next step is on the
+** path, as for the built-in */
+static bool druid_json_container(DruidJsonScan *p, int iStep){
+  const DruidJsonStep *pStep = 0;
+  bool bObject = p->z[p->i]=='{';
+  char cEnd = bObject ? '}' : ']';
+  sqlite3_int64 iIdx = 0;
+  if( ++p->depth>DRUID_JSON_MAX_DEPTH ) return false;
+  if( iStep>=0 && iStep<p->nStep && (p->aStep[iStep].zKey!=0)==bObject ){
+    pStep = &p->aStep[iStep];
+  }
+  p->i++;
+  druid_json_ws(p);
+  if( p->i<p->n && p->z[p->i]==cEnd ){
+    p->i++;
+    p->depth--;
+    return true;
+  }
+  while( true ){
+    int iNext = -1;
+    int iKey = -1, nKey = 0;
+    bool bEscape = false;
+    if( bObject ){
+      druid_json_ws(p);
+      if( p->i>=p->n || p->z[p->i]!='"' ) return false;
+      iKey = p->i + 1;
+      if( !druid_json_string(p, &bEscape) ) return false;
+      nKey = p->i - 1 - iKey;
+      if( pStep ){
+        /* The built-in compares the decoded label */
+        if( bEscape ) return false;
+        if( nKey==pStep->nKey && memcmp(&p->z[iKey], pStep->zKey, nKey)==0 ){
+          iNext = iStep + 1;
+          pStep = 0;
+        }
+      }
+      druid_json_ws(p);
+      if( p->i>=p->n || p->z[p->i]!=':' ) return false;
+      p->i++;
+    }else if( pStep && iIdx==pStep->iIdx ){
+      iNext = iStep + 1;
+    }
+    if( p->pDoc && p->depth==1 && !druid_json_member(p, iKey, nKey, bEscape) ){
+      return false;
+    }
+    if( !druid_json_value(p, iNext) ) return false;
+    if( p->pDoc && p->depth==1 ){
+      DruidJsonMember *pMember = &p->pDoc->aMember[p->pDoc->nMember-1];
+      pMember->nVal = p->i - pMember->iVal;
+    }
+    druid_json_ws(p);
+    if( p->i>=p->n ) return false;
+    if( p->z[p->i]==cEnd ) break;
+    if( p->z[p->i]!=',' ) return false;
+    p->i++;
+    iIdx++;
+  }
+  p->i++;
+  p->depth--;
+  return true;
+}
+
+/* Scan the value at p->i, see druid_json_container() for iStep */
+static bool druid_json_value(DruidJsonScan *p, int iStep){
+  int iStart;
+  bool bOk;
+  druid_json_ws(p);
+  if( p->i>=p->n ) return false;
+  iStart = p->i;
+  switch( p->z[p->i] ){
+    case '{':
+    case '[':
+      bOk = druid_json_container(p, iStep);
+      break;
+    case '"': {
+      bool bEscape;
+      bOk = druid_json_string(p, &bEscape);
+      break;
+    }
+    case 't':
+    case 'n':
+    case 'f': {
+      const char *zLit = p->z[p->i]=='t' ? "true" : p->z[p->i]=='n' ? "null" : "false";
+      int nLit = (int)strlen(zLit);
+      bOk = p->n-p->i>=nLit && memcmp(&p->z[p->i], zLit, nLit)==0;
+      p->i += nLit;
+      break;
+    }
+    default:
+      bOk = druid_json_number(p);
+      break;
+  }
+  if( bOk && iStep==p->nStep ){
+    p->iVal = iStart;
+    p->nVal = p->i - iStart;
+  }
+  return bOk;
+}
+
+/* Set the result to the string of n bytes at z, without its quotes.
+** Return false for the escapes the built-in may decode differently */
+static bool druid_json_result_string(sqlite3_context *ctx, const char *z, int n){
+  char *zOut;
+  int i, j = 0;
+  if( memchr(z, '\\', n)==0 ){
+    sqlite3_result_text(ctx, z, n, SQLITE_TRANSIENT);
+    return true;
+  }
+  zOut = sqlite3_malloc(n + 1);
+  if( zOut==0 ){
+    sqlite3_result_error_nomem(ctx);
+    return true;
+  }
+  for(i=0; i<n; i++){
+    char c = z[i];
+    if( c!='\\' ){
+      zOut[j++] = c;
+      continue;
+    }
+    c = z[++i];
+    switch( c ){
+      case 'b': zOut[j++] = '\b'; break;
+      case 'f': zOut[j++] = '\f'; break;
+      case 'n': zOut[j++] = '\n'; break;
+      case 'r': zOut[j++] = '\r'; break;
+      case 't': zOut[j++] = '\t'; break;
+      case 'u': {
+        unsigned int u = 0;
+        int k;
+        for(k=1; k<=4; k++) u = u*16 + (unsigned int)druid_json_hex(z[i+k]);
+        i += 4;
+        if( u==0 || (u>=0xd800 && u<=0xdfff) ){
+          sqlite3_free(zOut);
+          return false;
+        }
+        if( u<0x80 ){
+          zOut[j++] = (char)u;
+        }else if( u<0x800 ){
+          zOut[j++] = (char)(0xc0 | (u>>6));
+          zOut[j++] = (char)(0x80 | (u & 0x3f));
+        }else{
+          zOut[j++] = (char)(0xe0 | (u>>12));
+          zOut[j++] = (char)(0x80 | ((u>>6) & 0x3f));
+          zOut[j++] = (char)(0x80 | (u & 0x3f));
+        }
+        break;
+      }
+      default: zOut[j++] = c; break;
+    }
+  }
+  sqlite3_result_text(ctx, zOut, j, sqlite3_free);
+  return true;
+}
+
+/* Set the result to the number of n bytes at z.  Return false for the
+** numbers the built-in may not convert to the same value: those with an
+** exponent, more than 15 significant digits or "-0" */
+static bool druid_json_result_number(sqlite3_context *ctx, const char *z, int n){
+  sqlite3_uint64 m = 0;
+  int nDigit = 0, nFrac = 0;
+  bool bNeg = z[0]=='-';
+  bool bFrac = false;
+  int i;
+  for(i=bNeg; i<n; i++){
+    if( z[i]=='.' ){
+      bFrac = true;
+      continue;
+    }
+    if( z[i]<'0' || z[i]>'9' ) return false;
+    m = m*10 + (u8)(z[i] - '0');
+    if( m ) nDigit++;
+    if( bFrac ) nFrac++;
+  }
+  if( bNeg && m==0 && !bFrac ) return false;
+  if( !bFrac ){
+    if( nDigit>18 ) return false;
+    sqlite3_result_int64(ctx, bNeg ? -(sqlite3_int64)m : (sqlite3_int64)m);
+    return true;
+  }
+  if( nDigit>15 || nFrac>22 ) return false;
+  sqlite3_result_double(ctx, (bNeg ? -(double)m : (double)m) / druid_pow10[nFrac]);
+  return true;
+}
+
+/* Answer json_extract(X, P) or X ->> P with the built-in function */
+static void druid_json_builtin(sqlite3_context *ctx, int eFunc, sqlite3_value **argv){
+  static const char *const azSql[] = {
+    "SELECT json_extract(?1, ?2)",
+    "SELECT ?1 ->> ?2",
   };
-  char *azPValue[2];         /* Parameter values */
-  char *schema;
-  int num_druid_metrics=0;
-  char **druid_metric_names;
-# define DRUID_FILENAME (azPValue[0])
-# define DRUID_METRICS   (azPValue[1])
+  DruidTable *pTab = (DruidTable*)sqlite3_user_data(ctx);
+  sqlite3_stmt *pStmt = pTab->apJson[eFunc];
+  int rc;
+  if( pStmt==0 ){
+    rc = sqlite3_prepare_v2(pTab->db, azSql[eFunc], -1, &pTab->apJson[eFunc], 0);
+    if( rc!=SQLITE_OK ){
+      sqlite3_result_error(ctx, sqlite3_errmsg(pTab->db), -1);
+      return;
+    }
+    pStmt = pTab->apJson[eFunc];
+  }
+  sqlite3_bind_value(pStmt, 1, argv[0]);
+  sqlite3_bind_value(pStmt, 2, argv[1]);
+  rc = sqlite3_step(pStmt);
+  if( rc==SQLITE_ROW ){
+    sqlite3_result_value(ctx, sqlite3_column_value(pStmt, 0));
+  }else{
+    sqlite3_result_error(ctx, sqlite3_errmsg(pTab->db), -1);
+    sqlite3_result_error_code(ctx, rc);
+  }
+  sqlite3_reset(pStmt);
+  sqlite3_clear_bindings(pStmt);
+}
+
+/* Return the document of a column of the current row of a cursor of pTab
+** whose text is the n bytes at z, or NULL.  The overloads are passed a
+** copy of the value returned by xColumn */
+static DruidJsonDoc *druid_json_doc(DruidTable *pTab, const char *z, int n){
+  DruidCursor *pCur;
+  for(pCur=pTab->pCursors; pCur; pCur=pCur->pNextCursor){
+    const DruidBatchCol *pCol;
+    int iRow = pCur->iBatchRow;
+    if( iRow<0 || pCur->eScan!=DRUID_SCAN_ROWS || pCur->json.iCol<0 ) continue;
+    pCol = &pCur->pBatch->aCol[pCur->json.iCol];
+    if( pCol->anVal[iRow]==n && memcmp(pCol->azVal[iRow], z, n)==0 ){
+      return &pCur->json;
+    }
+  }
+  return 0;
+}
+
+/* Find the value at the path of p with the members of pDoc, the document
+** p->z.  Return false if the document must be scanned instead */
+static bool druid_json_doc_value(DruidJsonScan *p, const DruidJsonDoc *pDoc){
+  const DruidJsonStep *pStep = &p->aStep[0];
+  const DruidJsonMember *pMember = 0;
+  int i;
+  if( pDoc->nMember<0 || p->nStep==0 ) return false;
+  if( pStep->zKey && pDoc->cTop=='{' ){
+    for(i=0; i<pDoc->nMember && pMember==0; i++){
+      const DruidJsonMember *pM = &pDoc->aMember[i];
+      if( pM->bEscape ) return false;
+      if( pM->nKey==pStep->nKey && memcmp(&p->z[pM->iKey], pStep->zKey, pM->nKey)==0 ){
+        pMember = pM;
+      }
+    }
+  }else if( pStep->zKey==0 && pDoc->cTop=='[' && pStep->iIdx<pDoc->nMember ){
+    pMember = &pDoc->aMember[pStep->iIdx];
+  }
+  if( pMember==0 ) return true;   /* Nothing at the path */
+  if( p->nStep==1 ){
+    p->iVal = pMember->iVal;
+    p->nVal = pMember->nVal;
+    return true;
+  }
+  p->i = pMember->iVal;
+  p->n = pMember->iVal + pMember->nVal;
+  p->depth = 1;
+  return druid_json_value(p, 1);
+}
+
+static void druid_json_extract_path(sqlite3_context *ctx, int eFunc, sqlite3_value **argv){
+  DruidTable *pTab = (DruidTable*)sqlite3_user_data(ctx);
+  DruidJsonScan s;
+  bool bOk;
+  if( sqlite3_value_type(argv[0])!=SQLITE_TEXT ){
+    druid_json_builtin(ctx, eFunc, argv);
+    return;
+  }
+  if( eFunc==DRUID_JSON_ARROW ){
+    bOk = druid_json_arrow_path(&s, argv[1]);
+  }else{
+    const char *zPath = (const char*)sqlite3_value_text(argv[1]);
+    bOk = zPath && zPath[0]=='$' && druid_json_path(&s, zPath+1, sqlite3_value_bytes(argv[1])-1);
+  }
+  if( bOk ){
+    const char *z = (const char*)sqlite3_value_text(argv[0]);
+    int n = sqlite3_value_bytes(argv[0]);
+    DruidJsonDoc *pDoc = z ? druid_json_doc(pTab, z, n) : 0;
+    s.z = z;
+    s.n = n;
+    s.iVal = -1;
+    s.pDoc = 0;
+    if( pDoc==0 || !druid_json_doc_value(&s, pDoc) ){
+      if( pDoc && pDoc->nMember==-1 ){
+        /* The first path of the document, keep its members */
+        s.pDoc = pDoc;
+        pDoc->nMember = 0;
+      }
+      s.n = n;
+      s.i = 0;
+      s.depth = 0;
+      s.iVal = -1;
+      bOk = z && druid_json_value(&s, 0);
+      if( bOk ){
+        druid_json_ws(&s);
+        bOk = s.i==s.n;
+      }
+      if( s.pDoc ){
+        int i;
+        for(i=0; i<n && (z[i]==' ' || z[i]=='\t' || z[i]=='\n' || z[i]=='\r'); i++){}
+        pDoc->cTop = bOk && (z[i]=='{' || z[i]=='[') ? z[i] : 0;
+        if( !bOk ) pDoc->nMember = -2;
+      }
+    }
+  }
+  if( bOk && s.iVal<0 ){
+    sqlite3_result_null(ctx);     /* Nothing at the path */
+  }else if( bOk ){
+    switch( s.z[s.iVal] ){
+      case '{':
+      case '[': bOk = false; break;
+      case 'n': sqlite3_result_null(ctx); break;
+      case 't': sqlite3_result_int(ctx, 1); break;
+      case 'f': sqlite3_result_int(ctx, 0); break;
+      case '"': bOk = druid_json_result_string(ctx, &s.z[s.iVal+1], s.nVal-2); break;
+      default:  bOk = druid_json_result_number(ctx, &s.z[s.iVal], s.nVal); break;
+    }
+  }
+  if( !bOk ) druid_json_builtin(ctx, eFunc, argv);
+}
+
+static void druid_json_extract_func(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  (void)argc;
+  druid_json_extract_path(ctx, DRUID_JSON_EXTRACT, argv);
+}
+
+static void druid_json_arrow_func(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  (void)argc;
+  druid_json_extract_path(ctx, DRUID_JSON_ARROW, argv);
+}
+
+/*
+** xFindMethod: overload json_extract(X, P) and X ->> P on the columns of
+** the table.
+*/
+static int druidtabFindMethod(
+  sqlite3_vtab *pVtab,
+  int nArg,
+  const char *zName,
+  void (**pxFunc)(sqlite3_context*,int,sqlite3_value**),
+  void **ppArg
+){
+  if( nArg!=2 ) return 0;
+  if( sqlite3_stricmp(zName, "json_extract")==0 ){
+    *pxFunc = druid_json_extract_func;
+  }else if( strcmp(zName, "->>")==0 ){
+    *pxFunc = druid_json_arrow_func;
+  }else{
+    return 0;
+  }
+  *ppArg = pVtab;
+  return 1;
+}
+
+
+/*
+** Apache DataSketches serialization helpers.  DataSketches images are
+** little-endian, unlike Druid's own HyperLogLogCollector.
+*/
+#define DRUID_DS_FLAG_BIG_ENDIAN   0x01
+#define DRUID_DS_FLAG_READ_ONLY    0x02
+#define DRUID_DS_FLAG_EMPTY        0x04
+#define DRUID_DS_FLAG_COMPACT      0x08
+#define DRUID_DS_FLAG_ORDERED      0x10
+#define DRUID_DS_FLAG_SINGLE_ITEM  0x20
+
+static sqlite3_uint64 druid_get_le64(const u8 *a){
+  return ((sqlite3_uint64)a[0]) | ((sqlite3_uint64)a[1]<<8)
+       | ((sqlite3_uint64)a[2]<<16) | ((sqlite3_uint64)a[3]<<24)
+       | ((sqlite3_uint64)a[4]<<32) | ((sqlite3_uint64)a[5]<<40)
+       | ((sqlite3_uint64)a[6]<<48) | ((sqlite3_uint64)a[7]<<56);
+}
+
+static void druid_put_le64(u8 *a, sqlite3_uint64 v){
+  int i;
+  for(i=0; i<8; i++) a[i] = (u8)(v>>(8*i));
+}
 
+static u32 druid_get_le32(const u8 *a){
+  return ((u32)a[0]) | ((u32)a[1]<<8) | ((u32)a[2]<<16) | ((u32)a[3]<<24);
+}
 
-  assert( sizeof(azPValue)==sizeof(azParam) );
-  memset(&sRdr, 0, sizeof(sRdr));
-  memset(azPValue, 0, sizeof(azPValue));
-  for(i=3; i<argc; i++){
-    const char *z = argv[i];
-    const char *zValue;
-    for(j=0; j<sizeof(azParam)/sizeof(azParam[0]); j++){
-      if( druid_string_parameter(&sRdr, azParam[j], z, &azPValue[j]) ) break;
-    }
-    if( j<sizeof(azParam)/sizeof(azParam[0]) ){
-      if( sRdr.zErr[0] ) goto csvtab_connect_error;
-    }else
-    {
-      druid_errmsg(&sRdr, "bad parameter: '%s'", z);
-      goto csvtab_connect_error;
-    }
+static void druid_put_le32(u8 *a, u32 v){
+  a[0] = (u8)v; a[1] = (u8)(v>>8); a[2] = (u8)(v>>16); a[3] = (u8)(v>>24);
+}
+
+static double druid_get_le_double(const u8 *a){
+  sqlite3_uint64 v = druid_get_le64(a);
+  double r;
+  memcpy(&r, &v, sizeof(r));
+  return r;
+}
+
+static void druid_put_le_double(u8 *a, double r){
+  sqlite3_uint64 v;
+  memcpy(&v, &r, sizeof(v));
+  druid_put_le64(a, v);
+}
+
+/*
+** Theta sketches (Druid's thetaSketch aggregator).
+**
+** A serialized theta sketch (serialization version 3) is a preamble of
+** 1 to 3 longs followed by the retained 64-bit hashes:
+**
+**    byte 0      preamble longs (low 6 bits)
+**    byte 1      serialization version (3)
+**    byte 2      family (2 = QuickSelect, 3 = Compact)
+**    byte 3      lg(nominal entries)
+**    byte 4      lg(hash table size), QuickSelect only
+**    byte 5      flags (DRUID_DS_FLAG_xxx)
+**    bytes 6-7   seed hash
+**    bytes 8-11  number of retained hashes       (preamble longs >= 2)
+**    bytes 16-23 theta as a long                 (preamble longs == 3)
+**
+** The union keeps the K smallest hashes below the smallest theta, so its
+** state is a single array that grows to 2*K entries and is then
+** compacted in place.
+**
+**    druid_theta_union(X)      aggregate, union of the sketches in X
+**    druid_theta_estimate(X)   aggregate, distinct count estimate of the union
+*/
+#define DRUID_THETA_MAX          ((sqlite3_uint64)0x7fffffffffffffffULL)
+#define DRUID_THETA_DEFAULT_LGK  14          /* Druid's default size 16384 */
+#define DRUID_THETA_MAX_LGK      20
+
+/* State of druid_theta_union() and druid_theta_estimate() */
+typedef struct DruidTheta {
+  bool bInit;                     /* True once any sketch was merged */
+  int lgK;                        /* lg(nominal entries) of the union */
+  u16 seedHash;                   /* Seed hash of the merged sketches */
+  sqlite3_uint64 theta;           /* Current theta */
+  int nHash;                      /* Number of entries in aHash[] */
+  int nAlloc;                     /* Space allocated for aHash[] */
+  sqlite3_uint64 *aHash;          /* Retained hashes, in no particular order */
+} DruidTheta;
+
+static int druid_u64_cmp(const void *pA, const void *pB){
+  sqlite3_uint64 a = *(const sqlite3_uint64*)pA;
+  sqlite3_uint64 b = *(const sqlite3_uint64*)pB;
+  return a<b ? -1 : a>b;
+}
+
+/* Sort and deduplicate the hashes of p, and keep at most K of them,
+** lowering theta to the first hash that was dropped.
+*/
+static void druid_theta_compact(DruidTheta *p){
+  int i, j;
+  int k = 1<<p->lgK;
+  qsort(p->aHash, p->nHash, sizeof(p->aHash[0]), druid_u64_cmp);
+  for(i=j=0; i<p->nHash; i++){
+    if( p->aHash[i]>=p->theta ) break;
+    if( j>0 && p->aHash[j-1]==p->aHash[i] ) continue;
+    p->aHash[j++] = p->aHash[i];
   }
-  if( DRUID_FILENAME==0 ){
-    druid_errmsg(&sRdr, "must specify either filename= ");
-    goto csvtab_connect_error;
+  if( j>k ){
+    p->theta = p->aHash[k];
+    j = k;
   }
-  if(DRUID_METRICS != 0){
-    num_druid_metrics = count_string_reps(DRUID_METRICS, ',') + 1;
-    druid_metric_names = sqlite3_malloc(sizeof (char*) * num_druid_metrics);
-    memset(druid_metric_names, 0, sizeof (char*) * num_druid_metrics);
-    i=0;
-    int prev_start = 0;
-    int pos = 0;
-    int cur_len = 0;
-    for(pos=0;DRUID_METRICS[pos];pos++){
-      if(DRUID_METRICS[pos]==','){
-        cur_len = pos - prev_start;
-        druid_metric_names[i] = sqlite3_malloc(sizeof(char) * cur_len + 1);
-        memcpy(druid_metric_names[i], &DRUID_METRICS[prev_start], cur_len);
-        druid_metric_names[i][cur_len] = 0;
-        prev_start = pos + 1;
-        i++;
+  p->nHash = j;
+}
+
+/* Merge a serialized theta sketch into p.  Return NULL on success or an
+** error message.
+*/
+static const char *druid_theta_merge_bytes(DruidTheta *p, const u8 *a, int n){
+  int preLongs, nEntry, i, lgK;
+  sqlite3_uint64 theta = DRUID_THETA_MAX;
+  const u8 *aEntry;
+  u16 seedHash;
+  if( n<8 || a[1]!=3 || (a[2]!=2 && a[2]!=3) ){
+    return "unsupported theta sketch, expected serialization version 3";
+  }
+  if( a[5] & DRUID_DS_FLAG_BIG_ENDIAN ) return "big-endian theta sketches are not supported";
+  preLongs = a[0] & 0x3f;
+  seedHash = (u16)(a[6] | (a[7]<<8));
+  lgK = a[3];
+  if( lgK<4 || lgK>DRUID_THETA_MAX_LGK ) lgK = DRUID_THETA_DEFAULT_LGK;
+  if( !p->bInit ){
+    p->bInit = true;
+    p->theta = DRUID_THETA_MAX;
+    p->lgK = lgK;
+    p->seedHash = seedHash;
+  }else if( p->seedHash!=seedHash ){
+    return "theta sketches were built with different seeds";
+  }
+  if( lgK>p->lgK ) p->lgK = lgK;
+  if( preLongs==1 ){
+    if( (a[5] & DRUID_DS_FLAG_EMPTY) || n<16 ) return 0;
+    nEntry = 1;                               /* a single item sketch */
+  }else{
+    if( n<preLongs*8 ) return "truncated theta sketch";
+    nEntry = (int)druid_get_le32(&a[8]);
+    if( preLongs>=3 ) theta = druid_get_le64(&a[16]);
+    if( a[2]==2 ) nEntry = 1<<a[4];           /* the whole hash table */
+  }
+  aEntry = &a[preLongs*8];
+  if( nEntry<0 || (sqlite3_int64)nEntry*8>n-preLongs*8 ) return "truncated theta sketch";
+  if( theta<p->theta ) p->theta = theta;
+  for(i=0; i<nEntry; i++){
+    sqlite3_uint64 h = druid_get_le64(&aEntry[i*8]);
+    if( h==0 || h>=p->theta ) continue;
+    if( p->nHash>=p->nAlloc ){
+      int nNew = p->nAlloc ? p->nAlloc*2 : 1024;
+      sqlite3_uint64 *aNew;
+      if( p->nAlloc>=(2<<p->lgK) ){
+        druid_theta_compact(p);
+        if( h>=p->theta ) continue;
+        nNew = p->nAlloc;
+      }
+      if( nNew!=p->nAlloc ){
+        aNew = sqlite3_realloc64(p->aHash, sizeof(sqlite3_uint64)*nNew);
+        if( aNew==0 ) return "out of memory";
+        p->aHash = aNew;
+        p->nAlloc = nNew;
       }
     }
-    cur_len = pos - prev_start;
-    druid_metric_names[i] = sqlite3_malloc(sizeof(char) * cur_len + 1);
-    memcpy(druid_metric_names[i], &DRUID_METRICS[prev_start], cur_len);
-    druid_metric_names[i][cur_len] = 0;
-    assert(i+1==num_druid_metrics);
+    p->aHash[p->nHash++] = h;
   }
+  return 0;
+}
 
-  if(druid_reader_open(&sRdr, DRUID_FILENAME)){
-    goto csvtab_connect_error;
+/* Serialize p as a compact ordered theta sketch.  Return the number of
+** bytes written into the buffer returned in *pzOut, or -1 on OOM.
+*/
+static int druid_theta_serialize(DruidTheta *p, u8 **pzOut){
+  int preLongs, n, i;
+  u8 *z;
+  druid_theta_compact(p);
+  if( p->nHash==0 && p->theta==DRUID_THETA_MAX ){
+    preLongs = 1;
+  }else{
+    preLongs = p->theta==DRUID_THETA_MAX ? 2 : 3;
   }
-  pNew = sqlite3_malloc( sizeof(*pNew) );
-  *ppVtab = (sqlite3_vtab*)pNew;
-  if( pNew==0 ) goto csvtab_connect_oom;
-  memset(pNew, 0, sizeof(*pNew));
+  n = preLongs*8 + p->nHash*8;
+  z = sqlite3_malloc(n);
+  if( z==0 ) return -1;
+  memset(z, 0, preLongs*8);
+  z[0] = (u8)preLongs;
+  z[1] = 3;
+  z[2] = 3;
+  z[3] = (u8)p->lgK;
+  z[5] = DRUID_DS_FLAG_READ_ONLY | DRUID_DS_FLAG_COMPACT | DRUID_DS_FLAG_ORDERED;
+  if( preLongs==1 ) z[5] |= DRUID_DS_FLAG_EMPTY;
+  z[6] = (u8)p->seedHash;
+  z[7] = (u8)(p->seedHash>>8);
+  if( preLongs>=2 ){
+    float one = 1.0f;
+    u32 v;
+    memcpy(&v, &one, sizeof(v));
+    druid_put_le32(&z[8], (u32)p->nHash);
+    druid_put_le32(&z[12], v);
+  }
+  if( preLongs>=3 ) druid_put_le64(&z[16], p->theta);
+  for(i=0; i<p->nHash; i++){
+    druid_put_le64(&z[preLongs*8 + i*8], p->aHash[i]);
+  }
+  *pzOut = z;
+  return n;
+}
 
-  sqlite3_str *pStr = sqlite3_str_new(0);
-  char *zSep = "";
-  int iCol = 0;
-  sqlite3_str_appendf(pStr, "CREATE TABLE x(");
-  // count columns
-  nCol = 0;
-  do{
-    read_field_ret = druid_read_one_field(&sRdr);
-    nCol++;
-  }while( GOT_FIELD == read_field_ret);
-  rewindCur(&sRdr);
+/* xStep of druid_theta_union() and druid_theta_estimate() */
+static void druid_theta_step(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  DruidTheta *p;
+  const u8 *a;
+  u8 *zFree;
+  const char *zErr;
+  (void)argc;
+  int n;
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL ) return;
+  p = sqlite3_aggregate_context(ctx, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  a = druid_sketch_bytes(argv[0], &n, &zFree);
+  if( a==0 && n==-1 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  if( a==0 && n!=0 ){
+    sqlite3_result_error(ctx, "malformed theta sketch", -1);
+    return;
+  }
+  zErr = druid_theta_merge_bytes(p, a, n);
+  sqlite3_free(zFree);
+  if( zErr ) sqlite3_result_error(ctx, zErr, -1);
+}
 
-  pNew->colNames = sqlite3_malloc(sizeof(char*) * nCol);
-  memset(pNew->colNames, 0, sizeof(char*) * nCol);
-  pNew->metricsCols = sqlite3_malloc(sizeof(bool) * nCol);
-  memset(pNew->metricsCols, 0, sizeof(bool) * nCol);
+/* xFinal of druid_theta_union() */
+static void druid_theta_union_final(sqlite3_context *ctx){
+  DruidTheta *p = sqlite3_aggregate_context(ctx, 0);
+  u8 *zOut;
+  int n;
+  if( p==0 || !p->bInit ) return;
+  n = druid_theta_serialize(p, &zOut);
+  sqlite3_free(p->aHash);
+  if( n<0 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  sqlite3_result_blob(ctx, zOut, n, sqlite3_free);
+}
 
-  // read header
-  do{
-    read_field_ret = druid_read_one_field(&sRdr);
-    if( nCol>0 && iCol<nCol ){
-      bool is_metric = 0;
-      for(i=0;i<num_druid_metrics;i++){
-        if(0 == strcmp(druid_metric_names[i], sRdr.label)){
-          is_metric = 1;
-          break;
-        }
-      }
-      if(is_metric){
-          sqlite3_str_appendf(pStr,"%s\"%w\" REAL", zSep, sRdr.label);
-          pNew->metricsCols[iCol] = 1;
-      }else{
-          sqlite3_str_appendf(pStr,"%s\"%w\" TEXT", zSep, sRdr.label);
-      }
-      zSep = ",";
-      pNew->colNames[iCol] = sqlite3_malloc(sizeof(char) * (strlen(sRdr.label) + 1));
-      strcpy(pNew->colNames[iCol], sRdr.label);
-      iCol++;
-    }
-  }while( GOT_FIELD == read_field_ret );
-    rewindCur(&sRdr);
-  pNew->nCol = nCol;
-  sqlite3_str_appendf(pStr, ")");
-  schema = sqlite3_str_finish(pStr);
+/* xFinal of druid_theta_estimate() */
+static void druid_theta_estimate_final(sqlite3_context *ctx){
+  DruidTheta *p = sqlite3_aggregate_context(ctx, 0);
+  double r;
+  if( p==0 || !p->bInit ) return;
+  druid_theta_compact(p);
+  sqlite3_free(p->aHash);
+  r = p->nHash;
+  if( p->theta<DRUID_THETA_MAX ) r /= (double)p->theta/(double)DRUID_THETA_MAX;
+  sqlite3_result_double(ctx, r);
+}
 
-  if( schema==0 ) goto csvtab_connect_oom;
+/*
+** Quantiles sketches (Druid's quantilesDoublesSketch aggregator).
+**
+** A serialized DoublesSketch (serialization version 3) is:
+**
+**    byte 0      preamble longs (1 if empty, else 2)
+**    byte 1      serialization version (3)
+**    byte 2      family (8)
+**    byte 3      flags (DRUID_DS_FLAG_xxx)
+**    bytes 4-5   k
+**    bytes 8-15  n, the number of items summarized
+**    bytes 16-31 min and max item
+**    items       the base buffer (n % 2k items of weight 1), then k items
+**                for every level L set in n / 2k, of weight 2^(L+1)
+**
+** Compact images store only the valid items, updatable images store the
+** base buffer with room for 2k items and a slot of k items per level.
+**
+** The merge is the DataSketches algorithm: base buffer items are
+** inserted one by one, and levels are carried up with the same
+** sort/zip propagation that inserting into a full base buffer uses.
+** All the scratch space is allocated once per group.
+**
+**    druid_quantiles_merge(X)        aggregate, merge of the sketches in X
+**    druid_quantiles_quantile(X, F)  aggregate, quantile F (0..1) of the merge
+*/
+#define DRUID_QUANTILES_FAMILY  8
+#define DRUID_QUANTILES_MAX_K   32768
+#define DRUID_QUANTILES_MAX_N   ((sqlite3_int64)0x7fffffffffffffffLL)
 
-  pNew->zFilename = DRUID_FILENAME;  DRUID_FILENAME = 0;
-#ifdef SQLITE_TEST
-  pNew->tstFlags = tstFlags;
-#endif
-  // set iStart after header
-  pNew->iStart = (int)(ftell(sRdr.in) - sRdr.nIn + sRdr.iIn);
-  druid_reader_reset(&sRdr);
-  rc = sqlite3_declare_vtab(db, schema);
-  if( rc ){
-    druid_errmsg(&sRdr, "bad schema: '%s' - %s", schema, sqlite3_errmsg(db));
-    goto csvtab_connect_error;
+/* State of the quantiles aggregates */
+typedef struct DruidQuantiles {
+  bool bInit;                     /* True once any sketch was merged */
+  int k;                          /* k of the merged sketch */
+  sqlite3_int64 n;                /* Number of summarized items */
+  double min, max;                /* Smallest and largest item */
+  int nBase;                      /* Items in the base buffer */
+  double *aBase;                  /* Base buffer, room for 2k items */
+  double *aScratch;               /* Scratch space for 3k items */
+  sqlite3_uint64 bitPattern;      /* Bit L is set if level L is full */
+  int nLevelAlloc;                /* Number of levels allocated in aLevel[] */
+  double *aLevel;                 /* k items per level */
+  u32 rng;                        /* State of the zip offset generator */
+  double fraction;                /* Requested quantile */
+} DruidQuantiles;
+
+static int druid_double_cmp(const void *pA, const void *pB){
+  double a = *(const double*)pA;
+  double b = *(const double*)pB;
+  return a<b ? -1 : a>b;
+}
+
+/* Allocate the buffers of p for a given k.  Return non-zero on OOM. */
+static int druid_quantiles_alloc(DruidQuantiles *p, int k){
+  p->k = k;
+  p->aBase = sqlite3_malloc64(sizeof(double)*5*k);
+  if( p->aBase==0 ) return 1;
+  p->aScratch = &p->aBase[2*k];
+  p->nBase = 0;
+  p->bitPattern = 0;
+  p->nLevelAlloc = 0;
+  p->aLevel = 0;
+  if( p->rng==0 ) p->rng = 0x9e3779b9;
+  return 0;
+}
+
+static void druid_quantiles_free(DruidQuantiles *p){
+  sqlite3_free(p->aBase);
+  sqlite3_free(p->aLevel);
+  p->aBase = 0;
+  p->aLevel = 0;
+}
+
+/* Return 0 or 1, the offset of the next zip */
+static int druid_quantiles_coin(DruidQuantiles *p){
+  p->rng ^= p->rng<<13;
+  p->rng ^= p->rng>>17;
+  p->rng ^= p->rng<<5;
+  return p->rng & 1;
+}
+
+/* Carry k sorted items (aCarry, which must not be in aLevel[]) into
+** level L, merging and zipping full levels upwards.
+** Return non-zero on OOM.
+*/
+static int druid_quantiles_carry(DruidQuantiles *p, const double *aCarry, int L){
+  int k = p->k;
+  double *aMerge = p->aScratch;            /* 2k items */
+  double *aZip = &p->aScratch[2*k];        /* k items */
+  if( aCarry!=aZip ) memcpy(aZip, aCarry, sizeof(double)*k);
+  while( p->bitPattern & (((sqlite3_uint64)1)<<L) ){
+    const double *aLvl = &p->aLevel[L*k];
+    int i = 0, j = 0, m = 0, off;
+    while( i<k && j<k ) aMerge[m++] = aLvl[i]<=aZip[j] ? aLvl[i++] : aZip[j++];
+    while( i<k ) aMerge[m++] = aLvl[i++];
+    while( j<k ) aMerge[m++] = aZip[j++];
+    off = druid_quantiles_coin(p);
+    for(i=0; i<k; i++) aZip[i] = aMerge[2*i+off];
+    p->bitPattern &= ~(((sqlite3_uint64)1)<<L);
+    L++;
   }
-  for(i=0; i<sizeof(azPValue)/sizeof(azPValue[0]); i++){
-    sqlite3_free(azPValue[i]);
+  /* Level L holds k*2^(L+1) of the p->n items, see druid_quantiles_merge_bytes() */
+  assert( L<64 );
+  if( L>=p->nLevelAlloc ){
+    int nNew = L+4;
+    double *aNew = sqlite3_realloc64(p->aLevel, sizeof(double)*k*nNew);
+    if( aNew==0 ) return 1;
+    p->aLevel = aNew;
+    p->nLevelAlloc = nNew;
   }
-  /* Rationale for DIRECTONLY:
-  ** An attacker who controls a database schema could use this vtab
-  ** to exfiltrate sensitive data from other files in the filesystem.
-  ** And, recommended practice is to put all CSV virtual tables in the
-  ** TEMP namespace, so they should still be usable from within TEMP
-  ** views, so there shouldn't be a serious loss of functionality by
-  ** prohibiting the use of this vtab from persistent triggers and views.
-  */
-  sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
-  free_druid_metrics_names(num_druid_metrics, druid_metric_names);
-  return SQLITE_OK;
-
-csvtab_connect_oom:
-  rc = SQLITE_NOMEM;
-  druid_errmsg(&sRdr, "out of memory");
+  memcpy(&p->aLevel[L*k], aZip, sizeof(double)*k);
+  p->bitPattern |= ((sqlite3_uint64)1)<<L;
+  return 0;
+}
 
-csvtab_connect_error:
+/* Insert one item of weight 1, without changing n, min or max.
+** Return non-zero on OOM.
+*/
+static int druid_quantiles_insert(DruidQuantiles *p, double x){
+  int k = p->k;
+  int i, off;
+  p->aBase[p->nBase++] = x;
+  if( p->nBase<2*k ) return 0;
+  qsort(p->aBase, 2*k, sizeof(double), druid_double_cmp);
+  off = druid_quantiles_coin(p);
+  for(i=0; i<k; i++) p->aScratch[2*k+i] = p->aBase[2*i+off];
+  p->nBase = 0;
+  return druid_quantiles_carry(p, &p->aScratch[2*k], 0);
+}
 
-  free_druid_metrics_names(num_druid_metrics, druid_metric_names);
+/* Carry the k0 items of a level L0 of a sketch with k0>=p->k into p,
+** downsampling them to p->k items.  Return non-zero on OOM.
+*/
+static int druid_quantiles_add_level(DruidQuantiles *p, const double *a, int k0, int L0){
+  double *aZip = &p->aScratch[2*p->k];
+  int r = k0/p->k;
+  int lgR = 0;
+  int off = druid_quantiles_coin(p) ? (int)(p->rng % r) : 0;
+  int i;
+  while( (1<<lgR)<r ) lgR++;
+  for(i=0; i<p->k; i++) aZip[i] = a[i*r + off];
+  return druid_quantiles_carry(p, aZip, L0+lgR);
+}
 
-  if( pNew ) druidtabDisconnect(&pNew->base);
-  for(i=0; i<sizeof(azPValue)/sizeof(azPValue[0]); i++){
-    sqlite3_free(azPValue[i]);
+/* Reduce the k of p to a smaller power of two.  Return non-zero on OOM. */
+static int druid_quantiles_downsample(DruidQuantiles *p, int k){
+  DruidQuantiles old = *p;
+  int L, i;
+  if( druid_quantiles_alloc(p, k) ){
+    *p = old;
+    return 1;
   }
-  if( sRdr.zErr[0] ){
-    sqlite3_free(*pzErr);
-    *pzErr = sqlite3_mprintf("%s", sRdr.zErr);
+  for(i=0; i<old.nBase; i++){
+    if( druid_quantiles_insert(p, old.aBase[i]) ) break;
   }
-  druid_reader_reset(&sRdr);
-  if( rc==SQLITE_OK ) rc = SQLITE_ERROR;
-  return rc;
+  for(L=0; i>=old.nBase && L<64; L++){
+    if( (old.bitPattern & (((sqlite3_uint64)1)<<L))==0 ) continue;
+    if( druid_quantiles_add_level(p, &old.aLevel[L*old.k], old.k, L) ) break;
+  }
+  druid_quantiles_free(&old);
+  return i<old.nBase || L<64;
 }
 
-static void free_druid_metrics_names(int num_druid_metrics, char **druid_metric_names) {
-  if(num_druid_metrics){
-    for(int i=0;i<num_druid_metrics;i++){
-      sqlite3_free(druid_metric_names[i]);
+/* Merge a serialized DoublesSketch into p.  Return SQLITE_OK, or
+** SQLITE_CORRUPT for an image that is not valid, SQLITE_ERROR for one
+** that is not supported or SQLITE_NOMEM, with the message in *pzErr.
+** p is left as it was if the image is rejected.
+*/
+static int druid_quantiles_merge_bytes(DruidQuantiles *p, const u8 *a, int n, const char **pzErr){
+  int preLongs, k, flags, bbCount, nLevel, nSet, lgR, L, i;
+  sqlite3_int64 nItem;
+  sqlite3_uint64 bitPattern, b;
+  const u8 *aItem;
+  sqlite3_int64 nNeed;
+  if( n<8 || a[1]!=3 || a[2]!=DRUID_QUANTILES_FAMILY ){
+    *pzErr = "unsupported quantiles sketch, expected serialization version 3";
+    return SQLITE_ERROR;
+  }
+  preLongs = a[0] & 0x3f;
+  flags = a[3];
+  k = a[4] | (a[5]<<8);
+  if( flags & DRUID_DS_FLAG_BIG_ENDIAN ){
+    *pzErr = "big-endian quantiles sketches are not supported";
+    return SQLITE_ERROR;
+  }
+  if( k<2 || k>DRUID_QUANTILES_MAX_K || (k & (k-1))!=0 ){
+    *pzErr = "bad k in quantiles sketch";
+    return SQLITE_CORRUPT;
+  }
+  if( !p->bInit ){
+    if( druid_quantiles_alloc(p, k) ) goto quantiles_nomem;
+    p->bInit = true;
+    p->n = 0;
+  }
+  if( (flags & DRUID_DS_FLAG_EMPTY) || preLongs<2 ) return SQLITE_OK;
+  if( n<32 ) goto quantiles_truncated;
+  nItem = (sqlite3_int64)druid_get_le64(&a[8]);
+  if( nItem<=0 ) return SQLITE_OK;
+  bbCount = (int)(nItem % (2*k));
+  bitPattern = (sqlite3_uint64)(nItem / (2*k));
+  nLevel = nSet = 0;
+  for(b=bitPattern; b; b>>=1){
+    nLevel++;
+    nSet += (int)(b & 1);
+  }
+  /* Level L of the image is carried into level L+lgR of p, and carries
+  ** move up the levels of p, of which there are 64 at most.  The weight
+  ** of all the items must also fit in p->n */
+  for(lgR=0; (k>>lgR)>p->k; lgR++){}
+  if( nLevel+lgR>=64 || nItem>DRUID_QUANTILES_MAX_N-p->n ){
+    *pzErr = "corrupt quantiles sketch, too many items";
+    return SQLITE_CORRUPT;
+  }
+  if( flags & DRUID_DS_FLAG_COMPACT ){
+    nNeed = 32 + ((sqlite3_int64)bbCount + (sqlite3_int64)nSet*k)*8;
+  }else{
+    nNeed = 32 + (sqlite3_int64)(bitPattern ? 2*k + nLevel*k : bbCount)*8;
+  }
+  if( nNeed>n ) goto quantiles_truncated;
+  if( k<p->k && druid_quantiles_downsample(p, k) ) goto quantiles_nomem;
+  if( p->n==0 ){
+    p->min = druid_get_le_double(&a[16]);
+    p->max = druid_get_le_double(&a[24]);
+  }else{
+    double mn = druid_get_le_double(&a[16]);
+    double mx = druid_get_le_double(&a[24]);
+    if( mn<p->min ) p->min = mn;
+    if( mx>p->max ) p->max = mx;
+  }
+  aItem = &a[32];
+  for(i=0; i<bbCount; i++){
+    if( druid_quantiles_insert(p, druid_get_le_double(&aItem[i*8])) ) goto quantiles_nomem;
+  }
+  aItem += (flags & DRUID_DS_FLAG_COMPACT) || bitPattern==0 ? bbCount*8 : 2*k*8;
+  for(L=0; bitPattern; L++, bitPattern>>=1){
+    if( bitPattern & 1 ){
+      /* Downsample the level if p has a smaller k, keeping every r-th item */
+      double *aZip = &p->aScratch[2*p->k];
+      int r = k/p->k;
+      int off = druid_quantiles_coin(p) ? (int)(p->rng % r) : 0;
+      for(i=0; i<p->k; i++) aZip[i] = druid_get_le_double(&aItem[(i*r + off)*8]);
+      if( druid_quantiles_carry(p, aZip, L+lgR) ) goto quantiles_nomem;
+      aItem += k*8;
+    }else if( (flags & DRUID_DS_FLAG_COMPACT)==0 ){
+      aItem += k*8;
     }
-    sqlite3_free(druid_metric_names);
   }
+  p->n += nItem;
+  return SQLITE_OK;
+
+quantiles_truncated:
+  *pzErr = "truncated quantiles sketch";
+  return SQLITE_CORRUPT;
+quantiles_nomem:
+  *pzErr = "out of memory";
+  return SQLITE_NOMEM;
 }
 
-/*
-** Reset the current row content held by a DruidCursor.
+/* Serialize p as a compact ordered DoublesSketch.  Return the number of
+** bytes written into the buffer returned in *pzOut, or -1 on OOM.
 */
-static void csvtabCursorRowReset(DruidCursor *pCur){
-  DruidTable *pTab = (DruidTable*)pCur->base.pVtab;
-  int i;
-  for(i=0; i<pTab->nCol; i++){
-    sqlite3_free(pCur->azVal[i]);
-    pCur->azVal[i] = 0;
-    pCur->aLen[i] = 0;
-    pCur->jsonType[i] = JSON_NULL;
+static int druid_quantiles_serialize(DruidQuantiles *p, u8 **pzOut){
+  int k = p->k;
+  int nLevel = 0, nByte, L, i;
+  sqlite3_uint64 b;
+  u8 *z, *zItem;
+  for(b=p->bitPattern; b; b>>=1) nLevel += (int)(b & 1);
+  nByte = p->n==0 ? 8 : 32 + (p->nBase + nLevel*k)*8;
+  z = sqlite3_malloc(nByte);
+  if( z==0 ) return -1;
+  memset(z, 0, nByte<32 ? nByte : 32);
+  z[0] = p->n==0 ? 1 : 2;
+  z[1] = 3;
+  z[2] = DRUID_QUANTILES_FAMILY;
+  z[3] = DRUID_DS_FLAG_READ_ONLY | DRUID_DS_FLAG_COMPACT | DRUID_DS_FLAG_ORDERED;
+  if( p->n==0 ) z[3] |= DRUID_DS_FLAG_EMPTY;
+  z[4] = (u8)k;
+  z[5] = (u8)(k>>8);
+  if( p->n>0 ){
+    druid_put_le64(&z[8], (sqlite3_uint64)p->n);
+    druid_put_le_double(&z[16], p->min);
+    druid_put_le_double(&z[24], p->max);
+    qsort(p->aBase, p->nBase, sizeof(double), druid_double_cmp);
+    zItem = &z[32];
+    for(i=0; i<p->nBase; i++, zItem+=8) druid_put_le_double(zItem, p->aBase[i]);
+    for(L=0; L<64; L++){
+      if( (p->bitPattern & (((sqlite3_uint64)1)<<L))==0 ) continue;
+      for(i=0; i<k; i++, zItem+=8) druid_put_le_double(zItem, p->aLevel[L*k+i]);
+    }
+  }
+  *pzOut = z;
+  return nByte;
+}
+
+/* Return the item of p at normalized rank fraction */
+static double druid_quantiles_get(DruidQuantiles *p, double fraction){
+  int k = p->k;
+  int nItem, L, i;
+  sqlite3_int64 pos, cum;
+  typedef struct { double v; sqlite3_int64 w; } Weighted;
+  Weighted *a;
+  double r;
+  if( fraction<=0.0 ) return p->min;
+  if( fraction>=1.0 ) return p->max;
+  nItem = p->nBase;
+  for(L=0; L<64; L++){
+    if( p->bitPattern & (((sqlite3_uint64)1)<<L) ) nItem += k;
+  }
+  a = sqlite3_malloc64(sizeof(Weighted)*(nItem ? nItem : 1));
+  if( a==0 ) return p->max;
+  for(i=0; i<p->nBase; i++){
+    a[i].v = p->aBase[i];
+    a[i].w = 1;
   }
+  for(L=0; L<64; L++){
+    int j;
+    if( (p->bitPattern & (((sqlite3_uint64)1)<<L))==0 ) continue;
+    for(j=0; j<k; j++, i++){
+      a[i].v = p->aLevel[L*k+j];
+      a[i].w = ((sqlite3_int64)2)<<L;
+    }
+  }
+  qsort(a, nItem, sizeof(Weighted), druid_double_cmp);
+  pos = (sqlite3_int64)(fraction*(double)p->n);
+  r = p->max;
+  for(i=0, cum=0; i<nItem; i++){
+    cum += a[i].w;
+    if( cum>pos ){
+      r = a[i].v;
+      break;
+    }
+  }
+  sqlite3_free(a);
+  return r;
+}
+
+/* xStep of druid_quantiles_merge() and druid_quantiles_quantile() */
+static void druid_quantiles_step(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  DruidQuantiles *p;
+  const u8 *a;
+  u8 *zFree;
+  const char *zErr;
+  int n, rc;
+  p = sqlite3_aggregate_context(ctx, sizeof(*p));
+  if( p==0 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  if( argc>1 && !p->bInit ) p->fraction = sqlite3_value_double(argv[1]);
+  if( sqlite3_value_type(argv[0])==SQLITE_NULL ) return;
+  a = druid_sketch_bytes(argv[0], &n, &zFree);
+  if( a==0 && n==-1 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  if( a==0 && n!=0 ){
+    sqlite3_result_error(ctx, "malformed quantiles sketch", -1);
+    return;
+  }
+  rc = druid_quantiles_merge_bytes(p, a, n, &zErr);
+  sqlite3_free(zFree);
+  if( rc==SQLITE_NOMEM ){
+    sqlite3_result_error_nomem(ctx);
+  }else if( rc!=SQLITE_OK ){
+    sqlite3_result_error(ctx, zErr, -1);
+    sqlite3_result_error_code(ctx, rc);
+  }
+}
+
+/* xFinal of druid_quantiles_merge() */
+static void druid_quantiles_merge_final(sqlite3_context *ctx){
+  DruidQuantiles *p = sqlite3_aggregate_context(ctx, 0);
+  u8 *zOut;
+  int n;
+  if( p==0 || !p->bInit ) return;
+  n = druid_quantiles_serialize(p, &zOut);
+  druid_quantiles_free(p);
+  if( n<0 ){
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  sqlite3_result_blob(ctx, zOut, n, sqlite3_free);
+}
+
+/* xFinal of druid_quantiles_quantile() */
+static void druid_quantiles_quantile_final(sqlite3_context *ctx){
+  DruidQuantiles *p = sqlite3_aggregate_context(ctx, 0);
+  if( p==0 || !p->bInit ) return;
+  if( p->n>0 ) sqlite3_result_double(ctx, druid_quantiles_get(p, p->fraction));
+  druid_quantiles_free(p);
 }
 
+static sqlite3_module DruidJsonModule = {
+#if SQLITE_VERSION_NUMBER>=3026000
+  3,                       /* iVersion */
+#else
+  0,                       /* iVersion */
+#endif
+  druidtabCreate,            /* xCreate */
+  druidtabConnect,           /* xConnect */
+  druidtabBestIndex,         /* xBestIndex */
+  druidtabDisconnect,        /* xDisconnect */
+  druidtabDestroy,           /* xDestroy */
+  druidtabOpen,              /* xOpen - open a cursor */
+  druidtabClose,             /* xClose - close a cursor */
+  druidtabFilter,            /* xFilter - configure scan constraints */
+  druidtabNext,              /* xNext - advance a cursor */
+  druidtabEof,               /* xEof - check for end of scan */
+  druidtabColumn,            /* xColumn - read data */
+  druidtabRowid,             /* xRowid - read data */
+  0,                       /* xUpdate */
+  0,                       /* xBegin */
+  0,                       /* xSync */
+  0,                       /* xCommit */
+  0,                       /* xRollback */
+  druidtabFindMethod,      /* xFindMethod */
+  druidtabRename,          /* xRename */
+#if SQLITE_VERSION_NUMBER>=3026000
+  0,                       /* xSavepoint */
+  0,                       /* xRelease */
+  0,                       /* xRollbackTo */
+  druidtabShadowName,      /* xShadowName */
+#endif
+};
+
 /*
-** The xConnect and xCreate methods do the same thing, but they must be
-** different so that the virtual table is not an eponymous virtual table.
+** The druid_json_column_stats table-valued function.
+**
+**    SELECT * FROM druid_json_column_stats('my_druid_result');
+**
+** returns one row per column of a druid_json table with its type, the
+** number of rows, the estimated number of distinct values (TEXT columns
+** only) and the number of NULLs.  If no full scan of the table completed
+** yet, the statistics are collected first.  That reads the whole file, so
+** the function is DIRECTONLY: schema objects cannot run it.
 */
-static int druidtabCreate(
+typedef struct DruidStatsVtab {
+  sqlite3_vtab base;              /* Base class.  Must be first */
+  DruidModule *pModule;           /* Tables of the connection */
+} DruidStatsVtab;
+
+typedef struct DruidStatsCursor {
+  sqlite3_vtab_cursor base;       /* Base class.  Must be first */
+  DruidTable *pTab;               /* Table whose columns are listed */
+  int iCol;                       /* Current column */
+} DruidStatsCursor;
+
+#define DRUID_STATS_COL_NAME   0
+#define DRUID_STATS_COL_TYPE   1
+#define DRUID_STATS_COL_ROWS   2
+#define DRUID_STATS_COL_NDV    3
+#define DRUID_STATS_COL_NULLS  4
+#define DRUID_STATS_COL_MIN    5
+#define DRUID_STATS_COL_MAX    6
+#define DRUID_STATS_COL_SUM    7
+#define DRUID_STATS_COL_TABLE  8
+
+static int druidStatsConnect(
   sqlite3 *db,
   void *pAux,
   int argc, const char *const*argv,
   sqlite3_vtab **ppVtab,
   char **pzErr
 ){
- return druidtabConnect(db, pAux, argc, argv, ppVtab, pzErr);
+  DruidStatsVtab *pNew;
+  int rc = sqlite3_declare_vtab(db,
+      "CREATE TABLE x(name TEXT, type TEXT, rows INTEGER, ndv INTEGER,"
+      " nulls INTEGER, min REAL, max REAL, sum REAL, tbl HIDDEN)");
+  (void)argc; (void)argv; (void)pzErr;
+  if( rc!=SQLITE_OK ) return rc;
+  pNew = sqlite3_malloc(sizeof(*pNew));
+  *ppVtab = (sqlite3_vtab*)pNew;
+  if( pNew==0 ) return SQLITE_NOMEM;
+  memset(pNew, 0, sizeof(*pNew));
+  pNew->pModule = (DruidModule*)pAux;
+  sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+  return SQLITE_OK;
 }
 
-/*
-** Destructor for a DruidCursor.
-*/
-static int druidtabClose(sqlite3_vtab_cursor *cur){
-  DruidCursor *pCur = (DruidCursor*)cur;
-  csvtabCursorRowReset(pCur);
-  druid_reader_reset(&pCur->rdr);
-  sqlite3_free(cur);
+static int druidStatsDisconnect(sqlite3_vtab *pVtab){
+  sqlite3_free(pVtab);
   return SQLITE_OK;
 }
 
-/*
-** Constructor for a new DruidTable cursor object.
-*/
-static int druidtabOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor){
-  DruidTable *pTab = (DruidTable*)p;
-  DruidCursor *pCur;
-  size_t nByte;
-  nByte = sizeof(*pCur) + (sizeof(char*)+sizeof(int)+sizeof(int))*pTab->nCol;
-  pCur = sqlite3_malloc64( nByte );
+static int druidStatsOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor){
+  DruidStatsCursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  (void)p;
   if( pCur==0 ) return SQLITE_NOMEM;
-  memset(pCur, 0, nByte);
-  pCur->azVal = (char**)&pCur[1];
-  pCur->aLen = (int*)&pCur->azVal[pTab->nCol];
-  pCur->jsonType = (int*)&pCur->aLen[pTab->nCol];
+  memset(pCur, 0, sizeof(*pCur));
   *ppCursor = &pCur->base;
-  if(druid_reader_open(&pCur->rdr, pTab->zFilename) ){
-    druid_xfer_error(pTab, &pCur->rdr);
-    return SQLITE_ERROR;
-  }
   return SQLITE_OK;
 }
 
+static int druidStatsClose(sqlite3_vtab_cursor *cur){
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
 
-/*
-** Advance a DruidCursor to its next row of input.
-** Set the EOF marker if we reach the end of input.
-*/
-static int druidtabNext(sqlite3_vtab_cursor *cur){
-  DruidCursor *pCur = (DruidCursor*)cur;
-  DruidTable *pTab = (DruidTable*)cur->pVtab;
-  int i = 0;
-  int druid_field_ret;
-  char *z;
-  do{
-    druid_field_ret = druid_read_one_field(&pCur->rdr);
-    if( druid_field_ret < 0){
+static int druidStatsNext(sqlite3_vtab_cursor *cur){
+  ((DruidStatsCursor*)cur)->iCol++;
+  return SQLITE_OK;
+}
+
+static int druidStatsEof(sqlite3_vtab_cursor *cur){
+  DruidStatsCursor *pCur = (DruidStatsCursor*)cur;
+  return pCur->pTab==0 || pCur->iCol>=pCur->pTab->nCol;
+}
+
+static int druidStatsColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int i){
+  DruidStatsCursor *pCur = (DruidStatsCursor*)cur;
+  DruidTable *pTab = pCur->pTab;
+  DruidStats *pStats = pTab->pStats;
+  int iCol = pCur->iCol;
+  if( pStats==0 ) return SQLITE_OK;   /* Dropped as the file was replaced */
+  switch( i ){
+    case DRUID_STATS_COL_NAME:
+      sqlite3_result_text(ctx, pTab->colNames[iCol], -1, SQLITE_TRANSIENT);
       break;
-    }
-    if( i<pTab->nCol ){
-      if( pCur->aLen[i] < pCur->rdr.value_n + 1 ){
-        char *zNew = sqlite3_realloc64(pCur->azVal[i], pCur->rdr.value_n + 1);
-        if( zNew==0 ){
-          druid_errmsg(&pCur->rdr, "out of memory");
-          druid_xfer_error(pTab, &pCur->rdr);
-          break;
-        }
-        pCur->azVal[i] = zNew;
-        pCur->aLen[i] = pCur->rdr.value_n + 1;
+    case DRUID_STATS_COL_TYPE:
+      sqlite3_result_text(ctx, pTab->metricsCols[iCol] ? "REAL" :
+                               pTab->sketchCols[iCol] ? "BLOB" : "TEXT", -1, SQLITE_STATIC);
+      break;
+    case DRUID_STATS_COL_ROWS:
+      sqlite3_result_int64(ctx, pStats->nRow);
+      break;
+    case DRUID_STATS_COL_NDV:
+      if( druid_is_text_col(pTab, iCol) ){
+        sqlite3_result_int64(ctx, (sqlite3_int64)(druid_stats_ndv(pTab, iCol) + 0.5));
       }
-      memcpy(pCur->azVal[i], pCur->rdr.value, pCur->rdr.value_n + 1);
-      if(0 != strcmp(pCur->rdr.label, pTab->colNames[i])){
-        druid_errmsg(&pCur->rdr, "result %d(offset %d): druid json order change is not supported",
-                     pCur->rdr.nResult, pCur->rdr.file_off);
-        sqlite3_free(pTab->base.zErrMsg);
-        pTab->base.zErrMsg = sqlite3_mprintf("%s", pCur->rdr.zErr);
-        return SQLITE_ERROR;
+      break;
+    case DRUID_STATS_COL_NULLS:
+      sqlite3_result_int64(ctx, pStats->anNull[iCol]);
+      break;
+    case DRUID_STATS_COL_MIN:
+    case DRUID_STATS_COL_MAX:
+    case DRUID_STATS_COL_SUM: {
+      DruidAccum *pAccum = &pStats->aAccum[iCol];
+      if( pTab->metricsCols[iCol] && pAccum->n>0 ){
+        sqlite3_result_double(ctx, i==DRUID_STATS_COL_MIN ? pAccum->rMin :
+                                   i==DRUID_STATS_COL_MAX ? pAccum->rMax :
+                                   druid_accum_sum(pAccum));
       }
-      pCur->jsonType[i] = pCur->rdr.value_type;
-      i++;
-    }
-  }while( GOT_FIELD == druid_field_ret);
-  if( GOT_FAILURE == druid_field_ret || (druid_field_ret == EOF && i<pTab->nCol) ){
-    pCur->iRowid = -1;
-  }else{
-    pCur->iRowid++;
-    while( i<pTab->nCol ){
-      sqlite3_free(pCur->azVal[i]);
-      pCur->azVal[i] = 0;
-      pCur->aLen[i] = 0;
-      pCur->jsonType[i] = JSON_NULL;
-      i++;
+      break;
     }
+    case DRUID_STATS_COL_TABLE:
+      sqlite3_result_text(ctx, pTab->zName, -1, SQLITE_TRANSIENT);
+      break;
   }
-  if (GOT_FAILURE == druid_field_ret) {
-    sqlite3_free(pTab->base.zErrMsg);
-    pTab->base.zErrMsg = sqlite3_mprintf("%s", pCur->rdr.zErr);
+  return SQLITE_OK;
+}
+
+static int druidStatsRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid){
+  *pRowid = ((DruidStatsCursor*)cur)->iCol;
+  return SQLITE_OK;
+}
+
+static int druidStatsFilter(
+  sqlite3_vtab_cursor *pVtabCursor,
+  int idxNum, const char *idxStr,
+  int argc, sqlite3_value **argv
+){
+  DruidStatsCursor *pCur = (DruidStatsCursor*)pVtabCursor;
+  DruidStatsVtab *pVtab = (DruidStatsVtab*)pVtabCursor->pVtab;
+  const char *zName = argc>0 ? (const char*)sqlite3_value_text(argv[0]) : 0;
+  DruidTable *pTab;
+  int rc;
+  (void)idxNum; (void)idxStr;
+  pCur->pTab = 0;
+  pCur->iCol = 0;
+  if( zName==0 ) return SQLITE_OK;
+  for(pTab=pVtab->pModule->pTables; pTab; pTab=pTab->pNextTable){
+    if( sqlite3_stricmp(pTab->zName, zName)==0 ) break;
+  }
+  if( pTab==0 ){
+    sqlite3_free(pVtab->base.zErrMsg);
+    pVtab->base.zErrMsg = sqlite3_mprintf("no such druid_json table: %s", zName);
     return SQLITE_ERROR;
   }
-  else
+  druid_table_refresh(pTab);
+  rc = druid_table_build(pTab, 0, true);
+  if( rc!=SQLITE_OK ){
+    sqlite3_free(pVtab->base.zErrMsg);
+    pVtab->base.zErrMsg = sqlite3_mprintf("%s", pTab->base.zErrMsg);
+    return rc;
+  }
+  pCur->pTab = pTab;
+  return SQLITE_OK;
+}
+
+/* The table name argument is required */
+static int druidStatsBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo){
+  int i;
+  for(i=0; i<pIdxInfo->nConstraint; i++){
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if( pCons->iColumn!=DRUID_STATS_COL_TABLE ) continue;
+    if( pCons->op!=SQLITE_INDEX_CONSTRAINT_EQ ) continue;
+    if( !pCons->usable ) return SQLITE_CONSTRAINT;
+    pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+    pIdxInfo->aConstraintUsage[i].omit = 1;
+    pIdxInfo->estimatedCost = 10;
+    pIdxInfo->estimatedRows = 10;
     return SQLITE_OK;
+  }
+  sqlite3_free(tab->zErrMsg);
+  tab->zErrMsg = sqlite3_mprintf("druid_json_column_stats requires a table name argument");
+  return SQLITE_ERROR;
 }
 
+static sqlite3_module DruidStatsModule = {
+  0,                       /* iVersion */
+  0,                       /* xCreate */
+  druidStatsConnect,         /* xConnect */
+  druidStatsBestIndex,       /* xBestIndex */
+  druidStatsDisconnect,      /* xDisconnect */
+  0,                       /* xDestroy */
+  druidStatsOpen,            /* xOpen - open a cursor */
+  druidStatsClose,           /* xClose - close a cursor */
+  druidStatsFilter,          /* xFilter - configure scan constraints */
+  druidStatsNext,            /* xNext - advance a cursor */
+  druidStatsEof,             /* xEof - check for end of scan */
+  druidStatsColumn,          /* xColumn - read data */
+  druidStatsRowid,           /* xRowid - read data */
+  0,                       /* xUpdate */
+  0,                       /* xBegin */
+  0,                       /* xSync */
+  0,                       /* xCommit */
+  0,                       /* xRollback */
+  0,                       /* xFindMethod */
+  0,                       /* xRename */
+  0,                       /* xSavepoint */
+  0,                       /* xRelease */
+  0,                       /* xRollbackTo */
+  0,                       /* xShadowName */
+};
+
 /*
-** Return values of columns for the row at which the DruidCursor
-** is currently pointing.
+** The druid_json_scans eponymous table lists the scans of the druid_json
+** tables of the connection in progress, including the ones building a
+** rollup, the column statistics or a shm cache:
+**
+**    SELECT tbl, kind, rows, bytes, size, progress FROM druid_json_scans;
+**
+** bytes is how far the scan is in the file (or in its shm cache), size
+** the current size of the file, and progress their ratio.  Scans answered
+** from a rollup have no bytes.  It is meant to be queried from a progress
+** handler, or between two steps of the statement running the scan.
 */
-static int druidtabColumn(
-    sqlite3_vtab_cursor *cur,   /* The cursor */
-    sqlite3_context *ctx,       /* First argument to sqlite3_result_...() */
-    int i                       /* Which column to return */
-) {
-  double r;
-  DruidCursor *pCur = (DruidCursor *) cur;
-  DruidTable *pTab = (DruidTable *) cur->pVtab;
-  if (i >= 0 && i < pTab->nCol && pCur->azVal[i] != 0) {
-    if (pTab->metricsCols[i]) {
-      switch (pCur->jsonType[i]) {
-        case JSON_NUMBER:
-          r = strtod(pCur->azVal[i], 0);
-          sqlite3_result_double(ctx, r);
-          break;
-        case JSON_NULL:
-          sqlite3_result_null(ctx);
-          break;
-        default:
-          druid_errmsg(&pCur->rdr,
-                       "unexpected JSON value inside a metric, got %s='%s', expected JSON_NUMBER / JSON_NULL",
-                       pTab->colNames[i],
-                       pCur->azVal[i]
-          );
-          sqlite3_free(pTab->base.zErrMsg);
-          pTab->base.zErrMsg = sqlite3_mprintf("%s", pCur->rdr.zErr);
-          return SQLITE_ERROR;
-      }
-    } else {
-      switch (pCur->jsonType[i]) {
-        case JSON_NULL:
-          sqlite3_result_null(ctx);
-          break;
-        default:
-          sqlite3_result_text(ctx, pCur->azVal[i], -1, SQLITE_TRANSIENT);
-      }
-    }
+typedef struct DruidScanInfo {
+  char *zTable;                   /* Name of the druid_json table */
+  const char *zKind;              /* DruidCursor.zKind */
+  sqlite3_int64 nRow;             /* Rows visited so far */
+  sqlite3_int64 nByte;            /* Bytes read so far, or -1 */
+  sqlite3_int64 nSize;            /* Size of the file or cache, or -1 */
+} DruidScanInfo;
+
+typedef struct DruidScansCursor {
+  sqlite3_vtab_cursor base;       /* Base class.  Must be first */
+  int nScan;                      /* Number of entries in aScan[] */
+  int iScan;                      /* Current entry */
+  DruidScanInfo *aScan;           /* Snapshot of the scans, taken by xFilter */
+} DruidScansCursor;
 
+#define DRUID_SCANS_COL_TABLE    0
+#define DRUID_SCANS_COL_KIND     1
+#define DRUID_SCANS_COL_ROWS     2
+#define DRUID_SCANS_COL_BYTES    3
+#define DRUID_SCANS_COL_SIZE     4
+#define DRUID_SCANS_COL_PROGRESS 5
 
-  }
+static int druidScansConnect(
+  sqlite3 *db,
+  void *pAux,
+  int argc, const char *const*argv,
+  sqlite3_vtab **ppVtab,
+  char **pzErr
+){
+  DruidStatsVtab *pNew;
+  int rc = sqlite3_declare_vtab(db,
+      "CREATE TABLE x(tbl TEXT, kind TEXT, rows INTEGER, bytes INTEGER,"
+      " size INTEGER, progress REAL)");
+  (void)argc; (void)argv; (void)pzErr;
+  if( rc!=SQLITE_OK ) return rc;
+  pNew = sqlite3_malloc(sizeof(*pNew));
+  *ppVtab = (sqlite3_vtab*)pNew;
+  if( pNew==0 ) return SQLITE_NOMEM;
+  memset(pNew, 0, sizeof(*pNew));
+  pNew->pModule = (DruidModule*)pAux;
+  sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
   return SQLITE_OK;
 }
 
-/*
-** Return the rowid for the current row.
-*/
-static int druidtabRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid){
-  DruidCursor *pCur = (DruidCursor*)cur;
-  *pRowid = pCur->iRowid;
+/* Free the snapshot of a DruidScansCursor */
+static void druid_scans_reset(DruidScansCursor *pCur){
+  int i;
+  for(i=0; i<pCur->nScan; i++) sqlite3_free(pCur->aScan[i].zTable);
+  sqlite3_free(pCur->aScan);
+  pCur->aScan = 0;
+  pCur->nScan = 0;
+  pCur->iScan = 0;
+}
+
+static int druidScansClose(sqlite3_vtab_cursor *cur){
+  druid_scans_reset((DruidScansCursor*)cur);
+  sqlite3_free(cur);
   return SQLITE_OK;
 }
 
-/*
-** Return TRUE if the cursor has been moved off of the last
-** row of output.
-*/
-static int druidtabEof(sqlite3_vtab_cursor *cur){
-  DruidCursor *pCur = (DruidCursor*)cur;
-  return pCur->iRowid<0;
+static int druidScansOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor){
+  DruidScansCursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  (void)p;
+  if( pCur==0 ) return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
 }
 
-static void rewindCur(DruidReader *p){
-    fseek(p->in, 0, SEEK_SET);
-    p->iIn = 0;
-    p->nIn = 0;
-    p->file_off = 0;
+static int druidScansNext(sqlite3_vtab_cursor *cur){
+  ((DruidScansCursor*)cur)->iScan++;
+  return SQLITE_OK;
 }
 
-/*
-** Only a full table scan is supported.  So xFilter simply rewinds to
-** the beginning.
-*/
-static int druidtabFilter(
+static int druidScansEof(sqlite3_vtab_cursor *cur){
+  DruidScansCursor *pCur = (DruidScansCursor*)cur;
+  return pCur->iScan>=pCur->nScan;
+}
+
+static int druidScansColumn(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int i){
+  DruidScansCursor *pCur = (DruidScansCursor*)cur;
+  DruidScanInfo *pScan = &pCur->aScan[pCur->iScan];
+  switch( i ){
+    case DRUID_SCANS_COL_TABLE:
+      sqlite3_result_text(ctx, pScan->zTable, -1, SQLITE_TRANSIENT);
+      break;
+    case DRUID_SCANS_COL_KIND:
+      sqlite3_result_text(ctx, pScan->zKind, -1, SQLITE_STATIC);
+      break;
+    case DRUID_SCANS_COL_ROWS:
+      sqlite3_result_int64(ctx, pScan->nRow);
+      break;
+    case DRUID_SCANS_COL_BYTES:
+      if( pScan->nByte>=0 ) sqlite3_result_int64(ctx, pScan->nByte);
+      break;
+    case DRUID_SCANS_COL_SIZE:
+      if( pScan->nSize>=0 ) sqlite3_result_int64(ctx, pScan->nSize);
+      break;
+    case DRUID_SCANS_COL_PROGRESS:
+      if( pScan->nByte>=0 && pScan->nSize>0 ){
+        sqlite3_result_double(ctx, (double)pScan->nByte / (double)pScan->nSize);
+      }
+      break;
+  }
+  return SQLITE_OK;
+}
+
+static int druidScansRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid){
+  *pRowid = ((DruidScansCursor*)cur)->iScan;
+  return SQLITE_OK;
+}
+
+/* Snapshot the scans of the connection, as the cursors can be closed
+** before this one is */
+static int druidScansFilter(
   sqlite3_vtab_cursor *pVtabCursor,
   int idxNum, const char *idxStr,
   int argc, sqlite3_value **argv
 ){
-  DruidCursor *pCur = (DruidCursor*)pVtabCursor;
-  rewindCur(&(pCur->rdr));
-  return druidtabNext(pVtabCursor);
+  DruidScansCursor *pCur = (DruidScansCursor*)pVtabCursor;
+  DruidStatsVtab *pVtab = (DruidStatsVtab*)pVtabCursor->pVtab;
+  DruidTable *pTab;
+  DruidCursor *pScan;
+  int nAlloc = 0;
+  (void)idxNum; (void)idxStr; (void)argc; (void)argv;
+  druid_scans_reset(pCur);
+  for(pTab=pVtab->pModule->pTables; pTab; pTab=pTab->pNextTable){
+    for(pScan=pTab->pCursors; pScan; pScan=pScan->pNextCursor){
+      DruidScanInfo *pInfo;
+      if( pScan->zKind==0 || pScan->iRowid<0 ) continue;
+      if( pCur->nScan>=nAlloc ){
+        DruidScanInfo *aNew;
+        nAlloc = nAlloc ? nAlloc*2 : 8;
+        aNew = sqlite3_realloc64(pCur->aScan, sizeof(DruidScanInfo)*nAlloc);
+        if( aNew==0 ) return SQLITE_NOMEM;
+        pCur->aScan = aNew;
+      }
+      pInfo = &pCur->aScan[pCur->nScan];
+      pInfo->zTable = sqlite3_mprintf("%s", pTab->zName);
+      if( pInfo->zTable==0 ) return SQLITE_NOMEM;
+      pCur->nScan++;
+      pInfo->zKind = pScan->zKind;
+      pInfo->nRow = pScan->iRowid;
+      pInfo->nByte = -1;
+      pInfo->nSize = -1;
+      if( pScan->pShm ){
+        pInfo->nByte = (sqlite3_int64)(pScan->pShmNext - pScan->pShm->aMap);
+        pInfo->nSize = (sqlite3_int64)pScan->pShm->nMap;
+      }else if( pScan->pStream ){
+        DruidReader *pRdr = &pScan->pStream->pDecoder->rdr;
+        struct stat st;
+        pInfo->nByte = pScan->pStream->aiOff[pScan->iBlock>0 ? pScan->iBlock : 0];
+        if( fstat(fileno(pRdr->in), &st)==0 ) pInfo->nSize = (sqlite3_int64)st.st_size;
+      }else if( pScan->eScan==DRUID_SCAN_ROWS && pScan->rdr.in ){
+        struct stat st;
+        pInfo->nByte = druid_reader_tell(&pScan->rdr);
+        if( fstat(fileno(pScan->rdr.in), &st)==0 ) pInfo->nSize = (sqlite3_int64)st.st_size;
+      }
+    }
+  }
+  return SQLITE_OK;
 }
 
-/*
-** Only a forward full table scan is supported.  xBestIndex is mostly
-** a no-op.
-*/
-static int druidtabBestIndex(
-  sqlite3_vtab *tab,
-  sqlite3_index_info *pIdxInfo
-){
-  pIdxInfo->estimatedCost = 1000000;
+static int druidScansBestIndex(sqlite3_vtab *tab, sqlite3_index_info *pIdxInfo){
+  (void)tab;
+  pIdxInfo->estimatedCost = 10;
+  pIdxInfo->estimatedRows = 10;
   return SQLITE_OK;
 }
 
-
-static sqlite3_module DruidJsonModule = {
+static sqlite3_module DruidScansModule = {
   0,                       /* iVersion */
-  druidtabCreate,            /* xCreate */
-  druidtabConnect,           /* xConnect */
-  druidtabBestIndex,         /* xBestIndex */
-  druidtabDisconnect,        /* xDisconnect */
-  druidtabDisconnect,        /* xDestroy */
-  druidtabOpen,              /* xOpen - open a cursor */
-  druidtabClose,             /* xClose - close a cursor */
-  druidtabFilter,            /* xFilter - configure scan constraints */
-  druidtabNext,              /* xNext - advance a cursor */
-  druidtabEof,               /* xEof - check for end of scan */
-  druidtabColumn,            /* xColumn - read data */
-  druidtabRowid,             /* xRowid - read data */
+  0,                       /* xCreate */
+  druidScansConnect,         /* xConnect */
+  druidScansBestIndex,       /* xBestIndex */
+  druidStatsDisconnect,      /* xDisconnect */
+  0,                       /* xDestroy */
+  druidScansOpen,            /* xOpen - open a cursor */
+  druidScansClose,           /* xClose - close a cursor */
+  druidScansFilter,          /* xFilter - configure scan constraints */
+  druidScansNext,            /* xNext - advance a cursor */
+  druidScansEof,             /* xEof - check for end of scan */
+  druidScansColumn,          /* xColumn - read data */
+  druidScansRowid,           /* xRowid - read data */
   0,                       /* xUpdate */
   0,                       /* xBegin */
   0,                       /* xSync */
@@ -1142,8 +9011,83 @@ static sqlite3_module DruidJsonModule = {
   0,                       /* xRollback */
   0,                       /* xFindMethod */
   0,                       /* xRename */
+  0,                       /* xSavepoint */
+  0,                       /* xRelease */
+  0,                       /* xRollbackTo */
+  0,                       /* xShadowName */
 };
 
+/*
+** druid_json_config(NAME) returns a process-wide setting of the extension,
+** druid_json_config(NAME, VALUE) changes it and returns the new value.
+**
+**    threads    Size of the worker pool, 0 disables it
+**    hugepages  1 to allocate large memory on huge pages (the default), 0 not to
+**    shm_max_age  Seconds after which a shm cache that no process opened is
+**               removed, 86400 by default, 0 never removes them
+*/
+#ifdef SQLITE_DIRECTONLY
+# define DRUID_DIRECTONLY SQLITE_DIRECTONLY   /* Not from triggers and views */
+#else
+# define DRUID_DIRECTONLY 0
+#endif
+static void druid_json_config(
+  sqlite3_context *ctx,
+  int argc,
+  sqlite3_value **argv
+){
+  const char *zName = (const char*)sqlite3_value_text(argv[0]);
+  if( zName && sqlite3_stricmp(zName, "threads")==0 ){
+    if( argc>1 ){
+      sqlite3_int64 n = sqlite3_value_int64(argv[1]);
+      if( sqlite3_value_type(argv[1])!=SQLITE_INTEGER || n<0 || n>DRUID_POOL_MAX ){
+        char *zErr = sqlite3_mprintf("threads must be between 0 and %d", DRUID_POOL_MAX);
+        sqlite3_result_error(ctx, zErr ? zErr : "threads out of range", -1);
+        sqlite3_free(zErr);
+        return;
+      }
+      druid_pool_configure((int)n);
+    }
+    sqlite3_result_int(ctx, druid_pool_threads());
+    return;
+  }
+  if( zName && sqlite3_stricmp(zName, "hugepages")==0 ){
+    if( argc>1 ){
+      sqlite3_int64 n = sqlite3_value_int64(argv[1]);
+      if( sqlite3_value_type(argv[1])!=SQLITE_INTEGER || n<0 || n>1 ){
+        sqlite3_result_error(ctx, "hugepages must be 0 or 1", -1);
+        return;
+      }
+      DRUID_ATOMIC_STORE(&druidHugePages, (int)n);
+    }
+    sqlite3_result_int(ctx, DRUID_ATOMIC_LOAD(&druidHugePages));
+    return;
+  }
+  if( zName && sqlite3_stricmp(zName, "shm_max_age")==0 ){
+    if( argc>1 ){
+      sqlite3_int64 n = sqlite3_value_int64(argv[1]);
+      if( sqlite3_value_type(argv[1])!=SQLITE_INTEGER || n<0 || n>0x7fffffff ){
+        sqlite3_result_error(ctx, "shm_max_age must be a number of seconds", -1);
+        return;
+      }
+      DRUID_ATOMIC_STORE(&druidShmMaxAge, (int)n);
+    }
+    sqlite3_result_int(ctx, DRUID_ATOMIC_LOAD(&druidShmMaxAge));
+    return;
+  }
+  {
+    char *zErr = sqlite3_mprintf("unknown druid_json_config setting: %s", zName);
+    sqlite3_result_error(ctx, zErr ? zErr : "unknown druid_json_config setting", -1);
+    sqlite3_free(zErr);
+  }
+}
+
+/* Destructor of the DruidModule of a connection */
+static void druid_module_destroy(void *p){
+  sqlite3_free(p);
+  druid_pool_detach();
+}
+
 #endif /* !defined(SQLITE_OMIT_VIRTUALTABLE) */
 
 
@@ -1162,8 +9106,66 @@ int sqlite3_druidjson_init(
 ){
 #ifndef SQLITE_OMIT_VIRTUALTABLE
   int rc;
+  DruidModule *pModule;
   SQLITE_EXTENSION_INIT2(pApi);
-  rc = sqlite3_create_module(db, "druid_json", &DruidJsonModule, 0);
+  pModule = sqlite3_malloc(sizeof(*pModule));
+  if( pModule==0 ) return SQLITE_NOMEM;
+  memset(pModule, 0, sizeof(*pModule));
+  druid_pool_attach();
+  rc = sqlite3_create_module_v2(db, "druid_json", &DruidJsonModule, pModule,
+                                druid_module_destroy);
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_module(db, "druid_json_column_stats", &DruidStatsModule, pModule);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_module(db, "druid_json_scans", &DruidScansModule, pModule);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "approx_count_distinct", 1,
+                                 SQLITE_UTF8|SQLITE_INNOCUOUS, 0, 0,
+                                 druid_approx_count_distinct_step,
+                                 druid_approx_count_distinct_final);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "druid_hll_union", 1,
+                                 SQLITE_UTF8|SQLITE_INNOCUOUS, 0,
+                                 0, druid_hll_step, druid_hll_union_final);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "druid_hll_estimate", 1,
+                                 SQLITE_UTF8|SQLITE_INNOCUOUS, 0,
+                                 0, druid_hll_step, druid_hll_estimate_final);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "druid_theta_union", 1,
+                                 SQLITE_UTF8|SQLITE_INNOCUOUS, 0,
+                                 0, druid_theta_step, druid_theta_union_final);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "druid_theta_estimate", 1,
+                                 SQLITE_UTF8|SQLITE_INNOCUOUS, 0,
+                                 0, druid_theta_step, druid_theta_estimate_final);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "druid_quantiles_merge", 1,
+                                 SQLITE_UTF8|SQLITE_INNOCUOUS, 0,
+                                 0, druid_quantiles_step, druid_quantiles_merge_final);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "druid_quantiles_quantile", 2,
+                                 SQLITE_UTF8|SQLITE_INNOCUOUS, 0,
+                                 0, druid_quantiles_step, druid_quantiles_quantile_final);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "druid_json_config", 1,
+                                 SQLITE_UTF8|DRUID_DIRECTONLY, 0,
+                                 druid_json_config, 0, 0);
+  }
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_create_function(db, "druid_json_config", 2,
+                                 SQLITE_UTF8|DRUID_DIRECTONLY, 0,
+                                 druid_json_config, 0, 0);
+  }
 #ifdef SQLITE_TEST
   if( rc==SQLITE_OK ){
     rc = sqlite3_create_module(db, "csv_wr", &DruidJsonModuleFauxWrite, 0);
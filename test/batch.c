@@ -0,0 +1,235 @@
+/*
+** Check of the row batches of druid_json.c: the rows a scan reads at once
+** into column vectors, and returns one at a time.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/batch.c -o batch -lsqlite3 -lm -lpthread
+**    ./batch
+**
+**   - The rows, their rowids and values are the ones of the file, around
+**     the ends of the batches and of the blocks of the shared stream, with
+**     missing and null values, escapes and columns not read, for a plain,
+**     a trusted=1 and a shm=1 table.
+**
+**   - LIMIT, OFFSET, _sample, pushed down constraints and the cursors of a
+**     self-join, reading the same stream, return the same rows everywhere.
+**
+**   - The comparisons of the filter kernels are the ones of SQLite, with
+**     null values and a metric that is not a number.
+**
+**   - The rows before an error in the file are returned, then the error.
+**
+**   - The column statistics collected by a full scan are the ones of the
+**     scan of druid_json_column_stats, to the bit.
+*/
+#include "../druid_json.c"
+#include "testutil.h"
+
+#define TEST_ROWS 1000
+
+/* The app of row i, 1 for the first, or NULL if it has none */
+static const char *test_app(int i){
+  static const char *azApp[] = { "app0", "app1", "app2", "app \\\"3\\\"", "app4" };
+  return (i%37)==0 ? 0 : azApp[i%5];
+}
+
+/* The clicks of row i, a number, or NULL if they are null */
+static double test_clicks(int i){
+  return i*0.1 + (i%3);
+}
+
+/* Write the result file: row i has no app if i%37 is 0, and null clicks
+** if i%41 is 0.  If iBad is positive, row iBad is cut short */
+static void test_generate(const char *zFile, int iBad){
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  char *z;
+  int i;
+  sqlite3_str_appendall(pOut, "[");
+  for(i=1; i<=TEST_ROWS; i++){
+    const char *zApp = test_app(i);
+    sqlite3_str_appendf(pOut,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T%02d:00:00.000Z\", "
+        "\"event\": {", i>1 ? ",\n" : "", i%24);
+    if( i==iBad ){
+      sqlite3_str_appendall(pOut, "\"country\": \"c");
+      break;
+    }
+    sqlite3_str_appendf(pOut, "\"country\": \"c%d\", ", i%4);
+    if( zApp ){
+      sqlite3_str_appendf(pOut, "\"app\": \"%s\", ", zApp);
+    }else{
+      sqlite3_str_appendall(pOut, "\"app\": null, ");
+    }
+    if( (i%41)==0 ){
+      sqlite3_str_appendall(pOut, "\"clicks\": null}}");
+    }else{
+      sqlite3_str_appendf(pOut, "\"clicks\": %!.17g}}", test_clicks(i));
+    }
+  }
+  if( iBad<=0 ) sqlite3_str_appendall(pOut, "]\n");
+  z = sqlite3_str_finish(pOut);
+  test_write(zFile, z, -1);
+  sqlite3_free(z);
+}
+
+/* The expected rowid, app and clicks of the rows of a list, as test_query()
+** shows them */
+static char *test_rows(const int *aiRow, int nRow){
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  int i;
+  for(i=0; i<nRow; i++){
+    int iRow = aiRow[i];
+    const char *zApp = test_app(iRow);
+    sqlite3_str_appendf(pOut, "%s%d|", i ? ";" : "", iRow);
+    if( zApp==0 ){
+      sqlite3_str_appendall(pOut, "NULL");
+    }else if( iRow%5==3 ){
+      sqlite3_str_appendall(pOut, "app \"3\"");
+    }else{
+      sqlite3_str_appendall(pOut, zApp);
+    }
+    if( (iRow%41)==0 ){
+      sqlite3_str_appendall(pOut, "|NULL");
+    }else{
+      sqlite3_str_appendf(pOut, "|%!.17g", test_clicks(iRow));
+    }
+  }
+  return sqlite3_str_finish(pOut);
+}
+
+/* Check that zSql returns nRow rows before it fails with zError */
+static void test_error_after(sqlite3 *db, const char *zSql, int nRow, const char *zError){
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  int n = 0;
+  while( rc==SQLITE_OK && (rc = sqlite3_step(pStmt))==SQLITE_ROW ){
+    rc = SQLITE_OK;
+    n++;
+  }
+  nTestCheck++;
+  if( n!=nRow || rc==SQLITE_DONE || strcmp(sqlite3_errmsg(db), zError)!=0 ){
+    fprintf(stderr, "%s\n  got:      %d rows, %s\n  expected: %d rows, %s\n",
+            zSql, n, rc==SQLITE_DONE ? "no error" : sqlite3_errmsg(db), nRow, zError);
+    nTestFail++;
+  }
+  sqlite3_finalize(pStmt);
+}
+
+int main(void){
+  static const char *azOpt[] = { "", ", trusted=1", ", shm=1" };
+  static const char *azOp[] = { "=", ">", ">=", "<", "<=" };
+  static const int aiEdge[] = { 1, 2, 15, 16, 17, 31, 32, 33, 255, 256, 257, 511, 512, 513, 999, 1000 };
+  const char *zFile = "batch-test.json";
+  const char *zBad = "batch-test-bad.json";
+  sqlite3 *db = test_open();
+  const char *zSampleSql = "SELECT count(*), sum(rowid) FROM t WHERE _sample=0.25";
+  char *zSql, *zWant, *zSample = 0;
+  int iOpt, i, nMatch = 0;
+  double rSum = 0.0;
+
+  test_generate(zFile, 0);
+  test_generate(zBad, 300);
+  for(i=1; i<=TEST_ROWS; i++){
+    if( (i%41)!=0 ) rSum += test_clicks(i);
+    if( (i%41)!=0 && test_clicks(i)>=50.0 && (i%5)==1 && (i%37)!=0 ) nMatch++;
+  }
+
+  for(iOpt=0; iOpt<(int)(sizeof(azOpt)/sizeof(azOpt[0])); iOpt++){
+    char zCount[100];
+    zSql = sqlite3_mprintf(
+        "DROP TABLE IF EXISTS temp.t;"
+        "CREATE VIRTUAL TABLE temp.t USING druid_json(filename=%Q, metrics='clicks'%s);",
+        zFile, azOpt[iOpt]);
+    test_exec(db, zSql);
+    sqlite3_free(zSql);
+
+    /* Around the ends of the batches, which double from 1 row to 256 */
+    zWant = test_rows(aiEdge, sizeof(aiEdge)/sizeof(aiEdge[0]));
+    test_expect(db, "SELECT rowid, app, clicks FROM t WHERE rowid IN"
+                    " (1,2,15,16,17,31,32,33,255,256,257,511,512,513,999,1000)", zWant);
+    sqlite3_free(zWant);
+    sqlite3_snprintf(sizeof(zCount), zCount, "%d|%d|%d|%!.17g",
+                     TEST_ROWS, TEST_ROWS - TEST_ROWS/37, TEST_ROWS - TEST_ROWS/41, rSum);
+    test_expect(db, "SELECT count(*), count(app), count(clicks), sum(clicks) FROM t", zCount);
+    test_expect(db, "SELECT count(*), max(rowid) FROM t", "1000|1000");
+    /* Only the timestamp is read */
+    test_expect(db, "SELECT timestamp FROM t WHERE rowid=257", "2020-01-01T17:00:00.000Z");
+
+    /* LIMIT and OFFSET */
+    test_expect(db, "SELECT group_concat(rowid) FROM (SELECT rowid FROM t LIMIT 3 OFFSET 254)",
+                    "255,256,257");
+    test_expect(db, "SELECT rowid, country FROM t LIMIT 1 OFFSET 511", "512|c0");
+    test_expect(db, "SELECT rowid FROM t LIMIT 1", "1");
+
+    /* Pushed down constraints */
+    sqlite3_snprintf(sizeof(zCount), zCount, "%d", nMatch);
+    test_expect(db, "SELECT count(*) FROM t WHERE clicks>=50 AND app='app1'", zCount);
+    test_expect(db, "SELECT rowid FROM t WHERE app='app \"3\"' AND rowid>990", "993;998");
+    /* The filter kernels, against the comparisons SQLite makes itself */
+    for(i=0; i<(int)(sizeof(azOp)/sizeof(azOp[0])); i++){
+      char *zSql2;
+      zSql = sqlite3_mprintf("SELECT count(*), sum(rowid) FROM t WHERE clicks%s41", azOp[i]);
+      zSql2 = sqlite3_mprintf("SELECT count(*), sum(rowid) FROM t WHERE +clicks%s41", azOp[i]);
+      test_same(db, zSql, zSql2);
+      sqlite3_free(zSql);
+      sqlite3_free(zSql2);
+    }
+    test_same(db, "SELECT group_concat(rowid) FROM t WHERE app='app2' AND clicks<20",
+                  "SELECT group_concat(rowid) FROM t WHERE +app='app2' AND +clicks<20");
+
+    /* Sampling, the same rows whatever the table reads */
+    if( iOpt==0 ){
+      zSample = test_query(db, zSampleSql);
+    }else{
+      test_expect(db, zSampleSql, zSample);
+    }
+
+    /* Self-join, the two cursors reading the shared stream in turn */
+    test_exec(db, "PRAGMA automatic_index=0");
+    test_expect(db, "SELECT count(*), sum(a.rowid) FROM t a, t b"
+                    " WHERE a.rowid%100=1 AND b.rowid=a.rowid+255", "8|2808");
+    test_same(db, "SELECT count(*) FROM t a, t b WHERE a.rowid<=20 AND b.app=a.app",
+                  "SELECT sum((SELECT count(*) FROM t b WHERE b.app=a.app))"
+                  " FROM t a WHERE a.rowid<=20");
+  }
+
+  /* A metric that is not a number satisfies the comparisons pushed down */
+  zSql = sqlite3_mprintf(
+      "DROP TABLE IF EXISTS temp.t;"
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename=%Q, metrics='clicks,country');",
+      zFile);
+  test_exec(db, zSql);
+  sqlite3_free(zSql);
+  test_same(db, "SELECT count(*) FROM t WHERE country>1 AND clicks>1",
+                "SELECT count(*) FROM t WHERE +country>1 AND +clicks>1");
+
+  /* The rows before a row cut short, then the error */
+  for(iOpt=0; iOpt<2; iOpt++){
+    zSql = sqlite3_mprintf(
+        "DROP TABLE IF EXISTS temp.t;"
+        "CREATE VIRTUAL TABLE temp.t USING druid_json(filename=%Q, metrics='clicks'%s);",
+        zBad, azOpt[iOpt]);
+    test_exec(db, zSql);
+    sqlite3_free(zSql);
+    test_error_after(db, "SELECT rowid, app FROM t", 299,
+                     iOpt==0 ? "result 299(offset 38994): unterminated string"
+                             : "result 299(offset 38994): unexpected end of input");
+  }
+
+  /* The statistics of a full scan, and of the scan of the statistics */
+  test_exec(db,
+      "DROP TABLE IF EXISTS temp.t;"
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename='batch-test.json', metrics='clicks');"
+      "CREATE VIRTUAL TABLE temp.u USING druid_json(filename='batch-test.json', metrics='clicks');");
+  test_expect(db, "SELECT count(*) FROM (SELECT * FROM t)", "1000");
+  test_same(db, "SELECT * FROM druid_json_column_stats('t')",
+                "SELECT * FROM druid_json_column_stats('u')");
+
+  sqlite3_free(zSample);
+  sqlite3_exec(db, "DROP TABLE IF EXISTS temp.t; DROP TABLE IF EXISTS temp.u", 0, 0, 0);
+  sqlite3_close(db);
+  remove(zFile);
+  remove(zBad);
+  return test_done("batch");
+}
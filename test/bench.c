@@ -0,0 +1,634 @@
+/*
+** Benchmarks of druid_json.c.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/bench.c -o bench -lsqlite3 -lm -lpthread
+**    ./bench BENCHMARK [ARGS...]
+**
+** The benchmarks are:
+**
+**    registry [NTHREAD [MS]]
+**        NTHREAD threads, each with its own connection, scan the same file,
+**        one file each, and the same file while another thread replaces it
+**        every few milliseconds.  This exercises the process-wide file
+**        registry, its shards and the inotify watcher.  Each setting runs
+**        for MS milliseconds (1000 by default) with 1, 2, 4 ... NTHREAD (8
+**        by default) threads.  The last column is the share of the scans
+**        that read the other version of the replaced file.  A scan that
+**        sees neither version fails the run.
+**
+**    skip [NROW [NREPEAT]]
+**        The row skipper on a file of NROW rows (500000 by default):
+**        druid_skip_block() over the file in memory, next to a read of the
+**        memory and the skip one character at a time, and druid_skip_row()
+**        and druid_read_one_field() on the file.  The best of NREPEAT (5 by
+**        default) runs is reported.  Every way must find every row.
+**
+**    accum [NROW [NREPEAT]]
+**        The sum, smallest and largest number of NROW (1048576 by default)
+**        metric values, a tenth of them NULL: one row at a time, as the
+**        scans did before the row batches, and druid_accum_scalar() and
+**        druid_accum_batch() (AVX2 where the CPU has it) a batch of
+**        DRUID_BATCH_ROWS at a time.  Every way must give the same sum to
+**        the bit.
+**
+**    hugepages [MB [NROW [NREPEAT]]]
+**        The same work with druid_json_config('hugepages') 0 and 1: random
+**        reads of MB (512 by default) megabytes from druid_huge_alloc(),
+**        and the build of an hourly rollup of NROW (1000000 by default)
+**        rows with as many groups.  The best of NREPEAT (3 by default) runs
+**        is reported, with the memory of the process on transparent huge
+**        pages.  Huge pages need vm.nr_hugepages, or "always" or "madvise"
+**        in /sys/kernel/mm/transparent_hugepage/enabled.
+**
+** The result files are generated in the current directory and removed.
+*/
+#include "../druid_json.c"
+
+/* Milliseconds of a monotonic clock */
+static double bench_now_ms(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+static sqlite3_uint64 benchRandState = 1;
+
+/* Return a pseudo-random number in [0,n) */
+static int bench_rand(int n){
+  benchRandState = benchRandState*6364136223846793005ULL + 1442695040888963407ULL;
+  return (int)((benchRandState>>33) % (sqlite3_uint64)n);
+}
+
+/* Write a result file of nRow rows with the dimensions app, of nApp
+** values, and country, and the metrics clicks and cost */
+static void bench_generate(const char *zFile, int nRow, int nApp){
+  FILE *out = fopen(zFile, "wb");
+  int i;
+  if( out==0 ){
+    fprintf(stderr, "cannot write %s\n", zFile);
+    exit(1);
+  }
+  fputs("[", out);
+  for(i=0; i<nRow; i++){
+    fprintf(out, "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-%02dT%02d:00:00.000Z\", "
+            "\"event\": {\"app\": \"app%d\", \"country\": \"%s\", "
+            "\"clicks\": %d, \"cost\": %d.%02d}}",
+            i ? ", " : "", 1 + i/24%28, i%24, bench_rand(nApp),
+            "US\0FR\0DE\0JP\0BR\0IL" + 3*bench_rand(6),
+            bench_rand(100), bench_rand(1000), bench_rand(100));
+  }
+  fputs("]\n", out);
+  if( fclose(out) ){
+    fprintf(stderr, "cannot write %s\n", zFile);
+    exit(1);
+  }
+}
+
+/* Open a connection with the extension loaded, or exit */
+static sqlite3 *bench_open(void){
+  sqlite3 *db = 0;
+  char *zErr = 0;
+  if( sqlite3_open(":memory:", &db)!=SQLITE_OK
+   || sqlite3_druidjson_init(db, &zErr, 0)!=SQLITE_OK ){
+    fprintf(stderr, "cannot load druid_json: %s\n", zErr ? zErr : sqlite3_errmsg(db));
+    exit(1);
+  }
+  return db;
+}
+
+/* Run zSql on db, or exit */
+static void bench_exec(sqlite3 *db, const char *zSql){
+  char *zErr = 0;
+  if( sqlite3_exec(db, zSql, 0, 0, &zErr)!=SQLITE_OK ){
+    fprintf(stderr, "%s: %s\n", zSql, zErr);
+    exit(1);
+  }
+}
+
+/*
+** The registry benchmark.
+*/
+#define BENCH_REGISTRY_ROWS  2000      /* Rows of the files scanned */
+#define BENCH_REPLACE_MS     5         /* Interval between two replacements */
+
+typedef struct RegistryThread {
+  pthread_t tid;
+  const char *zFile;              /* File scanned */
+  int *pbStop;                    /* Set when the threads must stop */
+  sqlite3_int64 nScan;            /* Scans completed */
+  sqlite3_int64 nOther;           /* Scans of the other version of the file */
+  int nFail;                      /* Scans with an unexpected row count */
+} RegistryThread;
+
+/* Scan a file until told to stop.  Every row is decoded, as sum() reads
+** a metric.  The count is BENCH_REGISTRY_ROWS, or one more if the file was
+** replaced by its other version */
+static void *registry_thread(void *pArg){
+  RegistryThread *p = (RegistryThread*)pArg;
+  sqlite3 *db = bench_open();
+  sqlite3_stmt *pStmt;
+  char *zSql = sqlite3_mprintf(
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename=%Q,"
+      " metrics='clicks,cost')", p->zFile);
+  bench_exec(db, zSql);
+  sqlite3_free(zSql);
+  if( sqlite3_prepare_v2(db, "SELECT count(*), sum(clicks) FROM t", -1, &pStmt, 0) ){
+    fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  while( !DRUID_ATOMIC_LOAD(p->pbStop) ){
+    if( sqlite3_step(pStmt)==SQLITE_ROW ){
+      int n = sqlite3_column_int(pStmt, 0);
+      if( n==BENCH_REGISTRY_ROWS+1 ){
+        p->nOther++;
+      }else if( n!=BENCH_REGISTRY_ROWS ){
+        p->nFail++;
+      }
+    }else{
+      p->nFail++;
+    }
+    sqlite3_reset(pStmt);
+    p->nScan++;
+  }
+  sqlite3_finalize(pStmt);
+  sqlite3_close(db);
+  return 0;
+}
+
+/* Rename the two versions of zFile over it in turn until told to stop */
+static void registry_replace(const char *zFile, int *pbStop){
+  char *zNew = sqlite3_mprintf("%s.new", zFile);
+  int i;
+  for(i=0; !DRUID_ATOMIC_LOAD(pbStop); i++){
+    bench_generate(zNew, BENCH_REGISTRY_ROWS + (i&1), 50);
+    if( rename(zNew, zFile) ){
+      fprintf(stderr, "cannot rename %s\n", zNew);
+      exit(1);
+    }
+    usleep(BENCH_REPLACE_MS*1000);
+  }
+  sqlite3_free(zNew);
+}
+
+/* The thread of registry_replace() */
+static void *registry_replace_thread(void *pArg){
+  void **ap = (void**)pArg;
+  registry_replace((const char*)ap[0], (int*)ap[1]);
+  return 0;
+}
+
+static int bench_registry(int argc, char **argv){
+  static const char *azMode[] = { "same file", "one file each", "replaced file" };
+  int nThreadMax = argc>0 ? atoi(argv[0]) : 8;
+  int nMs = argc>1 ? atoi(argv[1]) : 1000;
+  RegistryThread *aThread;
+  char **azFile;
+  int nFail = 0;
+  int eMode, nThread, i;
+
+  aThread = calloc(nThreadMax, sizeof(RegistryThread));
+  azFile = calloc(nThreadMax, sizeof(char*));
+  for(i=0; i<nThreadMax; i++){
+    azFile[i] = sqlite3_mprintf("bench-registry-%d.json", i);
+    bench_generate(azFile[i], BENCH_REGISTRY_ROWS, 50);
+  }
+  printf("%-14s %8s %12s %12s %12s\n",
+         "files", "threads", "scans/s", "per thread", "other file");
+  for(eMode=0; eMode<3; eMode++){
+    for(nThread=1; nThread<=nThreadMax; nThread*=2){
+      pthread_t replacer;
+      void *apArg[2];
+      int bStop = 0;
+      sqlite3_int64 nScan = 0, nOther = 0;
+      double t0, ms;
+      apArg[0] = azFile[0];
+      apArg[1] = &bStop;
+      if( eMode==2 ) pthread_create(&replacer, 0, registry_replace_thread, apArg);
+      t0 = bench_now_ms();
+      for(i=0; i<nThread; i++){
+        memset(&aThread[i], 0, sizeof(aThread[i]));
+        aThread[i].zFile = azFile[eMode==1 ? i : 0];
+        aThread[i].pbStop = &bStop;
+        pthread_create(&aThread[i].tid, 0, registry_thread, &aThread[i]);
+      }
+      usleep(nMs*1000);
+      DRUID_ATOMIC_STORE(&bStop, 1);
+      for(i=0; i<nThread; i++){
+        pthread_join(aThread[i].tid, 0);
+        nScan += aThread[i].nScan;
+        nOther += aThread[i].nOther;
+        nFail += aThread[i].nFail;
+      }
+      ms = bench_now_ms() - t0;
+      if( eMode==2 ) pthread_join(replacer, 0);
+      printf("%-14s %8d %12.0f %12.0f %11.0f%%\n", azMode[eMode], nThread,
+             nScan*1000.0/ms, nScan*1000.0/ms/nThread,
+             nScan ? nOther*100.0/nScan : 0.0);
+    }
+  }
+  for(i=0; i<nThreadMax; i++){
+    remove(azFile[i]);
+    sqlite3_free(azFile[i]);
+  }
+  free(azFile);
+  free(aThread);
+  if( nFail ) printf("%d scans failed\n", nFail);
+  return nFail!=0;
+}
+
+/*
+** The skip benchmark.
+*/
+
+/* Read all of zFile in memory, with 64 bytes of padding that are not a
+** quote, a backslash or a bracket */
+static u8 *skip_load(const char *zFile, size_t *pn){
+  FILE *in = fopen(zFile, "rb");
+  struct stat st;
+  u8 *z;
+  if( in==0 || fstat(fileno(in), &st) ){
+    fprintf(stderr, "cannot read %s\n", zFile);
+    exit(1);
+  }
+  z = malloc((size_t)st.st_size + 64);
+  if( z==0 || fread(z, 1, (size_t)st.st_size, in)!=(size_t)st.st_size ){
+    fprintf(stderr, "cannot read %s\n", zFile);
+    exit(1);
+  }
+  memset(&z[st.st_size], ' ', 64);
+  fclose(in);
+  *pn = (size_t)st.st_size;
+  return z;
+}
+
+/* Return the offset of the next row at or after i, or n */
+static size_t skip_next_row(const u8 *z, size_t n, size_t i){
+  while( i<n && z[i]!='{' ) i++;
+  return i;
+}
+
+static volatile sqlite3_uint64 skipSink;
+
+/* Sum the 64-bit words of z[], the speed of memory */
+static void skip_read_memory(const u8 *z, size_t n){
+  sqlite3_uint64 x = 0;
+  size_t i;
+  for(i=0; i+8<=n; i+=8){
+    sqlite3_uint64 w;
+    memcpy(&w, &z[i], 8);
+    x += w;
+  }
+  skipSink = x;
+}
+
+/* Count the rows of z[] with druid_skip_block() */
+static int skip_count_blocks(const u8 *z, size_t n){
+  size_t i = skip_next_row(z, n, 0);
+  int nRow = 0;
+  while( i<n ){
+    DruidSkip skip = {0, 0, 0};
+    int k;
+    while( (k = druid_skip_block(&skip, &z[i]))==0 ) i += 64;
+    i = skip_next_row(z, n, i+k);
+    nRow++;
+  }
+  return nRow;
+}
+
+/* Count the rows of z[] one character at a time */
+static int skip_count_bytes(const u8 *z, size_t n){
+  size_t i = skip_next_row(z, n, 0);
+  int nRow = 0;
+  while( i<n ){
+    bool bInString = false, bEscaped = false;
+    int depth = 0;
+    for(; ; i++){
+      u8 c = z[i];
+      if( bEscaped ){
+        bEscaped = false;
+      }else if( bInString ){
+        if( c=='\\' ) bEscaped = true;
+        else if( c=='"' ) bInString = false;
+      }else if( c=='"' ){
+        bInString = true;
+      }else if( c=='{' || c=='[' ){
+        depth++;
+      }else if( (c=='}' || c==']') && --depth==0 ){
+        break;
+      }
+    }
+    i = skip_next_row(z, n, i+1);
+    nRow++;
+  }
+  return nRow;
+}
+
+/* Count the rows of zFile with druid_skip_row(), or with
+** druid_read_one_field() if bDecode */
+static int skip_count_file(const char *zFile, bool bDecode){
+  DruidReader rdr;
+  int nRow = 0;
+  int rc;
+  druid_reader_init(&rdr);
+  if( druid_reader_open(&rdr, zFile) ){
+    fprintf(stderr, "%s\n", rdr.zErr);
+    exit(1);
+  }
+  if( bDecode ){
+    while( (rc = druid_read_one_field(&rdr))==GOT_FIELD || rc==GOT_LAST_FIELD ){
+      if( rc==GOT_LAST_FIELD ) nRow++;
+    }
+  }else{
+    while( druid_skip_row(&rdr)==GOT_LAST_FIELD ) nRow++;
+  }
+  druid_reader_reset(&rdr);
+  return nRow;
+}
+
+static int bench_skip(int argc, char **argv){
+  static const char *azWay[] = {
+    "read memory", "druid_skip_block", "one character at a time",
+    "druid_skip_row", "druid_read_one_field",
+  };
+  const char *zFile = "bench-skip.json";
+  int nRow = argc>0 ? atoi(argv[0]) : 500000;
+  int nRepeat = argc>1 ? atoi(argv[1]) : 5;
+  int nFail = 0;
+  size_t n;
+  u8 *z;
+  int eWay, i;
+
+  bench_generate(zFile, nRow, 50);
+  z = skip_load(zFile, &n);
+  printf("%d rows, %.1f MB\n", nRow, n/1e6);
+  printf("%-24s %10s %10s\n", "", "ms", "MB/s");
+  for(eWay=0; eWay<5; eWay++){
+    double msBest = 0.0;
+    int nFound = 0;
+    for(i=0; i<nRepeat; i++){
+      double t0 = bench_now_ms(), ms;
+      switch( eWay ){
+        case 0: skip_read_memory(z, n); nFound = nRow;   break;
+        case 1: nFound = skip_count_blocks(z, n);        break;
+        case 2: nFound = skip_count_bytes(z, n);         break;
+        case 3: nFound = skip_count_file(zFile, false);  break;
+        case 4: nFound = skip_count_file(zFile, true);   break;
+      }
+      ms = bench_now_ms() - t0;
+      if( i==0 || ms<msBest ) msBest = ms;
+    }
+    printf("%-24s %10.1f %10.0f\n", azWay[eWay], msBest, n/1e3/msBest);
+    if( nFound!=nRow ){
+      printf("%s found %d rows of %d\n", azWay[eWay], nFound, nRow);
+      nFail++;
+    }
+  }
+  free(z);
+  remove(zFile);
+  return nFail!=0;
+}
+
+/*
+** The accum benchmark.
+*/
+/* Add number r of row iRow one at a time, as the scans did before batches */
+static void accum_add(DruidAccum *p, sqlite3_int64 iRow, double r){
+  p->aLane[iRow&(DRUID_ACCUM_LANES-1)] += r;
+  if( r<p->rMin ) p->rMin = r;
+  if( r>p->rMax ) p->rMax = r;
+  p->n++;
+}
+
+static void accum_rows(DruidAccum *p, const double *a, const sqlite3_uint64 *aSel, int n){
+  int i;
+  for(i=0; i<n; i++){
+    if( (aSel[i>>6]>>(i&63)) & 1 ) accum_add(p, i, a[i]);
+  }
+}
+
+static void accum_scalar(DruidAccum *p, const double *a, const sqlite3_uint64 *aSel, int n){
+  int i, k;
+  for(i=0; i<n; i+=DRUID_BATCH_ROWS){
+    int nBatch = n-i<DRUID_BATCH_ROWS ? n-i : DRUID_BATCH_ROWS;
+    for(k=0; k<(nBatch+63)/64; k++) p->n += DRUID_POPCOUNT64(aSel[i/64+k]);
+    druid_accum_scalar(p, &a[i], &aSel[i/64], 0, nBatch);
+  }
+}
+
+static void accum_batch(DruidAccum *p, const double *a, const sqlite3_uint64 *aSel, int n){
+  int i;
+  for(i=0; i<n; i+=DRUID_BATCH_ROWS){
+    int nBatch = n-i<DRUID_BATCH_ROWS ? n-i : DRUID_BATCH_ROWS;
+    druid_accum_batch(p, &a[i], &aSel[i/64], nBatch);
+  }
+}
+
+static int bench_accum(int argc, char **argv){
+  static const struct {
+    const char *zName;
+    void (*xAccum)(DruidAccum*, const double*, const sqlite3_uint64*, int);
+  } aWay[] = {
+    { "one row at a time", accum_rows },
+    { "druid_accum_scalar", accum_scalar },
+    { "druid_accum_batch",  accum_batch },
+  };
+  int nRow = argc>0 ? atoi(argv[0]) : 1048576;
+  int nRepeat = argc>1 ? atoi(argv[1]) : 5;
+  DruidAccum ref;
+  double *a;
+  sqlite3_uint64 *aSel;
+  int nFail = 0;
+  int i, eWay;
+
+  nRow = (nRow+63)/64*64;
+  a = malloc(sizeof(double)*nRow);
+  aSel = calloc(nRow/64, sizeof(sqlite3_uint64));
+  if( a==0 || aSel==0 ){
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for(i=0; i<nRow; i++){
+    if( bench_rand(10)==0 ){
+      a[i] = 0.0;
+    }else{
+      a[i] = bench_rand(1000000)/100.0 - 1000.0;
+      aSel[i>>6] |= ((sqlite3_uint64)1)<<(i&63);
+    }
+  }
+#if defined(DRUID_ACCUM_AVX2)
+  printf("%d rows, AVX2 %s\n", nRow, __builtin_cpu_supports("avx2") ? "on" : "off");
+#else
+  printf("%d rows, no AVX2\n", nRow);
+#endif
+  printf("%-20s %10s %12s\n", "", "ms", "Mrows/s");
+  memset(&ref, 0, sizeof(ref));
+  for(eWay=0; eWay<(int)(sizeof(aWay)/sizeof(aWay[0])); eWay++){
+    DruidAccum acc;
+    double msBest = 0.0;
+    for(i=0; i<nRepeat; i++){
+      double t0, ms;
+      druid_accum_init(&acc);
+      t0 = bench_now_ms();
+      aWay[eWay].xAccum(&acc, a, aSel, nRow);
+      ms = bench_now_ms() - t0;
+      if( i==0 || ms<msBest ) msBest = ms;
+    }
+    printf("%-20s %10.2f %12.0f\n", aWay[eWay].zName, msBest, nRow/1e3/msBest);
+    if( eWay==0 ){
+      ref = acc;
+    }else if( druid_accum_sum(&acc)!=druid_accum_sum(&ref) || acc.rMin!=ref.rMin
+           || acc.rMax!=ref.rMax || acc.n!=ref.n ){
+      printf("%s: sum %.17g min %g max %g n %lld, row by row %.17g %g %g %lld\n",
+             aWay[eWay].zName, druid_accum_sum(&acc), acc.rMin, acc.rMax, acc.n,
+             druid_accum_sum(&ref), ref.rMin, ref.rMax, ref.n);
+      nFail++;
+    }
+  }
+  free(a);
+  free(aSel);
+  return nFail!=0;
+}
+
+/*
+** The hugepages benchmark.
+*/
+#define BENCH_HUGE_READS  20000000
+
+/* Return the AnonHugePages of the process in KB, or -1 if unknown */
+static sqlite3_int64 huge_anon_kb(void){
+  FILE *in = fopen("/proc/self/smaps_rollup", "r");
+  char zLine[200];
+  sqlite3_int64 nKb = -1;
+  if( in==0 ) return -1;
+  while( fgets(zLine, sizeof(zLine), in) ){
+    if( strncmp(zLine, "AnonHugePages:", 14)==0 ) nKb = atoll(&zLine[14]);
+  }
+  fclose(in);
+  return nKb;
+}
+
+/* Print the first line of a file, if it exists */
+static void huge_print_file(const char *zFile){
+  FILE *in = fopen(zFile, "r");
+  char zLine[200];
+  if( in && fgets(zLine, sizeof(zLine), in) ) printf("%s: %s", zFile, zLine);
+  if( in ) fclose(in);
+}
+
+static volatile sqlite3_uint64 hugeSink;
+
+/* Read nReads random words of nByte bytes from druid_huge_alloc().  Set
+** *pnKb to the memory of the process on huge pages once they are touched,
+** and return the milliseconds taken by the reads */
+static double huge_reads(size_t nByte, int nRead, sqlite3_int64 *pnKb){
+  sqlite3_uint64 *a, x = 0, r = 1;
+  size_t nWord = nByte/8;
+  bool bMapped;
+  double t0, ms;
+  int i;
+  a = druid_huge_alloc(nByte, &bMapped);
+  if( a==0 ){
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  memset(a, 1, nByte);
+  *pnKb = huge_anon_kb();
+  t0 = bench_now_ms();
+  for(i=0; i<nRead; i++){
+    r = r*6364136223846793005ULL + 1442695040888963407ULL;
+    x += a[(r>>17) % nWord];
+  }
+  ms = bench_now_ms() - t0;
+  hugeSink = x;
+  druid_huge_free(a, nByte, bMapped);
+  return ms;
+}
+
+/* Build the hourly rollup of zFile.  Return the milliseconds taken and
+** set *pnCount to its sum(_count) */
+static double huge_rollup(sqlite3 *db, const char *zFile, sqlite3_int64 *pnCount){
+  sqlite3_stmt *pStmt;
+  char *zSql;
+  double t0, ms;
+  zSql = sqlite3_mprintf(
+      "DROP TABLE IF EXISTS temp.t;"
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename=%Q,"
+      " metrics='clicks,cost', rollups='PT1H:app,country')", zFile);
+  bench_exec(db, zSql);
+  sqlite3_free(zSql);
+  if( sqlite3_prepare_v2(db, "SELECT sum(_count) FROM temp.t WHERE _granularity='PT1H'",
+                         -1, &pStmt, 0) ){
+    fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+    exit(1);
+  }
+  t0 = bench_now_ms();
+  *pnCount = sqlite3_step(pStmt)==SQLITE_ROW ? sqlite3_column_int64(pStmt, 0) : -1;
+  ms = bench_now_ms() - t0;
+  sqlite3_finalize(pStmt);
+  return ms;
+}
+
+static int bench_hugepages(int argc, char **argv){
+  const char *zFile = "bench-hugepages.json";
+  int nMb = argc>0 ? atoi(argv[0]) : 512;
+  int nRow = argc>1 ? atoi(argv[1]) : 1000000;
+  int nRepeat = argc>2 ? atoi(argv[2]) : 3;
+  sqlite3 *db = bench_open();
+  int nFail = 0;
+  int bHuge, i;
+
+  huge_print_file("/proc/sys/vm/nr_hugepages");
+  huge_print_file("/sys/kernel/mm/transparent_hugepage/enabled");
+  bench_generate(zFile, nRow, nRow);
+  printf("%-10s %16s %16s %16s\n", "hugepages", "random reads ms", "huge pages KB",
+         "rollup build ms");
+  for(bHuge=0; bHuge<2; bHuge++){
+    double msRead = 0.0, msRollup = 0.0;
+    sqlite3_int64 nKb = 0;
+    char *zSql = sqlite3_mprintf("SELECT druid_json_config('hugepages', %d)", bHuge);
+    bench_exec(db, zSql);
+    sqlite3_free(zSql);
+    for(i=0; i<nRepeat; i++){
+      sqlite3_int64 nCount, nKbRun;
+      double ms = huge_reads((size_t)nMb<<20, BENCH_HUGE_READS, &nKbRun);
+      if( i==0 || ms<msRead ) msRead = ms;
+      if( nKbRun>nKb ) nKb = nKbRun;
+      ms = huge_rollup(db, zFile, &nCount);
+      if( i==0 || ms<msRollup ) msRollup = ms;
+      if( nCount!=nRow ){
+        printf("hugepages %d: sum(_count) is %lld of %d rows\n", bHuge, nCount, nRow);
+        nFail++;
+      }
+    }
+    printf("%-10d %16.1f %16lld %16.1f\n", bHuge, msRead, nKb, msRollup);
+  }
+  bench_exec(db, "DROP TABLE IF EXISTS temp.t");
+  sqlite3_close(db);
+  remove(zFile);
+  return nFail!=0;
+}
+
+int main(int argc, char **argv){
+  static const struct {
+    const char *zName;
+    int (*xBench)(int, char**);
+  } aBench[] = {
+    { "registry",  bench_registry },
+    { "skip",      bench_skip },
+    { "accum",     bench_accum },
+    { "hugepages", bench_hugepages },
+  };
+  int i;
+  for(i=0; argc>1 && i<(int)(sizeof(aBench)/sizeof(aBench[0])); i++){
+    if( strcmp(argv[1], aBench[i].zName)==0 ){
+      return aBench[i].xBench(argc-2, argv+2);
+    }
+  }
+  fprintf(stderr, "usage: %s BENCHMARK [ARGS...], where BENCHMARK is one of:\n", argv[0]);
+  for(i=0; i<(int)(sizeof(aBench)/sizeof(aBench[0])); i++){
+    fprintf(stderr, "   %s\n", aBench[i].zName);
+  }
+  return 1;
+}
@@ -0,0 +1,224 @@
+/*
+** Check of the decoding of \u escapes by druid_json.c, a run of them at a
+** time while it is in the input buffer, one at a time at the end of it.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/escape.c -o escape -lsqlite3 -lm -lpthread
+**    ./escape
+**
+**   - druid_hex4() decodes 4 hex digits of either case, and refuses every
+**     other byte in each of the 4 places.  A \u escape with another byte
+**     fails the scan.
+**
+**   - Strings of random escapes, of every size of UTF-8 character, pairs
+**     of surrogates, lone ones, \u0000 and other escapes, read with and
+**     without the worker pool so that the runs cross the ends of the
+**     buffers of both sizes, are decoded to the UTF-8 the test made them
+**     of, in values and labels.
+*/
+#include "../druid_json.c"
+#include "testutil.h"
+
+#define TEST_ROWS 1500
+
+static sqlite3_uint64 iTestRng = 0x2545f4914f6cdd1dULL;
+
+/* A pseudo-random number below n */
+static u32 test_rand(u32 n){
+  iTestRng = iTestRng*6364136223846793005ULL + 1442695040888963407ULL;
+  return (u32)(iTestRng>>33) % n;
+}
+
+/* Append the escape of code unit v to pJson, in hex digits of random case */
+static void test_escape(sqlite3_str *pJson, u32 v){
+  int i;
+  sqlite3_str_appendall(pJson, "\\u");
+  for(i=12; i>=0; i-=4){
+    sqlite3_str_appendchar(pJson, 1,
+        (test_rand(2) ? "0123456789abcdef" : "0123456789ABCDEF")[(v>>i)&0xf]);
+  }
+}
+
+/* Append the UTF-8 of code point v to pUtf8, as a 3 byte character if it
+** is a surrogate */
+static void test_utf8(sqlite3_str *pUtf8, u32 v){
+  char a[4];
+  int n;
+  if( v<0x80 ){
+    a[0] = (char)v; n = 1;
+  }else if( v<0x800 ){
+    a[0] = (char)(0xc0 | (v>>6)); a[1] = (char)(0x80 | (v&0x3f)); n = 2;
+  }else if( v<0x10000 ){
+    a[0] = (char)(0xe0 | (v>>12)); a[1] = (char)(0x80 | ((v>>6)&0x3f));
+    a[2] = (char)(0x80 | (v&0x3f)); n = 3;
+  }else{
+    a[0] = (char)(0xf0 | (v>>18)); a[1] = (char)(0x80 | ((v>>12)&0x3f));
+    a[2] = (char)(0x80 | ((v>>6)&0x3f)); a[3] = (char)(0x80 | (v&0x3f)); n = 4;
+  }
+  sqlite3_str_append(pUtf8, a, n);
+}
+
+/* Append a random string to pJson, with its quotes, and what it decodes
+** to pUtf8 */
+static void test_string(sqlite3_str *pJson, sqlite3_str *pUtf8){
+  int nPiece = (int)test_rand(test_rand(4) ? 40 : 400);
+  int bHigh = 0;             /* The last piece is a lone high surrogate */
+  int i;
+  sqlite3_str_appendchar(pJson, 1, '"');
+  for(i=0; i<nPiece; i++){
+    u32 v;
+    int e = (int)test_rand(10);
+    if( bHigh && e==6 ) e = 3;
+    bHigh = 0;
+    switch( e ){
+      case 0:              /* A character as it is */
+        v = 'a' + test_rand(26);
+        sqlite3_str_appendchar(pJson, 1, (char)v);
+        sqlite3_str_appendchar(pUtf8, 1, (char)v);
+        break;
+      case 1:              /* The escape of a 1 byte character */
+        v = 1 + test_rand(0x7f);
+        test_escape(pJson, v);
+        test_utf8(pUtf8, v);
+        break;
+      case 2:              /* Of a 2 byte character */
+        v = 0x80 + test_rand(0x800-0x80);
+        test_escape(pJson, v);
+        test_utf8(pUtf8, v);
+        break;
+      case 3:              /* Of a 3 byte character */
+        v = 0x800 + test_rand(0x10000-0x800-0x800);
+        if( v>=0xd800 ) v += 0x800;
+        test_escape(pJson, v);
+        test_utf8(pUtf8, v);
+        break;
+      case 4:              /* A pair of surrogates */
+        v = 0x10000 + test_rand(0x100000);
+        test_escape(pJson, 0xd800 + ((v-0x10000)>>10));
+        test_escape(pJson, 0xdc00 + ((v-0x10000)&0x3ff));
+        test_utf8(pUtf8, v);
+        break;
+      case 5:              /* A lone high surrogate */
+        v = 0xd800 + test_rand(0x400);
+        test_escape(pJson, v);
+        test_utf8(pUtf8, v);
+        bHigh = 1;
+        break;
+      case 6:              /* A lone low surrogate */
+        v = 0xdc00 + test_rand(0x400);
+        test_escape(pJson, v);
+        test_utf8(pUtf8, v);
+        break;
+      case 7:              /* \u0000, dropped */
+        test_escape(pJson, 0);
+        break;
+      case 8: {            /* Another escape */
+        static const char *azEsc[] = { "\\n", "\\\"", "\\\\", "\\/", "\\t" };
+        static const char azChar[] = { '\n', '"', '\\', '/', '\t' };
+        int k = (int)test_rand(5);
+        sqlite3_str_appendall(pJson, azEsc[k]);
+        sqlite3_str_appendchar(pUtf8, 1, azChar[k]);
+        break;
+      }
+      default:             /* A UTF-8 character as it is */
+        sqlite3_str_appendall(pJson, "\xc3\xa9");
+        sqlite3_str_appendall(pUtf8, "\xc3\xa9");
+        break;
+    }
+  }
+  sqlite3_str_appendchar(pJson, 1, '"');
+}
+
+/* Check druid_hex4() on the 4 bytes at z */
+static void test_hex4(const u8 *z){
+  u32 vWant = 0, v = 0;
+  int bWant = 1;
+  int i;
+  for(i=0; i<4; i++){
+    if( !safe_isxdigit(z[i]) ){
+      bWant = 0;
+      break;
+    }
+    vWant = (vWant<<4) | jsonHexToInt(z[i]);
+  }
+  nTestCheck++;
+  if( druid_hex4(z, &v)!=bWant || (bWant && v!=vWant) ){
+    fprintf(stderr, "druid_hex4(%02x %02x %02x %02x): %x, expected %x\n",
+            z[0], z[1], z[2], z[3], v, bWant ? vWant : 0);
+    nTestFail++;
+  }
+}
+
+int main(void){
+  static const u8 aDigit[] = { '0', '7', '9', 'a', 'f', 'A', 'F' };
+  const char *zFile = "escape-test.json";
+  sqlite3 *db = test_open();
+  sqlite3_stmt *pIns;
+  sqlite3_str *pJson = sqlite3_str_new(0);
+  u8 a[4];
+  char *z;
+  int i, j, k;
+
+  /* Every byte in each place of 4 hex digits */
+  for(i=0; i<4; i++){
+    for(j=0; j<(int)sizeof(aDigit); j++){
+      for(k=0; k<256; k++){
+        memset(a, aDigit[j], 4);
+        a[i] = (u8)k;
+        test_hex4(a);
+      }
+    }
+  }
+
+  /* The rows, and what their strings decode to in table e */
+  test_exec(db, "CREATE TABLE e(id INTEGER PRIMARY KEY, app TEXT, ete TEXT)");
+  if( sqlite3_prepare_v2(db, "INSERT INTO e VALUES(?1, ?2, ?3)", -1, &pIns, 0) ){
+    fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+    return 1;
+  }
+  sqlite3_str_appendall(pJson, "[");
+  for(i=1; i<=TEST_ROWS; i++){
+    sqlite3_str *pApp = sqlite3_str_new(0);
+    sqlite3_str *pEte = sqlite3_str_new(0);
+    sqlite3_str_appendf(pJson,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T00:00:00.000Z\", "
+        "\"event\": {\"app\": ", i>1 ? ",\n" : "");
+    test_string(pJson, pApp);
+    sqlite3_str_appendall(pJson, ", \"\\u00e9t\\u00E9\": ");
+    test_string(pJson, pEte);
+    sqlite3_str_appendall(pJson, "}}");
+    sqlite3_bind_int(pIns, 1, i);
+    sqlite3_bind_text(pIns, 2, sqlite3_str_value(pApp) ? sqlite3_str_value(pApp) : "",
+                      sqlite3_str_length(pApp), SQLITE_TRANSIENT);
+    sqlite3_bind_text(pIns, 3, sqlite3_str_value(pEte) ? sqlite3_str_value(pEte) : "",
+                      sqlite3_str_length(pEte), SQLITE_TRANSIENT);
+    sqlite3_step(pIns);
+    sqlite3_reset(pIns);
+    sqlite3_free(sqlite3_str_finish(pApp));
+    sqlite3_free(sqlite3_str_finish(pEte));
+  }
+  sqlite3_finalize(pIns);
+  sqlite3_str_appendall(pJson, "]\n");
+  z = sqlite3_str_finish(pJson);
+  test_write(zFile, z, -1);
+  sqlite3_free(z);
+
+  /* Read with and without the read-ahead of the worker pool */
+  test_exec(db, "CREATE VIRTUAL TABLE temp.t USING druid_json(filename='escape-test.json')");
+  for(i=0; i<2; i++){
+    test_exec(db, i ? "SELECT druid_json_config('threads', 2)"
+                    : "SELECT druid_json_config('threads', 0)");
+    test_same(db, "SELECT rowid, app, \"\xc3\xa9t\xc3\xa9\" FROM t",
+                  "SELECT id, app, ete FROM e");
+  }
+
+  /* A digit that is not a hex digit */
+  test_write(zFile, "[{\"version\": \"v1\", \"timestamp\": \"2020-01-01T00:00:00.000Z\", "
+                    "\"event\": {\"app\": \"x\\u12g4\", \"\\u00e9t\\u00e9\": \"y\"}}]", -1);
+  test_expect(db, "SELECT app FROM t", "error: result 0(offset 84): invalid \\u escape");
+
+  sqlite3_close(db);
+  remove(zFile);
+  return test_done("escape");
+}
@@ -0,0 +1,127 @@
+/*
+** Check that a failed read of a result file fails the query with
+** SQLITE_IOERR, instead of ending the scan as if the file ended there.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/ioerr.c -o ioerr -lsqlite3 -lm -lpthread
+**    ./ioerr
+**
+** The reads of druid_json.c go through wrappers of pread(), fread(),
+** ferror() and clearerr() that fail the reads past an offset of the file,
+** both the reads ahead of the worker pool and the fread() of a reader
+** without it.
+*/
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+static ssize_t test_pread(int fd, void *pBuf, size_t n, off_t iOff);
+static size_t test_fread(void *pBuf, size_t nSize, size_t n, FILE *in);
+static int test_ferror(FILE *in);
+static void test_clearerr(FILE *in);
+#define pread    test_pread
+#define fread    test_fread
+#define ferror   test_ferror
+#define clearerr test_clearerr
+#include "../druid_json.c"
+#undef pread
+#undef fread
+#undef ferror
+#undef clearerr
+#include "testutil.h"
+
+static off_t iTestFailAt = -1;    /* Reads at or past this offset fail */
+static FILE *pTestFailed = 0;     /* Stream of the last failed fread() */
+
+static ssize_t test_pread(int fd, void *pBuf, size_t n, off_t iOff){
+  if( iTestFailAt>=0 && iOff+(off_t)n>iTestFailAt ){
+    errno = EIO;
+    return -1;
+  }
+  return pread(fd, pBuf, n, iOff);
+}
+
+static size_t test_fread(void *pBuf, size_t nSize, size_t n, FILE *in){
+  if( iTestFailAt>=0 && ftell(in)+(long)(nSize*n)>iTestFailAt ){
+    pTestFailed = in;
+    errno = EIO;
+    return 0;
+  }
+  return fread(pBuf, nSize, n, in);
+}
+
+static int test_ferror(FILE *in){
+  return in==pTestFailed || ferror(in);
+}
+
+static void test_clearerr(FILE *in){
+  if( in==pTestFailed ) pTestFailed = 0;
+  clearerr(in);
+}
+
+/* The result file, of nRow rows */
+static void test_generate(const char *zFile, int nRow){
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  char *z;
+  int i;
+  sqlite3_str_appendall(pOut, "[");
+  for(i=0; i<nRow; i++){
+    sqlite3_str_appendf(pOut,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T%02d:00:00.000Z\", "
+        "\"event\": {\"app\": \"app%d\", \"clicks\": %d}}",
+        i ? ",\n" : "", i%24, i%7, i%100);
+  }
+  sqlite3_str_appendall(pOut, "]\n");
+  z = sqlite3_str_finish(pOut);
+  test_write(zFile, z, -1);
+  sqlite3_free(z);
+}
+
+int main(void){
+  static const char *azQuery[] = {
+    "SELECT count(*) FROM t",
+    "SELECT sum(clicks) FROM t",
+    "SELECT count(*) FROM t WHERE app='app3'",
+    "SELECT timestamp FROM t LIMIT 1 OFFSET 19999",
+  };
+  const char *zFile = "ioerr-test.json";
+  sqlite3 *db = test_open();
+  char *zSql;
+  int nThread, bTrusted, i;
+
+  test_generate(zFile, 20000);
+  for(nThread=0; nThread<=2; nThread+=2){
+    for(bTrusted=0; bTrusted<2; bTrusted++){
+      iTestFailAt = -1;
+      zSql = sqlite3_mprintf(
+          "SELECT druid_json_config('threads', %d);"
+          "DROP TABLE IF EXISTS temp.t;"
+          "CREATE VIRTUAL TABLE temp.t USING druid_json(filename=%Q,"
+          " metrics='clicks', trusted=%d);", nThread, zFile, bTrusted);
+      test_exec(db, zSql);
+      sqlite3_free(zSql);
+      test_expect(db, azQuery[0], "20000");
+      test_expect(db, azQuery[1], "990000.0");
+      test_expect(db, azQuery[2], "2857");
+      test_expect(db, azQuery[3], "2020-01-01T07:00:00.000Z");
+      /* Past the first blocks, read ahead or not */
+      iTestFailAt = 300000;
+      for(i=0; i<(int)(sizeof(azQuery)/sizeof(azQuery[0])); i++){
+        test_expect(db, azQuery[i], "error: error reading ioerr-test.json");
+      }
+    }
+  }
+
+  /* A file that cannot be read at all */
+  iTestFailAt = 0;
+  test_expect(db,
+      "CREATE VIRTUAL TABLE temp.u USING druid_json(filename='ioerr-test.json')",
+      "error: error reading ioerr-test.json");
+  iTestFailAt = -1;
+
+  sqlite3_exec(db, "DROP TABLE IF EXISTS temp.t", 0, 0, 0);
+  sqlite3_close(db);
+  remove(zFile);
+  return test_done("ioerr");
+}
@@ -0,0 +1,266 @@
+/*
+** Check of the json_extract(X, P) and X ->> P overloads of druid_json.c
+** against the built-in functions.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/json.c -o json -lsqlite3 -lm -lpthread
+**    ./json
+**
+**   - Every path of every document returns the same type and value as the
+**     built-in function on a copy of the column in an ordinary table, or
+**     fails with the same error: duplicate labels, -0, large integers and
+**     exponents, escapes, nesting, malformed and JSON5 documents.
+**
+**   - Several paths of the documents of a row, of one cursor or of the two
+**     cursors of a self-join, return the values of the built-in too, from
+**     the members the first path of the row found.
+**
+**   - The paths and documents the overloads answer themselves do not run
+**     the built-in.  SQLite does not overload the functions in the
+**     arguments of an aggregate, so these queries return rows.
+**
+** The module of the connection is captured by a wrapper of
+** sqlite3_create_module_v2(), for the test functions to look at its tables.
+*/
+#include "sqlite3.h"
+
+static int test_create_module_v2(sqlite3*, const char*, const sqlite3_module*,
+                                 void*, void(*)(void*));
+#define sqlite3_create_module_v2 test_create_module_v2
+#include "../druid_json.c"
+#undef sqlite3_create_module_v2
+#include "testutil.h"
+
+static DruidModule *pTestModule = 0;  /* Module of the druid_json tables */
+
+static int test_create_module_v2(
+  sqlite3 *db,
+  const char *zName,
+  const sqlite3_module *pMod,
+  void *pAux,
+  void (*xDestroy)(void*)
+){
+  if( strcmp(zName, "druid_json")==0 ) pTestModule = (DruidModule*)pAux;
+  return sqlite3_create_module_v2(db, zName, pMod, pAux, xDestroy);
+}
+
+/* The druid_json table named zName */
+static DruidTable *test_table(const char *zName){
+  DruidTable *pTab;
+  for(pTab=pTestModule->pTables; pTab; pTab=pTab->pNextTable){
+    if( zName && sqlite3_stricmp(pTab->zName, zName)==0 ) break;
+  }
+  return pTab;
+}
+
+/* SQL function test_builtin(NAME), true if the overloads of druid_json
+** table NAME ran the built-in functions */
+static void test_builtin(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  DruidTable *pTab = test_table((const char*)sqlite3_value_text(argv[0]));
+  (void)argc;
+  sqlite3_result_int(ctx, pTab && (pTab->apJson[0] || pTab->apJson[1]));
+}
+
+/* SQL function test_members(NAME), the members kept of the document of
+** the current row of the cursors of druid_json table NAME, or NULL */
+static void test_members(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  DruidTable *pTab = test_table((const char*)sqlite3_value_text(argv[0]));
+  DruidCursor *pCur;
+  (void)argc;
+  for(pCur=pTab ? pTab->pCursors : 0; pCur; pCur=pCur->pNextCursor){
+    if( pCur->json.iCol>=0 && pCur->json.nMember>=0 ){
+      sqlite3_result_int(ctx, pCur->json.nMember);
+      return;
+    }
+  }
+}
+
+/* The documents, one per row */
+static const char *azDoc[] = {
+  /* Duplicate labels, the first one is found */
+  "{\"a\":1,\"b\":\"x\",\"a\":2}",
+  "{\"a\":{\"b\":1},\"a\":{\"b\":2}}",
+  /* Numbers */
+  "{\"a\":-0}",
+  "{\"a\":-0.0,\"b\":0,\"c\":-0e0}",
+  "{\"a\":9223372036854775807,\"b\":-9223372036854775808}",
+  "{\"a\":9223372036854775808,\"b\":-9223372036854775809}",
+  "{\"a\":123456789012345678901234567890,\"b\":999999999999999999}",
+  "{\"a\":1e400,\"b\":-1e400,\"c\":1.5e3,\"d\":2E-2}",
+  "{\"a\":0.1,\"b\":3.14159265358979323846,\"c\":-12.5,\"d\":1234567890.12345}",
+  "{\"a\":0.0000000000000000000001,\"b\":100000000000000000000.5}",
+  "[0,-1,2.5,1e2]",
+  "-0",
+  "42",
+  /* Strings and escapes */
+  "{\"a\":\"x\\\"y\\\\z\\/\\b\\f\\n\\r\\t\",\"b\":\"\"}",
+  "{\"a\":\"\\u00e9\\u4e2d\\u0041\",\"b\":\"\\u007f\\u0080\\u07ff\\u0800\\uffff\"}",
+  "{\"a\":\"\\ud83d\\ude00\",\"b\":\"\\ud83d\",\"c\":\"\\u0000x\"}",
+  "{\"a\\u0062\":1,\"ab\":2,\"c\":3}",
+  "{\"c\":3,\"a\\u0062\":1,\"ab\":2}",
+  "{\"a b\":1,\"a.b\":2,\"a\":{\"b\":3}}",
+  "{\"a\":\"caf\xc3\xa9\",\"b\":\"\xe4\xb8\xad\"}",
+  "\"str\"",
+  /* Nesting, literals and whitespace */
+  "{\"a\":{\"b\":[1,{\"c\":true}]},\"d\":[[1],[2,3]],\"e\":{}}",
+  "[10,20,[30,40],{\"a\":[50]}]",
+  "{\"a\":null,\"b\":false,\"c\":true,\"d\":[null,false,true]}",
+  "  {  \"a\" :\t[ 1 ,\n2 ]\r, \"b\" : { \"c\" : \"d\" } }  ",
+  "{\"a\":[[[[[[[[[[1]]]]]]]]]]}",
+  "{}",
+  "[]",
+  /* Malformed and JSON5 */
+  "{\"a\":1",
+  "{\"a\":01}",
+  "{'a':1}",
+  "{a:1}",
+  "[1,2,]",
+  "{\"a\":tru}",
+  "{\"a\":1} x",
+  "{\"a\":\"\\x\"}",
+  "{\"a\":\"\\u12\"}",
+  "{\"a\":+1}",
+  "{\"a\":.5}",
+  "{\"a\":0x10}",
+  "{\"a\":1,}",
+  "{\"a\":NaN}",
+  "{\"a\":\"tab\there\"}",
+  "nul",
+  "",
+  "   ",
+};
+
+/* The paths of json_extract(), and of ->> but for the integers */
+static const char *azPath[] = {
+  "$", "$.a", "$.b", "$.c", "$.d", "$.e", "$.x", "$.ab", "$.a.b", "$.a.b[1]",
+  "$.a.b[1].c", "$.a[0]", "$.a[1]", "$.d[1][0]", "$.d[2]", "$[0]", "$[1]",
+  "$[2][1]", "$[3].a[0]", "$[#-1]", "$[99999999999999999999]", "$.\"a b\"",
+  "$.\"a.b\"", "$.a[0][0][0][0][0][0][0][0][0][0]", "$.", "$a", "a", "ab",
+  "a b", "0", "1", "-1",
+};
+
+/* A JSON string of the text z, for the result file */
+static void test_append_string(sqlite3_str *pOut, const char *z){
+  sqlite3_str_appendchar(pOut, 1, '"');
+  for(; *z; z++){
+    if( *z=='"' || *z=='\\' ){
+      sqlite3_str_appendf(pOut, "\\%c", *z);
+    }else if( (u8)*z<0x20 ){
+      sqlite3_str_appendf(pOut, "\\u%04x", *z);
+    }else{
+      sqlite3_str_appendchar(pOut, 1, *z);
+    }
+  }
+  sqlite3_str_appendchar(pOut, 1, '"');
+}
+
+int main(void){
+  const char *zFile = "json-test.json";
+  const int nDoc = sizeof(azDoc)/sizeof(azDoc[0]);
+  const int nPath = sizeof(azPath)/sizeof(azPath[0]);
+  sqlite3 *db = test_open();
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  char *z;
+  int i, j;
+
+  sqlite3_create_function(db, "test_builtin", 1, SQLITE_UTF8, 0, test_builtin, 0, 0);
+  sqlite3_create_function(db, "test_members", 1, SQLITE_UTF8, 0, test_members, 0, 0);
+  sqlite3_str_appendall(pOut, "[");
+  for(i=0; i<nDoc; i++){
+    sqlite3_str_appendf(pOut,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T00:00:00.000Z\", "
+        "\"event\": {\"doc\": ", i ? ",\n" : "");
+    test_append_string(pOut, azDoc[i]);
+    sqlite3_str_appendf(pOut, ", \"other\": \"{\\\"a\\\":%d}\"}}", i);
+  }
+  sqlite3_str_appendall(pOut, "]\n");
+  z = sqlite3_str_finish(pOut);
+  test_write(zFile, z, -1);
+  sqlite3_free(z);
+  test_exec(db,
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename='json-test.json');"
+      "CREATE TABLE c AS SELECT rowid AS id, doc, other FROM t;");
+
+  /* Every path of every document */
+  for(i=1; i<=nDoc; i++){
+    for(j=0; j<nPath; j++){
+      char *zSql1 = sqlite3_mprintf(
+          "SELECT typeof(x), x FROM (SELECT json_extract(doc, %Q) x FROM t WHERE rowid=%d)",
+          azPath[j], i);
+      char *zSql2 = sqlite3_mprintf(
+          "SELECT typeof(x), x FROM (SELECT json_extract(doc, %Q) x FROM c WHERE id=%d)",
+          azPath[j], i);
+      test_same(db, zSql1, zSql2);
+      sqlite3_free(zSql1);
+      sqlite3_free(zSql2);
+      if( azPath[j][0]=='-' || (azPath[j][0]>='0' && azPath[j][0]<='9') ){
+        zSql1 = sqlite3_mprintf(
+            "SELECT typeof(x), x FROM (SELECT doc ->> %s x FROM t WHERE rowid=%d)",
+            azPath[j], i);
+        zSql2 = sqlite3_mprintf(
+            "SELECT typeof(x), x FROM (SELECT doc ->> %s x FROM c WHERE id=%d)",
+            azPath[j], i);
+        test_same(db, zSql1, zSql2);
+        sqlite3_free(zSql1);
+        sqlite3_free(zSql2);
+      }
+      zSql1 = sqlite3_mprintf(
+          "SELECT typeof(x), x FROM (SELECT doc ->> %Q x FROM t WHERE rowid=%d)",
+          azPath[j], i);
+      zSql2 = sqlite3_mprintf(
+          "SELECT typeof(x), x FROM (SELECT doc ->> %Q x FROM c WHERE id=%d)",
+          azPath[j], i);
+      test_same(db, zSql1, zSql2);
+      sqlite3_free(zSql1);
+      sqlite3_free(zSql2);
+    }
+  }
+
+  /* Several paths of the documents of a row */
+  test_same(db,
+      "SELECT rowid, json_extract(doc, '$.a'), json_extract(doc, '$.b'), doc ->> 'c',"
+      " json_extract(doc, '$.a.b[1].c'), doc ->> '$[2][1]', doc ->> 1, json_extract(doc, '$.x'),"
+      " json_extract(doc, '$.a'), json_extract(other, '$.a'), json_extract(doc, '$.d[1][0]'),"
+      " doc ->> 'ab'"
+      " FROM t WHERE json_valid(doc)",
+      "SELECT id, json_extract(doc, '$.a'), json_extract(doc, '$.b'), doc ->> 'c',"
+      " json_extract(doc, '$.a.b[1].c'), doc ->> '$[2][1]', doc ->> 1, json_extract(doc, '$.x'),"
+      " json_extract(doc, '$.a'), json_extract(other, '$.a'), json_extract(doc, '$.d[1][0]'),"
+      " doc ->> 'ab'"
+      " FROM c WHERE json_valid(doc)");
+  test_same(db,
+      "SELECT a.rowid, b.rowid, json_extract(a.doc, '$.a'), json_extract(b.doc, '$.b'),"
+      " json_extract(a.doc, '$.b'), json_extract(b.doc, '$.a')"
+      " FROM t a, t b WHERE json_valid(a.doc) AND json_valid(b.doc) AND b.rowid>a.rowid",
+      "SELECT a.id, b.id, json_extract(a.doc, '$.a'), json_extract(b.doc, '$.b'),"
+      " json_extract(a.doc, '$.b'), json_extract(b.doc, '$.a')"
+      " FROM c a, c b WHERE json_valid(a.doc) AND json_valid(b.doc) AND b.id>a.id");
+  /* A label with escapes after the member of the first path */
+  test_same(db, "SELECT doc ->> 'c', doc ->> 'ab', doc ->> 'a' FROM t WHERE json_valid(doc)",
+                "SELECT doc ->> 'c', doc ->> 'ab', doc ->> 'a' FROM c WHERE json_valid(doc)");
+  test_same(db, "SELECT json_extract(doc, '$.a', '$.b') FROM t WHERE json_valid(doc)",
+                "SELECT json_extract(doc, '$.a', '$.b') FROM c WHERE json_valid(doc)");
+  /* The members found by the first path of the row */
+  test_expect(db, "SELECT json_extract(doc, '$.d[1][0]'), test_members('t') FROM t WHERE rowid=22",
+                  "2|3");
+  test_expect(db, "SELECT json_extract(doc, '$[0]'), test_members('t') FROM t WHERE rowid=23",
+                  "10|4");
+
+  /* Answered without the built-in */
+  test_exec(db,
+      "CREATE VIRTUAL TABLE temp.u USING druid_json(filename='json-test.json');");
+  test_expect(db, "SELECT rowid, json_extract(doc, '$.c'), doc ->> '$.b.c',"
+                  " doc ->> '$.a.b[1].c', doc ->> 0 FROM u WHERE rowid IN (1,13,22,23,24,25,27,28)",
+                  "1|NULL|NULL|NULL|NULL;13|NULL|NULL|NULL|NULL;22|NULL|NULL|1|NULL;"
+                  "23|NULL|NULL|NULL|10;24|1|NULL|NULL|NULL;25|NULL|d|NULL|NULL;"
+                  "27|NULL|NULL|NULL|NULL;28|NULL|NULL|NULL|NULL");
+  test_expect(db, "SELECT test_builtin('u')", "0");
+  test_expect(db, "SELECT json_extract(doc, '$.a') FROM u WHERE rowid=3", "0");
+  test_expect(db, "SELECT test_builtin('u')", "1");
+
+  sqlite3_exec(db, "DROP TABLE IF EXISTS temp.t; DROP TABLE IF EXISTS temp.u", 0, 0, 0);
+  sqlite3_close(db);
+  remove(zFile);
+  return test_done("json");
+}
@@ -0,0 +1,154 @@
+/*
+** Check of the materialized tables of druid_json.c (materialize=1), whose
+** rows are copied into the indexed shadow table <name>_data.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/materialized.c -o materialized -lsqlite3 -lm -lpthread
+**    ./materialized
+**
+**   - A materialized table returns the rows of the same table that is not,
+**     for constraints and ORDER BY answered by its indexes or not, and its
+**     plans show the query on <name>_data.
+**
+**   - A table outside of temp keeps its copy across connections, and the
+**     first query after the file changed copies it again.
+**
+**   - _sample constraints still read the file, and the parameters that do
+**     not go with materialize are refused.
+*/
+#include "../druid_json.c"
+#include "testutil.h"
+
+#define TEST_ROWS 500
+
+/* Write the result file, with the clicks of each row plus iAdd */
+static void test_generate(const char *zFile, int iAdd){
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  char *z;
+  int i;
+  sqlite3_str_appendall(pOut, "[");
+  for(i=1; i<=TEST_ROWS; i++){
+    sqlite3_str_appendf(pOut,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-%02dT%02d:00:00.000Z\", "
+        "\"event\": {\"app\": \"app%d\", \"country\": \"c%d\", ",
+        i>1 ? ",\n" : "", 1 + i%28, i%24, i%7, i%3);
+    if( i%13 ){
+      sqlite3_str_appendf(pOut, "\"clicks\": %d}}", i%50 + iAdd);
+    }else{
+      sqlite3_str_appendall(pOut, "\"clicks\": null}}");
+    }
+  }
+  sqlite3_str_appendall(pOut, "]\n");
+  z = sqlite3_str_finish(pOut);
+  test_write(zFile, z, -1);
+  sqlite3_free(z);
+}
+
+/* Open database zDb with the plain table temp.p on zFile, and m, the
+** materialized one, unless it exists */
+static sqlite3 *test_connect(const char *zDb, const char *zFile){
+  sqlite3 *db;
+  char *zErr = 0;
+  char *zSql;
+  if( sqlite3_open(zDb, &db)!=SQLITE_OK || sqlite3_druidjson_init(db, &zErr, 0)!=SQLITE_OK ){
+    fprintf(stderr, "cannot open %s: %s\n", zDb, zErr ? zErr : sqlite3_errmsg(db));
+    exit(1);
+  }
+  zSql = sqlite3_mprintf(
+      "CREATE VIRTUAL TABLE temp.p USING druid_json(filename=%Q, metrics='clicks');"
+      "CREATE VIRTUAL TABLE IF NOT EXISTS m USING druid_json(filename=%Q, metrics='clicks',"
+      " materialize=1, index='app;timestamp,country');", zFile, zFile);
+  test_exec(db, zSql);
+  sqlite3_free(zSql);
+  return db;
+}
+
+/* Check that query zSql, where %s stands for the table, returns the same
+** rows on p and m */
+static void test_rows(sqlite3 *db, const char *zSql){
+  char *zP = sqlite3_mprintf(zSql, "p");
+  char *zM = sqlite3_mprintf(zSql, "m");
+  test_same(db, zP, zM);
+  sqlite3_free(zP);
+  sqlite3_free(zM);
+}
+
+int main(void){
+  static const char *azSql[] = {
+    "SELECT rowid, * FROM %s",
+    "SELECT rowid, clicks FROM %s WHERE app='app3'",
+    "SELECT rowid FROM %s WHERE timestamp='2020-01-05T04:00:00.000Z' AND country>'c0'",
+    "SELECT timestamp, rowid FROM %s WHERE timestamp>='2020-01-27' ORDER BY timestamp, rowid",
+    "SELECT app, country FROM %s WHERE rowid IN (1, 250, 500)",
+    "SELECT count(*), count(clicks), sum(clicks) FROM %s WHERE clicks>=20 AND app<>'app1'",
+    "SELECT app, sum(clicks) FROM %s GROUP BY app ORDER BY app",
+    "SELECT rowid FROM %s ORDER BY app DESC, rowid LIMIT 5 OFFSET 100",
+  };
+  const char *zFile = "materialized-test.json";
+  const char *zDb = "materialized-test.db";
+  sqlite3 *db;
+  char *zIdentity;
+  int i;
+
+  remove(zDb);
+  test_generate(zFile, 0);
+  db = test_connect(zDb, zFile);
+  for(i=0; i<(int)(sizeof(azSql)/sizeof(azSql[0])); i++) test_rows(db, azSql[i]);
+  test_expect(db, "SELECT name FROM sqlite_schema WHERE name LIKE 'm%' ORDER BY name",
+                  "m;m_config;m_data;m_data_i0;m_data_i1");
+  test_expect(db, "SELECT count(*) FROM m_data", "500");
+
+  /* The plans */
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT * FROM m WHERE app='app3'",
+                  "2|0|0|SCAN m VIRTUAL TABLE INDEX 2:WHERE \"app\"=?");
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT * FROM m WHERE timestamp='x' AND country>'c'",
+                  "2|0|0|SCAN m VIRTUAL TABLE INDEX 2:WHERE \"timestamp\"=? AND \"country\">?");
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT * FROM m ORDER BY timestamp",
+                  "3|0|0|SCAN m VIRTUAL TABLE INDEX 2:ORDER BY \"timestamp\"");
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT * FROM m WHERE rowid=2",
+                  "2|0|0|SCAN m VIRTUAL TABLE INDEX 2:WHERE \"rowid\"=?");
+
+  /* The copy is kept across connections: a change made to it shows */
+  test_exec(db, "UPDATE m_data SET app='changed' WHERE rowid=1");
+  zIdentity = test_query(db, "SELECT * FROM m_config");
+  sqlite3_close(db);
+  db = test_connect(zDb, zFile);
+  test_expect(db, "SELECT app FROM m WHERE rowid=1", "changed");
+
+  /* The file changed, copied again */
+  sqlite3_sleep(20);
+  test_generate(zFile, 1000);
+  test_expect(db, "SELECT app, clicks FROM m WHERE rowid=1", "app1|1001.0");
+  for(i=0; i<(int)(sizeof(azSql)/sizeof(azSql[0])); i++) test_rows(db, azSql[i]);
+  {
+    char *z = test_query(db, "SELECT * FROM m_config");
+    nTestCheck++;
+    if( strcmp(z, zIdentity)==0 ){
+      fprintf(stderr, "identity of the changed file: %s\n", z);
+      nTestFail++;
+    }
+    sqlite3_free(z);
+  }
+
+  /* _sample reads the file */
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT count(*) FROM m WHERE _sample=0.5",
+                  "3|0|0|SCAN m VIRTUAL TABLE INDEX 0:_sample=?");
+  test_rows(db, "SELECT count(*), sum(rowid) FROM %s WHERE _sample=0.5");
+
+  /* Refused */
+  test_expect(db, "ALTER TABLE m RENAME TO n",
+                  "error: cannot rename the materialized table m");
+  test_expect(db, "CREATE VIRTUAL TABLE temp.f USING druid_json(filename='materialized-test.json',"
+                  " materialize=1, follow=1)",
+                  "error: follow and materialize cannot be combined");
+  test_expect(db, "CREATE VIRTUAL TABLE temp.f USING druid_json(filename='materialized-test.json',"
+                  " index='app')",
+                  "error: index requires materialize=1");
+
+  sqlite3_free(zIdentity);
+  sqlite3_close(db);
+  remove(zDb);
+  remove(zFile);
+  return test_done("materialized");
+}
@@ -0,0 +1,184 @@
+/*
+** Check of the numbers of druid_json.c, parsed once by consume_number()
+** as they are read, or on first use by the rows that only carry their
+** text.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/number.c -o number -lsqlite3 -lm -lpthread
+**    ./number
+**
+**   - druid_parse_number() returns the double of strtod(), to the bit, for
+**     integers, decimals and exponents of every size around the limits of
+**     its exact path, and the integer of strtoll() for the integers of up
+**     to 18 significant digits.
+**
+**   - The values of a metric column, its sum and the rows of a comparison
+**     are the ones of strtod() for a plain and a trusted table, with and
+**     without the worker pool, and for the cursors of a self-join.
+*/
+#include "../druid_json.c"
+#include "testutil.h"
+
+#define TEST_ROWS 3000
+
+static sqlite3_uint64 iTestRng = 0x853c49e6748fea9bULL;
+
+/* A pseudo-random number below n */
+static u32 test_rand(u32 n){
+  iTestRng = iTestRng*6364136223846793005ULL + 1442695040888963407ULL;
+  return (u32)(iTestRng>>33) % n;
+}
+
+/* Append n random digits to p, the first one not 0 if bLead */
+static void test_digits(sqlite3_str *p, int n, int bLead){
+  int i;
+  for(i=0; i<n; i++){
+    sqlite3_str_appendchar(p, 1, (char)('0' + (i==0 && bLead ? 1+test_rand(9) : test_rand(10))));
+  }
+}
+
+/* Return a random number, in memory from sqlite3_malloc() */
+static char *test_number(void){
+  sqlite3_str *p = sqlite3_str_new(0);
+  int e = (int)test_rand(4);
+  int nInt = 1 + (int)test_rand(test_rand(2) ? 20 : 8);
+  if( test_rand(3)==0 ) sqlite3_str_appendchar(p, 1, '-');
+  if( e==0 || test_rand(4)==0 ){
+    test_digits(p, nInt, nInt>1);
+  }else{
+    sqlite3_str_appendchar(p, 1, '0');
+  }
+  if( e>=1 ){
+    sqlite3_str_appendchar(p, 1, '.');
+    test_digits(p, 1 + (int)test_rand(test_rand(2) ? 20 : 6), 0);
+  }
+  if( e==3 || (e==0 && test_rand(4)==0) ){
+    sqlite3_str_appendchar(p, 1, test_rand(2) ? 'e' : 'E');
+    switch( test_rand(3) ){
+      case 0: sqlite3_str_appendchar(p, 1, '-'); break;
+      case 1: sqlite3_str_appendchar(p, 1, '+'); break;
+    }
+    sqlite3_str_appendf(p, "%d", test_rand(2) ? (int)test_rand(30) : (int)test_rand(300));
+  }
+  return sqlite3_str_finish(p);
+}
+
+/* Check druid_parse_number() on the number z */
+static void test_parse(const char *z){
+  int n = (int)strlen(z);
+  double rWant = strtod(z, 0);
+  double r = 0.0;
+  sqlite3_int64 i = 0;
+  int bInt = druid_parse_number(z, n, &r, &i);
+  int bIntWant = strspn(z, "-0123456789")==(size_t)n;
+  if( bIntWant ){
+    int nDigit = (int)strspn(z + (z[0]=='-'), "0");
+    nDigit = n - (z[0]=='-') - nDigit;
+    bIntWant = nDigit<=18;
+  }
+  nTestCheck++;
+  if( memcmp(&r, &rWant, sizeof(r))!=0 || bInt!=bIntWant
+   || (bInt && i!=strtoll(z, 0, 10)) ){
+    fprintf(stderr, "druid_parse_number(%s): %.17g %s %lld, expected %.17g %s\n",
+            z, r, bInt ? "integer" : "real", (long long)i, rWant,
+            bIntWant ? "integer" : "real");
+    nTestFail++;
+  }
+}
+
+int main(void){
+  static const char *azEdge[] = {
+    "0", "-0", "0.0", "-0.0", "0e0", "1", "-1", "10", "0.1", "0.3",
+    "999999999999999999", "-999999999999999999", "1000000000000000000",
+    "9223372036854775807", "-9223372036854775808", "18446744073709551616",
+    "9007199254740992", "9007199254740993", "9007199254740992.5", "0.9007199254740993",
+    "1e22", "1e23", "1e-22", "1e-23", "1.5e22", "1.5e-22", "123456789e-30",
+    "4.9e-324", "2.2250738585072011e-308", "1.7976931348623157e308", "1e-400",
+    "00012", "-00012.500", "1.e5", "12E+2", "3.14159265358979323846",
+    "0.000000000000000000000000001", "100000000000000000000000000000",
+    "1e400", "-1e400",
+  };
+  const char *zFile = "number-test.json";
+  sqlite3 *db = test_open();
+  sqlite3_stmt *pIns;
+  sqlite3_str *pJson = sqlite3_str_new(0);
+  char *z;
+  int i;
+
+  /* druid_parse_number() */
+  for(i=0; i<(int)(sizeof(azEdge)/sizeof(azEdge[0])); i++) test_parse(azEdge[i]);
+  for(i=0; i<1000000; i++){
+    z = test_number();
+    test_parse(z);
+    sqlite3_free(z);
+  }
+
+  /* The rows, and the strtod() of their numbers in table e */
+  test_exec(db, "CREATE TABLE e(id INTEGER PRIMARY KEY, r REAL)");
+  if( sqlite3_prepare_v2(db, "INSERT INTO e VALUES(?1, ?2)", -1, &pIns, 0) ){
+    fprintf(stderr, "%s\n", sqlite3_errmsg(db));
+    return 1;
+  }
+  sqlite3_str_appendall(pJson, "[");
+  for(i=1; i<=TEST_ROWS; i++){
+    z = test_number();
+    if( i<=(int)(sizeof(azEdge)/sizeof(azEdge[0])) - 2 ){
+      /* The edges, but the last two, infinite, that would make the sums NaN */
+      sqlite3_free(z);
+      z = sqlite3_mprintf("%s", azEdge[i-1]);
+    }
+    while( strchr(z, '+') ){
+      /* Druid does not write the sign of an exponent */
+      sqlite3_free(z);
+      z = test_number();
+    }
+    sqlite3_str_appendf(pJson,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T00:00:00.000Z\", "
+        "\"event\": {\"app\": \"app%d\", \"n\": %s, \"m\": %s%d}}",
+        i>1 ? ",\n" : "", i%7, z, i%2 ? "-" : "", i);
+    sqlite3_bind_int(pIns, 1, i);
+    sqlite3_bind_double(pIns, 2, strtod(z, 0));
+    sqlite3_step(pIns);
+    sqlite3_reset(pIns);
+    sqlite3_free(z);
+  }
+  sqlite3_finalize(pIns);
+  sqlite3_str_appendall(pJson, "]\n");
+  z = sqlite3_str_finish(pJson);
+  test_write(zFile, z, -1);
+  sqlite3_free(z);
+
+  test_exec(db,
+      "CREATE VIRTUAL TABLE temp.p USING druid_json(filename='number-test.json', metrics='n,m');"
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename='number-test.json', metrics='n,m',"
+      " trusted=1);");
+  for(i=0; i<4; i++){
+    const char *zTab = i%2 ? "t" : "p";
+    char *zSql;
+    test_exec(db, i<2 ? "SELECT druid_json_config('threads', 0)"
+                      : "SELECT druid_json_config('threads', 2)");
+    zSql = sqlite3_mprintf(
+        "SELECT count(*) FROM %s JOIN e ON e.id=%s.rowid WHERE n IS NOT r", zTab, zTab);
+    test_expect(db, zSql, "0");
+    sqlite3_free(zSql);
+    zSql = sqlite3_mprintf(
+        "SELECT (SELECT sum(n) FROM %s)=(SELECT sum(r) FROM e),"
+        " (SELECT sum(m) FROM %s)", zTab, zTab);
+    test_expect(db, zSql, "1|1500.0");
+    sqlite3_free(zSql);
+    zSql = sqlite3_mprintf(
+        "SELECT (SELECT group_concat(rowid) FROM %s WHERE n>=1e3)"
+        " IS (SELECT group_concat(id) FROM e WHERE r>=1e3)", zTab);
+    test_expect(db, zSql, "1");
+    sqlite3_free(zSql);
+  }
+
+  /* The second cursor of a self-join reads the rows of the first */
+  test_expect(db, "SELECT count(*) FROM p a JOIN p b ON a.rowid=b.rowid JOIN e ON e.id=a.rowid"
+                  " WHERE b.n IS NOT r OR a.n IS NOT r", "0");
+
+  sqlite3_close(db);
+  remove(zFile);
+  return test_done("number");
+}
@@ -0,0 +1,135 @@
+/*
+** Check of the plans of druid_json.c, the idxStr of xBestIndex that
+** EXPLAIN QUERY PLAN shows and that xFilter reads back.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/plan.c -o plan -lsqlite3 -lm -lpthread
+**    ./plan
+**
+**   - Each item of a plan shows for the queries it answers: rollups,
+**     _granularity, _sample, eq(), comparisons, offset, limit, skip and
+**     proj, with the names of the columns quoted as in SQL.
+**
+**   - xFilter takes the arguments of the items in the order of the plan:
+**     the queries return the rows of an ordinary table, also when the
+**     columns are named as the items, and with NULL arguments.
+*/
+#include "../druid_json.c"
+#include "testutil.h"
+
+#define TEST_ROWS 600
+
+/* Write the result file */
+static void test_generate(const char *zFile){
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  char *z;
+  int i;
+  sqlite3_str_appendall(pOut, "[");
+  for(i=1; i<=TEST_ROWS; i++){
+    sqlite3_str_appendf(pOut,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-%02dT%02d:00:00.000Z\", "
+        "\"event\": {\"app\": \"app%d\", \"a b\": \"v%d\", \"x\\\"y\": \"q%d\", "
+        "\"eq\": \"e%d\", \"offset\": %d, \"proj\": %d.5, \"skip\": %d, \"clicks\": %d}}",
+        i>1 ? ",\n" : "", 1 + i%20, i%24, i%5, i%3, i%2, i%4, i%10, i%7, i%6, i%100);
+  }
+  sqlite3_str_appendall(pOut, "]\n");
+  z = sqlite3_str_finish(pOut);
+  test_write(zFile, z, -1);
+  sqlite3_free(z);
+}
+
+/* Check that query zSql, where %s stands for the table, has plan zPlan on
+** p, and returns the rows of zWant on c on p and on t */
+static void test_plan(sqlite3 *db, const char *zSql, const char *zPlan, const char *zWant){
+  char *zP = sqlite3_mprintf(zSql, "p", "p");
+  char *zT = sqlite3_mprintf(zSql, "t", "t");
+  char *zC = sqlite3_mprintf(zWant ? zWant : zSql, "c", "c");
+  char *zEqp = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", zP);
+  char *z = test_query(db, zEqp);
+  nTestCheck++;
+  if( strstr(z, zPlan)==0 ){
+    fprintf(stderr, "%s\n  plan: %s\n  expected: %s\n", zP, z, zPlan);
+    nTestFail++;
+  }
+  test_same(db, zP, zC);
+  test_same(db, zT, zC);
+  sqlite3_free(z);
+  sqlite3_free(zEqp);
+  sqlite3_free(zP);
+  sqlite3_free(zT);
+  sqlite3_free(zC);
+}
+
+int main(void){
+  const char *zFile = "plan-test.json";
+  sqlite3 *db = test_open();
+
+  test_generate(zFile);
+  test_exec(db,
+      "CREATE VIRTUAL TABLE temp.p USING druid_json(filename='plan-test.json',"
+      " metrics='offset,proj,skip,clicks', rollups='P1D:app;P1W:app,a b;P1D:eq');"
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename='plan-test.json',"
+      " metrics='offset,proj,skip,clicks', rollups='P1D:app;P1W:app,a b;P1D:eq', trusted=1);"
+      "CREATE TABLE c AS SELECT rowid AS id, * FROM p;");
+
+  /* Pushed down constraints, by column name */
+  test_plan(db, "SELECT count(*), sum(clicks) FROM %s WHERE app='app3'",
+                "INDEX 0:eq(app)", 0);
+  test_plan(db, "SELECT count(*) FROM %s WHERE \"a b\"='v2' AND \"x\"\"y\"='q1' AND eq='e3'",
+                "INDEX 0:eq(\"a b\");eq(\"x\"\"y\");eq(eq)", 0);
+  test_plan(db, "SELECT count(*), sum(proj) FROM %s WHERE offset>=5 AND proj<3.5 AND skip=4",
+                "INDEX 0:offset>=?;proj<?;eq(skip)", 0);
+  test_plan(db, "SELECT count(*) FROM %s WHERE clicks>90 AND eq='e1' AND clicks<=95",
+                "INDEX 0:clicks>?;eq(eq);clicks<=?", 0);
+  test_plan(db, "SELECT rowid, app FROM %s WHERE skip>=3 AND offset<2 AND \"a b\"='v1'",
+                "INDEX 0:skip>=?;offset<?;eq(\"a b\")",
+                "SELECT id, app FROM %s WHERE skip>=3 AND offset<2 AND \"a b\"='v1'");
+  test_plan(db, "SELECT count(*) FROM %s WHERE offset=NULL", "eq(offset)", 0);
+  test_plan(db, "SELECT count(*) FROM %s WHERE app=NULL", "eq(app)", 0);
+  test_plan(db, "SELECT count(*) FROM %s WHERE clicks>9999999999999999999", "clicks>?", 0);
+
+  /* skip, offset and limit */
+  test_plan(db, "SELECT count(*) FROM %s", "INDEX 0:skip", 0);
+  test_plan(db, "SELECT rowid, app FROM %s LIMIT 3 OFFSET 100",
+                "INDEX 0:offset=?;limit",
+                "SELECT id, app FROM %s LIMIT 3 OFFSET 100");
+  test_plan(db, "SELECT rowid, clicks FROM %s WHERE eq='e1' AND clicks>=50 LIMIT 4 OFFSET 6",
+                "INDEX 0:eq(eq);clicks>=?;limit",
+                "SELECT id, clicks FROM %s WHERE eq='e1' AND clicks>=50 LIMIT 4 OFFSET 6");
+  test_plan(db, "SELECT count(*) FROM (SELECT 1 FROM %s LIMIT 5 OFFSET 597)",
+                "INDEX 0:offset=?;limit;skip", 0);
+
+  /* The columns decoded by a trusted scan, by their index */
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT count(*) FROM t WHERE offset>=5 AND proj<3.5 AND skip=4",
+                  "3|0|0|SCAN t VIRTUAL TABLE INDEX 0:proj=6,7,8;offset>=?;proj<?;eq(skip)");
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT rowid, \"x\"\"y\" FROM t LIMIT 3 OFFSET 100",
+                  "6|0|0|SCAN t VIRTUAL TABLE INDEX 0:proj=4;offset=?;limit");
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT count(*) FROM t",
+                  "3|0|0|SCAN t VIRTUAL TABLE INDEX 0:skip");
+
+  /* Rollups, the sums of the rows */
+  test_plan(db, "SELECT app, sum(clicks), sum(_count) FROM %s WHERE _granularity='P1D'"
+                " GROUP BY 1 ORDER BY 1",
+                ":rollups=P1D,P1W;_granularity=?",
+                "SELECT app, sum(clicks), count(*) FROM %s GROUP BY 1 ORDER BY 1");
+  test_plan(db, "SELECT app, \"a b\", sum(offset) FROM %s WHERE _granularity='P1W' AND app='app2'"
+                " GROUP BY 1, 2 ORDER BY 1, 2",
+                ":rollups=P1W;_granularity=?;eq(app)",
+                "SELECT app, \"a b\", sum(offset) FROM %s WHERE app='app2' GROUP BY 1, 2 ORDER BY 1, 2");
+  test_plan(db, "SELECT sum(_count), sum(skip) FROM %s WHERE _granularity='P1D' AND eq='e2'",
+                ":rollups=P1D;_granularity=?;eq(eq)",
+                "SELECT count(*), sum(skip) FROM %s WHERE eq='e2'");
+  test_plan(db, "SELECT sum(_count) FROM %s WHERE _granularity=NULL",
+                ";_granularity=?", "SELECT NULL");
+
+  /* _sample: the same rows on both tables */
+  test_plan(db, "SELECT count(*) FROM %s WHERE _sample=0.5 AND app='app1' AND clicks<50",
+                "INDEX 0:_sample=?;eq(app);clicks<?",
+                "SELECT count(*) FROM p WHERE _sample=0.5 AND app='app1' AND clicks<50");
+  test_plan(db, "SELECT count(*) FROM %s WHERE _sample=NULL", "_sample=?", "SELECT 0");
+
+  sqlite3_close(db);
+  remove(zFile);
+  return test_done("plan");
+}
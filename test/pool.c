@@ -0,0 +1,180 @@
+/*
+** Check of the worker pool of druid_json.c under contention.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE -DDRUIDJSON_COUNT_CHUNK_SZ=4096 \
+**        test/pool.c -o pool -lsqlite3 -lm -lpthread
+**    ./pool
+**
+**   - Fork-join tasks, that split in two until a depth and submit one half
+**     from the worker that splits it, must count every leaf while several
+**     threads submit them and another one resizes the pool.  The halves
+**     run by another worker than the one that pushed them on its deque
+**     were stolen: there must be some.
+**
+**   - count(*) from several connections at once, the chunks of the row
+**     count split by the workers, must return the number of rows.
+*/
+#include "../druid_json.c"
+#include "testutil.h"
+
+#define TEST_THREADS  4           /* Threads submitting tasks */
+#define TEST_ROOTS    20          /* Trees of tasks per thread */
+#define TEST_DEPTH    8           /* Depth of a tree, 2^8 leaves */
+
+static int nTestSteal = 0;        /* Halves stolen */
+static int bTestDone = 0;         /* Set when the submitters are done */
+
+/* The checks of a thread, added to nTestCheck and nTestFail once joined */
+typedef struct TestThread {
+  pthread_t id;
+  int nCheck, nFail;
+} TestThread;
+
+/* A task of a tree */
+typedef struct TestFork {
+  int iDepth;                     /* Depth of the subtree */
+  int iPusher;                    /* 1 + worker that pushed it, or 0 */
+  sqlite3_int64 nLeaf;            /* Leaves counted */
+} TestFork;
+
+static void test_fork(void *pArg){
+  TestFork *p = (TestFork*)pArg;
+  TestFork left, right;
+  DruidTask *pTask;
+  if( p->iPusher && p->iPusher!=druidPoolWorker ){
+    DRUID_ATOMIC_INC(&nTestSteal);
+  }
+  if( p->iDepth==0 ){
+    volatile int i;
+    for(i=0; i<20000; i++){}
+    p->nLeaf = 1;
+    return;
+  }
+  left.iDepth = right.iDepth = p->iDepth-1;
+  left.iPusher = 0;
+  right.iPusher = druidPoolWorker;
+  pTask = druid_pool_submit(test_fork, &right);
+  test_fork(&left);
+  if( pTask ){
+    druid_task_wait(pTask);
+    druid_task_release(pTask);
+  }else{
+    test_fork(&right);
+  }
+  p->nLeaf = left.nLeaf + right.nLeaf;
+}
+
+static void *test_submitter(void *pArg){
+  TestThread *pThread = (TestThread*)pArg;
+  int i;
+  for(i=0; i<TEST_ROOTS; i++){
+    TestFork root;
+    DruidTask *pTask;
+    root.iDepth = TEST_DEPTH;
+    root.iPusher = 0;
+    pTask = druid_pool_submit(test_fork, &root);
+    if( pTask ){
+      druid_task_wait(pTask);
+      druid_task_release(pTask);
+    }else{
+      test_fork(&root);
+    }
+    pThread->nCheck++;
+    if( root.nLeaf!=(1<<TEST_DEPTH) ){
+      fprintf(stderr, "tree %d: %lld leaves\n", i, root.nLeaf);
+      pThread->nFail++;
+    }
+  }
+  return 0;
+}
+
+static void *test_resizer(void *pArg){
+  int i;
+  (void)pArg;
+  for(i=0; !DRUID_ATOMIC_LOAD(&bTestDone); i++){
+    druid_pool_configure(2 + i%3);
+    usleep(2000);
+  }
+  return 0;
+}
+
+static void *test_counter(void *pArg){
+  TestThread *pThread = (TestThread*)pArg;
+  sqlite3 *db = test_open();
+  int i;
+  test_exec(db, "CREATE VIRTUAL TABLE temp.t USING druid_json(filename='pool-test.json')");
+  for(i=0; i<10; i++){
+    char *zGot = test_query(db, "SELECT count(*) FROM t");
+    pThread->nCheck++;
+    if( strcmp(zGot ? zGot : "", "20000")!=0 ){
+      fprintf(stderr, "count(*): %s\n", zGot);
+      pThread->nFail++;
+    }
+    sqlite3_free(zGot);
+  }
+  sqlite3_close(db);
+  return 0;
+}
+
+/* Join the threads of a, and add up their checks */
+static void test_join(TestThread *a, int n){
+  int i;
+  for(i=0; i<n; i++){
+    pthread_join(a[i].id, 0);
+    nTestCheck += a[i].nCheck;
+    nTestFail += a[i].nFail;
+  }
+}
+
+int main(void){
+  TestThread aThread[TEST_THREADS+1];
+  pthread_t resizer;
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  sqlite3 *db = test_open();     /* Attaches the pool until closed */
+  char *z;
+  int i;
+
+  /* Fork-join trees */
+  druid_pool_configure(4);
+  pthread_create(&resizer, 0, test_resizer, 0);
+  memset(aThread, 0, sizeof(aThread));
+  for(i=0; i<TEST_THREADS; i++){
+    pthread_create(&aThread[i].id, 0, test_submitter, &aThread[i]);
+  }
+  test_join(aThread, TEST_THREADS);
+  DRUID_ATOMIC_STORE(&bTestDone, 1);
+  pthread_join(resizer, 0);
+  druid_pool_configure(4);
+  test_submitter(&aThread[TEST_THREADS]);
+  nTestCheck += aThread[TEST_THREADS].nCheck + 1;
+  nTestFail += aThread[TEST_THREADS].nFail;
+  if( nTestSteal==0 ){
+    fprintf(stderr, "no half was stolen\n");
+    nTestFail++;
+  }
+
+  /* count(*) of 20000 rows in chunks of 4 KB */
+  sqlite3_str_appendall(pOut, "[");
+  for(i=0; i<20000; i++){
+    sqlite3_str_appendf(pOut,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T00:00:00.000Z\", "
+        "\"event\": {\"app\": \"app%d\", \"note\": \"}, {\\\"x\\\": %d}\"}}",
+        i ? ",\n" : "", i%7, i);
+  }
+  sqlite3_str_appendall(pOut, "]\n");
+  z = sqlite3_str_finish(pOut);
+  test_write("pool-test.json", z, -1);
+  sqlite3_free(z);
+  memset(aThread, 0, sizeof(aThread));
+  for(i=0; i<TEST_THREADS; i++){
+    pthread_create(&aThread[i].id, 0, test_counter, &aThread[i]);
+  }
+  test_join(aThread, TEST_THREADS);
+
+  sqlite3_close(db);
+  remove("pool-test.json");
+  printf("pool: %d halves stolen\n", nTestSteal);
+  return test_done("pool");
+}
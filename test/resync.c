@@ -0,0 +1,303 @@
+/*
+** Check of the resynchronization of druid_json.c on adversarial inputs.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE -DDRUIDJSON_COUNT_CHUNK_SZ=4096 \
+**        test/resync.c -o resync -lsqlite3 -lm -lpthread
+**    ./resync [SEED [NFILE]]
+**
+** The small DRUIDJSON_COUNT_CHUNK_SZ makes count(*) count the rows of files
+** of a few KB in parallel chunks.  The generated result files have string
+** values made to look like row boundaries: "}, {", escaped quotes and runs
+** of backslashes, in both the short and the \u escapes.  For each file:
+**
+**   - druid_reader_resync() at random offsets must either find the first
+**     row that starts at or after the offset, or report that it cannot
+**     tell.  A wrong row is only counted, as the caller checks the row
+**     found against the end of the chunk before it, but it must not happen
+**     on the files without adversarial strings, where at least 99% of the
+**     offsets must find their row.
+**
+**   - count(*) with worker threads must return what the sequential skip of
+**     every row, without threads, returns, and the number of rows written
+**     if the file is complete.
+**
+** The exit status is 0 if all checks pass.
+*/
+#include "../druid_json.c"
+
+/* A generated result file, and the offsets of its rows */
+typedef struct TestFile {
+  char *z;                        /* Content */
+  sqlite3_int64 n;                /* Bytes of content */
+  sqlite3_int64 nAlloc;           /* Allocated bytes of z[] */
+  sqlite3_int64 *aiRow;           /* Offset of the '{' of each row */
+  int nRow;                       /* Rows written */
+  sqlite3_int64 iEnd;             /* Offset of the closing ']', or -1 */
+} TestFile;
+
+static sqlite3_uint64 testRandState = 1;
+
+/* Return a pseudo-random number in [0,n) */
+static int test_rand(int n){
+  testRandState = testRandState*6364136223846793005ULL + 1442695040888963407ULL;
+  return (int)((testRandState>>33) % (sqlite3_uint64)n);
+}
+
+static void test_append(TestFile *p, const char *z, int n){
+  if( n<0 ) n = (int)strlen(z);
+  if( p->n + n + 1 > p->nAlloc ){
+    p->nAlloc = (p->n + n + 1)*2;
+    p->z = realloc(p->z, (size_t)p->nAlloc);
+    if( p->z==0 ){
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  memcpy(&p->z[p->n], z, (size_t)n);
+  p->n += n;
+  p->z[p->n] = 0;
+}
+
+/* Append the JSON string of the n bytes at z, escaped every way JSON
+** allows */
+static void test_append_string(TestFile *p, const char *z, int n){
+  int i;
+  test_append(p, "\"", 1);
+  for(i=0; i<n; i++){
+    char c = z[i];
+    if( c=='"' ){
+      test_append(p, test_rand(4) ? "\\\"" : "\\u0022", -1);
+    }else if( c=='\\' ){
+      test_append(p, test_rand(4) ? "\\\\" : "\\u005c", -1);
+    }else if( c=='/' && test_rand(2) ){
+      test_append(p, "\\/", 2);
+    }else{
+      test_append(p, &c, 1);
+    }
+  }
+  test_append(p, "\"", 1);
+}
+
+/* Append a dimension value.  If bTricky, strings look like JSON */
+static void test_append_value(TestFile *p, bool bTricky){
+  static const char *azTricky[] = {
+    "}, {\"a\": 1", "\"}, {\"", "\\", "\\\"", "]", "}]", "{\"event\": {",
+    "x}, {\"timestamp\"", "},{\"version\":\"v1\"", "\"}, {", "\"},\n{\"",
+    "\\\"}, {\\\"", "}, {\"version\": \"v1\", \"timestamp\": \"",
+  };
+  static const char zChars[] = "ab}{[],:\"\\ /";
+  static const char zPlain[] = "abcdefghijklmnopqrstuvwxyz0123456789-_ .";
+  char zBuf[128];
+  int i, n;
+  int r = test_rand(10);
+  if( r==0 ){
+    test_append(p, "null", 4);
+  }else if( r<3 ){
+    sqlite3_snprintf(sizeof(zBuf), zBuf, "%d.%d", test_rand(100000), test_rand(100));
+    test_append(p, zBuf, -1);
+  }else if( !bTricky ){
+    n = test_rand(40);
+    for(i=0; i<n; i++) zBuf[i] = zPlain[test_rand(sizeof(zPlain)-1)];
+    test_append_string(p, zBuf, n);
+  }else if( r<6 ){
+    const char *z = azTricky[test_rand(sizeof(azTricky)/sizeof(azTricky[0]))];
+    test_append_string(p, z, (int)strlen(z));
+  }else if( r<8 ){
+    /* A run of quotes and backslashes */
+    n = 0;
+    for(i=test_rand(5); i>=0; i--) zBuf[n++] = '"';
+    for(i=test_rand(8); i>0; i--) zBuf[n++] = '\\';
+    if( test_rand(2) ) zBuf[n++] = '"';
+    if( test_rand(2) ){
+      memcpy(&zBuf[n], "}, {", 4);
+      n += 4;
+    }
+    test_append_string(p, zBuf, n);
+  }else{
+    n = test_rand(40);
+    for(i=0; i<n; i++) zBuf[i] = zChars[test_rand(sizeof(zChars)-1)];
+    test_append_string(p, zBuf, n);
+  }
+}
+
+/* Generate a result file of nRow rows */
+static void test_generate(TestFile *p, int nRow, bool bTricky){
+  static const char *azSep[] = { ", ", ",\n", ",", " ,\n  ", ",\r\n" };
+  const char *zSep = azSep[test_rand(sizeof(azSep)/sizeof(azSep[0]))];
+  const char *zColon = test_rand(2) ? ": " : ":";
+  char zBuf[100];
+  int i;
+  memset(p, 0, sizeof(*p));
+  p->aiRow = malloc(sizeof(sqlite3_int64)*(nRow>0 ? nRow : 1));
+  if( p->aiRow==0 ){
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  test_append(p, test_rand(2) ? "[" : "[\n", -1);
+  for(i=0; i<nRow; i++){
+    if( i>0 ) test_append(p, zSep, -1);
+    p->aiRow[i] = p->n;
+    sqlite3_snprintf(sizeof(zBuf), zBuf,
+        "{\"version\"%s\"v1\", \"timestamp\"%s\"2020-01-01T%02d:00:00.000Z\", "
+        "\"event\"%s{\"app\"%s", zColon, zColon, i%24, zColon, zColon);
+    test_append(p, zBuf, -1);
+    test_append_value(p, bTricky);
+    sqlite3_snprintf(sizeof(zBuf), zBuf, ", \"country\"%s", zColon);
+    test_append(p, zBuf, -1);
+    test_append_value(p, bTricky);
+    sqlite3_snprintf(sizeof(zBuf), zBuf, ", \"clicks\"%s%d}}", zColon, test_rand(1000));
+    test_append(p, zBuf, -1);
+  }
+  p->nRow = nRow;
+  p->iEnd = p->n;
+  test_append(p, test_rand(2) ? "]" : "]\n", -1);
+}
+
+static void test_write(const char *zFile, const char *z, sqlite3_int64 n){
+  FILE *out = fopen(zFile, "wb");
+  if( out==0 || fwrite(z, 1, (size_t)n, out)!=(size_t)n || fclose(out) ){
+    fprintf(stderr, "cannot write %s\n", zFile);
+    exit(1);
+  }
+}
+
+/* Counts of the outcomes of druid_reader_resync() */
+typedef struct ResyncStats {
+  int nRight;                     /* Found the right row or end */
+  int nUnknown;                   /* Could not tell */
+  int nWrong;                     /* Found another offset */
+} ResyncStats;
+
+/* Resynchronize at nTry random offsets of a complete file, after its first
+** row, which the count never resynchronizes on */
+static void test_resync(const char *zFile, TestFile *p, int nTry, ResyncStats *pStats){
+  DruidReader rdr;
+  u8 *zWindow = sqlite3_malloc(DRUIDJSON_RESYNC_SZ);
+  int i;
+  druid_reader_init(&rdr);
+  if( zWindow==0 || druid_reader_open(&rdr, zFile) ){
+    fprintf(stderr, "cannot open %s\n", zFile);
+    exit(1);
+  }
+  for(i=0; i<nTry && p->nRow>0; i++){
+    sqlite3_int64 iOff = p->aiRow[0] + 1 + test_rand((int)(p->n - p->aiRow[0] - 1));
+    sqlite3_int64 iRow = -1, iTrue = p->iEnd;
+    int eTrue = DRUID_RESYNC_END;
+    int lo = 0, hi = p->nRow;
+    int eRes;
+    /* The first row at or after iOff */
+    while( lo<hi ){
+      int mid = (lo+hi)/2;
+      if( p->aiRow[mid]<iOff ) lo = mid+1; else hi = mid;
+    }
+    if( lo<p->nRow ){
+      eTrue = DRUID_RESYNC_ROW;
+      iTrue = p->aiRow[lo];
+    }
+    eRes = druid_reader_resync(&rdr, iOff, zWindow, &iRow);
+    if( eRes==DRUID_RESYNC_UNKNOWN ){
+      pStats->nUnknown++;
+    }else if( eRes==eTrue && iRow==iTrue && iOff<=p->iEnd ){
+      pStats->nRight++;
+    }else if( iOff>p->iEnd && eRes==DRUID_RESYNC_END ){
+      pStats->nRight++;
+    }else{
+      pStats->nWrong++;
+    }
+  }
+  druid_reader_reset(&rdr);
+  sqlite3_free(zWindow);
+}
+
+/* Return count(*) of the file read with nThread workers, or the error
+** message, in memory from sqlite3_malloc() */
+static char *test_count(sqlite3 *db, const char *zFile, bool bTrusted, int nThread){
+  sqlite3_stmt *pStmt = 0;
+  char *zSql, *zRes;
+  int rc;
+  zSql = sqlite3_mprintf(
+      "SELECT druid_json_config('threads', %d);"
+      "DROP TABLE IF EXISTS temp.t;"
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename=%Q,"
+      " metrics='clicks'%s);", nThread, zFile, bTrusted ? ", trusted=1" : "");
+  rc = sqlite3_exec(db, zSql, 0, 0, 0);
+  sqlite3_free(zSql);
+  if( rc==SQLITE_OK ){
+    rc = sqlite3_prepare_v2(db, "SELECT count(*) FROM temp.t", -1, &pStmt, 0);
+  }
+  if( rc==SQLITE_OK && (rc = sqlite3_step(pStmt))==SQLITE_ROW ){
+    zRes = sqlite3_mprintf("%lld", sqlite3_column_int64(pStmt, 0));
+  }else{
+    zRes = sqlite3_mprintf("error: %s", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(pStmt);
+  return zRes;
+}
+
+int main(int argc, char **argv){
+  const char *zFile = "resync-test.json";
+  int iSeed = argc>1 ? atoi(argv[1]) : 1;
+  int nFile = argc>2 ? atoi(argv[2]) : 200;
+  ResyncStats aStats[2];
+  int nFail = 0, nCount = 0;
+  sqlite3 *db;
+  char *zErr = 0;
+  int i;
+
+  testRandState = (sqlite3_uint64)iSeed;
+  memset(aStats, 0, sizeof(aStats));
+  if( sqlite3_open(":memory:", &db)!=SQLITE_OK
+   || sqlite3_druidjson_init(db, &zErr, 0)!=SQLITE_OK ){
+    fprintf(stderr, "cannot load druid_json: %s\n", zErr ? zErr : sqlite3_errmsg(db));
+    return 1;
+  }
+  for(i=0; i<nFile; i++){
+    TestFile f;
+    bool bTricky = i%4!=0;
+    bool bTrusted = test_rand(3)==0;
+    bool bTrunc = test_rand(5)==0;
+    sqlite3_int64 nWrite;
+    char *zSeq, *zPar;
+    test_generate(&f, test_rand(3000), bTricky);
+    nWrite = bTrunc ? f.n/2 + test_rand((int)(f.n/2)) : f.n;
+    test_write(zFile, f.z, nWrite);
+    if( !bTrunc ) test_resync(zFile, &f, 300, &aStats[bTricky]);
+    zSeq = test_count(db, zFile, bTrusted, 0);
+    zPar = test_count(db, zFile, bTrusted, 1 + test_rand(4));
+    if( strcmp(zSeq, zPar)!=0 ){
+      fprintf(stderr, "file %d: sequential %s, parallel %s\n", i, zSeq, zPar);
+      nFail++;
+    }else if( !bTrunc && atoll(zSeq)!=f.nRow ){
+      fprintf(stderr, "file %d: count %s of %d rows\n", i, zSeq, f.nRow);
+      nFail++;
+    }
+    nCount++;
+    if( nFail ) test_write("resync-fail.json", f.z, nWrite);
+    sqlite3_free(zSeq);
+    sqlite3_free(zPar);
+    free(f.z);
+    free(f.aiRow);
+    if( nFail ) break;
+  }
+  if( aStats[0].nWrong ){
+    fprintf(stderr, "%d wrong resynchronizations without adversarial strings\n",
+            aStats[0].nWrong);
+    nFail++;
+  }
+  if( aStats[0].nRight < (aStats[0].nRight + aStats[0].nUnknown)*0.99 ){
+    fprintf(stderr, "%d resynchronizations without adversarial strings failed\n",
+            aStats[0].nUnknown);
+    nFail++;
+  }
+  printf("%d files counted, %d failures\n", nCount, nFail);
+  printf("resync plain:       %d right, %d unknown, %d wrong\n",
+         aStats[0].nRight, aStats[0].nUnknown, aStats[0].nWrong);
+  printf("resync adversarial: %d right, %d unknown, %d wrong\n",
+         aStats[1].nRight, aStats[1].nUnknown, aStats[1].nWrong);
+  sqlite3_exec(db, "DROP TABLE IF EXISTS temp.t", 0, 0, 0);
+  sqlite3_close(db);
+  remove(zFile);
+  return nFail!=0;
+}
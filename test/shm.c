@@ -0,0 +1,196 @@
+/*
+** Check of the shm cache of druid_json.c (shm=1), the decoded rows of a
+** result file shared by the connections and processes that query it.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/shm.c -o shm -lsqlite3 -lm -lpthread
+**    ./shm
+**
+**   - A table with shm=1 returns the rows of the same table without it,
+**     with their null values, escapes and metrics, and its
+**     plan shows cache=shm.  The first scan builds one cache file, which
+**     the scans of another connection map.
+**
+**   - A result file rewritten gets a new cache, and the old one, as well
+**     as the caches that no process opened for shm_max_age seconds, are
+**     removed.
+**
+**   - A cache whose rows were changed fails the scan with SQLITE_CORRUPT,
+**     and a link planted in place of a cache is not followed.
+*/
+#include <utime.h>
+#include "../druid_json.c"
+#include "testutil.h"
+
+#define TEST_ROWS 600
+
+/* Write the result file, with the clicks of each row multiplied by iMul */
+static void test_generate(const char *zFile, int iMul){
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  char *z;
+  int i;
+  sqlite3_str_appendall(pOut, "[");
+  for(i=1; i<=TEST_ROWS; i++){
+    sqlite3_str_appendf(pOut,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T%02d:00:00.000Z\", "
+        "\"event\": {\"country\": \"c%d\"", i>1 ? ",\n" : "", i%24, i%4);
+    if( i%7 ){
+      sqlite3_str_appendf(pOut, ", \"app\": \"app \\\"%d\\\" \\u00e9\"", i%5);
+    }else{
+      sqlite3_str_appendall(pOut, ", \"app\": null");
+    }
+    if( i%11 ){
+      sqlite3_str_appendf(pOut, ", \"clicks\": %d}}", i*iMul);
+    }else{
+      sqlite3_str_appendall(pOut, ", \"clicks\": null}}");
+    }
+  }
+  sqlite3_str_appendall(pOut, "]\n");
+  z = sqlite3_str_finish(pOut);
+  test_write(zFile, z, -1);
+  sqlite3_free(z);
+}
+
+/* Return the caches of file zFile, names separated by ';', in memory from
+** sqlite3_malloc().  If bRemove, remove them */
+static char *test_caches(const char *zFile, int bRemove){
+  char *zReal = realpath(zFile, 0);
+  char *zPrefix = sqlite3_mprintf("druid_json-%016llx-",
+                                  druid_hash64(zReal, (int)strlen(zReal)));
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  DIR *pDir = opendir(druid_shm_dir());
+  struct dirent *pEntry;
+  while( pDir && (pEntry = readdir(pDir))!=0 ){
+    if( strncmp(pEntry->d_name, zPrefix, strlen(zPrefix))!=0 ) continue;
+    if( sqlite3_str_length(pOut) ) sqlite3_str_appendchar(pOut, 1, ';');
+    sqlite3_str_appendall(pOut, pEntry->d_name);
+    if( bRemove ){
+      char *zPath = sqlite3_mprintf("%s/%s", druid_shm_dir(), pEntry->d_name);
+      unlink(zPath);
+      sqlite3_free(zPath);
+    }
+  }
+  if( pDir ) closedir(pDir);
+  free(zReal);
+  sqlite3_free(zPrefix);
+  return sqlite3_str_finish(pOut);
+}
+
+/* Check that file zFile has n caches */
+static void test_ncache(const char *zFile, int n){
+  char *z = test_caches(zFile, 0);
+  int i, nGot = z && z[0] ? 1 : 0;
+  for(i=0; z && z[i]; i++) nGot += z[i]==';';
+  nTestCheck++;
+  if( nGot!=n ){
+    fprintf(stderr, "caches of %s: %s, expected %d\n", zFile, z, n);
+    nTestFail++;
+  }
+  sqlite3_free(z);
+}
+
+/* Open a connection with table p on zFile, and table s with shm=1 */
+static sqlite3 *test_connect(const char *zFile){
+  sqlite3 *db = test_open();
+  char *zSql = sqlite3_mprintf(
+      "CREATE VIRTUAL TABLE temp.p USING druid_json(filename=%Q, metrics='clicks');"
+      "CREATE VIRTUAL TABLE temp.s USING druid_json(filename=%Q, metrics='clicks', shm=1);",
+      zFile, zFile);
+  test_exec(db, zSql);
+  sqlite3_free(zSql);
+  return db;
+}
+
+/* Check that the shm table of db returns the rows of the plain one */
+static void test_rows(sqlite3 *db){
+  test_same(db, "SELECT rowid, * FROM p", "SELECT rowid, * FROM s");
+  test_same(db, "SELECT count(*), count(app), sum(clicks) FROM p",
+                "SELECT count(*), count(app), sum(clicks) FROM s");
+  test_same(db, "SELECT rowid, clicks FROM p WHERE app='app \"3\" \xc3\xa9' AND clicks>300",
+                "SELECT rowid, clicks FROM s WHERE app='app \"3\" \xc3\xa9' AND clicks>300");
+  test_same(db, "SELECT rowid, app FROM p LIMIT 5 OFFSET 297",
+                "SELECT rowid, app FROM s LIMIT 5 OFFSET 297");
+}
+
+int main(void){
+  const char *zFile = "shm-test.json";
+  sqlite3 *db, *db2;
+  char *zCache, *zPath, *zStale, *z;
+  struct utimbuf times;
+  FILE *f;
+
+  test_generate(zFile, 1);
+  sqlite3_free(test_caches(zFile, 1));
+  db = test_connect(zFile);
+
+  /* Built by the first scan, mapped by another connection */
+  test_ncache(zFile, 0);
+  test_rows(db);
+  test_ncache(zFile, 1);
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT app FROM s",
+                  "2|0|0|SCAN s VIRTUAL TABLE INDEX 0:cache=shm");
+  db2 = test_connect(zFile);
+  test_rows(db2);
+  test_ncache(zFile, 1);
+  zCache = test_caches(zFile, 0);
+
+  /* A new cache for a rewritten file, the old one and stale ones removed */
+  zStale = sqlite3_mprintf("%s/druid_json-0000000000000000-0000000000000000.rows",
+                           druid_shm_dir());
+  test_write(zStale, "stale", -1);
+  times.actime = times.modtime = time(0) - 2*86400;
+  utime(zStale, &times);
+  sqlite3_sleep(20);
+  test_generate(zFile, 3);
+  test_rows(db2);
+  test_expect(db2, "SELECT sum(clicks) FROM s WHERE rowid<=10", "165.0");
+  test_ncache(zFile, 1);
+  z = test_caches(zFile, 0);
+  nTestCheck++;
+  if( strcmp(z, zCache)==0 || access(zStale, F_OK)==0 ){
+    fprintf(stderr, "cache %s of the rewritten file, stale cache %s\n", z,
+            access(zStale, F_OK)==0 ? "kept" : "removed");
+    nTestFail++;
+  }
+  sqlite3_free(zCache);
+  zCache = z;
+  sqlite3_close(db2);
+
+  /* A row of the cache changed by another process */
+  zPath = sqlite3_mprintf("%s/%s", druid_shm_dir(), zCache);
+  f = fopen(zPath, "r+b");
+  if( f ){
+    u32 nRow = 0xfffffff0;
+    fseek(f, sizeof(DruidShmHeader), SEEK_SET);
+    fwrite(&nRow, sizeof(nRow), 1, f);
+    fclose(f);
+  }
+  db2 = test_connect(zFile);
+  z = sqlite3_mprintf("error: corrupt shm cache of %s at row 0", zFile);
+  test_expect(db2, "SELECT count(app) FROM s", z);
+  sqlite3_free(z);
+  sqlite3_close(db2);
+
+  /* A link planted in place of the cache */
+  unlink(zPath);
+  if( symlink("/dev/null", zPath)!=0 ) fprintf(stderr, "cannot link %s\n", zPath);
+  db2 = test_connect(zFile);
+  z = test_query(db2, "SELECT count(app) FROM s");
+  nTestCheck++;
+  if( strncmp(z, "error: cannot open ", 19)!=0 ){
+    fprintf(stderr, "planted link: %s\n", z);
+    nTestFail++;
+  }
+  sqlite3_free(z);
+  sqlite3_close(db2);
+  unlink(zPath);
+
+  sqlite3_free(zPath);
+  sqlite3_free(zCache);
+  sqlite3_free(zStale);
+  sqlite3_close(db);
+  sqlite3_free(test_caches(zFile, 1));
+  remove(zFile);
+  return test_done("shm");
+}
@@ -0,0 +1,184 @@
+/*
+** Check of the sketch aggregates of druid_json.c on serialized sketches
+** built by the test, valid and malformed.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/sketches.c -o sketches -lsqlite3 -lm -lpthread
+**    ./sketches
+**
+**   - druid_hll_estimate() must return the same estimate for a sketch as a
+**     BLOB and as base64 TEXT, whatever its size: sparse sketches of up to
+**     1024 entries are larger than a dense one.
+**
+**   - druid_quantiles_merge() must merge valid DoublesSketch images, and
+**     fail with SQLITE_CORRUPT, without merging, on images whose item
+**     count does not fit with the others.
+*/
+#include "../druid_json.c"
+#include "testutil.h"
+
+/* Return the base64 of the n bytes at a, in memory from sqlite3_malloc() */
+static char *test_base64(const u8 *a, int n){
+  static const char zAlpha[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  int i;
+  for(i=0; i<n; i+=3){
+    u32 v = (u32)a[i]<<16 | (i+1<n ? (u32)a[i+1]<<8 : 0) | (i+2<n ? a[i+2] : 0);
+    sqlite3_str_appendchar(pOut, 1, zAlpha[(v>>18)&63]);
+    sqlite3_str_appendchar(pOut, 1, zAlpha[(v>>12)&63]);
+    sqlite3_str_appendchar(pOut, 1, i+1<n ? zAlpha[(v>>6)&63] : '=');
+    sqlite3_str_appendchar(pOut, 1, i+2<n ? zAlpha[v&63] : '=');
+  }
+  return sqlite3_str_finish(pOut);
+}
+
+/* Return an SQL literal of the n bytes at a, in memory from sqlite3_malloc() */
+static char *test_blob(const u8 *a, int n){
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  int i;
+  sqlite3_str_appendall(pOut, "x'");
+  for(i=0; i<n; i++) sqlite3_str_appendf(pOut, "%02x", a[i]);
+  sqlite3_str_appendchar(pOut, 1, '\'');
+  return sqlite3_str_finish(pOut);
+}
+
+/* Check that the sketch of n bytes at a gives the same result as a BLOB
+** and as base64 TEXT to the function zFunc, and that it is zExpected */
+static void test_sketch(sqlite3 *db, const char *zFunc, const u8 *a, int n, const char *zExpected){
+  char *zText = test_base64(a, n);
+  char *zBlob = test_blob(a, n);
+  char *zSql1 = sqlite3_mprintf("SELECT %s(%s)", zFunc, zBlob);
+  char *zSql2 = sqlite3_mprintf("SELECT %s('%s')", zFunc, zText);
+  test_same(db, zSql1, zSql2);
+  if( zExpected ) test_expect(db, zSql1, zExpected);
+  sqlite3_free(zText);
+  sqlite3_free(zBlob);
+  sqlite3_free(zSql1);
+  sqlite3_free(zSql2);
+}
+
+/* A version 1 HyperLogLog collector with nEntry non-zero bytes, sparse
+** unless nEntry is 1024.  Return its size */
+static int test_hll(u8 *a, int nEntry){
+  int i, n = DRUID_HLL_V1_HEADER;
+  memset(a, 0, DRUID_HLL_V1_HEADER);
+  a[0] = 1;
+  a[2] = (u8)((nEntry*2)>>8);
+  a[3] = (u8)(nEntry*2);
+  for(i=0; i<nEntry; i++){
+    if( nEntry<DRUID_HLL_DENSE_BYTES ){
+      a[n++] = (u8)(i>>8);
+      a[n++] = (u8)i;
+    }
+    a[n++] = 0x11;
+  }
+  return n;
+}
+
+/* A compact DoublesSketch of k items per level summarizing nItem items,
+** the items of value r.  Return its size, or 0 if it is too large for a */
+static int test_quantiles(u8 *a, int nAlloc, int k, sqlite3_int64 nItem, double r){
+  sqlite3_uint64 bitPattern = (sqlite3_uint64)(nItem/(2*k));
+  int nStored = (int)(nItem%(2*k));
+  int n = 32, i;
+  for(; bitPattern; bitPattern>>=1) nStored += (bitPattern&1) ? k : 0;
+  if( 32+nStored*8>nAlloc ) return 0;
+  memset(a, 0, 32);
+  a[0] = 2;
+  a[1] = 3;
+  a[2] = DRUID_QUANTILES_FAMILY;
+  a[3] = DRUID_DS_FLAG_COMPACT | DRUID_DS_FLAG_READ_ONLY;
+  a[4] = (u8)k;
+  a[5] = (u8)(k>>8);
+  druid_put_le64(&a[8], (sqlite3_uint64)nItem);
+  druid_put_le_double(&a[16], r);
+  druid_put_le_double(&a[24], r);
+  for(i=0; i<nStored; i++){
+    druid_put_le_double(&a[n], r);
+    n += 8;
+  }
+  return n;
+}
+
+/* Check that the merge of the sketches of zSql, a query of column x, fails
+** with SQLITE_CORRUPT */
+static void test_corrupt(sqlite3 *db, const char *zSql){
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  if( rc==SQLITE_OK ) rc = sqlite3_step(pStmt);
+  nTestCheck++;
+  if( rc!=SQLITE_CORRUPT ){
+    fprintf(stderr, "%s\n  -> %d %s, expected SQLITE_CORRUPT\n", zSql, rc, sqlite3_errmsg(db));
+    nTestFail++;
+  }
+  sqlite3_finalize(pStmt);
+}
+
+int main(void){
+  static const int anEntry[] = { 0, 1, 300, 344, 345, 700, 1023, 1024 };
+  u8 a[DRUID_HLL_V1_HEADER + 3*DRUID_HLL_DENSE_BYTES];
+  sqlite3 *db = test_open();
+  int i;
+
+  for(i=0; i<(int)(sizeof(anEntry)/sizeof(anEntry[0])); i++){
+    int n = test_hll(a, anEntry[i]);
+    test_sketch(db, "druid_hll_estimate", a, n, 0);
+  }
+  /* 700 entries set 1400 of the 2048 registers to 1 */
+  {
+    char *zText = test_base64(a, test_hll(a, 700));
+    char *zSql = sqlite3_mprintf("SELECT round(druid_hll_estimate('%s'), 3)", zText);
+    test_expect(db, zSql, "2356.692");
+    sqlite3_free(zSql);
+    sqlite3_free(zText);
+  }
+  test_expect(db, "SELECT druid_hll_estimate('not base64')",
+                  "error: malformed Druid HyperLogLog sketch");
+  test_expect(db, "SELECT druid_hll_estimate('AQ==')",
+                  "error: malformed Druid HyperLogLog sketch");
+
+  /* Quantiles */
+  {
+    static const struct {
+      int k;                      /* k of the sketch */
+      sqlite3_int64 nItem;        /* Items summarized */
+    } aQ[] = {
+      { 2, 5 }, { 16, 1000 }, { 128, 100000 },
+      { 2, ((sqlite3_int64)1)<<62 }, { 32768, ((sqlite3_int64)1)<<62 },
+    };
+    static u8 aBuf[32 + 8*40000];
+    char *zSql;
+    int n;
+    test_exec(db, "CREATE TABLE q(i INTEGER PRIMARY KEY, x BLOB)");
+    for(i=0; i<(int)(sizeof(aQ)/sizeof(aQ[0])); i++){
+      char *zBlob;
+      n = test_quantiles(aBuf, sizeof(aBuf), aQ[i].k, aQ[i].nItem, (double)(i+1));
+      zBlob = test_blob(aBuf, n);
+      zSql = sqlite3_mprintf("INSERT INTO q VALUES(%d, %s)", i, zBlob);
+      test_exec(db, zSql);
+      sqlite3_free(zSql);
+      sqlite3_free(zBlob);
+    }
+    test_expect(db, "SELECT druid_quantiles_quantile(x, 0.5) FROM q WHERE i=0", "1.0");
+    test_expect(db, "SELECT druid_quantiles_quantile(x, 1.0) FROM q WHERE i<3", "3.0");
+    /* 2^62 items, with the others that are merged before it */
+    test_expect(db, "SELECT druid_quantiles_quantile(x, 0.5) FROM q WHERE i IN (0,3)", "4.0");
+    test_expect(db, "SELECT druid_quantiles_quantile(x, 0.5) FROM q WHERE i IN (0,4)", "5.0");
+    /* 2^63 items or more */
+    test_corrupt(db, "SELECT druid_quantiles_merge(x) FROM q WHERE i>=3");
+    test_corrupt(db, "SELECT druid_quantiles_merge(x) FROM (SELECT x FROM q WHERE i=3"
+                     " UNION ALL SELECT x FROM q WHERE i=3)");
+    test_expect(db, "SELECT druid_quantiles_merge(x) FROM q WHERE i>=3",
+                    "error: corrupt quantiles sketch, too many items");
+    /* Truncated */
+    n = test_quantiles(aBuf, sizeof(aBuf), 16, 1000, 1.0);
+    zSql = sqlite3_mprintf("SELECT druid_quantiles_merge(substr(x, 1, %d)) FROM q WHERE i=1", n-8);
+    test_corrupt(db, zSql);
+    sqlite3_free(zSql);
+  }
+
+  sqlite3_close(db);
+  return test_done("sketches");
+}
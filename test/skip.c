@@ -0,0 +1,197 @@
+/*
+** Check of the rows that druid_json.c skips without decoding them, for
+** count(*), OFFSET and sampling, 64 characters at a time.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/skip.c -o skip -lsqlite3 -lm -lpthread
+**    ./skip
+**
+**   - druid_skip_block() ends each row where a loop over its characters
+**     does, with quotes, runs of backslashes and brackets in strings on
+**     every side of the ends of the blocks.
+**
+**   - count(*) and the rows after an OFFSET, with the pushed down OFFSET
+**     in the plan, are the ones of the scans that decode the rows, for a
+**     plain and a trusted table, with and without the worker pool.
+**
+**   - A file cut at any character of its last rows ends a count(*) and an
+**     OFFSET with the rows of a scan that decodes them, or fails as it
+**     does.
+*/
+#include "../druid_json.c"
+#include "testutil.h"
+
+#define TEST_ROWS 1200
+
+static sqlite3_uint64 iTestRng = 0xda3e39cb94b95bdbULL;
+
+/* A pseudo-random number below n */
+static u32 test_rand(u32 n){
+  iTestRng = iTestRng*6364136223846793005ULL + 1442695040888963407ULL;
+  return (u32)(iTestRng>>33) % n;
+}
+
+/* Append a random JSON string to p, with its quotes */
+static void test_string(sqlite3_str *p){
+  static const char *azPiece[] = {
+    "a", "b", " ", "\\\"", "\\\\", "\\\\\\\\", "\\\\\\\"", "{", "}", "[", "]",
+    "\\u0041", "\\n", "x\\\\\\\\\\\"y", "\xc3\xa9",
+  };
+  int n = (int)test_rand(test_rand(4) ? 12 : 120);
+  int i;
+  sqlite3_str_appendchar(p, 1, '"');
+  for(i=0; i<n; i++){
+    sqlite3_str_appendall(p, azPiece[test_rand(sizeof(azPiece)/sizeof(azPiece[0]))]);
+  }
+  sqlite3_str_appendchar(p, 1, '"');
+}
+
+/* Return the end of the row that starts at z[0], one character at a time */
+static int test_row_end(const u8 *z, int n){
+  int bEscaped = 0, bInString = 0, depth = 0;
+  int i;
+  for(i=0; i<n; i++){
+    if( bEscaped ){
+      bEscaped = 0;
+    }else if( bInString ){
+      if( z[i]=='\\' ) bEscaped = 1;
+      else if( z[i]=='"' ) bInString = 0;
+    }else if( z[i]=='"' ){
+      bInString = 1;
+    }else if( z[i]=='{' || z[i]=='[' ){
+      depth++;
+    }else if( (z[i]=='}' || z[i]==']') && --depth==0 ){
+      return i+1;
+    }
+  }
+  return -1;
+}
+
+/* Check druid_skip_block() on the rows of the n characters at z, which
+** are followed by 64 more */
+static void test_blocks(const u8 *z, int n){
+  const char *zRow = (const char*)z;
+  while( (zRow = strchr(zRow, '{'))!=0 && zRow<(const char*)&z[n] ){
+    DruidSkip skip = {0, 0, 0};
+    int i = (int)(zRow - (const char*)z);
+    int iWant = i + test_row_end(&z[i], n-i);
+    int iEnd = i;
+    int k;
+    while( (k = druid_skip_block(&skip, &z[iEnd]))==0 && iEnd<n ) iEnd += 64;
+    iEnd += k;
+    nTestCheck++;
+    if( iEnd!=iWant ){
+      fprintf(stderr, "druid_skip_block() on the row at %d: ends at %d, expected %d\n",
+              i, iEnd, iWant);
+      nTestFail++;
+    }
+    zRow = (const char*)&z[iWant];
+  }
+}
+
+/* Return the rows of the file as query zSql counts them, or "error" */
+static char *test_count(sqlite3 *db, const char *zSql){
+  char *z = test_query(db, zSql);
+  if( strncmp(z, "error: ", 7)==0 && strstr(z, "unterminated string")==0 ){
+    sqlite3_free(z);
+    z = sqlite3_mprintf("error");
+  }
+  return z;
+}
+
+/* Check that query zSkip, which skips the rows, counts those of zDecode */
+static void test_cut(sqlite3 *db, const char *zSkip, const char *zDecode, int nCut){
+  char *zWant = test_count(db, zDecode);
+  char *zGot = test_count(db, zSkip);
+  nTestCheck++;
+  if( strcmp(zGot, zWant)!=0 ){
+    fprintf(stderr, "%s, cut %d characters before the end: %s, expected %s\n",
+            zSkip, nCut, zGot, zWant);
+    nTestFail++;
+  }
+  sqlite3_free(zWant);
+  sqlite3_free(zGot);
+}
+
+int main(void){
+  static const int aOffset[] = { 0, 1, 63, 255, 256, 257, 700, 1197, 1199, 1200, 5000 };
+  const char *zFile = "skip-test.json";
+  sqlite3 *db = test_open();
+  sqlite3_str *pJson = sqlite3_str_new(0);
+  char *zData;
+  int nData;
+  int i, j;
+
+  sqlite3_str_appendall(pJson, "[");
+  for(i=1; i<=TEST_ROWS; i++){
+    sqlite3_str_appendf(pJson,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T00:00:00.000Z\", "
+        "\"event\": {\"app\": ", i>1 ? ",\n" : "");
+    test_string(pJson);
+    sqlite3_str_appendall(pJson, ", \"tags\": ");
+    if( test_rand(5) ){
+      test_string(pJson);
+    }else{
+      sqlite3_str_appendall(pJson, "null");
+    }
+    sqlite3_str_appendf(pJson, ", \"clicks\": %d}}", i);
+  }
+  sqlite3_str_appendall(pJson, "]\n");
+  nData = sqlite3_str_length(pJson);
+  sqlite3_str_appendchar(pJson, 64, ' ');
+  zData = sqlite3_str_finish(pJson);
+  test_write(zFile, zData, nData);
+
+  /* druid_skip_block() */
+  test_blocks((const u8*)zData, nData);
+
+  /* count(*) and OFFSET */
+  test_exec(db,
+      "CREATE VIRTUAL TABLE temp.p USING druid_json(filename='skip-test.json', metrics='clicks');"
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename='skip-test.json', metrics='clicks',"
+      " trusted=1);"
+      "CREATE TABLE c AS SELECT rowid AS id, app, tags, clicks FROM p;");
+  test_expect(db, "SELECT count(*), sum(clicks) FROM c", "1200|720600.0");
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT rowid, app FROM p LIMIT 3 OFFSET 7",
+                  "6|0|0|SCAN p VIRTUAL TABLE INDEX 0:offset=?;limit");
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT count(*) FROM p",
+                  "3|0|0|SCAN p VIRTUAL TABLE INDEX 0:skip");
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT rowid FROM p WHERE clicks>3 LIMIT 3 OFFSET 7",
+                  "6|0|0|SCAN p VIRTUAL TABLE INDEX 0:clicks>?;limit");
+  for(i=0; i<4; i++){
+    const char *zTab = i%2 ? "t" : "p";
+    char *zSql;
+    test_exec(db, i<2 ? "SELECT druid_json_config('threads', 0)"
+                      : "SELECT druid_json_config('threads', 2)");
+    zSql = sqlite3_mprintf("SELECT count(*) FROM %s", zTab);
+    test_expect(db, zSql, "1200");
+    sqlite3_free(zSql);
+    for(j=0; j<(int)(sizeof(aOffset)/sizeof(aOffset[0])); j++){
+      char *zC = sqlite3_mprintf(
+          "SELECT id, app, tags, clicks FROM c LIMIT 3 OFFSET %d", aOffset[j]);
+      zSql = sqlite3_mprintf(
+          "SELECT rowid, app, tags, clicks FROM %s LIMIT 3 OFFSET %d", zTab, aOffset[j]);
+      test_same(db, zSql, zC);
+      sqlite3_free(zSql);
+      sqlite3_free(zC);
+    }
+  }
+
+  /* Cut at every character of the last 2 rows */
+  test_exec(db, "SELECT druid_json_config('threads', 0)");
+  for(i=nData, j=0; j<2; i--){
+    if( memcmp(&zData[i-3], "},\n{", 4)==0 ) j++;
+  }
+  for(; i<nData; i++){
+    test_write(zFile, zData, i);
+    test_cut(db, "SELECT count(*) FROM p", "SELECT count(clicks IS NULL) FROM p", nData-i);
+    test_cut(db, "SELECT count(*) FROM (SELECT 1 FROM p LIMIT -1 OFFSET 1198)",
+                 "SELECT max(count(clicks IS NULL)-1198, 0) FROM p", nData-i);
+  }
+
+  sqlite3_close(db);
+  sqlite3_free(zData);
+  remove(zFile);
+  return test_done("skip");
+}
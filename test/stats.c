@@ -0,0 +1,113 @@
+/*
+** Check of the column statistics of druid_json.c: which scans collect them
+** on the way, and druid_json_column_stats.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/stats.c -o stats -lsqlite3 -lm -lpthread
+**    ./stats
+**
+**   - Only a scan that decodes every column, without LIMIT or OFFSET,
+**     collects the statistics.  The others leave them to the first query
+**     of druid_json_column_stats.
+**
+**   - druid_json_column_stats cannot be used from a view or a trigger.
+**
+** The module of the connection is captured by a wrapper of
+** sqlite3_create_module_v2(), for test_has_stats() to look at its tables.
+*/
+#include "sqlite3.h"
+
+static int test_create_module_v2(sqlite3*, const char*, const sqlite3_module*,
+                                 void*, void(*)(void*));
+#define sqlite3_create_module_v2 test_create_module_v2
+#include "../druid_json.c"
+#undef sqlite3_create_module_v2
+#include "testutil.h"
+
+static DruidModule *pTestModule = 0;  /* Module of the druid_json tables */
+
+static int test_create_module_v2(
+  sqlite3 *db,
+  const char *zName,
+  const sqlite3_module *pMod,
+  void *pAux,
+  void (*xDestroy)(void*)
+){
+  if( strcmp(zName, "druid_json")==0 ) pTestModule = (DruidModule*)pAux;
+  return sqlite3_create_module_v2(db, zName, pMod, pAux, xDestroy);
+}
+
+/* SQL function test_has_stats(NAME), true if druid_json table NAME has
+** its column statistics */
+static void test_has_stats(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+  const char *zName = (const char*)sqlite3_value_text(argv[0]);
+  DruidTable *pTab;
+  (void)argc;
+  for(pTab=pTestModule->pTables; pTab; pTab=pTab->pNextTable){
+    if( zName && sqlite3_stricmp(pTab->zName, zName)==0 ) break;
+  }
+  sqlite3_result_int(ctx, pTab && pTab->pStats!=0);
+}
+
+/* Create table t on file zFile, trusted or not, run zSql on it, and check
+** whether it collected the column statistics */
+static void test_scan(sqlite3 *db, const char *zFile, int bTrusted,
+                      const char *zSql, int bStats){
+  char *z = sqlite3_mprintf(
+      "DROP TABLE IF EXISTS temp.t;"
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename=%Q,"
+      " metrics='clicks', trusted=%d);", zFile, bTrusted);
+  char *zGot;
+  test_exec(db, z);
+  sqlite3_free(z);
+  zGot = test_query(db, zSql);
+  sqlite3_free(zGot);
+  test_expect(db, "SELECT test_has_stats('t')", bStats ? "1" : "0");
+}
+
+int main(void){
+  const char *zFile = "stats-test.json";
+  sqlite3 *db = test_open();
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  char *z;
+  int i, bTrusted;
+
+  sqlite3_create_function(db, "test_has_stats", 1, SQLITE_UTF8, 0,
+                          test_has_stats, 0, 0);
+  sqlite3_str_appendall(pOut, "[");
+  for(i=0; i<1000; i++){
+    sqlite3_str_appendf(pOut,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T00:00:00.000Z\", "
+        "\"event\": {\"app\": \"app%d\", \"country\": \"c%d\", \"clicks\": %d}}",
+        i ? ",\n" : "", i%7, i%3, i%100);
+  }
+  sqlite3_str_appendall(pOut, "]\n");
+  z = sqlite3_str_finish(pOut);
+  test_write(zFile, z, -1);
+  sqlite3_free(z);
+
+  for(bTrusted=0; bTrusted<2; bTrusted++){
+    test_scan(db, zFile, bTrusted, "SELECT * FROM t", 1);
+    test_scan(db, zFile, bTrusted, "SELECT sum(clicks) FROM t WHERE app='app3'", !bTrusted);
+    test_scan(db, zFile, bTrusted, "SELECT * FROM t LIMIT 5000", 0);
+    test_scan(db, zFile, bTrusted, "SELECT * FROM t LIMIT 5000 OFFSET 10", 0);
+    test_scan(db, zFile, bTrusted, "SELECT count(*) FROM t", 0);
+    test_scan(db, zFile, bTrusted, "SELECT * FROM t WHERE _sample=0.5", 0);
+    /* Collected by the query of the statistics */
+    test_expect(db, "SELECT name, rows, ndv, nulls, min, max, sum"
+                    " FROM druid_json_column_stats('t') WHERE name IN ('app','clicks')",
+                    "app|1000|7|0|NULL|NULL|NULL;clicks|1000|NULL|0|0.0|99.0|49500.0");
+    test_expect(db, "SELECT test_has_stats('t')", "1");
+  }
+
+  /* Not from a view */
+  test_exec(db, "CREATE VIEW v AS SELECT name FROM druid_json_column_stats('t')");
+  test_expect(db, "SELECT count(*) FROM v",
+                  "error: unsafe use of virtual table \"druid_json_column_stats\"");
+
+  sqlite3_exec(db, "DROP TABLE IF EXISTS temp.t", 0, 0, 0);
+  sqlite3_close(db);
+  remove(zFile);
+  return test_done("stats");
+}
@@ -0,0 +1,119 @@
+/*
+** Helpers of the feature tests of test/, included after druid_json.c.
+**
+** A test writes its result files with test_write(), opens a database with
+** the extension with test_open(), and compares the output of its queries
+** with what it expects with test_expect().  test_done() reports the
+** failures and returns the exit status.
+*/
+
+static int nTestCheck = 0;        /* Checks done */
+static int nTestFail = 0;         /* Checks failed */
+
+/* Write the n bytes at z to file zFile, or all of z if n is negative */
+static void test_write(const char *zFile, const char *z, sqlite3_int64 n){
+  FILE *out = fopen(zFile, "wb");
+  if( n<0 ) n = (sqlite3_int64)strlen(z);
+  if( out==0 || fwrite(z, 1, (size_t)n, out)!=(size_t)n || fclose(out) ){
+    fprintf(stderr, "cannot write %s\n", zFile);
+    exit(1);
+  }
+}
+
+/* Open an in-memory database with the extension */
+static sqlite3 *test_open(void){
+  sqlite3 *db;
+  char *zErr = 0;
+  if( sqlite3_open(":memory:", &db)!=SQLITE_OK
+   || sqlite3_druidjson_init(db, &zErr, 0)!=SQLITE_OK ){
+    fprintf(stderr, "cannot load druid_json: %s\n", zErr ? zErr : sqlite3_errmsg(db));
+    exit(1);
+  }
+  return db;
+}
+
+/* Run the statements of zSql, which must succeed */
+static void test_exec(sqlite3 *db, const char *zSql){
+  char *zErr = 0;
+  if( sqlite3_exec(db, zSql, 0, 0, &zErr)!=SQLITE_OK ){
+    fprintf(stderr, "%s\n  -> %s\n", zSql, zErr);
+    exit(1);
+  }
+}
+
+/* Return the rows of query zSql, in memory from sqlite3_malloc().  The
+** values of a row are separated by '|' and the rows by ';'.  NULL is
+** "NULL", a BLOB is x'..' and a REAL has the ".0" of an integral value,
+** so that the types show.  A failed query returns "error: <message>". */
+static char *test_query(sqlite3 *db, const char *zSql){
+  sqlite3_str *pOut = sqlite3_str_new(db);
+  sqlite3_stmt *pStmt = 0;
+  int rc = sqlite3_prepare_v2(db, zSql, -1, &pStmt, 0);
+  int nRow = 0;
+  while( rc==SQLITE_OK && (rc = sqlite3_step(pStmt))==SQLITE_ROW ){
+    int i;
+    rc = SQLITE_OK;
+    if( nRow++ ) sqlite3_str_appendchar(pOut, 1, ';');
+    for(i=0; i<sqlite3_column_count(pStmt); i++){
+      if( i ) sqlite3_str_appendchar(pOut, 1, '|');
+      switch( sqlite3_column_type(pStmt, i) ){
+        case SQLITE_NULL:
+          sqlite3_str_appendall(pOut, "NULL");
+          break;
+        case SQLITE_INTEGER:
+          sqlite3_str_appendf(pOut, "%lld", sqlite3_column_int64(pStmt, i));
+          break;
+        case SQLITE_FLOAT:
+          sqlite3_str_appendf(pOut, "%!.17g", sqlite3_column_double(pStmt, i));
+          break;
+        case SQLITE_BLOB: {
+          const u8 *a = sqlite3_column_blob(pStmt, i);
+          int j, n = sqlite3_column_bytes(pStmt, i);
+          sqlite3_str_appendall(pOut, "x'");
+          for(j=0; j<n; j++) sqlite3_str_appendf(pOut, "%02x", a[j]);
+          sqlite3_str_appendchar(pOut, 1, '\'');
+          break;
+        }
+        default:
+          sqlite3_str_appendall(pOut, (const char*)sqlite3_column_text(pStmt, i));
+          break;
+      }
+    }
+  }
+  if( rc!=SQLITE_DONE ){
+    sqlite3_str_reset(pOut);
+    sqlite3_str_appendf(pOut, "error: %s", sqlite3_errmsg(db));
+  }
+  sqlite3_finalize(pStmt);
+  return sqlite3_str_finish(pOut);
+}
+
+/* Check that query zSql returns zExpected, see test_query() */
+static void test_expect(sqlite3 *db, const char *zSql, const char *zExpected){
+  char *zGot = test_query(db, zSql);
+  nTestCheck++;
+  if( strcmp(zGot ? zGot : "", zExpected)!=0 ){
+    fprintf(stderr, "%s\n  got:      %s\n  expected: %s\n", zSql, zGot, zExpected);
+    nTestFail++;
+  }
+  sqlite3_free(zGot);
+}
+
+/* Check that queries zSql1 and zSql2 return the same rows */
+static void test_same(sqlite3 *db, const char *zSql1, const char *zSql2){
+  char *z1 = test_query(db, zSql1);
+  char *z2 = test_query(db, zSql2);
+  nTestCheck++;
+  if( strcmp(z1 ? z1 : "", z2 ? z2 : "")!=0 ){
+    fprintf(stderr, "%s\n  -> %s\n%s\n  -> %s\n", zSql1, z1, zSql2, z2);
+    nTestFail++;
+  }
+  sqlite3_free(z1);
+  sqlite3_free(z2);
+}
+
+/* Report the checks of a test, and return its exit status */
+static int test_done(const char *zTest){
+  printf("%s: %d checks, %d failures\n", zTest, nTestCheck, nTestFail);
+  return nTestFail!=0;
+}
@@ -0,0 +1,121 @@
+/*
+** Check of the trusted tables of druid_json.c (trusted=1), whose scans skip
+** the labels and the checks of the JSON structure, and decode only the
+** columns the query uses.
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE -DDRUIDJSON_COUNT_CHUNK_SZ=4096 \
+**        test/trusted.c -o trusted -lsqlite3 -lm -lpthread
+**    ./trusted
+**
+**   - A trusted table returns the rows of the same table that is not, with
+**     escapes, literals and numbers of every form, for queries that decode
+**     all, some or none of the columns, and its plans show the columns it
+**     decodes.
+**
+**   - A file cut short fails the scans that read rows, skip them for an
+**     OFFSET or count them, in chunks of the worker pool or not, as the one
+**     check of trusted files.
+**
+**   - The parameters that do not go with trusted are refused.
+*/
+#include "../druid_json.c"
+#include "testutil.h"
+
+#define TEST_ROWS 700
+
+/* Write the result file, cut nCut bytes before its end */
+static void test_generate(const char *zFile, int nCut){
+  static const char *azClicks[] = { "%d", "-%d.25", "%de2", "%d.5E-3", "null" };
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  char *z;
+  int i;
+  sqlite3_str_appendall(pOut, "[");
+  for(i=1; i<=TEST_ROWS; i++){
+    sqlite3_str_appendf(pOut,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T%02d:00:00.000Z\", "
+        "\"event\": {", i>1 ? ",\n" : "", i%24);
+    if( i%9 ){
+      sqlite3_str_appendf(pOut, "\"app\": \"app \\\"%d\\\" \\u00e9\\n\", ", i%4);
+    }else{
+      sqlite3_str_appendall(pOut, "\"app\": null, ");
+    }
+    sqlite3_str_appendf(pOut, "\"flag\": %s, \"clicks\": ",
+                        i%3==0 ? "true" : i%3==1 ? "false" : "null");
+    sqlite3_str_appendf(pOut, azClicks[i%5], i);
+    sqlite3_str_appendf(pOut, ",\"score\":%d}}", i%11);
+  }
+  sqlite3_str_appendall(pOut, "]\n");
+  z = sqlite3_str_finish(pOut);
+  test_write(zFile, z, (sqlite3_int64)strlen(z) - nCut);
+  sqlite3_free(z);
+}
+
+/* Check that query zSql, where %s stands for the table, returns the same
+** rows on p and t */
+static void test_rows(sqlite3 *db, const char *zSql){
+  char *zP = sqlite3_mprintf(zSql, "p", "p");
+  char *zT = sqlite3_mprintf(zSql, "t", "t");
+  test_same(db, zP, zT);
+  sqlite3_free(zP);
+  sqlite3_free(zT);
+}
+
+int main(void){
+  static const char *azSql[] = {
+    "SELECT rowid, * FROM %s",
+    "SELECT clicks FROM %s",
+    "SELECT rowid, score, app FROM %s WHERE clicks>10",
+    "SELECT flag, typeof(flag), count(*) FROM %s GROUP BY 1, 2",
+    "SELECT timestamp, rowid FROM %s LIMIT 3 OFFSET 400",
+    "SELECT count(*), sum(score) FROM %s",
+    "SELECT count(*) FROM (SELECT 1 FROM %s LIMIT -1 OFFSET 650)",
+    "SELECT a.rowid, b.app FROM %s a JOIN %s b ON a.rowid=b.rowid+1 WHERE a.score=3",
+  };
+  const char *zFile = "trusted-test.json";
+  sqlite3 *db = test_open();
+  int i;
+
+  test_generate(zFile, 0);
+  test_exec(db,
+      "CREATE VIRTUAL TABLE temp.p USING druid_json(filename='trusted-test.json',"
+      " metrics='clicks,score');"
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename='trusted-test.json',"
+      " metrics='clicks,score', trusted=1);");
+  for(i=0; i<(int)(sizeof(azSql)/sizeof(azSql[0])); i++) test_rows(db, azSql[i]);
+
+  /* The plans */
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT score, app FROM t",
+                  "2|0|0|SCAN t VIRTUAL TABLE INDEX 0:proj=2,5");
+  test_expect(db, "EXPLAIN QUERY PLAN SELECT count(*) FROM t",
+                  "3|0|0|SCAN t VIRTUAL TABLE INDEX 0:skip");
+
+  /* Cut short, in a label of the last row or before the closing ']' */
+  test_generate(zFile, 20);
+  test_expect(db, "SELECT count(score) FROM t",
+                  "error: result 699(offset 97940): unexpected end of input");
+  test_expect(db, "SELECT count(*) FROM t",
+                  "error: result 699(offset 97940): unterminated string");
+  test_expect(db, "SELECT count(*) FROM (SELECT 1 FROM t LIMIT -1 OFFSET 650)",
+                  "error: result 699(offset 97940): unterminated string");
+  test_generate(zFile, 2);
+  test_expect(db, "SELECT count(score) FROM t",
+                  "error: result 700(offset 97958): unexpected end of input");
+  test_expect(db, "SELECT count(*) FROM t",
+                  "error: result 700(offset 97958): unexpected end of input");
+  test_expect(db, "SELECT count(*) FROM (SELECT 1 FROM t LIMIT -1 OFFSET 650)",
+                  "error: result 700(offset 97958): unexpected end of input");
+
+  /* Refused */
+  test_expect(db, "CREATE VIRTUAL TABLE temp.f USING druid_json(filename='trusted-test.json',"
+                  " trusted=1, follow=1)",
+                  "error: follow and trusted cannot be combined");
+  test_expect(db, "CREATE VIRTUAL TABLE temp.f USING druid_json(filename='trusted-test.json',"
+                  " trusted=maybe)",
+                  "error: unrecognized trusted value: 'maybe'");
+
+  sqlite3_close(db);
+  remove(zFile);
+  return test_done("trusted");
+}
@@ -0,0 +1,223 @@
+/*
+** Check of the UTF-8 validation of druid_json.c (validate_utf8=1).
+**
+** Build and run from the top of the tree:
+**
+**    gcc -O2 -g -DSQLITE_CORE test/utf8.c -o utf8 -lsqlite3 -lm -lpthread
+**    ./utf8
+**
+**   - druid_utf8_valid(), 16 bytes at a time on x86 CPUs with SSSE3, and
+**     druid_utf8_valid_scalar() agree with a check of the byte sequences
+**     of RFC 3629 written here: on every sequence of 3 bytes, across the
+**     end of a block of 16, and on random strings of valid characters,
+**     some of them with a byte changed or cut short.
+**
+**   - A scan with validate_utf8=1 returns the rows before the first
+**     string that is not valid UTF-8, in a value or a label or decoded
+**     from a \u escape of a lone surrogate, then fails.  Without it the
+**     bytes are returned as they are.
+*/
+#include "../druid_json.c"
+#include "testutil.h"
+
+/* Return true if the n bytes at z are valid UTF-8, one character at a
+** time as RFC 3629 describes them */
+static int test_utf8_valid(const u8 *z, int n){
+  int i = 0;
+  while( i<n ){
+    u32 c = z[i];
+    u32 cMin;
+    int k, j;
+    if( c<0x80 ){
+      i++;
+      continue;
+    }else if( c>=0xc0 && c<=0xdf ){
+      k = 1; cMin = 0x80; c &= 0x1f;
+    }else if( c>=0xe0 && c<=0xef ){
+      k = 2; cMin = 0x800; c &= 0x0f;
+    }else if( c>=0xf0 && c<=0xf7 ){
+      k = 3; cMin = 0x10000; c &= 0x07;
+    }else{
+      return 0;
+    }
+    if( i+k>=n ) return 0;
+    for(j=1; j<=k; j++){
+      if( (z[i+j]&0xc0)!=0x80 ) return 0;
+      c = (c<<6) | (z[i+j]&0x3f);
+    }
+    if( c<cMin || c>0x10ffff || (c>=0xd800 && c<=0xdfff) ) return 0;
+    i += k + 1;
+  }
+  return 1;
+}
+
+/* Check both validations of the n bytes at z against test_utf8_valid() */
+static void test_check(const u8 *z, int n){
+  int bWant = test_utf8_valid(z, n);
+  nTestCheck++;
+  if( druid_utf8_valid(z, n)!=bWant || druid_utf8_valid_scalar(z, n)!=bWant ){
+    int i;
+    fprintf(stderr, "expected %s:", bWant ? "valid" : "invalid");
+    for(i=0; i<n; i++) fprintf(stderr, " %02x", z[i]);
+    fprintf(stderr, "\n");
+    nTestFail++;
+  }
+}
+
+static sqlite3_uint64 iTestRng = 0x9e3779b97f4a7c15ULL;
+
+/* A pseudo-random number below n */
+static u32 test_rand(u32 n){
+  iTestRng = iTestRng*6364136223846793005ULL + 1442695040888963407ULL;
+  return (u32)(iTestRng>>33) % n;
+}
+
+/* Append the UTF-8 encoding of a random character to a, return its size */
+static int test_char(u8 *a){
+  u32 c;
+  switch( test_rand(4) ){
+    case 0:  c = test_rand(0x80); break;
+    case 1:  c = 0x80 + test_rand(0x800-0x80); break;
+    case 2:  c = 0x800 + test_rand(0x10000-0x800);
+             if( c>=0xd800 && c<=0xdfff ) c -= 0x800;
+             break;
+    default: c = 0x10000 + test_rand(0x110000-0x10000); break;
+  }
+  if( c<0x80 ){
+    a[0] = (u8)c;
+    return 1;
+  }
+  if( c<0x800 ){
+    a[0] = (u8)(0xc0 | (c>>6));
+    a[1] = (u8)(0x80 | (c&0x3f));
+    return 2;
+  }
+  if( c<0x10000 ){
+    a[0] = (u8)(0xe0 | (c>>12));
+    a[1] = (u8)(0x80 | ((c>>6)&0x3f));
+    a[2] = (u8)(0x80 | (c&0x3f));
+    return 3;
+  }
+  a[0] = (u8)(0xf0 | (c>>18));
+  a[1] = (u8)(0x80 | ((c>>12)&0x3f));
+  a[2] = (u8)(0x80 | ((c>>6)&0x3f));
+  a[3] = (u8)(0x80 | (c&0x3f));
+  return 4;
+}
+
+/* Create table t on zFile, with validate_utf8=1 if bValidate */
+static void test_table(sqlite3 *db, const char *zFile, int bValidate){
+  char *zSql = sqlite3_mprintf(
+      "DROP TABLE IF EXISTS temp.t;"
+      "CREATE VIRTUAL TABLE temp.t USING druid_json(filename=%Q, validate_utf8=%d);",
+      zFile, bValidate);
+  test_exec(db, zSql);
+  sqlite3_free(zSql);
+}
+
+/* Write a result file of 3 rows, the second with app zApp, a JSON string
+** with its quotes.  If zLabel is not NULL, it is the label of app */
+static void test_generate(const char *zFile, const char *zApp, const char *zLabel){
+  sqlite3_str *pOut = sqlite3_str_new(0);
+  char *z;
+  int i;
+  sqlite3_str_appendall(pOut, "[");
+  for(i=1; i<=3; i++){
+    sqlite3_str_appendf(pOut,
+        "%s{\"version\": \"v1\", \"timestamp\": \"2020-01-01T00:00:00.000Z\", "
+        "\"event\": {\"%s\": %s}}",
+        i>1 ? ",\n" : "", zLabel && i==2 ? zLabel : "app",
+        i==2 ? zApp : "\"caf\xc3\xa9 \xe4\xb8\xad \xf0\x9f\x98\x80 and some more ASCII\"");
+  }
+  sqlite3_str_appendall(pOut, "]\n");
+  z = sqlite3_str_finish(pOut);
+  test_write(zFile, z, -1);
+  sqlite3_free(z);
+}
+
+int main(void){
+  static const struct {
+    const char *zApp;             /* The string of row 2, a JSON string */
+    int bValid;                   /* True if it is valid UTF-8 */
+  } aStr[] = {
+    { "\"\xc3\xa9\"", 1 },
+    { "\"\xef\xbb\xbf BOM\"", 1 },
+    { "\"\xf4\x8f\xbf\xbf is U+10FFFF\"", 1 },
+    { "\"\\ud83d\\ude00 a pair of escapes\"", 1 },
+    { "\"\\u00e9\\u4e2d\"", 1 },
+    { "\"stray \x80 continuation\"", 0 },
+    { "\"overlong \xc0\xaf\"", 0 },
+    { "\"overlong \xe0\x80\xaf after 16 bytes\"", 0 },
+    { "\"encoded surrogate \xed\xa0\x80\"", 0 },
+    { "\"past U+10FFFF \xf4\x90\x80\x80\"", 0 },
+    { "\"cut short \xe4\xb8\"", 0 },
+    { "\"a long string of ASCII to reach the second block \xff of 16\"", 0 },
+    { "\"lone surrogate \\ud800\"", 0 },
+    { "\"lone low surrogate \\udc00 here\"", 0 },
+  };
+  const char *zFile = "utf8-test.json";
+  sqlite3 *db = test_open();
+  u8 a[96];
+  int i, j;
+
+  /* Every sequence of 3 bytes, across the end of the first block of 16 */
+  memset(a, 'x', sizeof(a));
+  for(i=0; i<(1<<24); i++){
+    a[14] = (u8)(i>>16);
+    a[15] = (u8)(i>>8);
+    a[16] = (u8)i;
+    if( a[14]<0x80 && a[15]<0x80 && a[16]<0x80 ) continue;
+    if( test_utf8_valid(&a[14], 3)!=druid_utf8_valid(a, 32)
+     || test_utf8_valid(&a[14], 3)!=druid_utf8_valid_scalar(a, 32) ){
+      test_check(a, 32);
+    }
+  }
+  nTestCheck++;
+
+  /* Random strings, some of them with a byte changed or cut short */
+  for(i=0; i<200000; i++){
+    int n = 0;
+    int nChar = (int)test_rand(20);
+    for(j=0; j<nChar && n<(int)sizeof(a)-4; j++) n += test_char(&a[n]);
+    switch( test_rand(4) ){
+      case 0:
+        if( n>0 ) a[test_rand(n)] = (u8)test_rand(256);
+        break;
+      case 1:
+        if( n>0 ) n -= 1 + test_rand(n<3 ? n : 3);
+        break;
+    }
+    test_check(a, n);
+  }
+
+  /* Scans */
+  for(i=0; i<(int)(sizeof(aStr)/sizeof(aStr[0])); i++){
+    test_generate(zFile, aStr[i].zApp, 0);
+    test_table(db, zFile, 1);
+    if( aStr[i].bValid ){
+      test_expect(db, "SELECT count(app) FROM t", "3");
+    }else{
+      char *z = test_query(db, "SELECT count(app) FROM t");
+      nTestCheck++;
+      if( strstr(z, "result 1(offset ")==0 || strstr(z, "): invalid UTF-8 in string")==0 ){
+        fprintf(stderr, "%s\n  got: %s\n", aStr[i].zApp, z);
+        nTestFail++;
+      }
+      sqlite3_free(z);
+    }
+    /* Without validate_utf8 */
+    test_table(db, zFile, 0);
+    test_expect(db, "SELECT count(app) FROM t", "3");
+  }
+  test_generate(zFile, "\"app\"", "\xe4\xb8");
+  test_table(db, zFile, 1);
+  test_expect(db, "SELECT count(app) FROM t",
+                  "error: result 1(offset 190): invalid UTF-8 in string");
+  test_exec(db, "DROP TABLE temp.t");
+  test_expect(db, "CREATE VIRTUAL TABLE temp.t USING druid_json(filename='utf8-test.json',"
+                  " validate_utf8=2)", "error: unrecognized validate_utf8 value: '2'");
+
+  sqlite3_close(db);
+  remove(zFile);
+  return test_done("utf8");
+}